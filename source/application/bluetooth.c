@@ -29,10 +29,12 @@
 #include "error_logging.h"
 #include "flash.h"
 #include "frame_lua_libraries.h"
+#include "io_stats.h"
 #include "luaport.h"
 #include "nrf_nvic.h"
 #include "nrf_sdm.h"
 #include "nrfx_log.h"
+#include "nrfx_systick.h"
 
 nrf_nvic_state_t nrf_nvic_state = {{0}, 0};
 
@@ -84,11 +86,58 @@ bool flash_write_in_progress = false;
 
 uint16_t ble_negotiated_mtu;
 
+static bluetooth_connection_t connection;
+
+// 2M is accepted whenever the central asks, unless an app says otherwise
+static uint8_t preferred_phys = BLE_GAP_PHY_2MBPS;
+
+// The link layer runs one procedure at a time, so a PHY request made while
+// the connection parameters are being updated is sent once they're done
+static bool connection_update_pending = false;
+static bool phy_update_pending = false;
+
 static void softdevice_assert_handler(uint32_t id, uint32_t pc, uint32_t info)
 {
     error_with_message("Softdevice crashed");
 }
 
+static void set_connection_parameters(const ble_gap_conn_params_t *params)
+{
+    connection.interval = params->max_conn_interval;
+    connection.latency = params->slave_latency;
+    connection.timeout = params->conn_sup_timeout;
+}
+
+static uint32_t request_preferred_phys(void)
+{
+    ble_gap_phys_t const request = {
+        .rx_phys = preferred_phys,
+        .tx_phys = preferred_phys,
+    };
+
+    return sd_ble_gap_phy_update(ble_handles.connection, &request);
+}
+
+static void request_data_length(void)
+{
+    ble_gap_data_length_limitation_t limitation = {0};
+
+    // Automatic picks the longest length that fits within event_length
+    uint32_t status = sd_ble_gap_data_length_update(ble_handles.connection,
+                                                    NULL,
+                                                    &limitation);
+
+    // The link simply stays at its current length if this fails
+    if (status != NRF_SUCCESS)
+    {
+        LOG("Data length update failed: %lu. Limited by %u/%u bytes, %u us",
+            status,
+            limitation.tx_payload_limited_octets,
+            limitation.rx_payload_limited_octets,
+            limitation.tx_rx_time_limited_us);
+    }
+}
+
 void SD_EVT_IRQHandler(void)
 {
     uint32_t evt_id;
@@ -141,12 +190,19 @@ void SD_EVT_IRQHandler(void)
                                          .gap_evt
                                          .conn_handle;
 
+            set_connection_parameters(
+                &ble_evt->evt.gap_evt.params.connected.conn_params);
+            connection.tx_phy = BLE_GAP_PHY_1MBPS;
+            connection.rx_phy = BLE_GAP_PHY_1MBPS;
+            connection.data_length = BLE_GAP_DATA_LENGTH_DEFAULT;
+
             ble_gap_conn_params_t conn_params;
 
             check_error(sd_ble_gap_ppcp_get(&conn_params));
 
             check_error(sd_ble_gap_conn_param_update(ble_handles.connection,
                                                      &conn_params));
+            connection_update_pending = true;
 
             check_error(sd_ble_gatts_sys_attr_set(ble_handles.connection,
                                                   NULL,
@@ -163,6 +219,12 @@ void SD_EVT_IRQHandler(void)
         {
             ble_handles.connection = BLE_CONN_HANDLE_INVALID;
 
+            // The next connection starts again from the default ATT MTU
+            ble_negotiated_mtu = 0;
+
+            connection_update_pending = false;
+            phy_update_pending = false;
+
             check_error(sd_ble_gap_adv_start(ble_handles.advertising, 1));
 
             break;
@@ -178,8 +240,8 @@ void SD_EVT_IRQHandler(void)
         case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
         {
             ble_gap_phys_t const phys = {
-                .rx_phys = BLE_GAP_PHY_2MBPS,
-                .tx_phys = BLE_GAP_PHY_2MBPS,
+                .rx_phys = preferred_phys,
+                .tx_phys = preferred_phys,
             };
 
             check_error(sd_ble_gap_phy_update(ble_evt->evt.gap_evt.conn_handle,
@@ -208,6 +270,9 @@ void SD_EVT_IRQHandler(void)
                                      ? BLE_PREFERRED_MAX_MTU - 3
                                      : client_mtu - 3;
 
+            // Without a longer data length, each packet is split into many
+            request_data_length();
+
             break;
         }
 
@@ -225,6 +290,14 @@ void SD_EVT_IRQHandler(void)
                         ble_evt->evt.gatts_evt.params.write.len - 1);
                 }
 
+                // Reassemble scripts and files sent over many packets
+                else if (ble_evt->evt.gatts_evt.params.write.data[0] == 0x02)
+                {
+                    lua_upload_interrupt(
+                        ble_evt->evt.gatts_evt.params.write.data + 1,
+                        ble_evt->evt.gatts_evt.params.write.len - 1);
+                }
+
                 // Catch keyboard interrupts
                 else if (ble_evt->evt.gatts_evt.params.write.data[0] == 0x03)
                 {
@@ -266,9 +339,54 @@ void SD_EVT_IRQHandler(void)
 
         case BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST:
         {
-            check_error(sd_ble_gap_data_length_update(ble_handles.connection,
-                                                      NULL,
-                                                      NULL));
+            request_data_length();
+            break;
+        }
+
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+        {
+            connection.data_length = ble_evt
+                                         ->evt
+                                         .gap_evt
+                                         .params
+                                         .data_length_update
+                                         .effective_params
+                                         .max_tx_octets;
+            break;
+        }
+
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+        {
+            set_connection_parameters(
+                &ble_evt->evt.gap_evt.params.conn_param_update.conn_params);
+
+            connection_update_pending = false;
+
+            if (phy_update_pending)
+            {
+                phy_update_pending = false;
+
+                uint32_t status = request_preferred_phys();
+
+                if (status != NRF_SUCCESS)
+                {
+                    LOG("PHY update request failed: %lu", status);
+                }
+            }
+
+            break;
+        }
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+        {
+            ble_gap_evt_phy_update_t *update =
+                &ble_evt->evt.gap_evt.params.phy_update;
+
+            if (update->status == BLE_HCI_STATUS_CODE_SUCCESS)
+            {
+                connection.tx_phy = update->tx_phy;
+                connection.rx_phy = update->rx_phy;
+            }
 
             break;
         }
@@ -328,19 +446,19 @@ void SD_EVT_IRQHandler(void)
             if (ble_evt->evt.gap_evt.params.auth_status.auth_status ==
                 BLE_GAP_SEC_STATUS_SUCCESS)
             {
+                // Small enough to be copied into the flash queue, so this
+                // returns without waiting inside the event handler
                 flash_write(
                     bond_storage,
                     (uint32_t *)&bond.keyset.keys_own.p_enc_key->enc_info,
-                    sizeof(bond.keyset.keys_own.p_enc_key->enc_info));
+                    (sizeof(bond.keyset.keys_own.p_enc_key->enc_info) + 3) /
+                        sizeof(uint32_t));
             }
 
             break;
         }
 
         case BLE_GAP_EVT_CONN_SEC_UPDATE:
-        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
-        case BLE_GAP_EVT_PHY_UPDATE:
-        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
         case BLE_GATTS_EVT_HVN_TX_COMPLETE:
         {
             // Unused events
@@ -408,6 +526,12 @@ void bluetooth_setup(bool factory_reset)
 
     LOG("Softdevice using 0x%lx bytes of RAM", ram_start - 0x20000000);
 
+    // Let connection events run past event_length while there's more to send
+    ble_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = 1;
+    check_error(sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt));
+
     // Set device name
     ble_gap_conn_sec_mode_t write_permission;
     BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&write_permission);
@@ -431,7 +555,11 @@ void bluetooth_setup(bool factory_reset)
     if (factory_reset)
     {
         flash_erase_page(bond_storage);
-        flash_wait_until_complete();
+
+        if (!flash_wait_until_complete())
+        {
+            error_with_message("Could not erase bond storage");
+        }
     }
 
     // Read stored encryption key from memory
@@ -571,13 +699,91 @@ bool bluetooth_is_connected(void)
     return ble_handles.connection == BLE_CONN_HANDLE_INVALID ? false : true;
 }
 
-bool bluetooth_send_data(const uint8_t *data, size_t length)
+void bluetooth_get_connection(bluetooth_connection_t *current)
 {
+    // Updated from the softdevice event handler
+    NRFX_IRQ_DISABLE(SD_EVT_IRQn);
+    *current = connection;
+    NRFX_IRQ_ENABLE(SD_EVT_IRQn);
+}
+
+bool bluetooth_request_connection(uint16_t interval,
+                                  uint16_t latency,
+                                  uint16_t timeout)
+{
+    ble_gap_conn_params_t params = {
+        .min_conn_interval = interval,
+        .max_conn_interval = interval,
+        .slave_latency = latency,
+        .conn_sup_timeout = timeout,
+    };
+
+    // Also used for any future connections
+    if (sd_ble_gap_ppcp_set(&params) != NRF_SUCCESS)
+    {
+        return true;
+    }
+
     if (ble_handles.connection == BLE_CONN_HANDLE_INVALID)
+    {
+        return false;
+    }
+
+    if (sd_ble_gap_conn_param_update(ble_handles.connection, &params) !=
+        NRF_SUCCESS)
     {
         return true;
     }
 
+    NRFX_IRQ_DISABLE(SD_EVT_IRQn);
+    connection_update_pending = true;
+    NRFX_IRQ_ENABLE(SD_EVT_IRQn);
+
+    return false;
+}
+
+bool bluetooth_request_phy(uint8_t phys)
+{
+    preferred_phys = phys;
+
+    if (ble_handles.connection == BLE_CONN_HANDLE_INVALID)
+    {
+        return false;
+    }
+
+    bool deferred = false;
+
+    NRFX_IRQ_DISABLE(SD_EVT_IRQn);
+
+    if (connection_update_pending)
+    {
+        phy_update_pending = true;
+        deferred = true;
+    }
+
+    NRFX_IRQ_ENABLE(SD_EVT_IRQn);
+
+    if (deferred)
+    {
+        return false;
+    }
+
+    return request_preferred_phys() != NRF_SUCCESS;
+}
+
+size_t bluetooth_softdevice_ram(void)
+{
+    // Updated by sd_ble_enable() to the actual amount the softdevice needs
+    return ram_start - 0x20000000;
+}
+
+static uint32_t send_notification(const uint8_t *data, size_t length)
+{
+    if (ble_handles.connection == BLE_CONN_HANDLE_INVALID)
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
     // Initialise the handle value parameters
     ble_gatts_hvx_params_t hvx_params = {0};
     hvx_params.handle = ble_handles.repl_tx_notification.value_handle;
@@ -585,11 +791,36 @@ bool bluetooth_send_data(const uint8_t *data, size_t length)
     hvx_params.p_len = (uint16_t *)&length;
     hvx_params.type = BLE_GATT_HVX_NOTIFICATION;
 
+    io_stats_time_t start_time = IO_STATS_NOW();
+
     uint32_t status = sd_ble_gatts_hvx(ble_handles.connection, &hvx_params);
 
-    if (status == NRF_SUCCESS)
+    // Busy while the softdevice's transmit buffers are full
+    IO_STATS_RECORD(IO_STATS_BLUETOOTH_SEND,
+                    start_time,
+                    length,
+                    status != NRF_SUCCESS);
+
+    return status;
+}
+
+bool bluetooth_send_data(const uint8_t *data, size_t length)
+{
+    return send_notification(data, length) != NRF_SUCCESS;
+}
+
+bool bluetooth_send_data_waiting(const uint8_t *data, size_t length)
+{
+    for (uint32_t i = 0; i < BLUETOOTH_SEND_TIMEOUT_MS * 10; i++)
     {
-        return false;
+        uint32_t status = send_notification(data, length);
+
+        if (status != NRF_ERROR_RESOURCES)
+        {
+            return status != NRF_SUCCESS;
+        }
+
+        nrfx_systick_delay_us(100);
     }
 
     return true;
@@ -35,4 +35,48 @@ void bluetooth_setup(bool factory_reset);
 
 bool bluetooth_is_connected(void);
 
-bool bluetooth_send_data(const uint8_t *data, size_t length);
\ No newline at end of file
+bool bluetooth_send_data(const uint8_t *data, size_t length);
+
+#define BLUETOOTH_SEND_TIMEOUT_MS 500
+
+/**
+ * @brief Same as bluetooth_send_data(), but retries for up to
+ *        BLUETOOTH_SEND_TIMEOUT_MS while the softdevice's transmit buffers are
+ *        full. Any other error, such as the central not having enabled
+ *        notifications, drops the data straight away. Returns true if the data
+ *        wasn't sent.
+ */
+bool bluetooth_send_data_waiting(const uint8_t *data, size_t length);
+
+typedef struct bluetooth_connection_t
+{
+    uint16_t interval; // 1.25ms units
+    uint16_t latency;
+    uint16_t timeout; // 10ms units
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    uint16_t data_length; // Link layer payload in bytes
+} bluetooth_connection_t;
+
+void bluetooth_get_connection(bluetooth_connection_t *connection);
+
+/**
+ * @brief Sets the preferred connection parameters, and requests them from the
+ *        central if already connected. The central has the final say, so the
+ *        values in use are only known once bluetooth_get_connection() reports
+ *        them. Returns true if the request couldn't be made.
+ */
+bool bluetooth_request_connection(uint16_t interval,
+                                  uint16_t latency,
+                                  uint16_t timeout);
+
+/**
+ * @brief Sets the preferred PHYs, and requests them if already connected. If a
+ *        connection parameter update is still in progress, the request is
+ *        sent once it completes, so calling this straight after
+ *        bluetooth_request_connection() doesn't fail as busy. Returns true if
+ *        the request couldn't be made.
+ */
+bool bluetooth_request_phy(uint8_t phys);
+
+size_t bluetooth_softdevice_ram(void);
\ No newline at end of file
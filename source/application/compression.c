@@ -22,9 +22,358 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "compression.h"
 #include "lz4.h"
+#include "memory.h"
+
+#define LZ4_FRAME_MAGIC_NUMBER 0x184D2204
+#define LZSS_FRAME_MAGIC_NUMBER 0x535A4C46
+
+#define XXH32_PRIME_1 0x9E3779B1U
+#define XXH32_PRIME_2 0x85EBCA77U
+#define XXH32_PRIME_3 0xC2B2AE3DU
+#define XXH32_PRIME_4 0x27D4EB2FU
+#define XXH32_PRIME_5 0x165667B1U
+
+static uint32_t read_le32(const uint8_t *data)
+{
+    return (uint32_t)data[0] |
+           (uint32_t)data[1] << 8 |
+           (uint32_t)data[2] << 16 |
+           (uint32_t)data[3] << 24;
+}
+
+static uint32_t rotate_left(uint32_t value, uint32_t bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static uint32_t xxh32_round(uint32_t accumulator, uint32_t input)
+{
+    accumulator += input * XXH32_PRIME_2;
+    accumulator = rotate_left(accumulator, 13);
+    return accumulator * XXH32_PRIME_1;
+}
+
+static void xxh32_reset(xxh32_state_t *state)
+{
+    state->accumulator[0] = XXH32_PRIME_1 + XXH32_PRIME_2;
+    state->accumulator[1] = XXH32_PRIME_2;
+    state->accumulator[2] = 0;
+    state->accumulator[3] = 0 - XXH32_PRIME_1;
+    state->buffer_size = 0;
+    state->total_size = 0;
+}
+
+static void xxh32_update(xxh32_state_t *state, const uint8_t *data, size_t size)
+{
+    state->total_size += size;
+
+    // Top up a partially filled stripe first
+    if (state->buffer_size > 0)
+    {
+        size_t length = 16 - state->buffer_size < size
+                            ? 16 - state->buffer_size
+                            : size;
+
+        memcpy(state->buffer + state->buffer_size, data, length);
+        state->buffer_size += length;
+        data += length;
+        size -= length;
+
+        if (state->buffer_size < 16)
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            state->accumulator[i] = xxh32_round(state->accumulator[i],
+                                                read_le32(state->buffer + i * 4));
+        }
+
+        state->buffer_size = 0;
+    }
+
+    while (size >= 16)
+    {
+        for (size_t i = 0; i < 4; i++)
+        {
+            state->accumulator[i] = xxh32_round(state->accumulator[i],
+                                                read_le32(data + i * 4));
+        }
+
+        data += 16;
+        size -= 16;
+    }
+
+    memcpy(state->buffer, data, size);
+    state->buffer_size = size;
+}
+
+static uint32_t xxh32_digest(xxh32_state_t *state)
+{
+    uint32_t hash;
+
+    if (state->total_size >= 16)
+    {
+        hash = rotate_left(state->accumulator[0], 1) +
+               rotate_left(state->accumulator[1], 7) +
+               rotate_left(state->accumulator[2], 12) +
+               rotate_left(state->accumulator[3], 18);
+    }
+    else
+    {
+        hash = state->accumulator[2] + XXH32_PRIME_5;
+    }
+
+    hash += (uint32_t)state->total_size;
+
+    const uint8_t *data = state->buffer;
+    size_t size = state->buffer_size;
+
+    while (size >= 4)
+    {
+        hash += read_le32(data) * XXH32_PRIME_3;
+        hash = rotate_left(hash, 17) * XXH32_PRIME_4;
+        data += 4;
+        size -= 4;
+    }
+
+    while (size > 0)
+    {
+        hash += (*data) * XXH32_PRIME_5;
+        hash = rotate_left(hash, 11) * XXH32_PRIME_1;
+        data++;
+        size--;
+    }
+
+    hash ^= hash >> 15;
+    hash *= XXH32_PRIME_2;
+    hash ^= hash >> 13;
+    hash *= XXH32_PRIME_3;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+static uint32_t xxh32(const uint8_t *data, size_t size)
+{
+    xxh32_state_t state;
+    xxh32_reset(&state);
+    xxh32_update(&state, data, size);
+    return xxh32_digest(&state);
+}
+
+typedef struct frame_descriptor_t
+{
+    bool block_checksum;
+    bool content_checksum;
+    size_t block_max_size;
+    size_t header_size;
+} frame_descriptor_t;
+
+#if defined(COMPRESSION_CODEC_LZ4)
+
+static int parse_frame_descriptor(const uint8_t *source,
+                                  size_t source_size,
+                                  frame_descriptor_t *descriptor)
+{
+    // Magic number, FLG, BD and HC are the minimum
+    if (source_size < 7 || read_le32(source) != LZ4_FRAME_MAGIC_NUMBER)
+    {
+        return COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    uint8_t flags = source[4];
+    uint8_t block_descriptor = source[5];
+
+    if ((flags >> 6) != 0b01 || (flags & 0b10) || (block_descriptor & 0x8F))
+    {
+        return COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    // Linked blocks would need a 64KB history window, which we can't afford
+    bool block_independence = flags & 0b00100000;
+    bool content_size_present = flags & 0b00001000;
+    bool dictionary_id_present = flags & 0b00000001;
+
+    if (block_independence == false || dictionary_id_present)
+    {
+        return COMPRESSION_ERROR_UNSUPPORTED_FRAME;
+    }
+
+    descriptor->block_checksum = flags & 0b00010000;
+    descriptor->content_checksum = flags & 0b00000100;
+
+    switch ((block_descriptor >> 4) & 0b111)
+    {
+    case 4:
+        descriptor->block_max_size = 64 * 1024;
+        break;
+    case 5:
+        descriptor->block_max_size = 256 * 1024;
+        break;
+    case 6:
+        descriptor->block_max_size = 1024 * 1024;
+        break;
+    case 7:
+        descriptor->block_max_size = 4 * 1024 * 1024;
+        break;
+    default:
+        return COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    // FLG, BD and the optional content size are covered by the header checksum
+    size_t descriptor_size = content_size_present ? 10 : 2;
+
+    if (source_size < 4 + descriptor_size + 1)
+    {
+        return COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    uint8_t header_checksum = (xxh32(source + 4, descriptor_size) >> 8) & 0xFF;
+
+    if (header_checksum != source[4 + descriptor_size])
+    {
+        return COMPRESSION_ERROR_CHECKSUM_MISMATCH;
+    }
+
+    descriptor->header_size = 4 + descriptor_size + 1;
+
+    return COMPRESSION_SUCCESS;
+}
+
+// Enough of the frame header to find its full size
+#define FRAME_HEADER_MINIMUM_SIZE 5
+
+static size_t frame_header_size(const uint8_t *source)
+{
+    bool content_size_present = source[4] & 0b00001000;
+
+    return content_size_present ? 15 : 7;
+}
+
+static int decode_block(const uint8_t *source,
+                        size_t source_size,
+                        uint8_t *destination,
+                        size_t destination_size)
+{
+    return LZ4_decompress_safe((const char *)source,
+                               (char *)destination,
+                               source_size,
+                               destination_size);
+}
+
+#elif defined(COMPRESSION_CODEC_LZSS)
+
+static int parse_frame_descriptor(const uint8_t *source,
+                                  size_t source_size,
+                                  frame_descriptor_t *descriptor)
+{
+    // Magic number followed by the maximum decompressed block size
+    if (source_size < 8 || read_le32(source) != LZSS_FRAME_MAGIC_NUMBER)
+    {
+        return COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    descriptor->block_max_size = read_le32(source + 4);
+
+    // Offsets are 12 bits, so blocks can't reference beyond 4KB anyway
+    if (descriptor->block_max_size == 0 ||
+        descriptor->block_max_size > 4096)
+    {
+        return COMPRESSION_ERROR_UNSUPPORTED_FRAME;
+    }
+
+    descriptor->block_checksum = false;
+    descriptor->content_checksum = true;
+    descriptor->header_size = 8;
+
+    return COMPRESSION_SUCCESS;
+}
+
+#define FRAME_HEADER_MINIMUM_SIZE 8
+
+// The header has no optional fields, so its size is always the same
+static size_t frame_header_size(const uint8_t *source)
+{
+    (void)source;
+    return FRAME_HEADER_MINIMUM_SIZE;
+}
+
+/**
+ * Each flag byte describes the next eight tokens, LSB first. A set bit is a
+ * literal byte. A clear bit is a two byte match with a 12 bit offset and 4 bit
+ * length. Length 15 is followed by an extra byte which extends the match.
+ */
+static int decode_block(const uint8_t *source,
+                        size_t source_size,
+                        uint8_t *destination,
+                        size_t destination_size)
+{
+    const uint8_t *source_end = source + source_size;
+    size_t output_size = 0;
+
+    while (source < source_end)
+    {
+        uint8_t flags = *source++;
+
+        for (size_t token = 0; token < 8 && source < source_end; token++)
+        {
+            if (flags & (1 << token))
+            {
+                if (output_size == destination_size)
+                {
+                    return -1;
+                }
+
+                destination[output_size++] = *source++;
+                continue;
+            }
+
+            if (source_end - source < 2)
+            {
+                return -1;
+            }
+
+            size_t offset = (((size_t)(source[1] & 0xF0) << 4) | source[0]) + 1;
+            size_t length = (source[1] & 0x0F) + 3;
+            source += 2;
+
+            if (length == 18)
+            {
+                if (source == source_end)
+                {
+                    return -1;
+                }
+
+                length += *source++;
+            }
+
+            if (offset > output_size ||
+                length > destination_size - output_size)
+            {
+                return -1;
+            }
+
+            // Byte by byte as matches are allowed to overlap themselves
+            for (size_t i = 0; i < length; i++)
+            {
+                destination[output_size] = destination[output_size - offset];
+                output_size++;
+            }
+        }
+    }
+
+    return output_size;
+}
+
+#endif
 
 int compression_decompress(size_t destination_size,
                            const void *source,
@@ -32,49 +381,346 @@ int compression_decompress(size_t destination_size,
                            process_function process_function,
                            void *process_function_context)
 {
-    int status = 0;
+    const uint8_t *source_pointer = source;
+    const uint8_t *source_end = source_pointer + source_size;
+
+    frame_descriptor_t descriptor;
+
+    int status = parse_frame_descriptor(source_pointer,
+                                        source_size,
+                                        &descriptor);
+
+    if (status != COMPRESSION_SUCCESS)
+    {
+        return status;
+    }
+
+    source_pointer += descriptor.header_size;
+
+    // The frame may declare a larger maximum than the blocks actually used
+    if (destination_size > descriptor.block_max_size)
+    {
+        destination_size = descriptor.block_max_size;
+    }
 
-    char *output_buffer = malloc(destination_size);
-    if (output_buffer == NULL)
+    // Two buffers so that one can be consumed while the other is filled
+    char *output_buffers = memory_allocate(MEMORY_POOL_TRANSIENT,
+                                           2 * destination_size);
+    if (output_buffers == NULL)
     {
-        return -1;
+        return COMPRESSION_ERROR_NO_MEMORY;
     }
 
-    // TODO the frame header might not be 7
-    char *block_pointer = (char *)source + 7;
+    size_t current_buffer = 0;
+    bool blocks_processed = false;
+
+    xxh32_state_t content_hash;
+    xxh32_reset(&content_hash);
 
     while (1)
     {
+        if (source_end - source_pointer < 4)
+        {
+            status = COMPRESSION_ERROR_INVALID_BLOCK;
+            break;
+        }
 
-        int current_block_size = ((uint8_t)block_pointer[0]) +
-                                 ((uint8_t)block_pointer[1] << 8) +
-                                 ((uint8_t)block_pointer[2] << 16) +
-                                 ((uint8_t)block_pointer[3] << 24);
+        uint32_t block_header = read_le32(source_pointer);
+        source_pointer += 4;
 
-        if (current_block_size == 0)
+        // End mark
+        if (block_header == 0)
         {
-            status = 0;
+            status = COMPRESSION_SUCCESS;
             break;
         }
 
-        status = LZ4_decompress_safe(block_pointer + 4,
-                                     output_buffer,
-                                     current_block_size,
-                                     destination_size);
+        bool uncompressed = block_header & 0x80000000;
+        size_t block_size = block_header & 0x7FFFFFFF;
+        size_t checksum_size = descriptor.block_checksum ? 4 : 0;
 
-        if (status <= 0)
+        if ((size_t)(source_end - source_pointer) < checksum_size ||
+            block_size > (size_t)(source_end - source_pointer) - checksum_size)
         {
+            status = COMPRESSION_ERROR_INVALID_BLOCK;
             break;
         }
 
+        if (descriptor.block_checksum &&
+            xxh32(source_pointer, block_size) !=
+                read_le32(source_pointer + block_size))
+        {
+            status = COMPRESSION_ERROR_CHECKSUM_MISMATCH;
+            break;
+        }
+
+        char *output_buffer = output_buffers +
+                              current_buffer * destination_size;
+
+        int output_size;
+
+        if (uncompressed)
+        {
+            if (block_size > destination_size)
+            {
+                status = COMPRESSION_ERROR_INVALID_BLOCK;
+                break;
+            }
+
+            memcpy(output_buffer, source_pointer, block_size);
+            output_size = block_size;
+        }
+
+        else
+        {
+            output_size = decode_block(source_pointer,
+                                       block_size,
+                                       (uint8_t *)output_buffer,
+                                       destination_size);
+
+            if (output_size <= 0)
+            {
+                status = COMPRESSION_ERROR_INVALID_BLOCK;
+                break;
+            }
+        }
+
+        source_pointer += block_size + checksum_size;
+
+        // Hash before handing over as the buffer may be in use afterwards
+        if (descriptor.content_checksum)
+        {
+            xxh32_update(&content_hash, (uint8_t *)output_buffer, output_size);
+        }
+
         process_function(process_function_context,
                          output_buffer,
-                         status);
+                         output_size);
+
+        blocks_processed = true;
+        current_buffer ^= 1;
+    }
 
-        block_pointer += current_block_size + 4;
+    // Let the consumer finish with the last buffer before it's freed
+    if (blocks_processed)
+    {
+        process_function(process_function_context, NULL, 0);
     }
 
-    free(output_buffer);
+    if (status == COMPRESSION_SUCCESS && descriptor.content_checksum)
+    {
+        if (source_end - source_pointer < 4)
+        {
+            status = COMPRESSION_ERROR_INVALID_FRAME;
+        }
+
+        else if (xxh32_digest(&content_hash) != read_le32(source_pointer))
+        {
+            status = COMPRESSION_ERROR_CHECKSUM_MISMATCH;
+        }
+    }
+
+    memory_free(output_buffers);
 
     return status;
-}
\ No newline at end of file
+}
+
+void compression_stream_init(compression_stream_t *stream,
+                             size_t destination_size,
+                             void *buffer,
+                             process_function process_function,
+                             void *process_function_context)
+{
+    memset(stream, 0, sizeof(compression_stream_t));
+
+    stream->state = COMPRESSION_STREAM_FRAME_HEADER;
+    stream->status = COMPRESSION_SUCCESS;
+    stream->destination_size = destination_size;
+    stream->input = buffer;
+    stream->input_needed = FRAME_HEADER_MINIMUM_SIZE;
+    stream->output = (uint8_t *)buffer + destination_size + 8;
+    stream->process_function = process_function;
+    stream->process_function_context = process_function_context;
+
+    xxh32_reset(&stream->content_hash);
+}
+
+// Called once input_needed bytes have been gathered into the input buffer
+static int stream_process_input(compression_stream_t *stream)
+{
+    uint8_t *input = stream->input;
+    size_t input_size = stream->input_size;
+
+    stream->input_size = 0;
+
+    switch (stream->state)
+    {
+    case COMPRESSION_STREAM_FRAME_HEADER:
+    {
+        size_t header_size = frame_header_size(input);
+
+        // Keep gathering if the start of the header says it's longer
+        if (header_size > input_size)
+        {
+            stream->input_size = input_size;
+            stream->input_needed = header_size;
+            return COMPRESSION_SUCCESS;
+        }
+
+        frame_descriptor_t descriptor;
+
+        int status = parse_frame_descriptor(input, input_size, &descriptor);
+
+        if (status != COMPRESSION_SUCCESS)
+        {
+            return status;
+        }
+
+        stream->block_checksum = descriptor.block_checksum;
+        stream->content_checksum = descriptor.content_checksum;
+
+        if (stream->destination_size > descriptor.block_max_size)
+        {
+            stream->destination_size = descriptor.block_max_size;
+        }
+
+        stream->state = COMPRESSION_STREAM_BLOCK_HEADER;
+        stream->input_needed = 4;
+        return COMPRESSION_SUCCESS;
+    }
+
+    case COMPRESSION_STREAM_BLOCK_HEADER:
+    {
+        uint32_t block_header = read_le32(input);
+
+        if (block_header == 0)
+        {
+            stream->state = stream->content_checksum
+                                ? COMPRESSION_STREAM_CONTENT_CHECKSUM
+                                : COMPRESSION_STREAM_DONE;
+            stream->input_needed = 4;
+            return COMPRESSION_SUCCESS;
+        }
+
+        size_t block_size = block_header & 0x7FFFFFFF;
+
+        // Blocks which don't shrink are stored, so a compressed block larger
+        // than the output buffer could never have come from a small enough one
+        if (block_size > stream->destination_size)
+        {
+            return COMPRESSION_ERROR_INVALID_BLOCK;
+        }
+
+        stream->uncompressed_block = block_header & 0x80000000;
+        stream->state = COMPRESSION_STREAM_BLOCK;
+        stream->input_needed = block_size + (stream->block_checksum ? 4 : 0);
+        return COMPRESSION_SUCCESS;
+    }
+
+    case COMPRESSION_STREAM_BLOCK:
+    {
+        size_t block_size = input_size - (stream->block_checksum ? 4 : 0);
+
+        if (stream->block_checksum &&
+            xxh32(input, block_size) != read_le32(input + block_size))
+        {
+            return COMPRESSION_ERROR_CHECKSUM_MISMATCH;
+        }
+
+        uint8_t *output = stream->output;
+        int output_size;
+
+        if (stream->uncompressed_block)
+        {
+            output = input;
+            output_size = block_size;
+        }
+
+        else
+        {
+            output_size = decode_block(input,
+                                       block_size,
+                                       output,
+                                       stream->destination_size);
+
+            if (output_size <= 0)
+            {
+                return COMPRESSION_ERROR_INVALID_BLOCK;
+            }
+        }
+
+        if (stream->content_checksum)
+        {
+            xxh32_update(&stream->content_hash, output, output_size);
+        }
+
+        stream->process_function(stream->process_function_context,
+                                 output,
+                                 output_size);
+
+        stream->blocks_processed = true;
+        stream->state = COMPRESSION_STREAM_BLOCK_HEADER;
+        stream->input_needed = 4;
+        return COMPRESSION_SUCCESS;
+    }
+
+    case COMPRESSION_STREAM_CONTENT_CHECKSUM:
+        if (xxh32_digest(&stream->content_hash) != read_le32(input))
+        {
+            return COMPRESSION_ERROR_CHECKSUM_MISMATCH;
+        }
+
+        stream->state = COMPRESSION_STREAM_DONE;
+        return COMPRESSION_SUCCESS;
+
+    default:
+        return COMPRESSION_SUCCESS;
+    }
+}
+
+int compression_stream_feed(compression_stream_t *stream,
+                            const void *data,
+                            size_t size)
+{
+    const uint8_t *data_pointer = data;
+
+    while (size > 0 &&
+           stream->status == COMPRESSION_SUCCESS &&
+           stream->state != COMPRESSION_STREAM_DONE)
+    {
+        size_t length = stream->input_needed - stream->input_size;
+        if (length > size)
+        {
+            length = size;
+        }
+
+        memcpy(stream->input + stream->input_size, data_pointer, length);
+        stream->input_size += length;
+        data_pointer += length;
+        size -= length;
+
+        if (stream->input_size == stream->input_needed)
+        {
+            stream->status = stream_process_input(stream);
+        }
+    }
+
+    return stream->status;
+}
+
+int compression_stream_finish(compression_stream_t *stream)
+{
+    if (stream->status == COMPRESSION_SUCCESS &&
+        stream->state != COMPRESSION_STREAM_DONE)
+    {
+        stream->status = COMPRESSION_ERROR_INVALID_FRAME;
+    }
+
+    if (stream->blocks_processed)
+    {
+        stream->blocks_processed = false;
+        stream->process_function(stream->process_function_context, NULL, 0);
+    }
+
+    return stream->status;
+}
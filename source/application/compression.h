@@ -24,14 +24,131 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+/**
+ * @brief The decoder is chosen at build time. LZ4 frames are the default.
+ *        Defining COMPRESSION_CODEC_LZSS instead selects the small window LZSS
+ *        frame format produced by tools/bitstream-compression/lzss.py
+ */
+#if !defined(COMPRESSION_CODEC_LZ4) && !defined(COMPRESSION_CODEC_LZSS)
+#define COMPRESSION_CODEC_LZ4
+#endif
+
+typedef enum compression_status_t
+{
+    COMPRESSION_SUCCESS = 0,
+    COMPRESSION_ERROR_NO_MEMORY = -1,
+    COMPRESSION_ERROR_INVALID_FRAME = -2,
+    COMPRESSION_ERROR_UNSUPPORTED_FRAME = -3,
+    COMPRESSION_ERROR_INVALID_BLOCK = -4,
+    COMPRESSION_ERROR_CHECKSUM_MISMATCH = -5,
+} compression_status_t;
+
+/**
+ * @brief Called once per decompressed block. Blocks are decompressed into two
+ *        alternating buffers, so the data passed here stays valid until the
+ *        following call returns. This allows the function to start a DMA
+ *        transfer and return while the next block is being decompressed.
+ *        A final call with data set to NULL and data_size set to 0 is made
+ *        once all blocks are done, before the buffers are freed.
+ */
 typedef void (*process_function)(void *context,
                                  void *data,
                                  size_t data_size);
 
+/**
+ * @brief Decompresses a frame one block at a time using the selected codec. The
+ *        frame descriptor, and any block and content checksums it declares,
+ *        are verified.
+ *
+ * @param destination_size Size of each of the two block buffers. Must be at
+ *                         least as large as the blocks used when compressing.
+ * @return compression_status_t as an int. 0 on success.
+ */
 int compression_decompress(size_t destination_size,
                            const void *source,
                            size_t source_size,
                            process_function process_function,
                            void *process_function_context);
+
+typedef struct xxh32_state_t
+{
+    uint32_t accumulator[4];
+    uint8_t buffer[16];
+    size_t buffer_size;
+    size_t total_size;
+} xxh32_state_t;
+
+typedef enum compression_stream_state_t
+{
+    COMPRESSION_STREAM_FRAME_HEADER,
+    COMPRESSION_STREAM_BLOCK_HEADER,
+    COMPRESSION_STREAM_BLOCK,
+    COMPRESSION_STREAM_CONTENT_CHECKSUM,
+    COMPRESSION_STREAM_DONE,
+} compression_stream_state_t;
+
+/**
+ * @brief State for decompressing a frame which arrives in pieces. The contents
+ *        are private to compression.c.
+ */
+typedef struct compression_stream_t
+{
+    compression_stream_state_t state;
+    int status;
+    bool block_checksum;
+    bool content_checksum;
+    bool uncompressed_block;
+    bool blocks_processed;
+    size_t destination_size;
+    uint8_t *input;
+    size_t input_size;
+    size_t input_needed;
+    uint8_t *output;
+    xxh32_state_t content_hash;
+    process_function process_function;
+    void *process_function_context;
+} compression_stream_t;
+
+/**
+ * @brief Size of the work buffer given to compression_stream_init(). It holds
+ *        one compressed block and one decompressed block.
+ */
+#define COMPRESSION_STREAM_BUFFER_SIZE(destination_size) \
+    (2 * (destination_size) + 8)
+
+/**
+ * @brief Prepares to decompress a frame which is fed in with any number of
+ *        compression_stream_feed() calls. Unlike compression_decompress(), only
+ *        one output buffer is used, so the data passed to the process function
+ *        is only valid until it returns. Nothing is allocated.
+ *
+ * @param buffer Work buffer of COMPRESSION_STREAM_BUFFER_SIZE() bytes. Must
+ *               remain valid until the stream is finished.
+ */
+void compression_stream_init(compression_stream_t *stream,
+                             size_t destination_size,
+                             void *buffer,
+                             process_function process_function,
+                             void *process_function_context);
+
+/**
+ * @brief Decodes as much of the frame as the data completes. Blocks are passed
+ *        to the process function as soon as they are whole. Data following the
+ *        end of the frame is ignored.
+ *
+ * @return compression_status_t as an int. Once an error is returned, the same
+ *         error is returned by all following calls.
+ */
+int compression_stream_feed(compression_stream_t *stream,
+                            const void *data,
+                            size_t size);
+
+/**
+ * @brief Checks that a complete frame was received and makes the final process
+ *        function call with data set to NULL.
+ */
+int compression_stream_finish(compression_stream_t *stream);
@@ -24,11 +24,17 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "error_logging.h"
-#include "lfs.h"
-#include "main.h"
+#include "flash.h"
+#include "io_stats.h"
 #include "nrf_soc.h"
 #include "nrfx_log.h"
+#include "nrfx_rtc.h"
+
+#define FLASH_QUEUE_LENGTH 8
+#define FLASH_MAX_RETRIES 3
+#define FLASH_TIMEOUT_MS 500
 
 extern uint32_t __empty_flash_start;
 extern uint32_t __empty_flash_end;
@@ -36,11 +42,223 @@ extern uint32_t __empty_flash_end;
 static uint32_t empty_flash_start = (uint32_t)&__empty_flash_start;
 static uint32_t empty_flash_end = (uint32_t)&__empty_flash_end;
 
-static volatile bool flash_is_busy = false;
+static const nrfx_rtc_t timeout_rtc = NRFX_RTC_INSTANCE(2);
+
+typedef enum flash_job_type_t
+{
+    FLASH_JOB_ERASE,
+    FLASH_JOB_WRITE,
+} flash_job_type_t;
+
+typedef struct flash_job_t
+{
+    flash_job_type_t type;
+    uint32_t address;
+    const uint32_t *data;
+    size_t length;
+    uint32_t inline_data[FLASH_INLINE_WORDS];
+    uint8_t retries;
+    io_stats_time_t start_time;
+    volatile bool *failed;
+    bool abandoned;
+    bool cancelled;
+} flash_job_t;
+
+/*
+ * Jobs are started one at a time, and the next one is started straight from
+ * the softdevice event handler when the previous one finishes. Thread code
+ * only has to wait if it needs the result.
+ *
+ * Each job reports a failure to whoever queued it. Jobs queued from thread
+ * code report to flash_wait_until_complete(), while jobs queued from
+ * interrupts, such as bond writes, are only logged.
+ */
+static flash_job_t queue[FLASH_QUEUE_LENGTH];
+static volatile size_t queue_head = 0;
+static volatile size_t queue_tail = 0;
+static volatile bool job_running = false;
+static volatile bool thread_jobs_failed = false;
+static volatile bool timed_out = false;
+
+static size_t queue_next(size_t index)
+{
+    return (index + 1) % FLASH_QUEUE_LENGTH;
+}
+
+static void start_job(flash_job_t *job)
+{
+    uint32_t error;
+
+    switch (job->type)
+    {
+    case FLASH_JOB_ERASE:
+        error = sd_flash_page_erase(job->address / NRF_FICR->CODEPAGESIZE);
+        break;
+
+    default:
+        error = sd_flash_write((uint32_t *)job->address,
+                               job->data,
+                               job->length);
+        break;
+    }
+
+    check_error(error);
+    job_running = true;
+}
+
+static void report_failure(flash_job_t *job)
+{
+    if (job->failed != NULL)
+    {
+        *job->failed = true;
+    }
+}
+
+static void start_next_job(void)
+{
+    // Cancelled jobs have already reported their failure
+    while (queue_head != queue_tail)
+    {
+        flash_job_t *job = &queue[queue_head];
+
+        if (!job->cancelled)
+        {
+            job->start_time = IO_STATS_NOW();
+            start_job(job);
+            return;
+        }
+
+        queue_head = queue_next(queue_head);
+    }
+
+    job_running = false;
+}
+
+static void finish_job(bool success)
+{
+    flash_job_t *job = &queue[queue_head];
+
+    // Abandoned jobs reported their failure when they timed out
+    if (!success && !job->abandoned)
+    {
+        report_failure(job);
+    }
+
+    if (job->type == FLASH_JOB_ERASE)
+    {
+        IO_STATS_RECORD(IO_STATS_FLASH_ERASE,
+                        job->start_time,
+                        NRF_FICR->CODEPAGESIZE,
+                        !success);
+    }
+    else
+    {
+        IO_STATS_RECORD(IO_STATS_FLASH_WRITE,
+                        job->start_time,
+                        job->length * sizeof(uint32_t),
+                        !success);
+    }
+
+    queue_head = queue_next(queue_head);
+    start_next_job();
+}
+
+/*
+ * The running job may still complete after timing out, so the softdevice stays
+ * busy until its event arrives, and the next job can only start then. Thread
+ * jobs queued behind it are cancelled, as their data may not outlive the wait.
+ */
+static void abandon_jobs(void)
+{
+    flash_job_t *job = &queue[queue_head];
+
+    if (!job->abandoned)
+    {
+        job->abandoned = true;
+        report_failure(job);
+    }
+
+    for (size_t i = queue_next(queue_head); i != queue_tail; i = queue_next(i))
+    {
+        if (queue[i].failed == &thread_jobs_failed && !queue[i].cancelled)
+        {
+            queue[i].cancelled = true;
+            report_failure(&queue[i]);
+        }
+    }
+}
 
 void flash_event_handler(bool success)
 {
-    flash_is_busy = false;
+    if (!job_running)
+    {
+        return;
+    }
+
+    flash_job_t *job = &queue[queue_head];
+
+    // The softdevice gives up if the radio leaves no room, so try again
+    if (!success && !job->abandoned && job->retries < FLASH_MAX_RETRIES)
+    {
+        job->retries++;
+        IO_STATS_RETRY(job->type == FLASH_JOB_ERASE ? IO_STATS_FLASH_ERASE
+                                                    : IO_STATS_FLASH_WRITE);
+        start_job(job);
+        return;
+    }
+
+    if (!success && !job->abandoned)
+    {
+        LOG("Flash operation failed at 0x%lx", job->address);
+    }
+
+    finish_job(success);
+}
+
+static void submit_job(flash_job_type_t type,
+                       uint32_t address,
+                       const uint32_t *data,
+                       size_t length)
+{
+    NRFX_IRQ_DISABLE(SD_EVT_IRQn);
+
+    // Checked with the event handler masked so that it can't submit into the
+    // last slot in between. It can also be the caller, where waiting would
+    // never end. The queue should never be this deep though
+    if (queue_next(queue_tail) == queue_head)
+    {
+        NRFX_IRQ_ENABLE(SD_EVT_IRQn);
+        error_with_message("Flash queue full");
+    }
+
+    flash_job_t *job = &queue[queue_tail];
+    job->type = type;
+    job->address = address;
+    job->length = length;
+    job->retries = 0;
+    job->failed = __get_IPSR() == 0 ? &thread_jobs_failed : NULL;
+    job->abandoned = false;
+    job->cancelled = false;
+
+    if (type == FLASH_JOB_WRITE && length <= FLASH_INLINE_WORDS)
+    {
+        memcpy(job->inline_data, data, length * sizeof(uint32_t));
+        job->data = job->inline_data;
+    }
+    else
+    {
+        job->data = data;
+    }
+
+    queue_tail = queue_next(queue_tail);
+
+    if (!job_running)
+    {
+        job->start_time = IO_STATS_NOW();
+        start_job(job);
+    }
+
+    NRFX_IRQ_ENABLE(SD_EVT_IRQn);
 }
 
 void flash_erase_page(uint32_t address)
@@ -50,22 +268,85 @@ void flash_erase_page(uint32_t address)
         error_with_message("Address not aligned to page boundary");
     }
 
-    check_error(sd_flash_page_erase(address / NRF_FICR->CODEPAGESIZE));
-    flash_is_busy = true;
+    submit_job(FLASH_JOB_ERASE, address, NULL, 0);
 }
 
 void flash_write(uint32_t address, const uint32_t *data, size_t length)
 {
-    check_error(sd_flash_write((uint32_t *)address, data, length));
-    flash_is_busy = true;
+    if (address % sizeof(uint32_t))
+    {
+        error_with_message("Address not aligned to word boundary");
+    }
+
+    submit_job(FLASH_JOB_WRITE, address, data, length);
+}
+
+static void timeout_rtc_event_handler(nrfx_rtc_int_type_t int_type)
+{
+    if (int_type == NRFX_RTC_INT_COMPARE0)
+    {
+        timed_out = true;
+    }
 }
 
-void flash_wait_until_complete(void)
+bool flash_wait_until_complete(void)
 {
-    // TODO add a timeout
-    while (flash_is_busy)
+    if (nrfx_rtc_init_check(&timeout_rtc) == false)
     {
+        nrfx_rtc_config_t config = NRFX_RTC_DEFAULT_CONFIG;
+        config.prescaler = NRF_RTC_FREQ_TO_PRESCALER(1000);
+        config.interrupt_priority = 6;
+        check_error(nrfx_rtc_init(&timeout_rtc,
+                                  &config,
+                                  timeout_rtc_event_handler));
+        nrfx_rtc_enable(&timeout_rtc);
     }
+
+    timed_out = false;
+    uint32_t deadline = (nrfx_rtc_counter_get(&timeout_rtc) +
+                         FLASH_TIMEOUT_MS) &
+                        nrfx_rtc_max_ticks_get(&timeout_rtc);
+    check_error(nrfx_rtc_cc_set(&timeout_rtc, 0, deadline, true));
+
+    // The timeout covers a single job, so restart it each time one finishes
+    size_t job = queue_head;
+
+    while (job_running)
+    {
+        if (queue_head != job)
+        {
+            job = queue_head;
+            timed_out = false;
+            deadline = (nrfx_rtc_counter_get(&timeout_rtc) +
+                        FLASH_TIMEOUT_MS) &
+                       nrfx_rtc_max_ticks_get(&timeout_rtc);
+            check_error(nrfx_rtc_cc_set(&timeout_rtc, 0, deadline, true));
+        }
+
+        if (timed_out)
+        {
+            LOG("Flash operation timed out");
+
+            NRFX_IRQ_DISABLE(SD_EVT_IRQn);
+            abandon_jobs();
+            NRFX_IRQ_ENABLE(SD_EVT_IRQn);
+
+            break;
+        }
+
+        // Clear FPU exceptions, otherwise their interrupt keeps us awake
+        __set_FPSCR(__get_FPSCR() & ~(0x0000009F));
+        (void)__get_FPSCR();
+        NVIC_ClearPendingIRQ(FPU_IRQn);
+
+        check_error(sd_app_evt_wait());
+    }
+
+    check_error(nrfx_rtc_cc_disable(&timeout_rtc, 0));
+
+    bool success = !thread_jobs_failed;
+    thread_jobs_failed = false;
+    return success;
 }
 
 void flash_get_info(size_t *page_size, size_t *total_size)
@@ -77,4 +358,4 @@ void flash_get_info(size_t *page_size, size_t *total_size)
 uint32_t flash_base_address(void)
 {
     return empty_flash_start;
-}
\ No newline at end of file
+}
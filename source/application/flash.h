@@ -28,13 +28,34 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Writes of up to this many words are copied into the queue, so the
+ *        data doesn't need to be aligned or kept around.
+ */
+#define FLASH_INLINE_WORDS 8
+
 void flash_event_handler(bool success);
 
+/**
+ * @brief Queues a page erase and returns straight away.
+ */
 void flash_erase_page(uint32_t address);
 
+/**
+ * @brief Queues a write of length words and returns straight away. Longer
+ *        than FLASH_INLINE_WORDS, the data must be word aligned and untouched
+ *        until flash_wait_until_complete() returns.
+ */
 void flash_write(uint32_t address, const uint32_t *data, size_t length);
 
-void flash_wait_until_complete(void);
+/**
+ * @brief Sleeps until every queued operation is done. Failed operations are
+ *        retried a few times first. Returns false if any operation queued
+ *        from thread code failed or timed out since the last call. After a
+ *        timeout, the operations queued behind it from thread code are
+ *        cancelled, and the rest wait for the late one to finish.
+ */
+bool flash_wait_until_complete(void);
 
 void flash_get_info(size_t *page_size, size_t *total_size);
 
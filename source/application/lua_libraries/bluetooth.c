@@ -23,7 +23,9 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include "ble_gap.h"
+#include "ble_gatt.h"
 #include "bluetooth.h"
 #include "error_logging.h"
 #include "frame_lua_libraries.h"
@@ -61,7 +63,7 @@ static int lua_bluetooth_max_length(lua_State *L)
 static int lua_bluetooth_send(lua_State *L)
 {
     size_t length;
-    const char *string = luaL_checklstring(L, 1, &length);
+    const uint8_t *string = lua_buffer_checkbytes(L, 1, &length);
 
     if (length + 1 > ble_negotiated_mtu)
     {
@@ -82,24 +84,187 @@ static int lua_bluetooth_send(lua_State *L)
     return 0;
 }
 
+static const struct lua_bluetooth_phy_t
+{
+    const char *name;
+    uint8_t phys;
+} lua_bluetooth_phys[] = {
+    {"auto", BLE_GAP_PHY_AUTO},
+    {"1m", BLE_GAP_PHY_1MBPS},
+    {"2m", BLE_GAP_PHY_2MBPS},
+    {"coded", BLE_GAP_PHY_CODED},
+};
+
+#define LUA_BLUETOOTH_PHY_COUNT \
+    (sizeof(lua_bluetooth_phys) / sizeof(lua_bluetooth_phys[0]))
+
+static const char *lua_bluetooth_phy_name(uint8_t phy)
+{
+    for (size_t i = 0; i < LUA_BLUETOOTH_PHY_COUNT; i++)
+    {
+        if (lua_bluetooth_phys[i].phys == phy)
+        {
+            return lua_bluetooth_phys[i].name;
+        }
+    }
+
+    return "unknown";
+}
+
+static int lua_bluetooth_set_connection(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    // Anything not given stays as it was
+    ble_gap_conn_params_t params;
+    check_error(sd_ble_gap_ppcp_get(&params));
+
+    lua_Number interval = params.max_conn_interval * 1.25;
+    lua_Integer latency = params.slave_latency;
+    lua_Integer timeout = params.conn_sup_timeout * 10;
+
+    if (lua_getfield(L, 1, "interval") != LUA_TNIL)
+    {
+        interval = luaL_checknumber(L, -1);
+
+        if (interval < 7.5 || interval > 4000)
+        {
+            luaL_error(L, "interval must be between 7.5 and 4000 milliseconds");
+        }
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, 1, "latency") != LUA_TNIL)
+    {
+        latency = luaL_checkinteger(L, -1);
+
+        if (latency < 0 || latency > 499)
+        {
+            luaL_error(L, "latency must be between 0 and 499");
+        }
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, 1, "timeout") != LUA_TNIL)
+    {
+        timeout = luaL_checkinteger(L, -1);
+
+        if (timeout < 100 || timeout > 32000)
+        {
+            luaL_error(L, "timeout must be between 100 and 32000 milliseconds");
+        }
+    }
+    lua_pop(L, 1);
+
+    // The Bluetooth specification requires this, otherwise the central rejects
+    if (timeout <= (1 + latency) * interval * 2)
+    {
+        luaL_error(L,
+                   "timeout must be longer than (1 + latency) * interval * 2");
+    }
+
+    int phy_index = -1;
+
+    if (lua_getfield(L, 1, "phy") != LUA_TNIL)
+    {
+        const char *phy = luaL_checkstring(L, -1);
+
+        for (size_t i = 0; i < LUA_BLUETOOTH_PHY_COUNT; i++)
+        {
+            if (strcmp(phy, lua_bluetooth_phys[i].name) == 0)
+            {
+                phy_index = i;
+            }
+        }
+
+        if (phy_index < 0)
+        {
+            luaL_error(L, "phy must be 'auto', '1m', '2m' or 'coded'");
+        }
+    }
+    lua_pop(L, 1);
+
+    if (bluetooth_request_connection((uint16_t)(interval / 1.25 + 0.5),
+                                     latency,
+                                     timeout / 10))
+    {
+        luaL_error(L, "bluetooth is busy");
+    }
+
+    if (phy_index >= 0 &&
+        bluetooth_request_phy(lua_bluetooth_phys[phy_index].phys))
+    {
+        luaL_error(L, "bluetooth is busy");
+    }
+
+    return 0;
+}
+
+static int lua_bluetooth_connection(lua_State *L)
+{
+    if (!bluetooth_is_connected())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    bluetooth_connection_t connection;
+    bluetooth_get_connection(&connection);
+
+    lua_newtable(L);
+
+    lua_pushnumber(L, connection.interval * 1.25);
+    lua_setfield(L, -2, "interval");
+
+    lua_pushinteger(L, connection.latency);
+    lua_setfield(L, -2, "latency");
+
+    lua_pushinteger(L, connection.timeout * 10);
+    lua_setfield(L, -2, "timeout");
+
+    lua_pushstring(L, lua_bluetooth_phy_name(connection.tx_phy));
+    lua_setfield(L, -2, "tx_phy");
+
+    lua_pushstring(L, lua_bluetooth_phy_name(connection.rx_phy));
+    lua_setfield(L, -2, "rx_phy");
+
+    // ble_negotiated_mtu excludes the 3 byte ATT header, and is 0 until the
+    // central exchanges MTUs, in which case the default ATT MTU is in use
+    lua_pushinteger(L,
+                    ble_negotiated_mtu == 0 ? BLE_GATT_ATT_MTU_DEFAULT
+                                            : ble_negotiated_mtu + 3);
+    lua_setfield(L, -2, "mtu");
+
+    lua_pushinteger(L, connection.data_length);
+    lua_setfield(L, -2, "data_length");
+
+    return 1;
+}
+
 static struct lua_bluetooth_callback
 {
     int function;
-    uint8_t data[BLE_PREFERRED_MAX_MTU];
-    size_t length;
 } lua_bluetooth_callback = {
     .function = 0,
 };
 
-static void lua_bluetooth_receive_callback_handler(lua_State *L, lua_Debug *ar)
+static void lua_bluetooth_receive_event_handler(lua_State *L,
+                                                const lua_event_t *event)
 {
-    lua_sethook(L, NULL, 0, 0);
+    lua_scheduler_notify(L,
+                         LUA_SCHEDULER_BLUETOOTH,
+                         event->payload,
+                         event->length);
+
+    // Data is queued for waiting tasks even when there is no callback
+    if (lua_bluetooth_callback.function == 0)
+    {
+        return;
+    }
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, lua_bluetooth_callback.function);
 
-    lua_pushlstring(L,
-                    (char *)lua_bluetooth_callback.data,
-                    lua_bluetooth_callback.length);
+    lua_pushlstring(L, (char *)event->payload, event->length);
 
     if (lua_pcall(L, 1, 0, 0) != LUA_OK)
     {
@@ -107,20 +272,10 @@ static void lua_bluetooth_receive_callback_handler(lua_State *L, lua_Debug *ar)
     }
 }
 
+// Always queued, as tasks may be waiting for data even without a callback
 void lua_bluetooth_data_interrupt(uint8_t *data, size_t length)
 {
-    if (lua_bluetooth_callback.function == 0)
-    {
-        return;
-    }
-
-    memcpy(lua_bluetooth_callback.data, data, length);
-    lua_bluetooth_callback.length = length;
-
-    lua_sethook(L_global,
-                lua_bluetooth_receive_callback_handler,
-                LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT,
-                1);
+    lua_event_push(LUA_EVENT_BLUETOOTH_DATA, data, length);
 }
 
 static int lua_bluetooth_receive_callback(lua_State *L)
@@ -144,6 +299,10 @@ static int lua_bluetooth_receive_callback(lua_State *L)
 
 void lua_open_bluetooth_library(lua_State *L)
 {
+    lua_bluetooth_callback.function = 0;
+    lua_event_set_handler(LUA_EVENT_BLUETOOTH_DATA,
+                          lua_bluetooth_receive_event_handler);
+
     lua_getglobal(L, "frame");
 
     lua_newtable(L);
@@ -163,6 +322,12 @@ void lua_open_bluetooth_library(lua_State *L)
     lua_pushcfunction(L, lua_bluetooth_receive_callback);
     lua_setfield(L, -2, "receive_callback");
 
+    lua_pushcfunction(L, lua_bluetooth_set_connection);
+    lua_setfield(L, -2, "set_connection");
+
+    lua_pushcfunction(L, lua_bluetooth_connection);
+    lua_setfield(L, -2, "connection");
+
     lua_setfield(L, -2, "bluetooth");
 
     lua_pop(L, 1);
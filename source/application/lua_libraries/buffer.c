@@ -0,0 +1,529 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lua.h"
+#include "memory.h"
+
+#define BUFFER_METATABLE "frame.buffer"
+#define TRANSIENT_METATABLE "frame.transient"
+
+/*
+ * Buffers own their storage, which is allocated along with the userdata so it
+ * never moves. Slices point into another buffer's storage instead, and keep it
+ * alive using their user value.
+ */
+
+static lua_buffer_t *check_buffer(lua_State *L, int index)
+{
+    return luaL_checkudata(L, index, BUFFER_METATABLE);
+}
+
+lua_buffer_t *lua_buffer_test(lua_State *L, int index)
+{
+    return luaL_testudata(L, index, BUFFER_METATABLE);
+}
+
+const uint8_t *lua_buffer_checkbytes(lua_State *L, int index, size_t *length)
+{
+    lua_buffer_t *buffer = lua_buffer_test(L, index);
+
+    if (buffer != NULL)
+    {
+        *length = buffer->length;
+        return buffer->data;
+    }
+
+    if (lua_type(L, index) != LUA_TSTRING)
+    {
+        luaL_typeerror(L, index, "string or buffer");
+    }
+
+    return (const uint8_t *)lua_tolstring(L, index, length);
+}
+
+lua_buffer_t *lua_buffer_optdestination(lua_State *L, int index, size_t length)
+{
+    if (lua_isnoneornil(L, index))
+    {
+        return NULL;
+    }
+
+    lua_buffer_t *buffer = check_buffer(L, index);
+
+    if (length > buffer->capacity)
+    {
+        luaL_error(L, "buffer capacity is less than %d bytes", (int)length);
+    }
+
+    return buffer;
+}
+
+static int lua_transient_gc(lua_State *L)
+{
+    void **pointer = luaL_checkudata(L, 1, TRANSIENT_METATABLE);
+    memory_free(*pointer);
+    *pointer = NULL;
+    return 0;
+}
+
+void *lua_transient_allocate(lua_State *L, size_t size)
+{
+    void **pointer = lua_newuserdatauv(L, sizeof(void *), 0);
+    *pointer = NULL;
+    luaL_setmetatable(L, TRANSIENT_METATABLE);
+
+    *pointer = memory_allocate(MEMORY_POOL_TRANSIENT, size);
+    return *pointer;
+}
+
+void lua_transient_free(lua_State *L, int index)
+{
+    void **pointer = luaL_checkudata(L, index, TRANSIENT_METATABLE);
+    memory_free(*pointer);
+    *pointer = NULL;
+}
+
+static lua_buffer_t *new_buffer(lua_State *L, size_t capacity)
+{
+    lua_buffer_t *buffer =
+        lua_newuserdatauv(L, sizeof(lua_buffer_t) + capacity, 1);
+
+    buffer->data = (uint8_t *)(buffer + 1);
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    memset(buffer->data, 0, capacity);
+
+    luaL_setmetatable(L, BUFFER_METATABLE);
+    return buffer;
+}
+
+// Converts a 1 based position, where negative values count from the end
+static size_t check_position(lua_State *L,
+                             int index,
+                             lua_Integer default_value,
+                             size_t end)
+{
+    lua_Integer position = luaL_optinteger(L, index, default_value);
+
+    if (position < 0)
+    {
+        position += end + 1;
+    }
+
+    if (position < 1 || position > (lua_Integer)end + 1)
+    {
+        luaL_argerror(L, index, "position is outside of the buffer");
+    }
+
+    return position - 1;
+}
+
+// Converts a 1 based inclusive end position into the offset just after it.
+// Like string.sub(), ends beyond the limit are clamped, and an end before the
+// start gives an empty range
+static size_t check_end(lua_State *L, int index, size_t start, size_t limit)
+{
+    lua_Integer position = luaL_optinteger(L, index, limit);
+
+    if (position < 0)
+    {
+        position += limit + 1;
+    }
+
+    if (position > (lua_Integer)limit)
+    {
+        position = limit;
+    }
+
+    if (position < (lua_Integer)start)
+    {
+        position = start;
+    }
+
+    return position;
+}
+
+static void check_range(lua_State *L,
+                        size_t offset,
+                        size_t length,
+                        size_t limit)
+{
+    if (offset > limit || length > limit - offset)
+    {
+        luaL_error(L, "access is outside of the buffer");
+    }
+}
+
+static void extend_length(lua_buffer_t *buffer, size_t end)
+{
+    if (end > buffer->length)
+    {
+        buffer->length = end;
+    }
+}
+
+static int lua_buffer_new(lua_State *L)
+{
+    lua_Integer capacity = luaL_checkinteger(L, 1);
+
+    if (capacity < 1)
+    {
+        luaL_error(L, "capacity must be greater than 0");
+    }
+
+    // Nothing bigger than the Lua pool can be allocated anyway, and on a 32
+    // bit target the userdata size would wrap around for huge capacities
+    memory_stats_t stats;
+    memory_get_stats(MEMORY_POOL_LUA, &stats);
+    size_t capacity_limit = stats.total_size - sizeof(lua_buffer_t);
+
+    if ((lua_Unsigned)capacity > capacity_limit)
+    {
+        luaL_error(L,
+                   "capacity must be at most %d bytes",
+                   (int)capacity_limit);
+    }
+
+    size_t length = 0;
+    const uint8_t *data = NULL;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        data = lua_buffer_checkbytes(L, 2, &length);
+
+        if (length > (size_t)capacity)
+        {
+            luaL_error(L, "data is longer than the capacity");
+        }
+    }
+
+    lua_buffer_t *buffer = new_buffer(L, capacity);
+
+    if (length > 0)
+    {
+        memcpy(buffer->data, data, length);
+        buffer->length = length;
+    }
+
+    return 1;
+}
+
+static int lua_buffer_capacity(lua_State *L)
+{
+    lua_pushinteger(L, check_buffer(L, 1)->capacity);
+    return 1;
+}
+
+static int lua_buffer_length(lua_State *L)
+{
+    lua_pushinteger(L, check_buffer(L, 1)->length);
+    return 1;
+}
+
+static int lua_buffer_set_length(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    lua_Integer length = luaL_checkinteger(L, 2);
+
+    if (length < 0 || length > (lua_Integer)buffer->capacity)
+    {
+        luaL_error(L, "length must be between 0 and the capacity");
+    }
+
+    buffer->length = length;
+    return 0;
+}
+
+static int lua_buffer_clear(lua_State *L)
+{
+    check_buffer(L, 1)->length = 0;
+    return 0;
+}
+
+static int lua_buffer_fill(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    lua_Integer value = luaL_checkinteger(L, 2);
+    size_t start = check_position(L, 3, 1, buffer->capacity);
+    size_t end = check_end(L, 4, start, buffer->capacity);
+
+    if (end > start)
+    {
+        memset(buffer->data + start, (uint8_t)value, end - start);
+        extend_length(buffer, end);
+    }
+
+    return 0;
+}
+
+static int lua_buffer_write(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    size_t offset = check_position(L, 2, 1, buffer->capacity);
+
+    size_t length;
+    const uint8_t *data = lua_buffer_checkbytes(L, 3, &length);
+
+    check_range(L, offset, length, buffer->capacity);
+
+    // Slices may overlap with the buffer they came from
+    memmove(buffer->data + offset, data, length);
+    extend_length(buffer, offset + length);
+
+    return 0;
+}
+
+static int lua_buffer_append(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+
+    size_t length;
+    const uint8_t *data = lua_buffer_checkbytes(L, 2, &length);
+
+    check_range(L, buffer->length, length, buffer->capacity);
+
+    memmove(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+
+    return 0;
+}
+
+static int lua_buffer_slice(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    size_t start = check_position(L, 2, 1, buffer->length);
+    size_t end = check_end(L, 3, start, buffer->length);
+
+    lua_buffer_t *slice = lua_newuserdatauv(L, sizeof(lua_buffer_t), 1);
+    slice->data = buffer->data + start;
+    slice->length = end - start;
+    slice->capacity = end - start;
+    luaL_setmetatable(L, BUFFER_METATABLE);
+
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+
+    return 1;
+}
+
+static int lua_buffer_tostring(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    size_t start = check_position(L, 2, 1, buffer->length);
+    size_t end = check_end(L, 3, start, buffer->length);
+
+    lua_pushlstring(L, (const char *)buffer->data + start, end - start);
+    return 1;
+}
+
+/*
+ * The integer accessors share one function each, with the size in bytes and
+ * whether the value is signed given as upvalues.
+ */
+static int lua_buffer_get_integer(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    size_t size = lua_tointeger(L, lua_upvalueindex(1));
+    bool is_signed = lua_toboolean(L, lua_upvalueindex(2));
+    size_t offset = check_position(L, 2, 1, buffer->length);
+    bool big_endian = lua_toboolean(L, 3);
+
+    check_range(L, offset, size, buffer->length);
+
+    uint32_t value = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t byte = big_endian ? i : size - 1 - i;
+        value = value << 8 | buffer->data[offset + byte];
+    }
+
+    if (is_signed && size < 4 && value & (1u << (size * 8 - 1)))
+    {
+        value |= UINT32_MAX << (size * 8);
+    }
+
+    lua_pushinteger(L, is_signed ? (lua_Integer)(int32_t)value : value);
+    return 1;
+}
+
+static int lua_buffer_set_integer(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    size_t size = lua_tointeger(L, lua_upvalueindex(1));
+    size_t offset = check_position(L, 2, 1, buffer->capacity);
+    uint32_t value = (uint32_t)luaL_checkinteger(L, 3);
+    bool big_endian = lua_toboolean(L, 4);
+
+    check_range(L, offset, size, buffer->capacity);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t byte = big_endian ? size - 1 - i : i;
+        buffer->data[offset + byte] = value & 0xFF;
+        value >>= 8;
+    }
+
+    extend_length(buffer, offset + size);
+    return 0;
+}
+
+static int lua_buffer_index(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Integer index = luaL_checkinteger(L, 2);
+
+        if (index < 1 || index > (lua_Integer)buffer->length)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        lua_pushinteger(L, buffer->data[index - 1]);
+        return 1;
+    }
+
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int lua_buffer_newindex(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    lua_Integer value = luaL_checkinteger(L, 3);
+
+    if (index < 1 || index > (lua_Integer)buffer->length)
+    {
+        luaL_error(L, "index is outside of the buffer");
+    }
+
+    buffer->data[index - 1] = (uint8_t)value;
+    return 0;
+}
+
+static int lua_buffer_to_display_string(lua_State *L)
+{
+    lua_buffer_t *buffer = check_buffer(L, 1);
+    lua_pushfstring(L,
+                    "buffer: %d of %d bytes",
+                    (int)buffer->length,
+                    (int)buffer->capacity);
+    return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+    {"capacity", lua_buffer_capacity},
+    {"length", lua_buffer_length},
+    {"set_length", lua_buffer_set_length},
+    {"clear", lua_buffer_clear},
+    {"fill", lua_buffer_fill},
+    {"write", lua_buffer_write},
+    {"append", lua_buffer_append},
+    {"slice", lua_buffer_slice},
+    {"tostring", lua_buffer_tostring},
+    {NULL, NULL},
+};
+
+static const struct
+{
+    const char *name;
+    int size;
+    bool is_signed;
+} integer_methods[] = {
+    {"u8", 1, false},
+    {"i8", 1, true},
+    {"u16", 2, false},
+    {"i16", 2, true},
+    {"u32", 4, false},
+    {"i32", 4, true},
+};
+
+#define INTEGER_METHOD_COUNT \
+    (sizeof(integer_methods) / sizeof(integer_methods[0]))
+
+void lua_open_buffer_library(lua_State *L)
+{
+    luaL_newmetatable(L, TRANSIENT_METATABLE);
+    lua_pushcfunction(L, lua_transient_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, BUFFER_METATABLE);
+
+    lua_pushcfunction(L, lua_buffer_length);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, lua_buffer_to_display_string);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lua_buffer_newindex);
+    lua_setfield(L, -2, "__newindex");
+
+    // Methods are looked up by __index, which also handles byte indexing
+    luaL_newlibtable(L, buffer_methods);
+    luaL_setfuncs(L, buffer_methods, 0);
+
+    for (size_t i = 0; i < INTEGER_METHOD_COUNT; i++)
+    {
+        char name[8];
+
+        lua_pushinteger(L, integer_methods[i].size);
+        lua_pushboolean(L, integer_methods[i].is_signed);
+        lua_pushcclosure(L, lua_buffer_get_integer, 2);
+        snprintf(name, sizeof(name), "get_%s", integer_methods[i].name);
+        lua_setfield(L, -2, name);
+
+        lua_pushinteger(L, integer_methods[i].size);
+        lua_pushcclosure(L, lua_buffer_set_integer, 1);
+        snprintf(name, sizeof(name), "set_%s", integer_methods[i].name);
+        lua_setfield(L, -2, name);
+    }
+
+    lua_pushcclosure(L, lua_buffer_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "frame");
+
+    lua_newtable(L);
+
+    lua_pushcfunction(L, lua_buffer_new);
+    lua_setfield(L, -2, "new");
+
+    lua_setfield(L, -2, "buffer");
+
+    lua_pop(L, 1);
+}
@@ -25,15 +25,22 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "error_logging.h"
+#include "frame_lua_libraries.h"
 #include "i2c.h"
 #include "jpeg.h"
 #include "lauxlib.h"
 #include "lua.h"
+#include "main.h"
+#include "memory.h"
 #include "nrf_gpio.h"
 #include "nrfx_systick.h"
 #include "pinout.h"
 #include "spi.h"
 
+// Longer than the encoder can go without output, including the wait for the
+// next frame to start after a capture is requested
+#define CAPTURE_STABLE_MS 200
+
 typedef enum camera_metering_mode
 {
     SPOT,
@@ -52,6 +59,8 @@ static struct camera_auto_last_values
 
 static size_t jpeg_header_bytes_sent_out = 0;
 static size_t jpeg_footer_bytes_sent_out = 0;
+static uint16_t capture_bytes_last_polled = 0;
+static uint64_t capture_bytes_changed_ms = 0;
 
 static int lua_camera_capture(lua_State *L)
 {
@@ -63,6 +72,8 @@ static int lua_camera_capture(lua_State *L)
     spi_write(FPGA, 0x20, NULL, 0);
     jpeg_header_bytes_sent_out = 0;
     jpeg_footer_bytes_sent_out = 0;
+    capture_bytes_last_polled = 0;
+    capture_bytes_changed_ms = lua_time_uptime_ms();
     return 0;
 }
 
@@ -78,6 +89,35 @@ static uint16_t get_bytes_available(void)
     return bytes_available;
 }
 
+/*
+ * Newer bitstreams flag when the encoder has finished. Older ones don't, so
+ * the capture is taken to be complete once the bytes available have stopped
+ * changing for CAPTURE_STABLE_MS. That adds up to CAPTURE_STABLE_MS of delay,
+ * and would still end early if the camera stalled for longer than that
+ */
+bool lua_camera_capture_complete(void)
+{
+    if (fpga_features & FPGA_FEATURE_CAPTURE_COMPLETE)
+    {
+        uint8_t complete = 0;
+        spi_read(FPGA, 0x27, &complete, sizeof(complete));
+        return complete & 1;
+    }
+
+    uint16_t bytes_available = get_bytes_available();
+    uint64_t now = lua_time_uptime_ms();
+
+    if (bytes_available != capture_bytes_last_polled)
+    {
+        capture_bytes_last_polled = bytes_available;
+        capture_bytes_changed_ms = now;
+        return false;
+    }
+
+    return bytes_available > 0 &&
+           now - capture_bytes_changed_ms >= CAPTURE_STABLE_MS;
+}
+
 static int lua_camera_read(lua_State *L)
 {
     lua_Integer bytes_requested = luaL_checkinteger(L, 1);
@@ -88,7 +128,13 @@ static int lua_camera_read(lua_State *L)
 
     size_t bytes_remaining = bytes_requested;
 
-    uint8_t *payload = malloc(bytes_requested);
+    // Reads straight into a buffer if one is given
+    lua_buffer_t *destination =
+        lua_buffer_optdestination(L, 2, bytes_requested);
+
+    uint8_t *payload = destination != NULL
+                           ? destination->data
+                           : lua_transient_allocate(L, bytes_requested);
     if (payload == NULL)
     {
         luaL_error(L, "bytes requested is too large");
@@ -158,16 +204,144 @@ static int lua_camera_read(lua_State *L)
         lua_pushnil(L);
     }
 
-    // Otherwise return payload
+    // Otherwise return the buffer
+    else if (destination != NULL)
+    {
+        destination->length = bytes_requested - bytes_remaining;
+        lua_pushvalue(L, 2);
+    }
+
+    // Or the payload as a string
     else
     {
         lua_pushlstring(L, (char *)payload, bytes_requested - bytes_remaining);
     }
 
-    free(payload);
+    if (destination == NULL)
+    {
+        lua_transient_free(L, -2);
+    }
+
     return 1;
 }
 
+static int lua_camera_save(lua_State *L)
+{
+    if (nrf_gpio_pin_out_read(CAMERA_SLEEP_PIN) == false)
+    {
+        luaL_error(L, "camera is asleep");
+    }
+
+    const char *filename = luaL_checkstring(L, 1);
+
+    // The file always starts with the whole header, so anything already read
+    // would be missing from the image
+    if (jpeg_header_bytes_sent_out > 0)
+    {
+        luaL_error(L, "capture has already been read");
+    }
+
+    uint64_t start_ms = lua_time_uptime_ms();
+
+    lfs_t *filesystem = lua_file_system();
+
+    // Staging a whole block at a time keeps every write to littlefs aligned
+    size_t block_size = filesystem->cfg->block_size;
+
+    uint8_t *block = memory_allocate(MEMORY_POOL_TRANSIENT,
+                                     block_size + sizeof(jpeg_footer));
+    if (block == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+
+    lfs_file_t file;
+    if (lfs_file_open(filesystem,
+                      &file,
+                      filename,
+                      LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC))
+    {
+        memory_free(block);
+        luaL_error(L, "cannot open file %s", filename);
+    }
+
+    memcpy(block, jpeg_header, sizeof(jpeg_header));
+
+    size_t block_used = sizeof(jpeg_header);
+    size_t total_written = 0;
+    bool failed = false;
+    bool image_done = false;
+
+    while (true)
+    {
+        if (!image_done)
+        {
+            uint16_t image_bytes_available = get_bytes_available();
+
+            if (image_bytes_available == 0)
+            {
+                image_done = true;
+
+                // Extra space was allocated so the footer always fits
+                memcpy(block + block_used, jpeg_footer, sizeof(jpeg_footer));
+                block_used += sizeof(jpeg_footer);
+            }
+
+            else
+            {
+                size_t length = block_size - block_used < image_bytes_available
+                                    ? block_size - block_used
+                                    : image_bytes_available;
+
+                spi_read(FPGA, 0x22, block + block_used, length);
+                block_used += length;
+            }
+        }
+
+        if (block_used >= block_size || (image_done && block_used > 0))
+        {
+            lfs_ssize_t result = lfs_file_write(filesystem,
+                                                &file,
+                                                block,
+                                                block_used);
+
+            if (result != block_used)
+            {
+                failed = true;
+                break;
+            }
+
+            total_written += block_used;
+            block_used = 0;
+        }
+
+        if (image_done && block_used == 0)
+        {
+            break;
+        }
+    }
+
+    memory_free(block);
+
+    if (lfs_file_close(filesystem, &file) < 0)
+    {
+        failed = true;
+    }
+
+    // Whatever happens, the image has been consumed from the FPGA
+    jpeg_header_bytes_sent_out = sizeof(jpeg_header);
+    jpeg_footer_bytes_sent_out = sizeof(jpeg_footer);
+
+    if (failed)
+    {
+        luaL_error(L, "error writing to file");
+    }
+
+    lua_pushinteger(L, total_written);
+    lua_pushnumber(L, (lua_time_uptime_ms() - start_ms) / 1000.0);
+    return 2;
+}
+
 static int lua_camera_auto(lua_State *L)
 {
     if (nrf_gpio_pin_out_read(CAMERA_SLEEP_PIN) == false)
@@ -562,6 +736,9 @@ void lua_open_camera_library(lua_State *L)
     lua_pushcfunction(L, lua_camera_read);
     lua_setfield(L, -2, "read");
 
+    lua_pushcfunction(L, lua_camera_save);
+    lua_setfield(L, -2, "save");
+
     lua_pushcfunction(L, lua_camera_auto);
     lua_setfield(L, -2, "auto");
 
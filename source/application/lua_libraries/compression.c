@@ -0,0 +1,366 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "compression.h"
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lua.h"
+#include "memory.h"
+
+#define DECODER_METATABLE "frame.compression.decoder"
+#define DEFAULT_BLOCK_SIZE 4096
+
+typedef struct lua_destination_t
+{
+    lua_State *L;
+    int index;
+    bool failed;
+    size_t total_size;
+} lua_destination_t;
+
+typedef struct decoder_t
+{
+    compression_stream_t stream;
+    lua_destination_t destination;
+    void *buffer;
+    bool finished;
+} decoder_t;
+
+// Output can go to a function, a buffer, or anything with a write(data) method
+// such as a file. The display has no such method, so drawing decompressed
+// sprites needs a function which passes each block on
+static void check_destination(lua_State *L, int index)
+{
+    if (lua_isfunction(L, index) || lua_buffer_test(L, index) != NULL)
+    {
+        return;
+    }
+
+    // Anything with a write method, such as a file, can also take the output
+    if ((lua_type(L, index) != LUA_TTABLE &&
+         lua_type(L, index) != LUA_TUSERDATA) ||
+        lua_getfield(L, index, "write") != LUA_TFUNCTION)
+    {
+        luaL_argerror(L, index,
+                      "expected a function, buffer or object with write");
+    }
+
+    lua_pop(L, 1);
+}
+
+// Errors are held on the stack rather than raised so that the decoder isn't
+// left half way through a block, and buffers can be freed before raising them
+static void send_to_destination(void *context, void *data, size_t data_size)
+{
+    lua_destination_t *destination = context;
+    lua_State *L = destination->L;
+
+    if (data == NULL || destination->failed)
+    {
+        return;
+    }
+
+    // Buffers are appended to directly rather than going through a string
+    lua_buffer_t *buffer = lua_buffer_test(L, destination->index);
+
+    if (buffer != NULL)
+    {
+        if (data_size > buffer->capacity - buffer->length)
+        {
+            lua_pushliteral(L, "buffer is too small for the decompressed data");
+            destination->failed = true;
+            return;
+        }
+
+        memcpy(buffer->data + buffer->length, data, data_size);
+        buffer->length += data_size;
+        destination->total_size += data_size;
+        return;
+    }
+
+    int arguments = 1;
+
+    if (lua_isfunction(L, destination->index))
+    {
+        lua_pushvalue(L, destination->index);
+    }
+    else
+    {
+        lua_getfield(L, destination->index, "write");
+        lua_pushvalue(L, destination->index);
+        arguments++;
+    }
+
+    lua_pushlstring(L, data, data_size);
+
+    if (lua_pcall(L, arguments, 0, 0) != LUA_OK)
+    {
+        destination->failed = true;
+        return;
+    }
+
+    destination->total_size += data_size;
+}
+
+static int raise_status(lua_State *L, int status)
+{
+    switch (status)
+    {
+    case COMPRESSION_ERROR_NO_MEMORY:
+        return luaL_error(L, "not enough memory");
+
+    case COMPRESSION_ERROR_INVALID_FRAME:
+        return luaL_error(L, "invalid or incomplete frame");
+
+    case COMPRESSION_ERROR_UNSUPPORTED_FRAME:
+        return luaL_error(L, "frame must use independent blocks");
+
+    case COMPRESSION_ERROR_INVALID_BLOCK:
+        return luaL_error(L, "invalid block, or block larger than block_size");
+
+    case COMPRESSION_ERROR_CHECKSUM_MISMATCH:
+        return luaL_error(L, "checksum mismatch");
+
+    default:
+        return luaL_error(L, "decompression failed");
+    }
+}
+
+static size_t check_block_size(lua_State *L, int index)
+{
+    lua_Integer block_size = luaL_optinteger(L, index, DEFAULT_BLOCK_SIZE);
+
+    if (block_size < 16 || block_size > 0x10000)
+    {
+        luaL_error(L, "block_size must be between 16 and 65536");
+    }
+
+    return block_size;
+}
+
+static int lua_compression_decompress(lua_State *L)
+{
+    size_t data_size;
+    const char *data = (const char *)lua_buffer_checkbytes(L, 1, &data_size);
+    check_destination(L, 2);
+    size_t block_size = check_block_size(L, 3);
+    lua_settop(L, 2);
+
+    void *buffer = lua_transient_allocate(
+        L,
+        COMPRESSION_STREAM_BUFFER_SIZE(block_size));
+    if (buffer == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+
+    lua_destination_t destination = {
+        .L = L,
+        .index = 2,
+        .failed = false,
+        .total_size = 0,
+    };
+
+    compression_stream_t stream;
+    compression_stream_init(&stream,
+                            block_size,
+                            buffer,
+                            send_to_destination,
+                            &destination);
+
+    compression_stream_feed(&stream, data, data_size);
+    int status = compression_stream_finish(&stream);
+
+    lua_transient_free(L, 3);
+
+    if (destination.failed)
+    {
+        return lua_error(L);
+    }
+
+    if (status != COMPRESSION_SUCCESS)
+    {
+        raise_status(L, status);
+    }
+
+    lua_pushinteger(L, destination.total_size);
+    return 1;
+}
+
+static decoder_t *check_decoder(lua_State *L)
+{
+    decoder_t *decoder = luaL_checkudata(L, 1, DECODER_METATABLE);
+
+    if (decoder->finished)
+    {
+        luaL_error(L, "decoder is already finished");
+    }
+
+    return decoder;
+}
+
+static int lua_compression_decoder(lua_State *L)
+{
+    check_destination(L, 1);
+    size_t block_size = check_block_size(L, 2);
+
+    decoder_t *decoder = lua_newuserdatauv(L, sizeof(decoder_t), 1);
+    decoder->buffer = NULL;
+    decoder->finished = true;
+    luaL_setmetatable(L, DECODER_METATABLE);
+
+    // The destination is kept alive by the decoder
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+
+    decoder->buffer = memory_allocate(MEMORY_POOL_LUA,
+                                      COMPRESSION_STREAM_BUFFER_SIZE(block_size));
+    if (decoder->buffer == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+
+    decoder->finished = false;
+    decoder->destination.total_size = 0;
+
+    compression_stream_init(&decoder->stream,
+                            block_size,
+                            decoder->buffer,
+                            send_to_destination,
+                            &decoder->destination);
+
+    return 1;
+}
+
+static int run_decoder(lua_State *L,
+                       decoder_t *decoder,
+                       const char *data,
+                       size_t data_size)
+{
+    // Pushed on top so the data argument below stays referenced throughout
+    lua_getiuservalue(L, 1, 1);
+
+    decoder->destination.L = L;
+    decoder->destination.index = lua_gettop(L);
+    decoder->destination.failed = false;
+
+    int status;
+
+    if (data == NULL)
+    {
+        status = compression_stream_finish(&decoder->stream);
+        decoder->finished = true;
+    }
+    else
+    {
+        status = compression_stream_feed(&decoder->stream, data, data_size);
+    }
+
+    // A failed destination can't be resumed as its block has been dropped
+    if (decoder->destination.failed)
+    {
+        decoder->finished = true;
+        return lua_error(L);
+    }
+
+    if (status != COMPRESSION_SUCCESS)
+    {
+        decoder->finished = true;
+        return raise_status(L, status);
+    }
+
+    return 0;
+}
+
+static int lua_decoder_feed(lua_State *L)
+{
+    decoder_t *decoder = check_decoder(L);
+
+    size_t data_size;
+    const char *data = (const char *)lua_buffer_checkbytes(L, 2, &data_size);
+    lua_settop(L, 2);
+
+    run_decoder(L, decoder, data, data_size);
+
+    return 0;
+}
+
+static int lua_decoder_finish(lua_State *L)
+{
+    decoder_t *decoder = check_decoder(L);
+    lua_settop(L, 1);
+
+    run_decoder(L, decoder, NULL, 0);
+
+    memory_free(decoder->buffer);
+    decoder->buffer = NULL;
+
+    lua_pushinteger(L, decoder->destination.total_size);
+    return 1;
+}
+
+static int lua_decoder_gc(lua_State *L)
+{
+    decoder_t *decoder = luaL_checkudata(L, 1, DECODER_METATABLE);
+
+    memory_free(decoder->buffer);
+    decoder->buffer = NULL;
+    decoder->finished = true;
+
+    return 0;
+}
+
+static const luaL_Reg decoder_methods[] = {
+    {"feed", lua_decoder_feed},
+    {"finish", lua_decoder_finish},
+    {NULL, NULL},
+};
+
+void lua_open_compression_library(lua_State *L)
+{
+    luaL_newmetatable(L, DECODER_METATABLE);
+    lua_pushcfunction(L, lua_decoder_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlibtable(L, decoder_methods);
+    luaL_setfuncs(L, decoder_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "frame");
+
+    lua_newtable(L);
+
+    lua_pushcfunction(L, lua_compression_decompress);
+    lua_setfield(L, -2, "decompress");
+
+    lua_pushcfunction(L, lua_compression_decoder);
+    lua_setfield(L, -2, "decoder");
+
+    lua_setfield(L, -2, "compression");
+
+    lua_pop(L, 1);
+}
@@ -23,9 +23,13 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include "error_logging.h"
+#include "frame_lua_libraries.h"
 #include "lauxlib.h"
 #include "lua.h"
+#include "main.h"
+#include "memory.h"
 #include "nrfx_systick.h"
 #include "spi.h"
 #include "system_font.h"
@@ -106,7 +110,7 @@ static int lua_display_assign_color(lua_State *L)
                        (uint8_t)cb,
                        (uint8_t)cr};
 
-    spi_write(FPGA, 0x11, (uint8_t *)data, sizeof(data));
+    spi_write_async(FPGA, 0x11, data, sizeof(data), NULL, 0, false);
 
     return 0;
 }
@@ -143,11 +147,327 @@ static int lua_display_assign_color_ycbcr(lua_State *L)
                        (uint8_t)cb,
                        (uint8_t)cr};
 
-    spi_write(FPGA, 0x11, (uint8_t *)data, sizeof(data));
+    spi_write_async(FPGA, 0x11, data, sizeof(data), NULL, 0, false);
 
     return 0;
 }
 
+/*
+ * Sprites can be stored in the FPGA once and then drawn again by ID. IDs below
+ * SPRITE_STORE_GLYPH_ID are used by Lua, and the rest cache text glyphs, which
+ * are evicted least recently drawn first. Stored sprites are drawn by the FPGA
+ * in the background, so anything else drawn must wait for them to finish.
+ *
+ * Bitstreams without FPGA_FEATURE_SPRITE_STORE don't have the store. Glyphs
+ * are then sent in full every time, and Lua sprites are kept in the Lua pool
+ * and sent with GRAPHICS_DRAW_SPRITE, still counted against the same 16KB.
+ */
+#define SPRITE_STORE_SIZE 16384
+#define SPRITE_STORE_QUEUE_DEPTH 32
+#define SPRITE_STORE_BUSY_POLL_US 100
+#define SPRITE_STORE_BUSY_POLL_LIMIT 5000
+#define SPRITE_STORE_IDS 256
+#define SPRITE_STORE_GLYPH_ID 128
+#define GLYPH_COUNT (sizeof(sprite_metadata) / sizeof(sprite_metadata_t))
+
+typedef struct sprite_store_entry_t
+{
+    uint16_t address;
+    uint16_t length;
+    uint16_t glyph;
+    uint16_t width;
+    uint32_t last_drawn;
+    uint8_t total_colors;
+    bool stored;
+} sprite_store_entry_t;
+
+static sprite_store_entry_t sprite_store[SPRITE_STORE_IDS];
+static uint8_t *sprite_copies[SPRITE_STORE_GLYPH_ID];
+static uint8_t glyph_store_id[GLYPH_COUNT];
+static uint32_t sprite_store_draw_count = 0;
+static size_t sprite_store_queued = 0;
+
+static bool sprite_store_supported(void)
+{
+    return fpga_features & FPGA_FEATURE_SPRITE_STORE;
+}
+
+static void wait_for_sprite_store(lua_State *L)
+{
+    if (sprite_store_queued == 0)
+    {
+        return;
+    }
+
+    // Even a full queue of the largest sprites is drawn in well under the
+    // ~500ms allowed here, so a longer wait means the FPGA has stopped
+    for (size_t poll = 0; poll < SPRITE_STORE_BUSY_POLL_LIMIT; poll++)
+    {
+        uint8_t busy = 1;
+        spi_read(FPGA, 0x18, &busy, sizeof(busy));
+
+        if ((busy & 1) == 0)
+        {
+            sprite_store_queued = 0;
+            return;
+        }
+
+        nrfx_systick_delay_us(SPRITE_STORE_BUSY_POLL_US);
+    }
+
+    sprite_store_queued = 0;
+    luaL_error(L, "timed out waiting for stored sprites to be drawn");
+}
+
+static size_t glyph_data_length(size_t glyph)
+{
+    size_t pixels = sprite_metadata[glyph].width * sprite_metadata[glyph].height;
+
+    switch (sprite_metadata[glyph].colors)
+    {
+    case SPRITE_16_COLORS:
+        return (pixels + 1) / 2;
+    case SPRITE_4_COLORS:
+        return (pixels + 3) / 4;
+    default:
+        return (pixels + 7) / 8;
+    }
+}
+
+static void sprite_store_free(size_t id)
+{
+    if (sprite_store[id].stored && id >= SPRITE_STORE_GLYPH_ID)
+    {
+        glyph_store_id[sprite_store[id].glyph] = 0;
+    }
+
+    if (id < SPRITE_STORE_GLYPH_ID && sprite_copies[id] != NULL)
+    {
+        memory_free(sprite_copies[id]);
+        sprite_copies[id] = NULL;
+    }
+
+    sprite_store[id].stored = false;
+}
+
+static size_t sprite_store_oldest_glyph(void)
+{
+    size_t oldest = 0;
+
+    for (size_t id = SPRITE_STORE_GLYPH_ID; id < SPRITE_STORE_IDS; id++)
+    {
+        if (sprite_store[id].stored &&
+            (oldest == 0 ||
+             sprite_store[id].last_drawn < sprite_store[oldest].last_drawn))
+        {
+            oldest = id;
+        }
+    }
+
+    return oldest;
+}
+
+static bool sprite_store_find_space(size_t length, uint16_t *address)
+{
+    // First fit. Each pass moves past any sprite overlapping the candidate
+    uint32_t candidate = 0;
+    bool moved = true;
+
+    while (moved)
+    {
+        moved = false;
+
+        for (size_t id = 0; id < SPRITE_STORE_IDS; id++)
+        {
+            sprite_store_entry_t *entry = &sprite_store[id];
+
+            if (entry->stored &&
+                entry->address < candidate + length &&
+                candidate < (uint32_t)entry->address + entry->length)
+            {
+                candidate = entry->address + entry->length;
+                moved = true;
+            }
+        }
+
+        if (candidate + length > SPRITE_STORE_SIZE)
+        {
+            return false;
+        }
+    }
+
+    *address = (uint16_t)candidate;
+    return true;
+}
+
+static bool sprite_store_allocate(size_t length, uint16_t *address)
+{
+    while (!sprite_store_find_space(length, address))
+    {
+        size_t oldest = sprite_store_oldest_glyph();
+
+        if (oldest == 0)
+        {
+            return false;
+        }
+
+        sprite_store_free(oldest);
+    }
+
+    return true;
+}
+
+static void send_sprite(lua_State *L,
+                        uint8_t opcode,
+                        uint8_t *meta_data,
+                        size_t meta_data_length,
+                        const uint8_t *pixel_data,
+                        size_t pixel_data_length)
+{
+    wait_for_sprite_store(L);
+
+    // Glyphs in flash are sent from where they are. Lua strings can be
+    // collected before the transfer finishes, so those are copied
+    if (!nrfx_is_in_ram(pixel_data))
+    {
+        spi_write_async(FPGA,
+                        opcode,
+                        meta_data,
+                        meta_data_length,
+                        (uint8_t *)pixel_data,
+                        pixel_data_length,
+                        false);
+        return;
+    }
+
+    uint8_t *payload = memory_allocate(MEMORY_POOL_TRANSIENT,
+                                       pixel_data_length);
+    if (payload == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+    memcpy(payload, pixel_data, pixel_data_length);
+    spi_write_async(FPGA,
+                    opcode,
+                    meta_data,
+                    meta_data_length,
+                    payload,
+                    pixel_data_length,
+                    true);
+}
+
+static void sprite_store_upload(lua_State *L,
+                                size_t id,
+                                uint16_t address,
+                                lua_Integer width,
+                                lua_Integer total_colors,
+                                const uint8_t *pixel_data,
+                                size_t pixel_data_length)
+{
+    if (!sprite_store_supported())
+    {
+        // Only Lua sprites get here, as text() doesn't use the store then
+        uint8_t *copy = memory_allocate(MEMORY_POOL_LUA, pixel_data_length);
+        if (copy == NULL)
+        {
+            luaL_error(L, "not enough memory");
+        }
+        memcpy(copy, pixel_data, pixel_data_length);
+        sprite_copies[id] = copy;
+    }
+
+    else
+    {
+        uint8_t meta_data[8] = {(uint8_t)id,
+                                (uint32_t)address >> 8,
+                                (uint32_t)address,
+                                (uint32_t)width >> 8,
+                                (uint32_t)width,
+                                (uint8_t)total_colors,
+                                (uint32_t)pixel_data_length >> 8,
+                                (uint32_t)pixel_data_length};
+
+        send_sprite(L,
+                    0x16,
+                    meta_data,
+                    sizeof(meta_data),
+                    pixel_data,
+                    pixel_data_length);
+    }
+
+    sprite_store[id].address = address;
+    sprite_store[id].length = (uint16_t)pixel_data_length;
+    sprite_store[id].width = (uint16_t)width;
+    sprite_store[id].total_colors = (uint8_t)total_colors;
+    sprite_store[id].last_drawn = sprite_store_draw_count;
+    sprite_store[id].stored = true;
+}
+
+static void sprite_store_draw(lua_State *L,
+                              size_t id,
+                              lua_Integer x_position,
+                              lua_Integer y_position,
+                              lua_Integer palette_offset)
+{
+    if (sprite_store_queued == SPRITE_STORE_QUEUE_DEPTH)
+    {
+        wait_for_sprite_store(L);
+    }
+
+    // Remove Lua 1 based offset before sending
+    x_position--;
+    y_position--;
+
+    uint8_t meta_data[6] = {(uint32_t)x_position >> 8,
+                            (uint32_t)x_position,
+                            (uint32_t)y_position >> 8,
+                            (uint32_t)y_position,
+                            (uint8_t)palette_offset,
+                            (uint8_t)id};
+
+    spi_write_async(FPGA, 0x17, meta_data, sizeof(meta_data), NULL, 0, false);
+
+    sprite_store_queued++;
+    sprite_store[id].last_drawn = ++sprite_store_draw_count;
+}
+
+static size_t store_glyph(lua_State *L, size_t glyph)
+{
+    size_t id = SPRITE_STORE_GLYPH_ID;
+
+    while (id < SPRITE_STORE_IDS && sprite_store[id].stored)
+    {
+        id++;
+    }
+
+    if (id == SPRITE_STORE_IDS)
+    {
+        id = sprite_store_oldest_glyph();
+        sprite_store_free(id);
+    }
+
+    uint16_t address;
+    size_t length = glyph_data_length(glyph);
+
+    if (!sprite_store_allocate(length, &address))
+    {
+        return 0;
+    }
+
+    sprite_store_upload(L,
+                        id,
+                        address,
+                        sprite_metadata[glyph].width,
+                        sprite_metadata[glyph].colors,
+                        sprite_data + sprite_metadata[glyph].data_offset,
+                        length);
+
+    sprite_store[id].glyph = glyph;
+    glyph_store_id[glyph] = id;
+
+    return id;
+}
+
 static void draw_sprite(lua_State *L,
                         lua_Integer x_position,
                         lua_Integer y_position,
@@ -195,24 +515,19 @@ static void draw_sprite(lua_State *L,
                             (uint8_t)total_colors,
                             (uint8_t)palette_offset};
 
-    uint8_t *payload = malloc(pixel_data_length + sizeof(meta_data));
-    if (payload == NULL)
-    {
-        error();
-    }
-    memcpy(payload, meta_data, sizeof(meta_data));
-    memcpy(payload + sizeof(meta_data), pixel_data, pixel_data_length);
-    spi_write(FPGA,
-              0x12,
-              payload,
-              pixel_data_length + sizeof(meta_data));
-    free(payload);
+    send_sprite(L,
+                0x12,
+                meta_data,
+                sizeof(meta_data),
+                pixel_data,
+                pixel_data_length);
 }
 
 static int lua_display_bitmap(lua_State *L)
 {
     size_t pixel_data_length;
-    const char *pixel_data = luaL_checklstring(L, 6, &pixel_data_length);
+    const uint8_t *pixel_data =
+        lua_buffer_checkbytes(L, 6, &pixel_data_length);
 
     draw_sprite(L,
                 luaL_checkinteger(L, 1),
@@ -226,6 +541,156 @@ static int lua_display_bitmap(lua_State *L)
     return 0;
 }
 
+/*
+ * Older bitstreams can't decode RLE sprites, so they are expanded into a 16
+ * color sprite instead. The sprite engine has no transparency, so skipped
+ * pixels are drawn in palette color 0, which is what clear() leaves behind,
+ * rather than being left untouched
+ */
+static void draw_sprite_rle_expanded(lua_State *L,
+                                     lua_Integer x_position,
+                                     lua_Integer y_position,
+                                     lua_Integer width,
+                                     lua_Integer palette_offset,
+                                     const uint8_t *rle_data,
+                                     size_t rle_data_length)
+{
+    size_t total_pixels = 0;
+
+    for (size_t i = 0; i < rle_data_length; i++)
+    {
+        total_pixels += rle_data[i] & 0x80 ? ((rle_data[i] >> 4) & 0x07) + 1
+                                           : (rle_data[i] & 0x7F) + 1;
+    }
+
+    size_t pixel_data_length = (total_pixels + 1) / 2;
+    uint8_t *pixel_data = memory_allocate(MEMORY_POOL_TRANSIENT,
+                                          pixel_data_length);
+    if (pixel_data == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+
+    // The palette offset is added to every pixel, so remove it from skips
+    uint8_t skip_color = (16 - palette_offset) & 0x0F;
+    size_t pixel = 0;
+
+    memset(pixel_data, skip_color << 4 | skip_color, pixel_data_length);
+
+    for (size_t i = 0; i < rle_data_length; i++)
+    {
+        if ((rle_data[i] & 0x80) == 0)
+        {
+            pixel += (rle_data[i] & 0x7F) + 1;
+            continue;
+        }
+
+        uint8_t color = rle_data[i] & 0x0F;
+
+        for (size_t run = ((rle_data[i] >> 4) & 0x07) + 1; run > 0; run--)
+        {
+            uint8_t shift = pixel % 2 ? 0 : 4;
+            pixel_data[pixel / 2] &= ~(0x0F << shift);
+            pixel_data[pixel / 2] |= color << shift;
+            pixel++;
+        }
+    }
+
+    // Remove Lua 1 based offset before sending
+    x_position--;
+    y_position--;
+
+    uint8_t meta_data[8] = {(uint32_t)x_position >> 8,
+                            (uint32_t)x_position,
+                            (uint32_t)y_position >> 8,
+                            (uint32_t)y_position,
+                            (uint32_t)width >> 8,
+                            (uint32_t)width,
+                            16,
+                            (uint8_t)palette_offset};
+
+    wait_for_sprite_store(L);
+
+    spi_write_async(FPGA,
+                    0x12,
+                    meta_data,
+                    sizeof(meta_data),
+                    pixel_data,
+                    pixel_data_length,
+                    true);
+}
+
+static int lua_display_bitmap_rle(lua_State *L)
+{
+    lua_Integer x_position = luaL_checkinteger(L, 1);
+    lua_Integer y_position = luaL_checkinteger(L, 2);
+    lua_Integer width = luaL_checkinteger(L, 3);
+    lua_Integer palette_offset = luaL_checkinteger(L, 4);
+
+    size_t rle_data_length;
+    const uint8_t *rle_data = lua_buffer_checkbytes(L, 5, &rle_data_length);
+
+    if (x_position < 1 || x_position > 640)
+    {
+        luaL_error(L, "x_position must be between 1 and 640 pixels");
+    }
+
+    if (y_position < 1 || y_position > 400)
+    {
+        luaL_error(L, "y_position must be between 1 and 400 pixels");
+    }
+
+    if (width < 1 || width > 640)
+    {
+        luaL_error(L, "width must be between 1 and 640 pixels");
+    }
+
+    if (palette_offset < 0 || palette_offset > 15)
+    {
+        luaL_error(L, "palette_offset must be between 0 and 15");
+    }
+
+    if (rle_data_length == 0)
+    {
+        return 0;
+    }
+
+    if ((fpga_features & FPGA_FEATURE_RLE_SPRITES) == 0)
+    {
+        draw_sprite_rle_expanded(L,
+                                 x_position,
+                                 y_position,
+                                 width,
+                                 palette_offset,
+                                 rle_data,
+                                 rle_data_length);
+        return 0;
+    }
+
+    // Remove Lua 1 based offset before sending
+    x_position--;
+    y_position--;
+
+    // Same as the raw sprite header, but without the color count as each RLE
+    // token carries its own 4 bit color
+    uint8_t meta_data[7] = {(uint32_t)x_position >> 8,
+                            (uint32_t)x_position,
+                            (uint32_t)y_position >> 8,
+                            (uint32_t)y_position,
+                            (uint32_t)width >> 8,
+                            (uint32_t)width,
+                            (uint8_t)palette_offset};
+
+    send_sprite(L,
+                0x15,
+                meta_data,
+                sizeof(meta_data),
+                (uint8_t *)rle_data,
+                rle_data_length);
+
+    return 0;
+}
+
 static int lua_display_text(lua_State *L)
 {
     // TODO color options
@@ -254,31 +719,41 @@ static int lua_display_text(lua_State *L)
                     if (x_position + sprite_metadata[entry].width <= 640 &&
                         y_position + sprite_metadata[entry].height <= 400)
                     {
-                        size_t data_offset = sprite_metadata[entry].data_offset;
+                        // Glyphs are stored in the FPGA the first time they
+                        // are used, and only sent again if they get evicted
+                        size_t id = 0;
+
+                        if (sprite_store_supported())
+                        {
+                            id = glyph_store_id[entry];
 
-                        size_t data_length = sprite_metadata[entry].width *
-                                             sprite_metadata[entry].height;
+                            if (id == 0)
+                            {
+                                id = store_glyph(L, entry);
+                            }
+                        }
 
-                        switch (sprite_metadata[entry].colors)
+                        if (id != 0)
                         {
-                        case SPRITE_16_COLORS:
-                            break;
-                        case SPRITE_4_COLORS:
-                            data_length = (size_t)ceil(data_length / 2.0);
-                            break;
-                        case SPRITE_2_COLORS:
-                            data_length = (size_t)ceil(data_length / 8.0);
-                            break;
+                            sprite_store_draw(L,
+                                              id,
+                                              x_position,
+                                              y_position,
+                                              0); // TODO
                         }
 
-                        draw_sprite(L,
-                                    x_position,
-                                    y_position,
-                                    sprite_metadata[entry].width,
-                                    sprite_metadata[entry].colors,
-                                    0, // TODO
-                                    sprite_data + data_offset,
-                                    data_length);
+                        else
+                        {
+                            draw_sprite(L,
+                                        x_position,
+                                        y_position,
+                                        sprite_metadata[entry].width,
+                                        sprite_metadata[entry].colors,
+                                        0, // TODO
+                                        sprite_data +
+                                            sprite_metadata[entry].data_offset,
+                                        glyph_data_length(entry));
+                        }
 
                         x_position += sprite_metadata[entry].width;
                         x_position += character_spacing;
@@ -291,9 +766,137 @@ static int lua_display_text(lua_State *L)
     return 0;
 }
 
+static size_t check_sprite_id(lua_State *L, int argument)
+{
+    lua_Integer id = luaL_checkinteger(L, argument);
+
+    if (id < 1 || id > SPRITE_STORE_GLYPH_ID)
+    {
+        luaL_error(L, "id must be between 1 and %d", SPRITE_STORE_GLYPH_ID);
+    }
+
+    return (size_t)id - 1;
+}
+
+static int lua_display_store_sprite(lua_State *L)
+{
+    size_t id = check_sprite_id(L, 1);
+    lua_Integer width = luaL_checkinteger(L, 2);
+    lua_Integer total_colors = luaL_checkinteger(L, 3);
+
+    size_t pixel_data_length;
+    const uint8_t *pixel_data =
+        lua_buffer_checkbytes(L, 4, &pixel_data_length);
+
+    if (width < 1 || width > 640)
+    {
+        luaL_error(L, "width must be between 1 and 640 pixels");
+    }
+
+    if (total_colors != 2 && total_colors != 4 && total_colors != 16)
+    {
+        luaL_error(L, "total_colors must be either 2, 4 or 16");
+    }
+
+    if (pixel_data_length == 0 || pixel_data_length > SPRITE_STORE_SIZE)
+    {
+        luaL_error(L,
+                   "data must be between 1 and %d bytes",
+                   SPRITE_STORE_SIZE);
+    }
+
+    sprite_store_free(id);
+
+    uint16_t address;
+    if (!sprite_store_allocate(pixel_data_length, &address))
+    {
+        luaL_error(L, "not enough sprite memory");
+    }
+
+    sprite_store_upload(L,
+                        id,
+                        address,
+                        width,
+                        total_colors,
+                        (uint8_t *)pixel_data,
+                        pixel_data_length);
+
+    return 0;
+}
+
+static int lua_display_draw_sprite(lua_State *L)
+{
+    size_t id = check_sprite_id(L, 1);
+    lua_Integer x_position = luaL_checkinteger(L, 2);
+    lua_Integer y_position = luaL_checkinteger(L, 3);
+    lua_Integer palette_offset = luaL_optinteger(L, 4, 0);
+
+    if (x_position < 1 || x_position > 640)
+    {
+        luaL_error(L, "x_position must be between 1 and 640 pixels");
+    }
+
+    if (y_position < 1 || y_position > 400)
+    {
+        luaL_error(L, "y_position must be between 1 and 400 pixels");
+    }
+
+    if (palette_offset < 0 || palette_offset > 15)
+    {
+        luaL_error(L, "palette_offset must be between 0 and 15");
+    }
+
+    if (!sprite_store[id].stored)
+    {
+        luaL_error(L, "sprite %d is not stored", (int)id + 1);
+    }
+
+    if (!sprite_store_supported())
+    {
+        draw_sprite(L,
+                    x_position,
+                    y_position,
+                    sprite_store[id].width,
+                    sprite_store[id].total_colors,
+                    palette_offset,
+                    sprite_copies[id],
+                    sprite_store[id].length);
+        return 0;
+    }
+
+    sprite_store_draw(L, id, x_position, y_position, palette_offset);
+
+    return 0;
+}
+
+static int lua_display_free_sprite(lua_State *L)
+{
+    sprite_store_free(check_sprite_id(L, 1));
+    return 0;
+}
+
+static int lua_display_sprite_memory(lua_State *L)
+{
+    // Cached glyphs are evicted as needed, so only count Lua sprites as used
+    size_t used = 0;
+
+    for (size_t id = 0; id < SPRITE_STORE_GLYPH_ID; id++)
+    {
+        if (sprite_store[id].stored)
+        {
+            used += sprite_store[id].length;
+        }
+    }
+
+    lua_pushinteger(L, SPRITE_STORE_SIZE - used);
+    lua_pushinteger(L, SPRITE_STORE_SIZE);
+    return 2;
+}
+
 static int lua_display_show(lua_State *L)
 {
-    spi_write(FPGA, 0x14, NULL, 0);
+    wait_for_sprite_store(L);
+    spi_write_async(FPGA, 0x14, NULL, 0, NULL, 0, false);
     return 0;
 }
 
@@ -350,6 +953,10 @@ static int lua_display_set_register(lua_State *L)
 
 void lua_open_display_library(lua_State *L)
 {
+    memset(sprite_store, 0, sizeof(sprite_store));
+    memset(glyph_store_id, 0, sizeof(glyph_store_id));
+    sprite_store_queued = 0;
+
     lua_getglobal(L, "frame");
 
     lua_newtable(L);
@@ -363,6 +970,21 @@ void lua_open_display_library(lua_State *L)
     lua_pushcfunction(L, lua_display_bitmap);
     lua_setfield(L, -2, "bitmap");
 
+    lua_pushcfunction(L, lua_display_bitmap_rle);
+    lua_setfield(L, -2, "bitmap_rle");
+
+    lua_pushcfunction(L, lua_display_store_sprite);
+    lua_setfield(L, -2, "store_sprite");
+
+    lua_pushcfunction(L, lua_display_draw_sprite);
+    lua_setfield(L, -2, "draw_sprite");
+
+    lua_pushcfunction(L, lua_display_free_sprite);
+    lua_setfield(L, -2, "free_sprite");
+
+    lua_pushcfunction(L, lua_display_sprite_memory);
+    lua_setfield(L, -2, "sprite_memory");
+
     lua_pushcfunction(L, lua_display_text);
     lua_setfield(L, -2, "text");
 
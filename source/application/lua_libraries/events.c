@@ -0,0 +1,235 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lua.h"
+#include "nrfx_log.h"
+
+#define LUA_EVENT_QUEUE_LENGTH 16
+
+/*
+ * Events are pushed from interrupts of any priority, and taken off by the Lua
+ * thread. Producers reserve a slot by advancing write_index, fill it, and then
+ * mark it ready. Interrupts always run to completion before the thread resumes,
+ * so the thread never sees a slot that is reserved but not yet ready.
+ */
+static struct lua_event_slot_t
+{
+    atomic_bool ready;
+    lua_event_t event;
+} queue[LUA_EVENT_QUEUE_LENGTH];
+
+static atomic_uint write_index;
+static atomic_uint read_index;
+static atomic_uint dropped_events;
+
+static lua_event_handler_t handlers[LUA_EVENT_TYPE_COUNT];
+
+// Hooks belong to a single thread, so the task being run by the scheduler is
+// armed as well. Otherwise events would wait until it yields
+static lua_State *volatile resumed_thread;
+
+static void lua_event_hook(lua_State *L, lua_Debug *ar);
+
+static void arm_hook(void)
+{
+    // Events can arrive between Lua states
+    if (L_global == NULL)
+    {
+        return;
+    }
+
+    lua_State *thread = resumed_thread;
+
+    // Every source shares this hook, so arming it again loses nothing
+    lua_sethook(L_global,
+                lua_event_hook,
+                LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT,
+                1);
+
+    if (thread != NULL)
+    {
+        lua_sethook(thread,
+                    lua_event_hook,
+                    LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT,
+                    1);
+    }
+}
+
+void lua_event_push(lua_event_type_t type, const void *payload, size_t length)
+{
+    if (length > LUA_EVENT_MAX_PAYLOAD_LENGTH)
+    {
+        length = LUA_EVENT_MAX_PAYLOAD_LENGTH;
+    }
+
+    // The last slot is kept for the break signal
+    unsigned int limit = type == LUA_EVENT_BREAK ? LUA_EVENT_QUEUE_LENGTH
+                                                 : LUA_EVENT_QUEUE_LENGTH - 1;
+
+    unsigned int index = atomic_load(&write_index);
+
+    do
+    {
+        if (index - atomic_load(&read_index) >= limit)
+        {
+            atomic_fetch_add(&dropped_events, 1);
+            arm_hook();
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&write_index, &index, index + 1));
+
+    struct lua_event_slot_t *slot = &queue[index % LUA_EVENT_QUEUE_LENGTH];
+    slot->event.type = type;
+    slot->event.length = length;
+    if (length > 0)
+    {
+        memcpy(slot->event.payload, payload, length);
+    }
+    atomic_store(&slot->ready, true);
+
+    arm_hook();
+}
+
+void lua_event_request_hook(void)
+{
+    arm_hook();
+}
+
+lua_State *lua_event_set_resumed_thread(lua_State *thread)
+{
+    lua_State *previous = resumed_thread;
+    resumed_thread = thread;
+
+    // Anything pushed before the thread was set would only reach it later
+    if (thread != NULL &&
+        atomic_load(&read_index) != atomic_load(&write_index))
+    {
+        arm_hook();
+    }
+
+    return previous;
+}
+
+static bool take_event(lua_event_t *event)
+{
+    unsigned int index = atomic_load(&read_index);
+    struct lua_event_slot_t *slot = &queue[index % LUA_EVENT_QUEUE_LENGTH];
+
+    if (!atomic_load(&slot->ready))
+    {
+        return false;
+    }
+
+    // Copied out so the slot is free while the handler runs
+    event->type = slot->event.type;
+    event->length = slot->event.length;
+    memcpy(event->payload, slot->event.payload, event->length);
+
+    atomic_store(&slot->ready, false);
+    atomic_store(&read_index, index + 1);
+
+    return true;
+}
+
+void lua_event_process(lua_State *L)
+{
+    unsigned int dropped = atomic_exchange(&dropped_events, 0);
+
+    if (dropped)
+    {
+        LOG("%u Lua events dropped", dropped);
+    }
+
+    lua_event_t event;
+
+    while (take_event(&event))
+    {
+        // A handler that raises an error leaves the rest for the next hook
+        if (atomic_load(&read_index) != atomic_load(&write_index))
+        {
+            arm_hook();
+        }
+
+        if (handlers[event.type] != NULL)
+        {
+            handlers[event.type](L, &event);
+        }
+    }
+}
+
+static void lua_event_hook(lua_State *L, lua_Debug *ar)
+{
+    lua_sethook(L, NULL, 0, 0);
+
+    lua_profiler_sample(L, ar);
+
+    lua_event_process(L);
+}
+
+static int lua_dispatch_events(lua_State *L)
+{
+    lua_event_process(L);
+    return 0;
+}
+
+void lua_event_dispatch(lua_State *L)
+{
+    if (atomic_load(&read_index) == atomic_load(&write_index))
+    {
+        return;
+    }
+
+    lua_pushcfunction(L, lua_dispatch_events);
+
+    // Errors are dropped the same way as when idling in frame.sleep()
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+    {
+        lua_pop(L, 1);
+    }
+}
+
+void lua_event_set_handler(lua_event_type_t type, lua_event_handler_t handler)
+{
+    handlers[type] = handler;
+}
+
+void lua_open_event_queue(void)
+{
+    // Events and handlers belong to the previous Lua state
+    memset(handlers, 0, sizeof(handlers));
+    resumed_thread = NULL;
+
+    lua_event_t event;
+    while (take_event(&event))
+    {
+    }
+
+    atomic_store(&dropped_events, 0);
+}
@@ -25,10 +25,20 @@
 #include "error_logging.h"
 #include "flash.h"
 #include "frame_lua_libraries.h"
+#include "io_stats.h"
 #include "lauxlib.h"
 #include "lfs.h"
 #include "lua.h"
 #include "luaconf.h"
+#include "lz4.h"
+#include "memory.h"
+
+// Compressed files are a magic number, followed by independently compressed
+// blocks, an index of block offsets, and a footer. Any block which doesn't
+// shrink is stored as is, which is detected by its stored size equalling its
+// uncompressed size. All values are little endian
+#define COMPRESSED_FILE_MAGIC 0x5A4C4346 // "FCLZ"
+#define COMPRESSED_FILE_BLOCK_SIZE 2048
 
 static int lfs_api_read_block(const struct lfs_config *c,
                               lfs_block_t block,
@@ -43,18 +53,8 @@ static int lfs_api_read_block(const struct lfs_config *c,
     return 0;
 }
 
-static void write_byte(uint32_t address, uint8_t b)
-{
-    uint32_t address_aligned = address & ~3;
-
-    // Value to write - leave all bits that should not change at 0xff.
-    uint32_t value = 0xffffff00 | b;
-
-    // Rotate bits in value to an aligned position.
-    value = (value << (address & 3) * 8) | (value >> (32 - (address & 3) * 8));
-
-    flash_write(address_aligned, &value, 1);
-}
+// Only used when littlefs hands over a buffer that isn't word aligned
+static uint32_t program_staging_buffer[64];
 
 static int lfs_api_program_block(const struct lfs_config *c,
                                  lfs_block_t block,
@@ -64,41 +64,38 @@ static int lfs_api_program_block(const struct lfs_config *c,
 {
     uint32_t address = flash_base_address() + (block * c->block_size) + off;
 
-    const uint8_t *source = buffer;
-    const uint8_t *source_end = source + size;
-
-    while (source != source_end && (address & 0b11))
+    // Programs are always whole multiples of prog_size, so always word aligned
+    if ((address | size) & 0b11)
     {
-
-        write_byte(address, *source);
-        flash_wait_until_complete();
-        address++;
-        source++;
+        return LFS_ERR_INVAL;
     }
 
-    while (source_end - source >= 4)
-    {
-        uint8_t buf[4] __attribute__((aligned(4)));
-        for (int i = 0; i < 4; i++)
-        {
-            buf[i] = ((uint8_t *)source)[i];
-        }
+    const uint8_t *source = buffer;
 
-        flash_write(address, (const uint32_t *)&buf, 1);
-        flash_wait_until_complete();
-        source += 4;
-        address += 4;
+    // Blocks are one flash page, which is the most a single call can write
+    if (((uintptr_t)source & 0b11) == 0)
+    {
+        flash_write(address, (const uint32_t *)source, size / 4);
+        return flash_wait_until_complete() ? 0 : LFS_ERR_IO;
     }
 
-    //  Write remaining unaligned bytes.
-    while (source != source_end)
+    while (size > 0)
     {
+        size_t length = size < sizeof(program_staging_buffer)
+                            ? size
+                            : sizeof(program_staging_buffer);
+
+        memcpy(program_staging_buffer, source, length);
+        flash_write(address, program_staging_buffer, length / 4);
 
-        write_byte(address, *source);
-        flash_wait_until_complete();
+        if (!flash_wait_until_complete())
+        {
+            return LFS_ERR_IO;
+        }
 
-        address++;
-        source++;
+        address += length;
+        source += length;
+        size -= length;
     }
 
     return 0;
@@ -114,20 +111,27 @@ static int lfs_api_erase_block(const struct lfs_config *c, lfs_block_t block)
     uint32_t address = flash_base_address() + (block * c->block_size);
 
     flash_erase_page(address);
-    flash_wait_until_complete();
 
-    return 0;
+    return flash_wait_until_complete() ? 0 : LFS_ERR_IO;
 }
 
+// Commits are padded to prog_size, which the superblock doesn't record. So
+// that filesystems from before it was raised from 8 aren't appended to with the
+// wrong padding, the size is kept as an attribute of the root directory, and
+// filesystems without one carry on using 8
+#define FILESYSTEM_PROG_SIZE 16
+#define FILESYSTEM_LEGACY_PROG_SIZE 8
+#define FILESYSTEM_PROG_SIZE_ATTRIBUTE 0x50
+
 static struct lfs_config filesystem_config = {
     .read = lfs_api_read_block,
     .prog = lfs_api_program_block,
     .erase = lfs_api_erase_block,
     .sync = lfs_api_sync_block,
-    .read_size = 8,
-    .prog_size = 8,
-    .cache_size = 32,
-    .lookahead_size = 8,
+    .read_size = 16,
+    .prog_size = FILESYSTEM_PROG_SIZE,
+    .cache_size = 512,
+    .lookahead_size = 64,
     .block_cycles = 100,
     .name_max = 0x100,
     .file_max = 0x10000,
@@ -135,11 +139,629 @@ static struct lfs_config filesystem_config = {
 
 static lfs_t filesystem;
 
-typedef struct file_stream_t
-{
-    lfs_file_t file;
-    lua_CFunction close_function;
-} file_stream_t;
+typedef struct compressed_file_footer_t
+{
+    uint32_t block_size;
+    uint32_t total_size;
+    uint32_t block_count;
+    uint32_t magic;
+} compressed_file_footer_t;
+
+typedef struct compressed_stream_t
+{
+    bool writing;
+    compressed_file_footer_t footer;
+    uint32_t *block_offsets;
+    uint32_t position;
+    uint32_t loaded_block;
+    size_t loaded_block_size;
+    uint8_t *block;
+    uint8_t *scratch;
+} compressed_stream_t;
+
+typedef struct file_stream_t
+{
+    lfs_file_t file;
+    lua_CFunction close_function;
+    compressed_stream_t *compressed;
+} file_stream_t;
+
+static size_t compressed_block_size(compressed_stream_t *compressed,
+                                    uint32_t block)
+{
+    uint32_t start = block * compressed->footer.block_size;
+    uint32_t remaining = compressed->footer.total_size - start;
+
+    return remaining < compressed->footer.block_size
+               ? remaining
+               : compressed->footer.block_size;
+}
+
+static void compressed_free(compressed_stream_t *compressed)
+{
+    if (compressed == NULL)
+    {
+        return;
+    }
+
+    memory_free(compressed->block_offsets);
+    memory_free(compressed->block);
+    memory_free(compressed->scratch);
+    memory_free(compressed);
+}
+
+static compressed_stream_t *compressed_allocate(uint32_t block_size)
+{
+    compressed_stream_t *compressed =
+        memory_allocate(MEMORY_POOL_LUA, sizeof(compressed_stream_t));
+
+    if (compressed == NULL)
+    {
+        return NULL;
+    }
+
+    memset(compressed, 0, sizeof(compressed_stream_t));
+    compressed->footer.block_size = block_size;
+    compressed->footer.magic = COMPRESSED_FILE_MAGIC;
+    compressed->loaded_block = UINT32_MAX;
+    compressed->block = memory_allocate(MEMORY_POOL_LUA, block_size);
+    compressed->scratch = memory_allocate(MEMORY_POOL_LUA, block_size);
+
+    if (compressed->block == NULL || compressed->scratch == NULL)
+    {
+        compressed_free(compressed);
+        return NULL;
+    }
+
+    return compressed;
+}
+
+static int compressed_flush_block(file_stream_t *stream)
+{
+    compressed_stream_t *compressed = stream->compressed;
+    size_t length = compressed->loaded_block_size;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    lfs_soff_t offset = lfs_file_tell(&filesystem, &stream->file);
+    if (offset < 0)
+    {
+        return offset;
+    }
+
+    uint32_t *block_offsets =
+        memory_reallocate(MEMORY_POOL_LUA,
+                          compressed->block_offsets,
+                          (compressed->footer.block_count + 1) *
+                              sizeof(uint32_t));
+
+    if (block_offsets == NULL)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    compressed->block_offsets = block_offsets;
+
+    // The hash table is only needed while compressing so it isn't kept around
+    void *lz4_state = memory_allocate(MEMORY_POOL_TRANSIENT, LZ4_sizeofState());
+    if (lz4_state == NULL)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    // Leaving no room for equal sized output means anything that doesn't
+    // shrink fails to compress, and is then stored as is
+    int compressed_length = LZ4_compress_fast_extState(lz4_state,
+                                                       (char *)compressed->block,
+                                                       (char *)compressed->scratch,
+                                                       length,
+                                                       length - 1,
+                                                       1);
+    memory_free(lz4_state);
+
+    const uint8_t *data = compressed->scratch;
+
+    if (compressed_length <= 0)
+    {
+        data = compressed->block;
+        compressed_length = length;
+    }
+
+    lfs_ssize_t result = lfs_file_write(&filesystem,
+                                        &stream->file,
+                                        data,
+                                        compressed_length);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    if (result != compressed_length)
+    {
+        return LFS_ERR_NOSPC;
+    }
+
+    compressed->block_offsets[compressed->footer.block_count++] = offset;
+    compressed->footer.total_size += length;
+    compressed->loaded_block_size = 0;
+
+    return 0;
+}
+
+static int compressed_read_block(file_stream_t *stream, uint32_t block)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    size_t length = compressed_block_size(compressed, block);
+    size_t stored_length = compressed->block_offsets[block + 1] -
+                           compressed->block_offsets[block];
+
+    if (stored_length > length)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    lfs_soff_t offset = lfs_file_seek(&filesystem,
+                                      &stream->file,
+                                      compressed->block_offsets[block],
+                                      LFS_SEEK_SET);
+    if (offset < 0)
+    {
+        return offset;
+    }
+
+    uint8_t *destination = stored_length == length ? compressed->block
+                                                   : compressed->scratch;
+
+    // Invalidated first so a failed load is retried rather than reused
+    compressed->loaded_block = UINT32_MAX;
+
+    lfs_ssize_t result = lfs_file_read(&filesystem,
+                                       &stream->file,
+                                       destination,
+                                       stored_length);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    if (result != stored_length)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    if (destination == compressed->scratch &&
+        LZ4_decompress_safe((char *)compressed->scratch,
+                            (char *)compressed->block,
+                            stored_length,
+                            length) != length)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    compressed->loaded_block = block;
+    compressed->loaded_block_size = length;
+
+    return 0;
+}
+
+static int compressed_load_block(file_stream_t *stream, uint32_t block)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed->loaded_block == block)
+    {
+        return 0;
+    }
+
+    io_stats_time_t start_time = IO_STATS_NOW();
+
+    int error = compressed_read_block(stream, block);
+
+    IO_STATS_RECORD(IO_STATS_LZ4_LOAD,
+                    start_time,
+                    compressed_block_size(compressed, block),
+                    error != 0);
+
+    return error;
+}
+
+// Returns 0 if the file isn't compressed, 1 if it is, or a negative error
+static int compressed_open_for_reading(file_stream_t *stream)
+{
+    uint32_t magic = 0;
+
+    lfs_ssize_t result = lfs_file_read(&filesystem,
+                                       &stream->file,
+                                       &magic,
+                                       sizeof(magic));
+    if (result < 0)
+    {
+        return result;
+    }
+
+    if (result != sizeof(magic) || magic != COMPRESSED_FILE_MAGIC)
+    {
+        int error = lfs_file_rewind(&filesystem, &stream->file);
+        return error < 0 ? error : 0;
+    }
+
+    compressed_file_footer_t footer;
+
+    lfs_soff_t footer_offset = lfs_file_seek(&filesystem,
+                                             &stream->file,
+                                             -(lfs_soff_t)sizeof(footer),
+                                             LFS_SEEK_END);
+    if (footer_offset < 0)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    result = lfs_file_read(&filesystem, &stream->file, &footer, sizeof(footer));
+    if (result != sizeof(footer) ||
+        footer.magic != COMPRESSED_FILE_MAGIC ||
+        footer.block_size == 0 ||
+        footer.block_size > 0x10000 ||
+        (footer.total_size + footer.block_size - 1) / footer.block_size !=
+            footer.block_count)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    size_t index_size = (footer.block_count + 1) * sizeof(uint32_t);
+
+    if (index_size + sizeof(magic) > (size_t)footer_offset)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    compressed_stream_t *compressed = compressed_allocate(footer.block_size);
+    if (compressed == NULL)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    compressed->footer = footer;
+    compressed->block_offsets = memory_allocate(MEMORY_POOL_LUA, index_size);
+
+    if (compressed->block_offsets == NULL)
+    {
+        compressed_free(compressed);
+        return LFS_ERR_NOMEM;
+    }
+
+    lfs_file_seek(&filesystem,
+                  &stream->file,
+                  footer_offset - index_size,
+                  LFS_SEEK_SET);
+
+    result = lfs_file_read(&filesystem,
+                           &stream->file,
+                           compressed->block_offsets,
+                           index_size);
+
+    // The final entry is where the index starts, which bounds the last block
+    bool valid = result == index_size &&
+                 compressed->block_offsets[footer.block_count] ==
+                     footer_offset - index_size;
+
+    for (uint32_t i = 0; valid && i < footer.block_count; i++)
+    {
+        valid = compressed->block_offsets[i] >= sizeof(magic) &&
+                compressed->block_offsets[i] <= compressed->block_offsets[i + 1];
+    }
+
+    if (!valid)
+    {
+        compressed_free(compressed);
+        return LFS_ERR_CORRUPT;
+    }
+
+    stream->compressed = compressed;
+    return 1;
+}
+
+static int stream_open(file_stream_t *stream,
+                       const char *filename,
+                       int flags,
+                       bool compress)
+{
+    stream->compressed = NULL;
+
+    int error = lfs_file_open(&filesystem, &stream->file, filename, flags);
+    if (error)
+    {
+        return error;
+    }
+
+    if (compress)
+    {
+        uint32_t magic = COMPRESSED_FILE_MAGIC;
+
+        stream->compressed = compressed_allocate(COMPRESSED_FILE_BLOCK_SIZE);
+
+        if (stream->compressed == NULL)
+        {
+            error = LFS_ERR_NOMEM;
+        }
+
+        else if (lfs_file_write(&filesystem,
+                                &stream->file,
+                                &magic,
+                                sizeof(magic)) != sizeof(magic))
+        {
+            error = LFS_ERR_IO;
+        }
+
+        else
+        {
+            stream->compressed->writing = true;
+        }
+    }
+
+    else if ((flags & LFS_O_RDWR) == LFS_O_RDONLY)
+    {
+        int result = compressed_open_for_reading(stream);
+        error = result < 0 ? result : 0;
+    }
+
+    // Appending raw data after the footer would corrupt a compressed file
+    else if ((flags & LFS_O_TRUNC) == 0)
+    {
+        uint32_t magic = 0;
+
+        lfs_ssize_t result = lfs_file_read(&filesystem,
+                                           &stream->file,
+                                           &magic,
+                                           sizeof(magic));
+        if (result < 0)
+        {
+            error = result;
+        }
+
+        else if (result == sizeof(magic) && magic == COMPRESSED_FILE_MAGIC)
+        {
+            error = LFS_ERR_INVAL;
+        }
+
+        else
+        {
+            error = lfs_file_rewind(&filesystem, &stream->file);
+        }
+    }
+
+    if (error)
+    {
+        compressed_free(stream->compressed);
+        stream->compressed = NULL;
+        lfs_file_close(&filesystem, &stream->file);
+    }
+
+    return error;
+}
+
+static int stream_close(file_stream_t *stream)
+{
+    compressed_stream_t *compressed = stream->compressed;
+    int error = 0;
+
+    // The remaining data, index and footer are only written on close
+    if (compressed != NULL && compressed->writing)
+    {
+        error = compressed_flush_block(stream);
+
+        if (error == 0)
+        {
+            lfs_soff_t index_offset = lfs_file_tell(&filesystem,
+                                                    &stream->file);
+
+            uint32_t *block_offsets =
+                memory_reallocate(MEMORY_POOL_LUA,
+                                  compressed->block_offsets,
+                                  (compressed->footer.block_count + 1) *
+                                      sizeof(uint32_t));
+
+            if (index_offset < 0 || block_offsets == NULL)
+            {
+                error = LFS_ERR_NOMEM;
+            }
+
+            else
+            {
+                compressed->block_offsets = block_offsets;
+                block_offsets[compressed->footer.block_count] = index_offset;
+
+                size_t index_size = (compressed->footer.block_count + 1) *
+                                    sizeof(uint32_t);
+
+                if (lfs_file_write(&filesystem,
+                                   &stream->file,
+                                   block_offsets,
+                                   index_size) != index_size ||
+                    lfs_file_write(&filesystem,
+                                   &stream->file,
+                                   &compressed->footer,
+                                   sizeof(compressed->footer)) !=
+                        sizeof(compressed->footer))
+                {
+                    error = LFS_ERR_NOSPC;
+                }
+            }
+        }
+    }
+
+    compressed_free(compressed);
+    stream->compressed = NULL;
+
+    int close_error = lfs_file_close(&filesystem, &stream->file);
+
+    return error ? error : close_error;
+}
+
+static lfs_ssize_t stream_read(file_stream_t *stream,
+                               void *buffer,
+                               lfs_size_t size)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed == NULL)
+    {
+        return lfs_file_read(&filesystem, &stream->file, buffer, size);
+    }
+
+    if (compressed->writing)
+    {
+        return LFS_ERR_BADF;
+    }
+
+    lfs_size_t total = 0;
+
+    while (total < size && compressed->position < compressed->footer.total_size)
+    {
+        uint32_t block = compressed->position / compressed->footer.block_size;
+
+        int error = compressed_load_block(stream, block);
+        if (error)
+        {
+            return error;
+        }
+
+        size_t offset = compressed->position -
+                        block * compressed->footer.block_size;
+
+        size_t length = compressed->loaded_block_size - offset;
+        if (length > size - total)
+        {
+            length = size - total;
+        }
+
+        memcpy((uint8_t *)buffer + total, compressed->block + offset, length);
+        compressed->position += length;
+        total += length;
+    }
+
+    return total;
+}
+
+static lfs_ssize_t stream_write(file_stream_t *stream,
+                                const void *buffer,
+                                lfs_size_t size)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed == NULL)
+    {
+        return lfs_file_write(&filesystem, &stream->file, buffer, size);
+    }
+
+    lfs_size_t total = 0;
+
+    while (total < size)
+    {
+        size_t length = compressed->footer.block_size -
+                        compressed->loaded_block_size;
+        if (length > size - total)
+        {
+            length = size - total;
+        }
+
+        memcpy(compressed->block + compressed->loaded_block_size,
+               (const uint8_t *)buffer + total,
+               length);
+
+        compressed->loaded_block_size += length;
+        total += length;
+
+        if (compressed->loaded_block_size == compressed->footer.block_size)
+        {
+            int error = compressed_flush_block(stream);
+            if (error)
+            {
+                return error;
+            }
+        }
+    }
+
+    return total;
+}
+
+static lfs_soff_t stream_size(file_stream_t *stream)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed == NULL)
+    {
+        return lfs_file_size(&filesystem, &stream->file);
+    }
+
+    if (compressed->writing)
+    {
+        return compressed->footer.total_size + compressed->loaded_block_size;
+    }
+
+    return compressed->footer.total_size;
+}
+
+static lfs_soff_t stream_tell(file_stream_t *stream)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed == NULL)
+    {
+        return lfs_file_tell(&filesystem, &stream->file);
+    }
+
+    if (compressed->writing)
+    {
+        return stream_size(stream);
+    }
+
+    return compressed->position;
+}
+
+static lfs_soff_t stream_seek(file_stream_t *stream,
+                              lfs_soff_t offset,
+                              int whence)
+{
+    compressed_stream_t *compressed = stream->compressed;
+
+    if (compressed == NULL)
+    {
+        return lfs_file_seek(&filesystem, &stream->file, offset, whence);
+    }
+
+    // Compressed files are written sequentially, but as every block can be
+    // found through the index, they can be read from any position
+    if (compressed->writing)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    lfs_soff_t position = offset;
+
+    if (whence == LFS_SEEK_CUR)
+    {
+        position += compressed->position;
+    }
+
+    else if (whence == LFS_SEEK_END)
+    {
+        position += compressed->footer.total_size;
+    }
+
+    if (position < 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    compressed->position = position;
+
+    return position;
+}
 
 static void check_if_file_closed(lua_State *L, file_stream_t *stream)
 {
@@ -157,10 +779,30 @@ static int lua_file_close(lua_State *L)
 
     check_if_file_closed(L, stream);
 
-    check_error(lfs_file_close(&filesystem, &stream->file));
-
     stream->close_function = NULL;
 
+    if (stream_close(stream) < 0)
+    {
+        luaL_error(L, "error closing file");
+    }
+
+    return 0;
+}
+
+static int lua_file_gc(lua_State *L)
+{
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    // Files left open are closed when collected, or when leaving the scope of
+    // a to-be-closed variable. Errors are ignored as they can't be raised here
+    if (stream->close_function != NULL)
+    {
+        stream->close_function = NULL;
+        stream_close(stream);
+    }
+
     return 0;
 }
 
@@ -172,7 +814,9 @@ static int lua_file_open(lua_State *L)
     file_stream_t *stream =
         (file_stream_t *)lua_newuserdatauv(L, sizeof(file_stream_t), 0);
 
-    stream->close_function = &lua_file_close;
+    // Only marked as open once stream_open() succeeds so that __gc doesn't
+    // try to close a file which was never opened
+    stream->close_function = NULL;
     luaL_setmetatable(L, LUA_FILEHANDLE);
 
     int lfs_mode_flag = 0;
@@ -189,20 +833,83 @@ static int lua_file_open(lua_State *L)
         lfs_mode_flag = LFS_O_RDWR | LFS_O_APPEND | LFS_O_CREAT;
         break;
     default:
-        luaL_error(L, "mode must be 'r', 'w', or 'a'");
+        luaL_error(L, "mode must be 'r', 'w', 'a' or 'wz'");
         break;
     }
 
-    int error = lfs_file_open(&filesystem,
-                              &stream->file,
-                              filename,
-                              lfs_mode_flag);
+    // Compressed files are detected automatically when reading, and can't be
+    // appended to
+    bool compress = mode[0] != '\0' && mode[1] == 'z';
+
+    if (compress && mode[0] != 'w')
+    {
+        luaL_error(L, "compressed files can only be opened with 'wz' or 'r'");
+    }
+
+    int error = stream_open(stream, filename, lfs_mode_flag, compress);
+
+    if (error == LFS_ERR_CORRUPT)
+    {
+        luaL_error(L, "compressed file %s is corrupt", filename);
+    }
+
+    if (error == LFS_ERR_INVAL)
+    {
+        luaL_error(L, "compressed file %s can't be appended to", filename);
+    }
 
     if (error)
     {
         luaL_error(L, "cannot open file %s", filename);
     }
 
+    stream->close_function = &lua_file_close;
+
+    return 1;
+}
+
+static int read_bytes(lua_State *L, file_stream_t *stream, size_t length)
+{
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+
+    size_t total = 0;
+
+    while (total < length)
+    {
+        size_t chunk = length - total;
+        if (chunk > LUAL_BUFFERSIZE)
+        {
+            chunk = LUAL_BUFFERSIZE;
+        }
+
+        char *destination = luaL_prepbuffsize(&buffer, chunk);
+
+        lfs_ssize_t result = stream_read(stream, destination, chunk);
+
+        if (result < 0)
+        {
+            luaL_error(L, "error reading file");
+        }
+
+        luaL_addsize(&buffer, result);
+        total += result;
+
+        if ((size_t)result < chunk)
+        {
+            break;
+        }
+    }
+
+    // Reading at the end of the file returns nil, except when zero bytes were
+    // requested, matching the standard Lua io library
+    if (total == 0 && length > 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    luaL_pushresult(&buffer);
     return 1;
 }
 
@@ -214,6 +921,78 @@ static int lua_file_read(lua_State *L)
 
     check_if_file_closed(L, stream);
 
+    // Fills the buffer up to its capacity, or returns nil at the end
+    lua_buffer_t *destination = lua_buffer_test(L, 2);
+
+    if (destination != NULL)
+    {
+        lfs_ssize_t result = stream_read(stream,
+                                         destination->data,
+                                         destination->capacity);
+
+        if (result < 0)
+        {
+            luaL_error(L, "error reading file");
+        }
+
+        destination->length = result;
+
+        if (result == 0)
+        {
+            lua_pushnil(L);
+        }
+        else
+        {
+            lua_pushvalue(L, 2);
+        }
+
+        return 1;
+    }
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Integer length = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, length >= 0, 2, "length must be positive");
+        return read_bytes(L, stream, (size_t)length);
+    }
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        const char *format = luaL_checkstring(L, 2);
+
+        if (*format == '*')
+        {
+            format++;
+        }
+
+        if (*format == 'a')
+        {
+            lfs_soff_t size = stream_size(stream);
+            lfs_soff_t position = stream_tell(stream);
+
+            if (size < 0 || position < 0)
+            {
+                luaL_error(L, "error reading file");
+            }
+
+            // Reading everything returns an empty string rather than nil
+            read_bytes(L, stream, size - position);
+
+            if (lua_isnil(L, -1))
+            {
+                lua_pop(L, 1);
+                lua_pushstring(L, "");
+            }
+
+            return 1;
+        }
+
+        if (*format != 'l')
+        {
+            luaL_argerror(L, 2, "format must be a length, 'a' or 'l'");
+        }
+    }
+
     luaL_Buffer buffer;
     luaL_buffinit(L, &buffer);
 
@@ -221,10 +1000,7 @@ static int lua_file_read(lua_State *L)
 
     for (size_t i = 0; i < LUAL_BUFFERSIZE; i++)
     {
-        lfs_ssize_t result = lfs_file_read(&filesystem,
-                                           &stream->file,
-                                           &character,
-                                           1);
+        lfs_ssize_t result = stream_read(stream, &character, 1);
 
         if (result < 0)
         {
@@ -271,12 +1047,9 @@ static int lua_file_write(lua_State *L)
     }
 
     size_t expected_length;
-    const char *string = luaL_checklstring(L, 2, &expected_length);
+    const uint8_t *string = lua_buffer_checkbytes(L, 2, &expected_length);
 
-    lfs_ssize_t result = lfs_file_write(&filesystem,
-                                        &stream->file,
-                                        string,
-                                        strlen(string));
+    lfs_ssize_t result = stream_write(stream, string, expected_length);
 
     if (result != expected_length)
     {
@@ -286,6 +1059,197 @@ static int lua_file_write(lua_State *L)
     return 0;
 }
 
+static const char *push_chunk(lua_State *L, lua_Integer i, size_t *length)
+{
+    if (lua_rawgeti(L, 2, i) != LUA_TSTRING)
+    {
+        luaL_error(L, "chunk %d is not a string", (int)i);
+    }
+
+    return lua_tolstring(L, -1, length);
+}
+
+static int lua_file_append_many(lua_State *L)
+{
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    check_if_file_closed(L, stream);
+
+    if ((stream->file.flags & LFS_O_RDWR) == LFS_O_RDONLY)
+    {
+        luaL_error(L, "file opened in read-only mode");
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    // Raw access so that metamethods can't hand back different chunks on the
+    // second pass than were measured on the first
+    lua_Integer chunks = (lua_Integer)lua_rawlen(L, 2);
+    size_t total_length = 0;
+
+    for (lua_Integer i = 1; i <= chunks; i++)
+    {
+        size_t length;
+        push_chunk(L, i, &length);
+        total_length += length;
+        lua_pop(L, 1);
+    }
+
+    if (total_length == 0)
+    {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    // Chunks are gathered so that littlefs sees one contiguous write and can
+    // program whole blocks directly rather than going through its cache
+    char *buffer = lua_transient_allocate(L, total_length);
+    lfs_ssize_t result;
+
+    if (buffer != NULL)
+    {
+        size_t offset = 0;
+
+        for (lua_Integer i = 1; i <= chunks; i++)
+        {
+            // Finalizers run by the allocation above could still have
+            // changed the table, so nothing is assumed from the first pass
+            size_t length;
+            const char *chunk = push_chunk(L, i, &length);
+
+            if (length > total_length - offset)
+            {
+                luaL_error(L, "chunks changed while being written");
+            }
+
+            memcpy(buffer + offset, chunk, length);
+            offset += length;
+            lua_pop(L, 1);
+        }
+
+        if (offset != total_length)
+        {
+            luaL_error(L, "chunks changed while being written");
+        }
+
+        result = stream_write(stream, buffer, total_length);
+
+        lua_transient_free(L, -1);
+    }
+
+    // If there's no room to gather the chunks, write them one by one instead
+    else
+    {
+        result = 0;
+
+        for (lua_Integer i = 1; i <= chunks; i++)
+        {
+            size_t length;
+            const char *chunk = push_chunk(L, i, &length);
+
+            lfs_ssize_t written = stream_write(stream, chunk, length);
+            lua_pop(L, 1);
+
+            if (written != length)
+            {
+                result = written < 0 ? written : result + written;
+                break;
+            }
+
+            result += written;
+        }
+    }
+
+    if (result != total_length)
+    {
+        luaL_error(L, "error writing to file");
+    }
+
+    lua_pushinteger(L, total_length);
+    return 1;
+}
+
+static int lua_file_seek(lua_State *L)
+{
+    static const int modes[] = {LFS_SEEK_SET, LFS_SEEK_CUR, LFS_SEEK_END};
+    static const char *const mode_names[] = {"set", "cur", "end", NULL};
+
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    check_if_file_closed(L, stream);
+
+    int whence = modes[luaL_checkoption(L, 2, "cur", mode_names)];
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+
+    lfs_soff_t position = stream_seek(stream, (lfs_soff_t)offset, whence);
+
+    if (position < 0)
+    {
+        luaL_error(L, "error seeking file");
+    }
+
+    lua_pushinteger(L, position);
+    return 1;
+}
+
+static int lua_file_tell(lua_State *L)
+{
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    check_if_file_closed(L, stream);
+
+    lfs_soff_t position = stream_tell(stream);
+
+    if (position < 0)
+    {
+        luaL_error(L, "error reading file position");
+    }
+
+    lua_pushinteger(L, position);
+    return 1;
+}
+
+static int lua_file_size(lua_State *L)
+{
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    check_if_file_closed(L, stream);
+
+    lfs_soff_t size = stream_size(stream);
+
+    if (size < 0)
+    {
+        luaL_error(L, "error reading file size");
+    }
+
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+static int lua_file_flush(lua_State *L)
+{
+    file_stream_t *stream = (file_stream_t *)luaL_checkudata(L,
+                                                             1,
+                                                             LUA_FILEHANDLE);
+
+    check_if_file_closed(L, stream);
+
+    if (lfs_file_sync(&filesystem, &stream->file) < 0)
+    {
+        luaL_error(L, "error flushing file");
+    }
+
+    return 0;
+}
+
 static int lua_file_remove(lua_State *L)
 {
     const char *filename = luaL_checkstring(L, 1);
@@ -417,46 +1381,41 @@ static int lua_file_require(lua_State *L)
     const char *module_name = luaL_checkstring(L, 1);
     const char *filename = lua_pushfstring(L, "%s.lua", module_name);
 
-    int error = lfs_file_open(&filesystem,
-                              &stream.file,
-                              filename,
-                              LFS_O_RDONLY);
+    int error = stream_open(&stream, filename, LFS_O_RDONLY, false);
 
     if (error)
     {
         luaL_error(L, "cannot open file: %s", filename);
     }
 
-    size_t size = 0;
+    // Compressed modules report their uncompressed size, so either kind is
+    // loaded with a single allocation
+    lfs_soff_t size = stream_size(&stream);
     char *buffer = NULL;
-    char character;
 
-    while (true)
+    if (size > 0)
     {
-        lfs_ssize_t result = lfs_file_read(&filesystem,
-                                           &stream.file,
-                                           &character,
-                                           1);
+        buffer = memory_allocate(MEMORY_POOL_TRANSIENT, size);
+    }
 
-        if (result < 0)
-        {
-            free(buffer);
-            luaL_error(L, "error reading file: %s", filename);
-        }
+    if (size < 0 || (size > 0 && buffer == NULL))
+    {
+        stream_close(&stream);
+        luaL_error(L, "cannot load file: %s", filename);
+    }
 
-        if (result == 0)
-        {
-            break;
-        }
+    lfs_ssize_t result = stream_read(&stream, buffer, size);
 
-        buffer = (char *)realloc(buffer, size + 1);
-        buffer[size++] = character;
-    };
+    stream_close(&stream);
 
-    check_error(lfs_file_close(&filesystem, &stream.file));
+    if (result != size)
+    {
+        memory_free(buffer);
+        luaL_error(L, "error reading file: %s", filename);
+    }
 
     int status = luaL_loadbuffer(L, buffer, size, filename);
-    free(buffer);
+    memory_free(buffer);
 
     if (status || lua_pcall(L, 0, LUA_MULTRET, 0))
     {
@@ -471,19 +1430,28 @@ static int lua_file_require(lua_State *L)
 
 static const luaL_Reg meta_methods[] = {
     {"__index", NULL},
-    // TODO do we need garbage collection?
-    // {"__gc", f_gc},
-    // {"__close", f_gc},
+    {"__gc", lua_file_gc},
+    {"__close", lua_file_gc},
     {NULL, NULL},
 };
 
 static const luaL_Reg file_methods[] = {
     {"read", lua_file_read},
     {"write", lua_file_write},
+    {"append_many", lua_file_append_many},
+    {"seek", lua_file_seek},
+    {"tell", lua_file_tell},
+    {"size", lua_file_size},
+    {"flush", lua_file_flush},
     {"close", lua_file_close},
     {NULL, NULL},
 };
 
+lfs_t *lua_file_system(void)
+{
+    return &filesystem;
+}
+
 void lua_open_file_library(lua_State *L, bool reformat)
 {
     size_t page_size;
@@ -493,13 +1461,49 @@ void lua_open_file_library(lua_State *L, bool reformat)
     filesystem_config.block_size = page_size;
     filesystem_config.block_count = (total_size / page_size) - 1;
 
+    filesystem_config.prog_size = FILESYSTEM_PROG_SIZE;
+
     int file_mount_error = lfs_mount(&filesystem, &filesystem_config);
 
+    if (!reformat && !file_mount_error)
+    {
+        uint32_t prog_size = 0;
+
+        lfs_ssize_t result = lfs_getattr(&filesystem,
+                                         "/",
+                                         FILESYSTEM_PROG_SIZE_ATTRIBUTE,
+                                         &prog_size,
+                                         sizeof(prog_size));
+
+        if (result != sizeof(prog_size) ||
+            (prog_size != FILESYSTEM_PROG_SIZE &&
+             prog_size != FILESYSTEM_LEGACY_PROG_SIZE))
+        {
+            prog_size = FILESYSTEM_LEGACY_PROG_SIZE;
+        }
+
+        if (prog_size != FILESYSTEM_PROG_SIZE)
+        {
+            LOG("Filesystem uses %lu byte programs", prog_size);
+            check_error(lfs_unmount(&filesystem));
+            filesystem_config.prog_size = prog_size;
+            file_mount_error = lfs_mount(&filesystem, &filesystem_config);
+        }
+    }
+
     if (reformat || file_mount_error)
     {
         LOG("Reformatting filesystem");
+        filesystem_config.prog_size = FILESYSTEM_PROG_SIZE;
         check_error(lfs_format(&filesystem, &filesystem_config));
         check_error(lfs_mount(&filesystem, &filesystem_config));
+
+        uint32_t prog_size = FILESYSTEM_PROG_SIZE;
+        check_error(lfs_setattr(&filesystem,
+                                "/",
+                                FILESYSTEM_PROG_SIZE_ATTRIBUTE,
+                                &prog_size,
+                                sizeof(prog_size)));
     }
 
     luaL_newmetatable(L, LUA_FILEHANDLE);
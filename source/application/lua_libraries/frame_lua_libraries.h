@@ -25,20 +25,117 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bluetooth.h"
+#include "lfs.h"
 #include "lua.h"
 
 extern lua_State *L_global;
 
+#define LUA_EVENT_MAX_PAYLOAD_LENGTH BLE_PREFERRED_MAX_MTU
+
+typedef enum lua_event_type_t
+{
+    LUA_EVENT_BREAK,
+    LUA_EVENT_BLUETOOTH_DATA,
+    LUA_EVENT_TAP,
+    LUA_EVENT_TIMER,
+    LUA_EVENT_UPLOAD,
+    LUA_EVENT_TYPE_COUNT,
+} lua_event_type_t;
+
+typedef struct lua_event_t
+{
+    lua_event_type_t type;
+    size_t length;
+    uint8_t payload[LUA_EVENT_MAX_PAYLOAD_LENGTH];
+} lua_event_t;
+
+typedef void (*lua_event_handler_t)(lua_State *L, const lua_event_t *event);
+
+void lua_event_push(lua_event_type_t type, const void *payload, size_t length);
+void lua_event_request_hook(void);
+
+/**
+ * @brief Sets the coroutine being resumed, which is hooked along with the main
+ *        thread whenever an event arrives. Returns the previous one so that
+ *        it can be restored afterwards.
+ */
+lua_State *lua_event_set_resumed_thread(lua_State *thread);
+
+void lua_event_set_handler(lua_event_type_t type, lua_event_handler_t handler);
+void lua_event_process(lua_State *L);
+void lua_event_dispatch(lua_State *L);
+void lua_open_event_queue(void);
+
+/**
+ * @brief Fixed capacity byte buffers shared with Lua as frame.buffer. Functions
+ *        taking binary data accept either a string or a buffer through
+ *        lua_buffer_checkbytes(), and functions returning it can fill a buffer
+ *        given by lua_buffer_optdestination() instead of creating a string.
+ */
+typedef struct lua_buffer_t
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} lua_buffer_t;
+
+lua_buffer_t *lua_buffer_test(lua_State *L, int index);
+const uint8_t *lua_buffer_checkbytes(lua_State *L, int index, size_t *length);
+lua_buffer_t *lua_buffer_optdestination(lua_State *L, int index, size_t length);
+
+/**
+ * @brief Allocates from the transient pool, and pushes a guard onto the stack
+ *        which frees it when collected. An error raised before
+ *        lua_transient_free() is called therefore can't leak the memory.
+ *        Returns NULL if there isn't enough memory.
+ */
+void *lua_transient_allocate(lua_State *L, size_t size);
+void lua_transient_free(lua_State *L, int index);
+
 void lua_bluetooth_data_interrupt(uint8_t *data, size_t length);
+void lua_upload_interrupt(uint8_t *data, size_t length);
+bool lua_upload_run_pending_script(lua_State *L);
+void lua_open_upload_channel(void);
+void lua_close_upload_channel(void);
+void lua_profiler_tick(void);
+void lua_profiler_sample(lua_State *L, lua_Debug *ar);
+
+typedef enum lua_scheduler_condition_t
+{
+    LUA_SCHEDULER_READY,
+    LUA_SCHEDULER_TIME,
+    LUA_SCHEDULER_BLUETOOTH,
+    LUA_SCHEDULER_TAP,
+    LUA_SCHEDULER_CAPTURE,
+} lua_scheduler_condition_t;
+
+void lua_scheduler_notify(lua_State *L,
+                          lua_scheduler_condition_t condition,
+                          const uint8_t *data,
+                          size_t length);
+
+uint64_t lua_time_uptime_ms(void);
+void lua_time_set_alarm(uint64_t at_ms);
+void lua_time_clear_alarm(void);
+
+bool lua_camera_capture_complete(void);
 
 void lua_open_bluetooth_library(lua_State *L);
+void lua_open_buffer_library(lua_State *L);
 void lua_open_camera_library(lua_State *L);
+void lua_open_compression_library(lua_State *L);
 void lua_open_display_library(lua_State *L);
 void lua_open_imu_library(lua_State *L);
 void lua_open_microphone_library(lua_State *L);
+void lua_open_profiler_library(lua_State *L);
+void lua_open_scheduler_library(lua_State *L);
 void lua_open_system_library(lua_State *L);
 void lua_open_time_library(lua_State *L);
 void lua_open_version_library(lua_State *L);
 
 void lua_open_file_library(lua_State *L, bool reformat);
 void lua_close_file_library(void);
+lfs_t *lua_file_system(void);
@@ -53,13 +53,13 @@ typedef struct imu_values_y
 
 static int lua_imu_callback_function = 0;
 
-static void lua_imu_tap_callback_handler(lua_State *L, lua_Debug *ar)
+static void lua_imu_tap_event_handler(lua_State *L, const lua_event_t *event)
 {
-    lua_sethook(L, NULL, 0, 0);
-
     // Clear the interrupt by reading the status register
     check_error(i2c_read(ACCELEROMETER, 0x03, 0xFF).fail);
 
+    lua_scheduler_notify(L, LUA_SCHEDULER_TAP, NULL, 0);
+
     if (lua_imu_callback_function != 0)
     {
         lua_rawgeti(L, LUA_REGISTRYINDEX, lua_imu_callback_function);
@@ -75,10 +75,7 @@ void imu_tap_interrupt_handler(nrfx_gpiote_pin_t unused_gptiote_pin,
                                nrfx_gpiote_trigger_t unused_gptiote_trigger,
                                void *unused_gptiote_context_pointer)
 {
-    lua_sethook(L_global,
-                lua_imu_tap_callback_handler,
-                LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT,
-                1);
+    lua_event_push(LUA_EVENT_TAP, NULL, 0);
 }
 
 static int lua_imu_tap_callback(lua_State *L)
@@ -264,6 +261,9 @@ void lua_open_imu_library(lua_State *L)
 
     nrfx_gpiote_trigger_enable(IMU_INTERRUPT_PIN, true);
 
+    lua_imu_callback_function = 0;
+    lua_event_set_handler(LUA_EVENT_TAP, lua_imu_tap_event_handler);
+
     // Add functions to the frame lua library
     lua_getglobal(L, "frame");
 
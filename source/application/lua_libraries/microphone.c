@@ -23,10 +23,15 @@
  */
 
 #include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include "arm_math.h"
 #include "error_logging.h"
+#include "frame_lua_libraries.h"
 #include "lauxlib.h"
 #include "lua.h"
+#include "memory.h"
 #include "nrfx_config.h"
 #include "nrfx_log.h"
 #include "nrfx_pdm.h"
@@ -36,8 +41,46 @@
 
 static lua_Integer bit_depth = 8;
 
+typedef enum microphone_encoding_t
+{
+    MICROPHONE_ENCODING_PCM,
+    MICROPHONE_ENCODING_ULAW,
+    MICROPHONE_ENCODING_ADPCM,
+} microphone_encoding_t;
+
+static microphone_encoding_t encoding = MICROPHONE_ENCODING_PCM;
+
+// Reads may be larger than a single Bluetooth packet so that a buffer holding
+// several of them can be filled at once
+#define MAXIMUM_READ_SIZE 4096
+
+// IMA ADPCM encoder state. Carried across reads, so the host decoder only needs
+// to start from zero when recording begins
+static struct adpcm
+{
+    int32_t predictor;
+    int32_t step_index;
+} adpcm = {
+    .predictor = 0,
+    .step_index = 0,
+};
+
+static const int8_t adpcm_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t adpcm_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+    45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209,
+    230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876,
+    963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749,
+    3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630,
+    9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+    27086, 29794, 32767};
+
 // Main FIFO where PDM data is written to
 #define FIFO_TOTAL_SIZE 80000
+#define FIFO_CHUNK_SIZE 100
+#define FIFO_TOTAL_CHUNKS (FIFO_TOTAL_SIZE / FIFO_CHUNK_SIZE)
 static struct fifo
 {
     int16_t buffer[FIFO_TOTAL_SIZE];
@@ -45,8 +88,9 @@ static struct fifo
     size_t head;
     size_t tail;
     size_t remaining_samples;
+    size_t raw_sample_rate;
 } fifo = {
-    .chunk_size = 100,
+    .chunk_size = FIFO_CHUNK_SIZE,
     .head = 0,
     .tail = 0,
     .remaining_samples = 0,
@@ -62,6 +106,42 @@ static struct moving_average
     .head = 0,
 };
 
+// Voice activity is decided for each chunk as soon as the PDM completes it.
+// Energies are mean squares where a full scale square wave is 1.0
+#define VOICE_THRESHOLD 8.0f
+#define VOICE_MINIMUM_ENERGY 1e-6f
+#define VOICE_MINIMUM_NOISE_FLOOR 1e-7f
+#define VOICE_MAXIMUM_ZERO_CROSSING_RATE 0.4f
+#define VOICE_NOISE_FLOOR_FALL 0.1f
+#define VOICE_NOISE_FLOOR_RISE 1.001f
+#define VOICE_HANGOVER_SECONDS 0.3f
+#define VOICE_PREROLL_SECONDS 0.2f
+static struct voice_activity
+{
+    bool chunk_voiced[FIFO_TOTAL_CHUNKS];
+    bool started;
+    size_t completed_chunks;
+    float noise_floor;
+    bool voice;
+    size_t hangover;
+    size_t hangover_chunks;
+    size_t preroll_chunks;
+    bool voice_only;
+    size_t kept_chunk;
+} voice_activity = {
+    .started = false,
+    .completed_chunks = 0,
+};
+
+#define FEATURES_FFT_LENGTH 512
+#define FEATURES_BAND_COUNT 5
+static const float features_band_edges[FEATURES_BAND_COUNT - 1] = {
+    300.0f,
+    1000.0f,
+    2000.0f,
+    4000.0f,
+};
+
 static nrfy_pdm_config_t config = {
     .mode = NRF_PDM_MODE_MONO,
     .edge = NRF_PDM_EDGE_LEFTRISING,
@@ -77,6 +157,64 @@ static nrfy_pdm_config_t config = {
     .skip_psel_cfg = false,
 };
 
+static void detect_voice(const int16_t *samples, size_t length)
+{
+    q63_t power;
+    arm_power_q15(samples, length, &power);
+
+    // The sum of squares is returned in 34.30 format
+    float energy = (float)power / (float)(1 << 30) / (float)length;
+
+    size_t crossings = 0;
+    for (size_t i = 1; i < length; i++)
+    {
+        if ((samples[i - 1] < 0) != (samples[i] < 0))
+        {
+            crossings++;
+        }
+    }
+
+    float zero_crossing_rate = (float)crossings / (float)(length - 1);
+
+    // The noise floor follows quiet periods quickly, but only creeps up slowly
+    // so that it doesn't learn continuous speech as noise
+    if (voice_activity.noise_floor == 0.0f)
+    {
+        voice_activity.noise_floor = energy;
+    }
+
+    else if (energy < voice_activity.noise_floor)
+    {
+        voice_activity.noise_floor +=
+            (energy - voice_activity.noise_floor) * VOICE_NOISE_FLOOR_FALL;
+    }
+
+    else
+    {
+        voice_activity.noise_floor *= VOICE_NOISE_FLOOR_RISE;
+    }
+
+    if (voice_activity.noise_floor < VOICE_MINIMUM_NOISE_FLOOR)
+    {
+        voice_activity.noise_floor = VOICE_MINIMUM_NOISE_FLOOR;
+    }
+
+    // Broadband noise crosses zero far more often than voiced speech
+    if (energy > voice_activity.noise_floor * VOICE_THRESHOLD &&
+        energy > VOICE_MINIMUM_ENERGY &&
+        zero_crossing_rate < VOICE_MAXIMUM_ZERO_CROSSING_RATE)
+    {
+        voice_activity.hangover = voice_activity.hangover_chunks;
+    }
+
+    else if (voice_activity.hangover > 0)
+    {
+        voice_activity.hangover--;
+    }
+
+    voice_activity.voice = voice_activity.hangover > 0;
+}
+
 void PDM_IRQHandler(void)
 {
     uint32_t evt_mask = nrfy_pdm_events_process(
@@ -86,6 +224,22 @@ void PDM_IRQHandler(void)
 
     if (evt_mask & NRFY_EVENT_TO_INT_BITMASK(NRF_PDM_EVENT_STARTED))
     {
+        // The PDM has just started filling the chunk at the head, meaning that
+        // the one before it is complete. Nothing is complete on the first start
+        if (voice_activity.started)
+        {
+            size_t completed = (fifo.head + FIFO_TOTAL_SIZE - fifo.chunk_size) %
+                               FIFO_TOTAL_SIZE;
+
+            detect_voice(fifo.buffer + completed, fifo.chunk_size);
+
+            voice_activity.chunk_voiced[completed / fifo.chunk_size] =
+                voice_activity.voice;
+            voice_activity.completed_chunks++;
+        }
+
+        voice_activity.started = true;
+
         fifo.head += fifo.chunk_size;
         fifo.remaining_samples -= fifo.chunk_size;
 
@@ -120,7 +274,10 @@ static int lua_microphone_record(lua_State *L)
 {
     lua_Number seconds = 9999.0;
     lua_Integer sample_rate = 8000;
+    bool voice_only = false;
+    bool bit_depth_given = false;
     bit_depth = 8;
+    encoding = MICROPHONE_ENCODING_PCM;
 
     if (lua_istable(L, 1))
     {
@@ -139,6 +296,36 @@ static int lua_microphone_record(lua_State *L)
         if (lua_getfield(L, 1, "bit_depth") != LUA_TNIL)
         {
             bit_depth = luaL_checkinteger(L, -1);
+            bit_depth_given = true;
+            lua_pop(L, 1);
+        }
+
+        if (lua_getfield(L, 1, "encoding") != LUA_TNIL)
+        {
+            const char *name = luaL_checkstring(L, -1);
+
+            if (strcmp(name, "ulaw") == 0)
+            {
+                encoding = MICROPHONE_ENCODING_ULAW;
+            }
+
+            else if (strcmp(name, "adpcm") == 0)
+            {
+                encoding = MICROPHONE_ENCODING_ADPCM;
+            }
+
+            else if (strcmp(name, "pcm") != 0)
+            {
+                luaL_error(L, "invalid encoding");
+            }
+
+            lua_pop(L, 1);
+        }
+
+        if (lua_getfield(L, 1, "voice_only") != LUA_TNIL)
+        {
+            luaL_checktype(L, -1, LUA_TBOOLEAN);
+            voice_only = lua_toboolean(L, -1);
             lua_pop(L, 1);
         }
     }
@@ -198,6 +385,23 @@ static int lua_microphone_record(lua_State *L)
         luaL_error(L, "invalid bit depth");
     }
 
+    // Encoded samples have a fixed size
+    if (encoding != MICROPHONE_ENCODING_PCM)
+    {
+        lua_Integer encoded_bit_depth =
+            encoding == MICROPHONE_ENCODING_ULAW ? 8 : 4;
+
+        if (bit_depth_given && bit_depth != encoded_bit_depth)
+        {
+            luaL_error(L, "bit depth doesn't match encoding");
+        }
+
+        bit_depth = encoded_bit_depth;
+    }
+
+    adpcm.predictor = 0;
+    adpcm.step_index = 0;
+
     // Figure out total samples, and round up to nearest chunksize
     fifo.remaining_samples =
         (size_t)ceil(seconds * sample_rate / fifo.chunk_size) *
@@ -206,6 +410,23 @@ static int lua_microphone_record(lua_State *L)
 
     fifo.head = 0;
     fifo.tail = 0;
+    fifo.raw_sample_rate = sample_rate * moving_average.window_size;
+
+    // Chunks are only read once the chunks following them are known to be
+    // silent or not, so that the start of each word isn't cut off
+    float chunk_seconds = (float)fifo.chunk_size / (float)fifo.raw_sample_rate;
+
+    voice_activity.started = false;
+    voice_activity.completed_chunks = 0;
+    voice_activity.noise_floor = 0.0f;
+    voice_activity.voice = false;
+    voice_activity.hangover = 0;
+    voice_activity.hangover_chunks =
+        (size_t)ceilf(VOICE_HANGOVER_SECONDS / chunk_seconds);
+    voice_activity.preroll_chunks =
+        (size_t)ceilf(VOICE_PREROLL_SECONDS / chunk_seconds);
+    voice_activity.voice_only = voice_only;
+    voice_activity.kept_chunk = SIZE_MAX;
 
     nrfy_pdm_disable(NRF_PDM0);
     nrfy_pdm_periph_configure(NRF_PDM0, &config);
@@ -263,11 +484,161 @@ static int16_t averaged_sample()
     return (int16_t)average;
 }
 
+static uint8_t adpcm_encode(int16_t sample)
+{
+    int32_t step = adpcm_step_table[adpcm.step_index];
+    int32_t difference = sample - adpcm.predictor;
+    uint8_t code = 0;
+
+    if (difference < 0)
+    {
+        code = 8;
+        difference = -difference;
+    }
+
+    // Quantize the difference the same way that the decoder will rebuild it,
+    // so that both predictors stay in step
+    int32_t delta = step >> 3;
+
+    for (uint8_t bit = 4; bit > 0; bit >>= 1)
+    {
+        if (difference >= step)
+        {
+            code |= bit;
+            difference -= step;
+            delta += step;
+        }
+
+        step >>= 1;
+    }
+
+    adpcm.predictor += code & 8 ? -delta : delta;
+
+    if (adpcm.predictor > INT16_MAX)
+    {
+        adpcm.predictor = INT16_MAX;
+    }
+
+    if (adpcm.predictor < INT16_MIN)
+    {
+        adpcm.predictor = INT16_MIN;
+    }
+
+    adpcm.step_index += adpcm_index_table[code];
+
+    if (adpcm.step_index < 0)
+    {
+        adpcm.step_index = 0;
+    }
+
+    if (adpcm.step_index > 88)
+    {
+        adpcm.step_index = 88;
+    }
+
+    return code;
+}
+
+// G.711 mu-law
+static uint8_t ulaw_encode(int16_t sample)
+{
+    int32_t magnitude = sample;
+    uint8_t sign = 0;
+
+    if (magnitude < 0)
+    {
+        sign = 0x80;
+        magnitude = -magnitude;
+    }
+
+    if (magnitude > 32635)
+    {
+        magnitude = 32635;
+    }
+
+    magnitude += 0x84;
+
+    uint8_t exponent = 7;
+    for (int32_t mask = 0x4000; (magnitude & mask) == 0 && exponent > 0;
+         mask >>= 1)
+    {
+        exponent--;
+    }
+
+    uint8_t mantissa = (magnitude >> (exponent + 3)) & 0x0F;
+
+    return ~(sign | exponent << 4 | mantissa);
+}
+
+static size_t completed_chunks_from(size_t chunk)
+{
+    if (voice_activity.started == false)
+    {
+        return 0;
+    }
+
+    // The chunk before the head is still being filled
+    size_t filling = (fifo.head / fifo.chunk_size + FIFO_TOTAL_CHUNKS - 1) %
+                     FIFO_TOTAL_CHUNKS;
+
+    return (filling + FIFO_TOTAL_CHUNKS - chunk) % FIFO_TOTAL_CHUNKS;
+}
+
+// Skips over silent chunks at the tail. Returns false if the next sample can't
+// be read yet, either because its chunk is incomplete, or because it's not yet
+// known whether voice follows within the pre-roll
+static bool voice_gate(void)
+{
+    size_t chunk = fifo.tail / fifo.chunk_size;
+
+    while (true)
+    {
+        size_t completed = completed_chunks_from(chunk);
+
+        if (completed == 0)
+        {
+            return false;
+        }
+
+        if (chunk == voice_activity.kept_chunk)
+        {
+            return true;
+        }
+
+        for (size_t i = 0; i <= voice_activity.preroll_chunks; i++)
+        {
+            if (i == completed)
+            {
+                return false;
+            }
+
+            if (voice_activity.chunk_voiced[(chunk + i) % FIFO_TOTAL_CHUNKS])
+            {
+                voice_activity.kept_chunk = chunk;
+                return true;
+            }
+        }
+
+        chunk = (chunk + 1) % FIFO_TOTAL_CHUNKS;
+        fifo.tail = chunk * fifo.chunk_size;
+    }
+}
+
+static bool samples_available(void)
+{
+    if (voice_activity.voice_only)
+    {
+        return voice_gate();
+    }
+
+    return fifo.tail != fifo.head;
+}
+
 static int lua_microphone_read(lua_State *L)
 {
     lua_Integer bytes = luaL_checkinteger(L, 1);
 
-    if (bytes > 512)
+    if (bytes > MAXIMUM_READ_SIZE)
     {
         luaL_error(L, "too many bytes requested");
     }
@@ -277,15 +648,21 @@ static int lua_microphone_read(lua_State *L)
         luaL_error(L, "bytes must be a multiple of 4");
     }
 
+    // Samples go straight into a buffer if one is given
+    lua_buffer_t *destination = lua_buffer_optdestination(L, 2, bytes);
+
     // Return nil if the fifo is empty
-    if (fifo.tail == fifo.head)
+    if (samples_available() == false)
     {
         lua_pushnil(L);
         return 1;
     }
 
     size_t i = 0;
-    char *samples = malloc(bytes);
+    bool stalled = false;
+    char *samples = destination != NULL
+                        ? (char *)destination->data
+                        : lua_transient_allocate(L, bytes);
     if (samples == NULL)
     {
         luaL_error(L, "not enough memory");
@@ -293,7 +670,7 @@ static int lua_microphone_read(lua_State *L)
 
     while (true)
     {
-        if (fifo.tail == fifo.head)
+        if (samples_available() == false)
         {
             break;
         }
@@ -307,26 +684,190 @@ static int lua_microphone_read(lua_State *L)
             break;
 
         case 8:
-            int16_t sample8 = averaged_sample() >> 8;
-            samples[i++] = sample8;
+            int16_t sample8 = averaged_sample();
+
+            if (encoding == MICROPHONE_ENCODING_ULAW)
+            {
+                samples[i++] = ulaw_encode(sample8);
+                break;
+            }
+
+            samples[i++] = sample8 >> 8;
             break;
 
         case 4:
-            int16_t sample4_top = (averaged_sample() >> 12) & 0x0F;
-            int16_t sample4_bot = (averaged_sample() >> 12) & 0x0F;
+            size_t first_tail = fifo.tail;
+            int16_t first_sample = averaged_sample();
+
+            // Give back the first sample if the second isn't ready yet
+            if (samples_available() == false)
+            {
+                fifo.tail = first_tail;
+                stalled = true;
+                break;
+            }
+
+            int16_t second_sample = averaged_sample();
+
+            // ADPCM follows the IMA convention of the first sample in the low
+            // nibble, whereas plain 4 bit samples are packed MSB first
+            if (encoding == MICROPHONE_ENCODING_ADPCM)
+            {
+                uint8_t code = adpcm_encode(first_sample);
+                code |= adpcm_encode(second_sample) << 4;
+                samples[i++] = code;
+                break;
+            }
+
+            int16_t sample4_top = (first_sample >> 12) & 0x0F;
+            int16_t sample4_bot = (second_sample >> 12) & 0x0F;
             int8_t combined_sample = (sample4_top << 4) | sample4_bot;
             samples[i++] = combined_sample;
             break;
         }
 
-        if (i == bytes)
+        if (stalled || i == bytes)
         {
             break;
         }
     }
 
+    if (destination != NULL)
+    {
+        destination->length = i;
+        lua_pushvalue(L, 2);
+        return 1;
+    }
+
+    // Freed straight away rather than waiting for the guard to be collected
     lua_pushlstring(L, samples, i);
-    free(samples);
+    lua_transient_free(L, -2);
+
+    return 1;
+}
+
+static int lua_microphone_features(lua_State *L)
+{
+    // Only complete chunks are analysed, and nothing is consumed from the fifo
+    if (voice_activity.completed_chunks * fifo.chunk_size <
+        FEATURES_FFT_LENGTH)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    float *input = memory_allocate(MEMORY_POOL_TRANSIENT,
+                                   sizeof(float) * FEATURES_FFT_LENGTH * 5 / 2);
+    if (input == NULL)
+    {
+        luaL_error(L, "not enough memory");
+    }
+
+    float *output = input + FEATURES_FFT_LENGTH;
+    float *power = output + FEATURES_FFT_LENGTH;
+
+    size_t end = (fifo.head + FIFO_TOTAL_SIZE - fifo.chunk_size) %
+                 FIFO_TOTAL_SIZE;
+    size_t start = (end + FIFO_TOTAL_SIZE - FEATURES_FFT_LENGTH) %
+                   FIFO_TOTAL_SIZE;
+
+    // The latest samples may wrap around the end of the fifo
+    if (start < end)
+    {
+        arm_q15_to_float(fifo.buffer + start, input, FEATURES_FFT_LENGTH);
+    }
+    else
+    {
+        size_t first_length = FIFO_TOTAL_SIZE - start;
+        arm_q15_to_float(fifo.buffer + start, input, first_length);
+        arm_q15_to_float(fifo.buffer,
+                         input + first_length,
+                         FEATURES_FFT_LENGTH - first_length);
+    }
+
+    float rms;
+    arm_rms_f32(input, FEATURES_FFT_LENGTH, &rms);
+
+    size_t crossings = 0;
+    for (size_t i = 1; i < FEATURES_FFT_LENGTH; i++)
+    {
+        if ((input[i - 1] < 0.0f) != (input[i] < 0.0f))
+        {
+            crossings++;
+        }
+    }
+
+    // Hann window
+    for (size_t i = 0; i < FEATURES_FFT_LENGTH; i++)
+    {
+        input[i] *= 0.5f - 0.5f * arm_cos_f32(2.0f * PI * (float)i /
+                                               (float)FEATURES_FFT_LENGTH);
+    }
+
+    arm_rfft_fast_instance_f32 fft;
+    arm_rfft_fast_init_f32(&fft, FEATURES_FFT_LENGTH);
+    arm_rfft_fast_f32(&fft, input, output, 0);
+
+    // The real parts of the DC and Nyquist bins are packed into the first pair
+    power[0] = output[0] * output[0];
+    arm_cmplx_mag_squared_f32(output + 2,
+                              power + 1,
+                              FEATURES_FFT_LENGTH / 2 - 1);
+
+    float peak_power;
+    uint32_t peak_bin;
+    arm_max_f32(power + 1, FEATURES_FFT_LENGTH / 2 - 1, &peak_power, &peak_bin);
+    peak_bin++;
+
+    float bin_width = (float)fifo.raw_sample_rate / (float)FEATURES_FFT_LENGTH;
+
+    // Scaled so that each band holds its share of the mean square, and then
+    // given in dB relative to a full scale sine wave. The Hann window has a
+    // power gain of 3/8
+    float scale = 2.0f * 2.0f /
+                  (0.375f * FEATURES_FFT_LENGTH * FEATURES_FFT_LENGTH);
+
+    float bands[FEATURES_BAND_COUNT] = {0.0f};
+    size_t band = 0;
+    for (size_t i = 1; i < FEATURES_FFT_LENGTH / 2; i++)
+    {
+        while (band < FEATURES_BAND_COUNT - 1 &&
+               (float)i * bin_width >= features_band_edges[band])
+        {
+            band++;
+        }
+
+        bands[band] += power[i];
+    }
+
+    memory_free(input);
+
+    lua_newtable(L);
+
+    lua_pushnumber(L, (lua_Number)rms);
+    lua_setfield(L, -2, "rms");
+
+    lua_pushnumber(L, (lua_Number)crossings / (FEATURES_FFT_LENGTH - 1));
+    lua_setfield(L, -2, "zero_crossing_rate");
+
+    lua_pushnumber(L, (lua_Number)((float)peak_bin * bin_width));
+    lua_setfield(L, -2, "peak_frequency");
+
+    lua_createtable(L, FEATURES_BAND_COUNT, 0);
+    for (size_t i = 0; i < FEATURES_BAND_COUNT; i++)
+    {
+        float decibels = 10.0f * log10f(bands[i] * scale + 1e-12f);
+        lua_pushnumber(L, (lua_Number)decibels);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "bands");
+
+    float noise_floor = 10.0f * log10f(2.0f * voice_activity.noise_floor);
+    lua_pushnumber(L, (lua_Number)noise_floor);
+    lua_setfield(L, -2, "noise_floor");
+
+    lua_pushboolean(L, voice_activity.voice);
+    lua_setfield(L, -2, "voice");
 
     return 1;
 }
@@ -360,6 +901,9 @@ void lua_open_microphone_library(lua_State *L)
     lua_pushcfunction(L, lua_microphone_read);
     lua_setfield(L, -2, "read");
 
+    lua_pushcfunction(L, lua_microphone_features);
+    lua_setfield(L, -2, "features");
+
     lua_setfield(L, -2, "microphone");
 
     lua_pop(L, 1);
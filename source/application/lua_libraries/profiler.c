@@ -0,0 +1,373 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lua.h"
+
+/*
+ * Samples are taken from the 1ms RTC tick of the time library. The tick only
+ * arms the event queue hook, which then walks the Lua stack at the next
+ * instruction, call or return. Time spent inside C functions such as
+ * frame.sleep() can't be sampled until they return, so the hook counts every
+ * tick since the last sample, and a return from a C function is recorded as
+ * native time for that function.
+ */
+
+#define PROFILE_MAX_DEPTH 8
+#define PROFILE_MAX_STACKS 128
+#define PROFILE_MAX_STRINGS 32
+#define PROFILE_MAX_STRING_LENGTH 31
+#define PROFILE_FORMAT_VERSION 1
+
+// Frames are stored innermost first
+typedef struct profile_stack_t
+{
+    uint32_t count;
+    uint16_t line;
+    uint8_t depth;
+    bool native;
+    uint8_t strings[PROFILE_MAX_DEPTH];
+    uint16_t lines_defined[PROFILE_MAX_DEPTH];
+} profile_stack_t;
+
+static struct profile
+{
+    volatile bool running;
+    volatile uint32_t ticks_elapsed;
+    uint32_t ticks_recorded;
+    uint16_t interval_ms;
+    uint16_t ticks;
+
+    uint32_t samples;
+    uint32_t native_samples;
+    uint32_t dropped_samples;
+
+    profile_stack_t stacks[PROFILE_MAX_STACKS];
+    uint8_t stack_count;
+
+    char strings[PROFILE_MAX_STRINGS][PROFILE_MAX_STRING_LENGTH + 1];
+    uint8_t string_count;
+} profile;
+
+static int profile_string_index(const char *string)
+{
+    for (int i = 0; i < profile.string_count; i++)
+    {
+        if (strncmp(profile.strings[i],
+                    string,
+                    PROFILE_MAX_STRING_LENGTH) == 0)
+        {
+            return i;
+        }
+    }
+
+    if (profile.string_count == PROFILE_MAX_STRINGS)
+    {
+        return -1;
+    }
+
+    strncpy(profile.strings[profile.string_count],
+            string,
+            PROFILE_MAX_STRING_LENGTH);
+
+    return profile.string_count++;
+}
+
+static bool profile_add_frame(profile_stack_t *stack,
+                              const char *string,
+                              int line_defined)
+{
+    int index = profile_string_index(string);
+
+    if (index < 0)
+    {
+        return false;
+    }
+
+    stack->strings[stack->depth] = index;
+    stack->lines_defined[stack->depth] = line_defined < 0 ? 0 : line_defined;
+    stack->depth++;
+
+    return true;
+}
+
+static void profile_record(const profile_stack_t *sample, uint32_t weight)
+{
+    for (int i = 0; i < profile.stack_count; i++)
+    {
+        profile_stack_t *stack = &profile.stacks[i];
+
+        if (stack->depth == sample->depth &&
+            stack->native == sample->native &&
+            stack->line == sample->line &&
+            memcmp(stack->strings, sample->strings, sample->depth) == 0 &&
+            memcmp(stack->lines_defined,
+                   sample->lines_defined,
+                   sample->depth * sizeof(uint16_t)) == 0)
+        {
+            stack->count += weight;
+            return;
+        }
+    }
+
+    if (profile.stack_count == PROFILE_MAX_STACKS)
+    {
+        profile.dropped_samples += weight;
+        return;
+    }
+
+    profile.stacks[profile.stack_count] = *sample;
+    profile.stacks[profile.stack_count].count = weight;
+    profile.stack_count++;
+}
+
+void lua_profiler_sample(lua_State *L, lua_Debug *ar)
+{
+    // Every tick since the last sample belongs to this one
+    uint32_t ticks_elapsed = profile.ticks_elapsed;
+    uint32_t weight = ticks_elapsed - profile.ticks_recorded;
+    profile.ticks_recorded = ticks_elapsed;
+
+    if (weight == 0)
+    {
+        return;
+    }
+
+    profile_stack_t sample = {0};
+    lua_Debug frame;
+    int level = 0;
+    bool complete = true;
+
+    // A called function hasn't run yet, so the time belongs to its caller
+    if (ar->event == LUA_HOOKCALL)
+    {
+        level = 1;
+    }
+
+    // A returning C function is where the time was actually spent
+    else if (ar->event == LUA_HOOKRET)
+    {
+        lua_getinfo(L, "Sn", ar);
+
+        if (ar->what[0] == 'C')
+        {
+            sample.native = true;
+            complete = profile_add_frame(&sample,
+                                         ar->name ? ar->name : "?",
+                                         0);
+            level = 1;
+        }
+    }
+
+    while (complete &&
+           sample.depth < PROFILE_MAX_DEPTH &&
+           lua_getstack(L, level, &frame))
+    {
+        lua_getinfo(L, "Sl", &frame);
+
+        // Also the calling line when the sample is native
+        if (sample.depth == (sample.native ? 1 : 0))
+        {
+            sample.line = frame.currentline < 0 ? 0 : frame.currentline;
+        }
+
+        complete = profile_add_frame(&sample,
+                                     frame.short_src,
+                                     frame.linedefined);
+        level++;
+    }
+
+    profile.samples += weight;
+
+    if (complete == false || sample.depth == 0)
+    {
+        profile.dropped_samples += weight;
+        return;
+    }
+
+    if (sample.native)
+    {
+        profile.native_samples += weight;
+    }
+
+    profile_record(&sample, weight);
+}
+
+void lua_profiler_tick(void)
+{
+    if (profile.running == false)
+    {
+        return;
+    }
+
+    if (++profile.ticks < profile.interval_ms)
+    {
+        return;
+    }
+
+    profile.ticks = 0;
+    profile.ticks_elapsed++;
+
+    lua_event_request_hook();
+}
+
+static int lua_profile_start(lua_State *L)
+{
+    lua_Integer interval_ms = luaL_optinteger(L, 1, 5);
+
+    if (interval_ms < 1 || interval_ms > 1000)
+    {
+        luaL_error(L, "interval must be between 1 and 1000 milliseconds");
+    }
+
+    profile.running = false;
+
+    memset(&profile, 0, sizeof(profile));
+    profile.interval_ms = interval_ms;
+    profile.running = true;
+
+    return 0;
+}
+
+static int lua_profile_stop(lua_State *L)
+{
+    profile.running = false;
+
+    lua_pushinteger(L, profile.samples);
+    return 1;
+}
+
+static int lua_profile_is_running(lua_State *L)
+{
+    lua_pushboolean(L, profile.running);
+    return 1;
+}
+
+static void add_u8(luaL_Buffer *buffer, uint8_t value)
+{
+    luaL_addchar(buffer, value);
+}
+
+static void add_u16(luaL_Buffer *buffer, uint16_t value)
+{
+    add_u8(buffer, value);
+    add_u8(buffer, value >> 8);
+}
+
+static void add_u32(luaL_Buffer *buffer, uint32_t value)
+{
+    add_u16(buffer, value);
+    add_u16(buffer, value >> 16);
+}
+
+/*
+ * Results are packed little endian as:
+ *
+ *     u8  version
+ *     u16 interval in milliseconds
+ *     u32 samples, u32 native samples, u32 dropped samples
+ *     u8  string count, then each string as u8 length and characters
+ *     u8  stack count, then each stack as:
+ *         u32 samples
+ *         u16 current line of the innermost Lua function
+ *         u8  depth, with bit 7 set if the innermost frame is native
+ *         depth frames, innermost first, of u8 string and u16 line defined
+ *
+ * Strings are source names for Lua functions, or function names for native
+ * ones. tools/lua-profiler converts this into folded stacks for flamegraphs.
+ */
+static int lua_profile_dump(lua_State *L)
+{
+    if (profile.running)
+    {
+        luaL_error(L, "profiler is still running");
+    }
+
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+
+    add_u8(&buffer, PROFILE_FORMAT_VERSION);
+    add_u16(&buffer, profile.interval_ms);
+    add_u32(&buffer, profile.samples);
+    add_u32(&buffer, profile.native_samples);
+    add_u32(&buffer, profile.dropped_samples);
+
+    add_u8(&buffer, profile.string_count);
+    for (int i = 0; i < profile.string_count; i++)
+    {
+        size_t length = strlen(profile.strings[i]);
+        add_u8(&buffer, length);
+        luaL_addlstring(&buffer, profile.strings[i], length);
+    }
+
+    add_u8(&buffer, profile.stack_count);
+    for (int i = 0; i < profile.stack_count; i++)
+    {
+        profile_stack_t *stack = &profile.stacks[i];
+
+        add_u32(&buffer, stack->count);
+        add_u16(&buffer, stack->line);
+        add_u8(&buffer, stack->depth | (stack->native ? 0x80 : 0));
+
+        for (int j = 0; j < stack->depth; j++)
+        {
+            add_u8(&buffer, stack->strings[j]);
+            add_u16(&buffer, stack->lines_defined[j]);
+        }
+    }
+
+    luaL_pushresult(&buffer);
+    return 1;
+}
+
+void lua_open_profiler_library(lua_State *L)
+{
+    // Hooks belong to the previous Lua state
+    profile.running = false;
+
+    lua_getglobal(L, "frame");
+    lua_getfield(L, -1, "system");
+
+    lua_newtable(L);
+
+    lua_pushcfunction(L, lua_profile_start);
+    lua_setfield(L, -2, "start");
+
+    lua_pushcfunction(L, lua_profile_stop);
+    lua_setfield(L, -2, "stop");
+
+    lua_pushcfunction(L, lua_profile_is_running);
+    lua_setfield(L, -2, "is_running");
+
+    lua_pushcfunction(L, lua_profile_dump);
+    lua_setfield(L, -2, "dump");
+
+    lua_setfield(L, -2, "profile");
+
+    lua_pop(L, 2);
+}
@@ -0,0 +1,543 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "error_logging.h"
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lua.h"
+#include "nrf_soc.h"
+#include "nrf52840.h"
+
+#define SCHEDULER_MAX_TIMERS 16
+#define SCHEDULER_MAX_TASKS 16
+
+/*
+ * Timers share compare channel 0 of the time library's RTC, which is always
+ * set to the earliest deadline. Its interrupt queues a timer event, so timer
+ * callbacks run wherever other callbacks do, including within frame.sleep().
+ *
+ * Tasks are coroutines started by frame.spawn() and resumed by frame.run().
+ * A task waiting on a condition using frame.wait() is made ready again by the
+ * timer, Bluetooth or tap event handlers, or by polling the camera. When no
+ * task is ready, frame.run() sleeps until the next interrupt.
+ */
+
+typedef struct scheduler_timer_t
+{
+    uint32_t id;
+    uint64_t deadline_ms;
+    uint32_t interval_ms;
+    int function; // LUA_NOREF when waking a task
+    int task;
+} scheduler_timer_t;
+
+typedef struct scheduler_task_t
+{
+    int thread; // LUA_NOREF when the slot is free
+    lua_State *coroutine;
+    lua_scheduler_condition_t condition;
+    int value; // Passed back from frame.wait()
+} scheduler_task_t;
+
+static scheduler_timer_t timers[SCHEDULER_MAX_TIMERS];
+static scheduler_task_t tasks[SCHEDULER_MAX_TASKS];
+static uint32_t next_timer_id;
+static int current_task;
+static bool running;
+
+static void update_alarm(void)
+{
+    uint64_t earliest = UINT64_MAX;
+
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        if (timers[i].id && timers[i].deadline_ms < earliest)
+        {
+            earliest = timers[i].deadline_ms;
+        }
+    }
+
+    if (earliest == UINT64_MAX)
+    {
+        lua_time_clear_alarm();
+        return;
+    }
+
+    lua_time_set_alarm(earliest);
+}
+
+static uint32_t add_timer(uint32_t delay_ms,
+                          uint32_t interval_ms,
+                          int function,
+                          int task)
+{
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        if (timers[i].id)
+        {
+            continue;
+        }
+
+        // Never 0, which marks a free slot
+        if (++next_timer_id == 0)
+        {
+            next_timer_id = 1;
+        }
+
+        timers[i].id = next_timer_id;
+        timers[i].deadline_ms = lua_time_uptime_ms() + delay_ms;
+        timers[i].interval_ms = interval_ms;
+        timers[i].function = function;
+        timers[i].task = task;
+
+        update_alarm();
+
+        return timers[i].id;
+    }
+
+    return 0;
+}
+
+static void remove_timer(lua_State *L, scheduler_timer_t *timer)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, timer->function);
+    timer->id = 0;
+}
+
+static void wake_task(lua_State *L, int task)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, tasks[task].value);
+    tasks[task].value = LUA_NOREF;
+    tasks[task].condition = LUA_SCHEDULER_READY;
+}
+
+static void lua_timer_event_handler(lua_State *L, const lua_event_t *event)
+{
+    uint64_t now = lua_time_uptime_ms();
+
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        scheduler_timer_t *timer = &timers[i];
+
+        if (timer->id == 0 || timer->deadline_ms > now)
+        {
+            continue;
+        }
+
+        if (timer->task >= 0)
+        {
+            wake_task(L, timer->task);
+            timer->id = 0;
+            continue;
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, timer->function);
+
+        // Intervals that fall behind skip ticks rather than bunching up
+        if (timer->interval_ms)
+        {
+            timer->deadline_ms += timer->interval_ms;
+
+            if (timer->deadline_ms <= now)
+            {
+                timer->deadline_ms = now + timer->interval_ms;
+            }
+        }
+        else
+        {
+            remove_timer(L, timer);
+        }
+
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+        {
+            update_alarm();
+            luaL_error(L, "%s", lua_tostring(L, -1));
+        }
+    }
+
+    update_alarm();
+}
+
+static uint32_t check_delay_ms(lua_State *L, int index)
+{
+    lua_Number seconds = luaL_checknumber(L, index);
+
+    if (seconds < 0 || seconds > 86400)
+    {
+        luaL_error(L, "seconds must be between 0 and 86400");
+    }
+
+    return (uint32_t)(seconds * 1000);
+}
+
+static int set_timer(lua_State *L, bool repeat)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    uint32_t delay_ms = check_delay_ms(L, 2);
+
+    if (repeat && delay_ms == 0)
+    {
+        luaL_error(L, "interval must be at least 1 millisecond");
+    }
+
+    lua_pushvalue(L, 1);
+    int function = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    uint32_t id = add_timer(delay_ms, repeat ? delay_ms : 0, function, -1);
+
+    if (id == 0)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, function);
+        luaL_error(L, "too many timers");
+    }
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+static int lua_time_set_timeout(lua_State *L)
+{
+    return set_timer(L, false);
+}
+
+static int lua_time_set_interval(lua_State *L)
+{
+    return set_timer(L, true);
+}
+
+static int lua_time_clear_timer(lua_State *L)
+{
+    lua_Integer id = luaL_checkinteger(L, 1);
+
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        if (id != 0 && timers[i].id == id && timers[i].task < 0)
+        {
+            remove_timer(L, &timers[i]);
+            update_alarm();
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void lua_scheduler_notify(lua_State *L,
+                          lua_scheduler_condition_t condition,
+                          const uint8_t *data,
+                          size_t length)
+{
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        if (tasks[i].thread == LUA_NOREF || tasks[i].condition != condition)
+        {
+            continue;
+        }
+
+        wake_task(L, i);
+
+        if (data != NULL)
+        {
+            lua_pushlstring(L, (char *)data, length);
+            tasks[i].value = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    }
+}
+
+static void free_task(lua_State *L, int task)
+{
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        if (timers[i].id && timers[i].task == task)
+        {
+            timers[i].id = 0;
+        }
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, tasks[task].value);
+    luaL_unref(L, LUA_REGISTRYINDEX, tasks[task].thread);
+    tasks[task].value = LUA_NOREF;
+    tasks[task].thread = LUA_NOREF;
+}
+
+static int lua_spawn(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        if (tasks[i].thread != LUA_NOREF)
+        {
+            continue;
+        }
+
+        // The function and its arguments become the coroutine's first resume
+        int count = lua_gettop(L);
+        lua_State *coroutine = lua_newthread(L);
+        lua_insert(L, 1);
+        lua_xmove(L, coroutine, count);
+
+        lua_pushvalue(L, 1);
+        tasks[i].thread = luaL_ref(L, LUA_REGISTRYINDEX);
+        tasks[i].coroutine = coroutine;
+        tasks[i].condition = LUA_SCHEDULER_READY;
+        tasks[i].value = LUA_NOREF;
+
+        return 1;
+    }
+
+    return luaL_error(L, "too many tasks");
+}
+
+static int lua_wait(lua_State *L)
+{
+    if (current_task < 0 || tasks[current_task].coroutine != L)
+    {
+        luaL_error(L, "can only wait within a task started by frame.spawn()");
+    }
+
+    scheduler_task_t *task = &tasks[current_task];
+
+    if (lua_isnoneornil(L, 1))
+    {
+        task->condition = LUA_SCHEDULER_READY;
+    }
+
+    else if (lua_type(L, 1) == LUA_TNUMBER)
+    {
+        uint32_t delay_ms = check_delay_ms(L, 1);
+
+        if (add_timer(delay_ms, 0, LUA_NOREF, current_task) == 0)
+        {
+            luaL_error(L, "too many timers");
+        }
+
+        task->condition = LUA_SCHEDULER_TIME;
+    }
+
+    else
+    {
+        static const char *const conditions[] = {"bluetooth",
+                                                 "tap",
+                                                 "capture",
+                                                 NULL};
+
+        task->condition = LUA_SCHEDULER_BLUETOOTH +
+                          luaL_checkoption(L, 1, NULL, conditions);
+    }
+
+    return lua_yield(L, 0);
+}
+
+// Returns true if a task is ready to run again straight away
+static bool resume_tasks(lua_State *L)
+{
+    bool any_waiting_for_capture = false;
+    bool any_ready = false;
+
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        if (tasks[i].thread != LUA_NOREF &&
+            tasks[i].condition == LUA_SCHEDULER_CAPTURE)
+        {
+            any_waiting_for_capture = true;
+        }
+    }
+
+    if (any_waiting_for_capture && lua_camera_capture_complete())
+    {
+        lua_scheduler_notify(L, LUA_SCHEDULER_CAPTURE, NULL, 0);
+    }
+
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        scheduler_task_t *task = &tasks[i];
+
+        if (task->thread == LUA_NOREF ||
+            task->condition != LUA_SCHEDULER_READY)
+        {
+            continue;
+        }
+
+        int arguments = 0;
+
+        // A new task has its function and arguments waiting on its stack
+        if (lua_status(task->coroutine) == LUA_OK &&
+            lua_gettop(task->coroutine) > 0)
+        {
+            arguments = lua_gettop(task->coroutine) - 1;
+        }
+
+        else if (task->value != LUA_NOREF)
+        {
+            lua_rawgeti(task->coroutine, LUA_REGISTRYINDEX, task->value);
+            luaL_unref(L, LUA_REGISTRYINDEX, task->value);
+            task->value = LUA_NOREF;
+            arguments = 1;
+        }
+
+        int results;
+        current_task = i;
+        lua_State *previous = lua_event_set_resumed_thread(task->coroutine);
+        int status = lua_resume(task->coroutine, L, arguments, &results);
+        lua_event_set_resumed_thread(previous);
+        current_task = -1;
+
+        if (status == LUA_YIELD)
+        {
+            lua_pop(task->coroutine, results);
+            any_ready |= task->condition == LUA_SCHEDULER_READY;
+            continue;
+        }
+
+        if (status != LUA_OK)
+        {
+            lua_xmove(task->coroutine, L, 1);
+            free_task(L, i);
+            lua_error(L);
+        }
+
+        free_task(L, i);
+    }
+
+    // Tasks waiting for a capture are polled each time the RTC tick wakes us
+    return any_ready;
+}
+
+static bool anything_scheduled(void)
+{
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        if (tasks[i].thread != LUA_NOREF)
+        {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        if (timers[i].id)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int run_scheduler(lua_State *L)
+{
+    while (anything_scheduled())
+    {
+        lua_event_process(L);
+
+        if (resume_tasks(L))
+        {
+            continue;
+        }
+
+        // Clear exceptions and sleep until the next interrupt
+        __set_FPSCR(__get_FPSCR() & ~(0x0000009F));
+        (void)__get_FPSCR();
+
+        NVIC_ClearPendingIRQ(FPU_IRQn);
+
+        check_error(sd_app_evt_wait());
+    }
+
+    return 0;
+}
+
+static int lua_run(lua_State *L)
+{
+    if (running)
+    {
+        luaL_error(L, "already running");
+    }
+
+    running = true;
+
+    lua_pushcfunction(L, run_scheduler);
+    int status = lua_pcall(L, 0, 0, 0);
+
+    running = false;
+
+    if (status != LUA_OK)
+    {
+        lua_error(L);
+    }
+
+    return 0;
+}
+
+void lua_open_scheduler_library(lua_State *L)
+{
+    // Timers and tasks belong to the previous Lua state
+    for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+    {
+        timers[i].id = 0;
+    }
+
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        tasks[i].thread = LUA_NOREF;
+        tasks[i].value = LUA_NOREF;
+    }
+
+    next_timer_id = 0;
+    current_task = -1;
+    running = false;
+
+    lua_time_clear_alarm();
+    lua_event_set_handler(LUA_EVENT_TIMER, lua_timer_event_handler);
+
+    lua_getglobal(L, "frame");
+
+    lua_getfield(L, -1, "time");
+
+    lua_pushcfunction(L, lua_time_set_timeout);
+    lua_setfield(L, -2, "set_timeout");
+
+    lua_pushcfunction(L, lua_time_set_interval);
+    lua_setfield(L, -2, "set_interval");
+
+    lua_pushcfunction(L, lua_time_clear_timer);
+    lua_setfield(L, -2, "clear_timer");
+
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, lua_spawn);
+    lua_setfield(L, -2, "spawn");
+
+    lua_pushcfunction(L, lua_wait);
+    lua_setfield(L, -2, "wait");
+
+    lua_pushcfunction(L, lua_run);
+    lua_setfield(L, -2, "run");
+
+    lua_pop(L, 1);
+}
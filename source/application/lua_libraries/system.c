@@ -24,10 +24,15 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <string.h>
+#include "bluetooth.h"
 #include "error_logging.h"
+#include "frame_lua_libraries.h"
+#include "io_stats.h"
 #include "lauxlib.h"
 #include "lua.h"
 #include "main.h"
+#include "memory.h"
 #include "nrf_soc.h"
 #include "nrf52840.h"
 #include "nrfx_saadc.h"
@@ -41,6 +46,64 @@ static int lua_update(lua_State *L)
     return 0;
 }
 
+// Idle collection stops once a cycle has finished, and picks up again after
+// this much new garbage could have been created
+#define IDLE_GC_RESTART_KB 4
+
+// Each wake up runs at most this many steps of about this much work, and stops
+// early if the wait is nearly over, so that the CPU can get back to sleep
+#define IDLE_GC_STEP_KB 1
+#define IDLE_GC_MAX_STEPS 8
+#define IDLE_GC_SLACK_MS 2
+
+static int gc_mode = LUA_GCINC;
+static bool idle_gc_enabled = true;
+static bool idle_gc_cycle_done = false;
+static int idle_gc_count_kb = 0;
+
+static void idle_collect_garbage(lua_State *L, uint64_t wait_until_ms)
+{
+    if (!idle_gc_enabled || !lua_gc(L, LUA_GCISRUNNING))
+    {
+        return;
+    }
+
+    if (idle_gc_cycle_done)
+    {
+        if (lua_gc(L, LUA_GCCOUNT) < idle_gc_count_kb + IDLE_GC_RESTART_KB)
+        {
+            return;
+        }
+
+        idle_gc_cycle_done = false;
+    }
+
+    // A generational step is a whole young collection, and never reports that
+    // a cycle has finished. One is run for every IDLE_GC_RESTART_KB allocated
+    if (gc_mode == LUA_GCGEN)
+    {
+        lua_gc(L, LUA_GCSTEP, 0);
+        idle_gc_cycle_done = true;
+        idle_gc_count_kb = lua_gc(L, LUA_GCCOUNT);
+        return;
+    }
+
+    for (int i = 0; i < IDLE_GC_MAX_STEPS; i++)
+    {
+        if (lua_time_uptime_ms() + IDLE_GC_SLACK_MS >= wait_until_ms)
+        {
+            return;
+        }
+
+        if (lua_gc(L, LUA_GCSTEP, IDLE_GC_STEP_KB))
+        {
+            idle_gc_cycle_done = true;
+            idle_gc_count_kb = lua_gc(L, LUA_GCCOUNT);
+            return;
+        }
+    }
+}
+
 static int lua_sleep(lua_State *L)
 {
     if (lua_gettop(L) == 0)
@@ -50,38 +113,23 @@ static int lua_sleep(lua_State *L)
     }
 
     lua_Number seconds = luaL_checknumber(L, 1);
-    lua_pop(L, 1);
 
-    // Get the current time
-    int status = luaL_dostring(L, "return frame.time.utc()");
-    if (status != LUA_OK)
+    // Uptime is read directly so that waking up doesn't create any garbage
+    uint64_t wait_until_ms = lua_time_uptime_ms();
+
+    if (seconds > 0)
     {
-        const char *lua_error = lua_tostring(L, -1);
-        luaL_error(L, "%s", lua_error);
-        lua_pop(L, -1);
+        wait_until_ms += (uint64_t)ceil(seconds * 1000);
     }
 
-    // Add the current time to the wait time
-    lua_Number wait_until = lua_tonumber(L, 1) + seconds;
-
-    while (true)
+    while (lua_time_uptime_ms() < wait_until_ms)
     {
-        // Keep getting the current time
-        status = luaL_dostring(L, "return frame.time.utc()");
-        if (status != LUA_OK)
-        {
-            const char *lua_error = lua_tostring(L, -1);
-            luaL_error(L, "%s", lua_error);
-            lua_pop(L, -1);
-        }
+        // No Lua code runs here for the hook to catch, so events are handled
+        // directly. A break signal, or an error from a callback, ends the
+        // sleep the same way it would end any other running code
+        lua_event_process(L);
 
-        lua_Number current_time = lua_tonumber(L, 2);
-        lua_pop(L, 1);
-
-        if (current_time >= wait_until)
-        {
-            break;
-        }
+        idle_collect_garbage(L, wait_until_ms);
 
         // Clear exceptions and sleep
         __set_FPSCR(__get_FPSCR() & ~(0x0000009F));
@@ -157,7 +205,18 @@ static int lua_fpga_read(lua_State *L)
 
     lua_Integer length = luaL_checkinteger(L, 2);
 
-    uint8_t *data = malloc(length);
+    // Reads straight into a buffer if one is given
+    lua_buffer_t *destination = lua_buffer_optdestination(L, 3, length);
+
+    if (destination != NULL)
+    {
+        spi_read(FPGA, address, destination->data, length);
+        destination->length = length;
+        lua_pushvalue(L, 3);
+        return 1;
+    }
+
+    uint8_t *data = memory_allocate(MEMORY_POOL_TRANSIENT, length);
     if (data == NULL)
     {
         luaL_error(L, "not enough memory");
@@ -165,7 +224,7 @@ static int lua_fpga_read(lua_State *L)
 
     spi_read(FPGA, address, data, length);
     lua_pushlstring(L, (char *)data, length);
-    free(data);
+    memory_free(data);
 
     return 1;
 }
@@ -179,13 +238,232 @@ static int lua_fpga_write(lua_State *L)
     }
 
     size_t length;
-    const char *data = luaL_checklstring(L, 2, &length);
+    const uint8_t *data = lua_buffer_checkbytes(L, 2, &length);
 
     spi_write(FPGA, address, (uint8_t *)data, length);
 
     return 0;
 }
 
+// Display commands are queued, so this is needed before timing them, or before
+// reading back anything they change
+static int lua_fpga_fence(lua_State *L)
+{
+    spi_fence(FPGA);
+    return 0;
+}
+
+static void set_integer_field(lua_State *L, const char *key, lua_Integer value)
+{
+    lua_pushinteger(L, value);
+    lua_setfield(L, -2, key);
+}
+
+static void set_pool_fields(lua_State *L, memory_pool_id_t pool)
+{
+    memory_stats_t stats;
+    memory_get_stats(pool, &stats);
+
+    set_integer_field(L, "total", stats.total_size);
+    set_integer_field(L, "free", stats.free_size);
+    set_integer_field(L, "largest_free_block", stats.largest_free_block);
+    set_integer_field(L, "high_water_mark", stats.high_water_mark);
+    set_integer_field(L, "fragmentation", memory_fragmentation(&stats));
+    set_integer_field(L, "allocations", stats.allocations);
+    set_integer_field(L, "frees", stats.frees);
+    set_integer_field(L, "failures", stats.failures);
+}
+
+static int lua_system_memory(lua_State *L)
+{
+    lua_newtable(L);
+
+    set_pool_fields(L, MEMORY_POOL_LUA);
+
+    // Same as collectgarbage('count')
+    lua_pushnumber(L,
+                   lua_gc(L, LUA_GCCOUNT) + lua_gc(L, LUA_GCCOUNTB) / 1024.0);
+    lua_setfield(L, -2, "lua_count");
+
+    set_integer_field(L, "stack_size", memory_stack_size());
+    set_integer_field(L,
+                      "stack_high_water_mark",
+                      memory_stack_high_water_mark());
+
+    set_integer_field(L, "softdevice", bluetooth_softdevice_ram());
+
+    lua_newtable(L);
+    set_pool_fields(L, MEMORY_POOL_TRANSIENT);
+    lua_setfield(L, -2, "transient");
+
+    return 1;
+}
+
+static int lua_system_gc(lua_State *L)
+{
+    // Lua can't report the mode without switching, which costs a full cycle
+    int previous_mode = gc_mode;
+
+    if (lua_gettop(L) > 0)
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+
+        lua_getfield(L, 1, "pause");
+        lua_Integer pause = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 1, "stepmul");
+        lua_Integer stepmul = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 1, "idle");
+        if (!lua_isnil(L, -1))
+        {
+            idle_gc_enabled = lua_toboolean(L, -1);
+        }
+        lua_getfield(L, 1, "mode");
+        const char *mode = luaL_optstring(L, -1, NULL);
+        lua_pop(L, 4);
+
+        if (pause < 0 || pause > 1000 || stepmul < 0 || stepmul > 1000)
+        {
+            luaL_error(L, "pause and stepmul must be between 0 and 1000");
+        }
+
+        // The generational collector is tuned by its own parameters instead
+        bool generational = mode == NULL ? gc_mode == LUA_GCGEN
+                                         : strcmp(mode, "generational") == 0;
+
+        if (generational && (pause || stepmul))
+        {
+            luaL_error(L, "pause and stepmul only apply in incremental mode");
+        }
+
+        if (mode == NULL)
+        {
+            if (pause)
+            {
+                lua_gc(L, LUA_GCSETPAUSE, pause);
+            }
+
+            if (stepmul)
+            {
+                lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+            }
+        }
+        else if (strcmp(mode, "incremental") == 0)
+        {
+            previous_mode = lua_gc(L, LUA_GCINC, pause, stepmul, 0);
+            gc_mode = LUA_GCINC;
+        }
+        else if (strcmp(mode, "generational") == 0)
+        {
+            previous_mode = lua_gc(L, LUA_GCGEN, 0, 0);
+            gc_mode = LUA_GCGEN;
+        }
+        else
+        {
+            luaL_error(L, "mode must be 'incremental' or 'generational'");
+        }
+    }
+
+    lua_pushstring(L,
+                   previous_mode == LUA_GCGEN ? "generational" : "incremental");
+    return 1;
+}
+
+static int lua_system_without_gc(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    bool was_running = lua_gc(L, LUA_GCISRUNNING);
+    lua_gc(L, LUA_GCSTOP);
+
+    int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+
+    if (was_running)
+    {
+        lua_gc(L, LUA_GCRESTART);
+    }
+
+    if (status != LUA_OK)
+    {
+        lua_error(L);
+    }
+
+    return lua_gettop(L);
+}
+
+static int lua_system_memory_trace(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    memory_trace_start();
+    int status = lua_pcall(L, lua_gettop(L) - 1, 0, 0);
+
+    memory_trace_t trace;
+    memory_trace_stop(&trace);
+
+    if (status != LUA_OK)
+    {
+        lua_error(L);
+    }
+
+    lua_newtable(L);
+    set_integer_field(L, "allocations", trace.allocations);
+    set_integer_field(L, "frees", trace.frees);
+    set_integer_field(L, "bytes_allocated", trace.bytes_allocated);
+    set_integer_field(L, "peak", trace.peak_used_size);
+
+    return 1;
+}
+
+static int lua_system_stats(lua_State *L)
+{
+#if IO_STATS
+    // The cycle counter runs at the CPU clock
+    lua_Number cycles_per_us = SystemCoreClock / 1000000.0;
+
+    lua_newtable(L);
+
+    for (int i = 0; i < IO_STATS_OPERATION_COUNT; i++)
+    {
+        io_stats_t stats;
+        io_stats_get(i, &stats);
+
+        lua_newtable(L);
+        set_integer_field(L, "count", stats.count);
+        set_integer_field(L, "failures", stats.failures);
+        set_integer_field(L, "retries", stats.retries);
+        set_integer_field(L, "bytes", stats.bytes);
+
+        lua_pushnumber(L, stats.min_cycles / cycles_per_us);
+        lua_setfield(L, -2, "min_us");
+
+        lua_pushnumber(L,
+                       stats.count ? stats.total_cycles / stats.count /
+                                         cycles_per_us
+                                   : 0);
+        lua_setfield(L, -2, "avg_us");
+
+        lua_pushnumber(L, stats.max_cycles / cycles_per_us);
+        lua_setfield(L, -2, "max_us");
+
+        lua_setfield(L, -2, io_stats_name(i));
+    }
+
+    return 1;
+#else
+    return luaL_error(L, "stats are not included in this build");
+#endif
+}
+
+static int lua_system_reset_stats(lua_State *L)
+{
+#if IO_STATS
+    io_stats_reset();
+    return 0;
+#else
+    return luaL_error(L, "stats are not included in this build");
+#endif
+}
+
 void lua_open_system_library(lua_State *L)
 {
     // Configure ADC
@@ -203,6 +481,11 @@ void lua_open_system_library(lua_State *L)
         check_error(nrfx_saadc_channel_config(&channel));
     }
 
+    // A fresh Lua state starts with the default collector settings
+    gc_mode = LUA_GCINC;
+    idle_gc_enabled = true;
+    idle_gc_cycle_done = false;
+
     lua_getglobal(L, "frame");
 
     lua_pushcfunction(L, lua_update);
@@ -226,8 +509,35 @@ void lua_open_system_library(lua_State *L)
         lua_pushcfunction(L, lua_fpga_write);
         lua_setfield(L, -2, "write");
 
+        lua_pushcfunction(L, lua_fpga_fence);
+        lua_setfield(L, -2, "fence");
+
         lua_setfield(L, -2, "fpga");
     }
 
+    {
+        lua_newtable(L);
+
+        lua_pushcfunction(L, lua_system_memory);
+        lua_setfield(L, -2, "memory");
+
+        lua_pushcfunction(L, lua_system_memory_trace);
+        lua_setfield(L, -2, "memory_trace");
+
+        lua_pushcfunction(L, lua_system_gc);
+        lua_setfield(L, -2, "gc");
+
+        lua_pushcfunction(L, lua_system_without_gc);
+        lua_setfield(L, -2, "without_gc");
+
+        lua_pushcfunction(L, lua_system_stats);
+        lua_setfield(L, -2, "stats");
+
+        lua_pushcfunction(L, lua_system_reset_stats);
+        lua_setfield(L, -2, "reset_stats");
+
+        lua_setfield(L, -2, "system");
+    }
+
     lua_pop(L, 1);
 }
\ No newline at end of file
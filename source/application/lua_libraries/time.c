@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include "error_logging.h"
+#include "frame_lua_libraries.h"
 #include "lauxlib.h"
 #include "lua.h"
 #include "nrfx_rtc.h"
@@ -33,12 +34,61 @@
 static const nrfx_rtc_t rtc = NRFX_RTC_INSTANCE(1);
 
 static uint64_t utc_time_ms = 0;
+static uint64_t uptime_ms = 0;
 static int8_t time_zone_offset_hours;
 static uint8_t time_zone_offset_minutes;
 
 static void rtc_event_handler(nrfx_rtc_int_type_t int_type)
 {
+    if (int_type == NRFX_RTC_INT_COMPARE0)
+    {
+        check_error(nrfx_rtc_cc_disable(&rtc, 0));
+        lua_event_push(LUA_EVENT_TIMER, NULL, 0);
+        return;
+    }
+
     utc_time_ms++;
+    uptime_ms++;
+    lua_profiler_tick();
+}
+
+// Unlike utc_time_ms, this is never changed by the user
+uint64_t lua_time_uptime_ms(void)
+{
+    NRFX_IRQ_DISABLE(rtc.irq);
+    uint64_t value = uptime_ms;
+    NRFX_IRQ_ENABLE(rtc.irq);
+
+    return value;
+}
+
+// Alarms further away than half the counter range simply fire early
+void lua_time_set_alarm(uint64_t at_ms)
+{
+    uint64_t now = lua_time_uptime_ms();
+    uint32_t max_delay = nrfx_rtc_max_ticks_get(&rtc) / 2;
+    uint64_t delay = at_ms > now ? at_ms - now : 0;
+
+    // The counter must be at least 2 ticks behind for the compare to trigger
+    if (delay < 2)
+    {
+        delay = 2;
+    }
+
+    if (delay > max_delay)
+    {
+        delay = max_delay;
+    }
+
+    uint32_t compare = (nrfx_rtc_counter_get(&rtc) + (uint32_t)delay) &
+                       nrfx_rtc_max_ticks_get(&rtc);
+
+    check_error(nrfx_rtc_cc_set(&rtc, 0, compare, true));
+}
+
+void lua_time_clear_alarm(void)
+{
+    check_error(nrfx_rtc_cc_disable(&rtc, 0));
 }
 
 static int lua_time_utc(lua_State *L)
@@ -0,0 +1,435 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "bluetooth.h"
+#include "frame_lua_libraries.h"
+#include "lauxlib.h"
+#include "lfs_util.h"
+#include "lfs.h"
+#include "lua.h"
+#include "luaport.h"
+#include "memory.h"
+
+/*
+ * Scripts and files larger than a single Bluetooth packet are sent as a start
+ * packet followed by numbered data packets, each prefixed with 0x02:
+ *
+ *   start:  0x00, mode, length (u32), crc32 (u32), filename (file mode only)
+ *   data:   0x01, sequence (u16), bytes
+ *
+ * All values are little endian, and sequence numbers count up from 0 after
+ * every start packet. Packets are reassembled in the Lua thread, so they're
+ * queued as events and the sender must keep no more than 8 packets in flight.
+ * Replies are sent as 0x02, status, sequence (u16), where sequence is the next
+ * one expected. One is sent after the start packet, every UPLOAD_ACK_INTERVAL
+ * data packets, and once the upload is done or has failed.
+ */
+
+#define UPLOAD_ACK_INTERVAL 4
+#define UPLOAD_START_HEADER_LENGTH 10
+#define UPLOAD_DATA_HEADER_LENGTH 3
+#define UPLOAD_MINIMUM_BUFFER_SIZE 512
+
+typedef enum upload_packet_t
+{
+    UPLOAD_PACKET_START = 0x00,
+    UPLOAD_PACKET_DATA = 0x01,
+} upload_packet_t;
+
+typedef enum upload_mode_t
+{
+    UPLOAD_MODE_EXECUTE = 0x00,
+    UPLOAD_MODE_FILE = 0x01,
+} upload_mode_t;
+
+typedef enum upload_status_t
+{
+    UPLOAD_STATUS_DONE = 0x00,
+    UPLOAD_STATUS_ACK = 0x01,
+    UPLOAD_STATUS_SEQUENCE_ERROR = 0x02,
+    UPLOAD_STATUS_CRC_ERROR = 0x03,
+    UPLOAD_STATUS_NO_MEMORY = 0x04,
+    UPLOAD_STATUS_FILE_ERROR = 0x05,
+    UPLOAD_STATUS_BUSY = 0x06,
+    UPLOAD_STATUS_BAD_PACKET = 0x07,
+} upload_status_t;
+
+static struct upload_t
+{
+    bool active;
+    upload_mode_t mode;
+    uint32_t length;
+    uint32_t received;
+    uint32_t crc;
+    uint32_t expected_crc;
+    uint16_t sequence;
+    uint8_t *buffer;
+    size_t buffer_size;
+    lfs_file_t file;
+    char filename[LUA_EVENT_MAX_PAYLOAD_LENGTH];
+    char temporary_filename[LUA_EVENT_MAX_PAYLOAD_LENGTH + 1];
+} upload;
+
+// A completed script waiting for the REPL loop to run it
+static uint8_t *pending_script = NULL;
+static size_t pending_script_length = 0;
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static void send_reply(upload_status_t status)
+{
+    uint8_t reply[4] = {0x02,
+                        status,
+                        upload.sequence & 0xFF,
+                        upload.sequence >> 8};
+
+    // Dropping a reply stalls the sender, so wait for a free buffer. If it
+    // still can't be sent, the sender has to time out and start again
+    if (bluetooth_send_data_waiting(reply, sizeof(reply)))
+    {
+        LOG("Upload reply %u couldn't be sent", status);
+    }
+}
+
+static void abort_upload(void)
+{
+    if (upload.active && upload.mode == UPLOAD_MODE_FILE)
+    {
+        lfs_file_close(lua_file_system(), &upload.file);
+        lfs_remove(lua_file_system(), upload.temporary_filename);
+    }
+
+    memory_free(upload.buffer);
+    upload.buffer = NULL;
+    upload.buffer_size = 0;
+    upload.active = false;
+}
+
+static void fail_upload(upload_status_t status)
+{
+    abort_upload();
+    send_reply(status);
+}
+
+static void finish_upload(void)
+{
+    if ((upload.crc ^ 0xFFFFFFFF) != upload.expected_crc)
+    {
+        fail_upload(UPLOAD_STATUS_CRC_ERROR);
+        return;
+    }
+
+    if (upload.mode == UPLOAD_MODE_FILE)
+    {
+        upload.active = false;
+
+        // Only replace the old file once the new one is known to be good
+        if (lfs_file_close(lua_file_system(), &upload.file) ||
+            lfs_rename(lua_file_system(),
+                       upload.temporary_filename,
+                       upload.filename))
+        {
+            lfs_remove(lua_file_system(), upload.temporary_filename);
+            send_reply(UPLOAD_STATUS_FILE_ERROR);
+            return;
+        }
+    }
+
+    else
+    {
+        pending_script = upload.buffer;
+        pending_script_length = upload.length;
+        upload.buffer = NULL;
+        upload.buffer_size = 0;
+        upload.active = false;
+    }
+
+    send_reply(UPLOAD_STATUS_DONE);
+}
+
+static void start_upload(const uint8_t *payload, size_t length)
+{
+    abort_upload();
+
+    upload.sequence = 0;
+
+    if (length < UPLOAD_START_HEADER_LENGTH)
+    {
+        send_reply(UPLOAD_STATUS_BAD_PACKET);
+        return;
+    }
+
+    upload.mode = payload[1];
+    upload.length = read_u32(payload + 2);
+    upload.expected_crc = read_u32(payload + 6);
+    upload.received = 0;
+    upload.crc = 0xFFFFFFFF;
+
+    size_t filename_length = length - UPLOAD_START_HEADER_LENGTH;
+
+    if (upload.mode == UPLOAD_MODE_FILE)
+    {
+        if (filename_length == 0)
+        {
+            send_reply(UPLOAD_STATUS_BAD_PACKET);
+            return;
+        }
+
+        memcpy(upload.filename,
+               payload + UPLOAD_START_HEADER_LENGTH,
+               filename_length);
+        upload.filename[filename_length] = 0;
+
+        strcpy(upload.temporary_filename, upload.filename);
+        strcat(upload.temporary_filename, "~");
+
+        if (lfs_file_open(lua_file_system(),
+                          &upload.file,
+                          upload.temporary_filename,
+                          LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC))
+        {
+            send_reply(UPLOAD_STATUS_FILE_ERROR);
+            return;
+        }
+    }
+
+    else if (upload.mode == UPLOAD_MODE_EXECUTE)
+    {
+        if (pending_script != NULL)
+        {
+            send_reply(UPLOAD_STATUS_BUSY);
+            return;
+        }
+    }
+
+    else
+    {
+        send_reply(UPLOAD_STATUS_BAD_PACKET);
+        return;
+    }
+
+    upload.active = true;
+
+    if (upload.length == 0)
+    {
+        finish_upload();
+        return;
+    }
+
+    send_reply(UPLOAD_STATUS_ACK);
+}
+
+static bool grow_buffer(size_t size)
+{
+    if (size <= upload.buffer_size)
+    {
+        return true;
+    }
+
+    // Doubling keeps reallocations down without reserving the whole length
+    size_t new_size = upload.buffer_size * 2;
+
+    if (new_size < UPLOAD_MINIMUM_BUFFER_SIZE)
+    {
+        new_size = UPLOAD_MINIMUM_BUFFER_SIZE;
+    }
+
+    if (new_size < size)
+    {
+        new_size = size;
+    }
+
+    if (new_size > upload.length)
+    {
+        new_size = upload.length;
+    }
+
+    uint8_t *new_buffer =
+        memory_reallocate(MEMORY_POOL_TRANSIENT, upload.buffer, new_size);
+
+    if (new_buffer == NULL)
+    {
+        return false;
+    }
+
+    upload.buffer = new_buffer;
+    upload.buffer_size = new_size;
+    return true;
+}
+
+static void receive_data(const uint8_t *payload, size_t length)
+{
+    if (!upload.active)
+    {
+        send_reply(UPLOAD_STATUS_SEQUENCE_ERROR);
+        return;
+    }
+
+    if (length < UPLOAD_DATA_HEADER_LENGTH)
+    {
+        fail_upload(UPLOAD_STATUS_BAD_PACKET);
+        return;
+    }
+
+    uint16_t sequence = payload[1] | payload[2] << 8;
+
+    if (sequence != upload.sequence)
+    {
+        fail_upload(UPLOAD_STATUS_SEQUENCE_ERROR);
+        return;
+    }
+
+    const uint8_t *data = payload + UPLOAD_DATA_HEADER_LENGTH;
+    size_t data_length = length - UPLOAD_DATA_HEADER_LENGTH;
+
+    if (data_length > upload.length - upload.received)
+    {
+        fail_upload(UPLOAD_STATUS_BAD_PACKET);
+        return;
+    }
+
+    if (upload.mode == UPLOAD_MODE_FILE)
+    {
+        lfs_ssize_t written = lfs_file_write(lua_file_system(),
+                                             &upload.file,
+                                             data,
+                                             data_length);
+
+        if (written != (lfs_ssize_t)data_length)
+        {
+            fail_upload(UPLOAD_STATUS_FILE_ERROR);
+            return;
+        }
+    }
+
+    else
+    {
+        if (!grow_buffer(upload.received + data_length))
+        {
+            fail_upload(UPLOAD_STATUS_NO_MEMORY);
+            return;
+        }
+
+        memcpy(upload.buffer + upload.received, data, data_length);
+    }
+
+    upload.crc = lfs_crc(upload.crc, data, data_length);
+    upload.received += data_length;
+    upload.sequence++;
+
+    if (upload.received == upload.length)
+    {
+        finish_upload();
+    }
+
+    else if (upload.sequence % UPLOAD_ACK_INTERVAL == 0)
+    {
+        send_reply(UPLOAD_STATUS_ACK);
+    }
+}
+
+static void lua_upload_handler(lua_State *L, const lua_event_t *event)
+{
+    if (event->length == 0)
+    {
+        return;
+    }
+
+    switch (event->payload[0])
+    {
+    case UPLOAD_PACKET_START:
+        start_upload(event->payload, event->length);
+        break;
+
+    case UPLOAD_PACKET_DATA:
+        receive_data(event->payload, event->length);
+        break;
+
+    default:
+        send_reply(UPLOAD_STATUS_BAD_PACKET);
+        break;
+    }
+}
+
+void lua_upload_interrupt(uint8_t *data, size_t length)
+{
+    lua_event_push(LUA_EVENT_UPLOAD, data, length);
+}
+
+bool lua_upload_run_pending_script(lua_State *L)
+{
+    if (pending_script == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *script = pending_script;
+    pending_script = NULL;
+
+    // The source isn't needed once compiled, so free it before running
+    int status = luaL_loadbuffer(L,
+                                 (const char *)script,
+                                 pending_script_length,
+                                 "=upload");
+    memory_free(script);
+
+    if (status == LUA_OK)
+    {
+        status = lua_pcall(L, 0, 0, 0);
+    }
+
+    if (status != LUA_OK)
+    {
+        const char *lua_error = lua_tostring(L, -1);
+        lua_writestring(lua_error, strlen(lua_error));
+        lua_pop(L, 1);
+    }
+
+    lua_flush_output();
+    return true;
+}
+
+void lua_open_upload_channel(void)
+{
+    upload.active = false;
+    upload.buffer = NULL;
+    upload.buffer_size = 0;
+
+    lua_event_set_handler(LUA_EVENT_UPLOAD, lua_upload_handler);
+}
+
+void lua_close_upload_channel(void)
+{
+    // Must happen before the file system is unmounted
+    abort_upload();
+
+    memory_free(pending_script);
+    pending_script = NULL;
+}
@@ -29,6 +29,7 @@
 #include "lauxlib.h"
 #include "lua.h"
 #include "lualib.h"
+#include "memory.h"
 #include "nrf_soc.h"
 #include "nrfx_log.h"
 
@@ -48,30 +49,112 @@ void lua_write_to_repl(uint8_t *buffer, uint8_t length)
     repl_buffer[length] = 0;
 }
 
-static void lua_break_signal_handler(lua_State *L, lua_Debug *ar)
+// Before the MTU is exchanged, only the default 23 byte ATT MTU can be used
+#define LUA_OUTPUT_DEFAULT_LENGTH 20
+
+static char output_buffer[BLE_PREFERRED_MAX_MTU];
+static size_t output_length = 0;
+
+static size_t output_packet_length(void)
+{
+    if (ble_negotiated_mtu == 0)
+    {
+        return LUA_OUTPUT_DEFAULT_LENGTH;
+    }
+
+    return ble_negotiated_mtu < sizeof(output_buffer) ? ble_negotiated_mtu
+                                                      : sizeof(output_buffer);
+}
+
+void lua_flush_output(void)
+{
+    size_t packet_length = output_packet_length();
+
+    for (size_t offset = 0; offset < output_length; offset += packet_length)
+    {
+        size_t length = output_length - offset < packet_length
+                            ? output_length - offset
+                            : packet_length;
+
+        // Waits while the notification queue is full, but the rest of the
+        // output is dropped if it can't be sent at all
+        if (bluetooth_send_data_waiting((uint8_t *)output_buffer + offset,
+                                        length))
+        {
+            break;
+        }
+    }
+
+    output_length = 0;
+}
+
+void lua_write_output(const char *string, size_t length)
+{
+    while (length > 0)
+    {
+        size_t packet_length = output_packet_length();
+
+        // The MTU may have shrunk after reconnecting
+        if (output_length >= packet_length)
+        {
+            lua_flush_output();
+            continue;
+        }
+
+        size_t space = packet_length - output_length;
+        size_t chunk = length < space ? length : space;
+        memcpy(output_buffer + output_length, string, chunk);
+        output_length += chunk;
+        string += chunk;
+        length -= chunk;
+
+        if (output_length == packet_length)
+        {
+            lua_flush_output();
+        }
+    }
+}
+
+static void lua_break_signal_handler(lua_State *L, const lua_event_t *event)
 {
-    lua_sethook(L, NULL, 0, 0);
     luaL_error(L, "break signal");
 }
 
 void lua_break_signal_interrupt(void)
 {
-    lua_sethook(L_global,
-                lua_break_signal_handler,
-                LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT,
-                1);
+    lua_event_push(LUA_EVENT_BREAK, NULL, 0);
+}
+
+static int lua_panic_handler(lua_State *L)
+{
+    const char *message = lua_tostring(L, -1);
+    LOG("Lua panic: %s", message ? message : "unknown error");
+    error_with_message("Lua panic");
+    return 0;
 }
 
 void run_lua(bool factory_reset)
 {
-    lua_State *L = luaL_newstate();
+    lua_State *L = lua_newstate(memory_lua_allocator, NULL);
     L_global = L; // Only used for interrupts
 
     if (L == NULL)
     {
+        memory_stats_t stats;
+        memory_get_stats(MEMORY_POOL_LUA, &stats);
+        LOG("Lua heap free: %u bytes, largest block: %u bytes",
+            stats.free_size,
+            stats.largest_free_block);
+
         error_with_message("Cannot create lua state: not enough memory");
     }
 
+    lua_atpanic(L, lua_panic_handler);
+
+    lua_open_event_queue();
+    lua_event_set_handler(LUA_EVENT_BREAK, lua_break_signal_handler);
+    lua_open_upload_channel();
+
     // Open the standard libraries
     luaL_requiref(L, LUA_GNAME, luaopen_base, 1);
     luaL_requiref(L, LUA_COLIBNAME, luaopen_coroutine, 1);
@@ -88,12 +171,16 @@ void run_lua(bool factory_reset)
 
     lua_open_version_library(L);
     lua_open_system_library(L);
+    lua_open_buffer_library(L);
     lua_open_bluetooth_library(L);
     lua_open_display_library(L);
     lua_open_camera_library(L);
     lua_open_microphone_library(L);
     lua_open_imu_library(L);
     lua_open_time_library(L);
+    lua_open_scheduler_library(L);
+    lua_open_profiler_library(L);
+    lua_open_compression_library(L);
 
     lua_open_file_library(L, factory_reset);
 
@@ -115,6 +202,7 @@ void run_lua(bool factory_reset)
                    "[string \"require('main')\"]:1: cannot open file: main.lua"))
         {
             lua_writestring(lua_error, strlen(lua_error));
+            lua_flush_output();
         }
 
         lua_pop(L, -1);
@@ -156,9 +244,20 @@ void run_lua(bool factory_reset)
                 lua_writestring(lua_error, strlen(lua_error));
                 lua_pop(L, -1);
             }
+
+            // Anything printed without a newline is sent on returning
+            lua_flush_output();
         }
         else
         {
+            lua_event_dispatch(L);
+
+            // Scripts uploaded over many packets run the same as REPL strings
+            if (lua_upload_run_pending_script(L))
+            {
+                continue;
+            }
+
             int status = luaL_dostring(L, "frame.sleep(0.01)");
             if (status != LUA_OK)
             {
@@ -167,7 +266,14 @@ void run_lua(bool factory_reset)
         }
     }
 
-    lua_close_file_library();
+    lua_close_upload_channel();
+
+    // Interrupts must not hook the state once it starts being freed
+    L_global = NULL;
 
+    // Files still open are closed by their finalizers, which must happen
+    // while the file system is mounted
     lua_close(L);
+
+    lua_close_file_library();
 }
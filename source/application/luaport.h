@@ -30,12 +30,21 @@
 #include "bluetooth.h"
 #include "nrfx_log.h"
 
-#define lua_writestring(s, l) bluetooth_send_data((uint8_t *)s, l)
-#define lua_writeline()
+#define lua_writestring(s, l) lua_write_output((const char *)(s), l)
+#define lua_writeline() lua_flush_output()
 #define lua_writestringerror(s, p) printf(s, p)
 
 void lua_write_to_repl(uint8_t *buffer, uint8_t length);
 
+/**
+ * @brief The pieces of each print are collected into packets of up to the
+ *        negotiated MTU. They're sent when the packet is full, and at the end
+ *        of each print, so that each print still arrives as one notification.
+ */
+void lua_write_output(const char *string, size_t length);
+
+void lua_flush_output(void);
+
 void lua_break_signal_interrupt(void);
 
 void run_lua(bool factory_reset);
\ No newline at end of file
@@ -32,7 +32,9 @@
 #include "error_logging.h"
 #include "fpga_application.h"
 #include "i2c.h"
+#include "io_stats.h"
 #include "luaport.h"
+#include "memory.h"
 #include "nrf_clock.h"
 #include "nrf_gpio.h"
 #include "nrf_sdm.h"
@@ -44,8 +46,15 @@
 #include "pinout.h"
 #include "spi.h"
 
+// The bitstream is decompressed with whichever codec compression.c is built for
+#if (defined(COMPRESSION_CODEC_LZ4) && !defined(FPGA_APPLICATION_CODEC_LZ4)) || \
+    (defined(COMPRESSION_CODEC_LZSS) && !defined(FPGA_APPLICATION_CODEC_LZSS))
+#error "fpga_application.h was packaged with a different COMPRESSION_CODEC"
+#endif
+
 bool not_real_hardware = false;
 bool stay_awake = false;
+uint8_t fpga_features = 0;
 
 static void set_power_rails(bool enable)
 {
@@ -100,6 +109,14 @@ void shutdown(bool enable_imu_wakeup)
         check_error(i2c_write(ACCELEROMETER, 0x07, 0xFF, 0x00).fail);
     }
 
+    // Queued FPGA transfers are let out before it's reset. The case detect
+    // interrupt shares a priority with the SPI interrupt, so from there the
+    // queue can't drain and is simply abandoned
+    if (__get_IPSR() == 0)
+    {
+        spi_fence(FPGA);
+    }
+
     nrf_gpio_pin_clear(FPGA_PROGRAM_PIN);
     nrfx_systick_delay_ms(100);
 
@@ -160,7 +177,21 @@ static void fpga_send_bitstream_bytes(void *context,
                                       void *data,
                                       size_t data_size)
 {
-    spi_write_raw(FPGA, data, data_size);
+    // The previous block must be out before its buffer gets reused
+    spi_fence(FPGA);
+
+    if (data_size == 0)
+    {
+        return;
+    }
+
+    spi_write_raw_nonblocking(FPGA, data, data_size);
+    *(size_t *)context += data_size;
+}
+
+static uint32_t cycles_to_ms(uint32_t start, uint32_t end)
+{
+    return (end - start) / (SystemCoreClock / 1000);
 }
 
 static void hardware_setup(bool *factory_reset)
@@ -170,6 +201,13 @@ static void hardware_setup(bool *factory_reset)
         nrfx_systick_init();
     }
 
+    // The cycle counter times IO stats and the phases of FPGA configuration,
+    // so it's started before any of them
+    {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
     // Configure the I2C and SPI drivers
     {
         i2c_configure();
@@ -293,6 +331,8 @@ static void hardware_setup(bool *factory_reset)
 
     // Load and start the FPGA image
     {
+        uint32_t power_up_start = DWT->CYCCNT;
+
         nrf_gpio_cfg_output(FPGA_PROGRAM_PIN);
         nrf_gpio_pin_clear(FPGA_PROGRAM_PIN);
 
@@ -308,21 +348,35 @@ static void hardware_setup(bool *factory_reset)
         spi_write(FPGA, 0xC6, enable_programming, sizeof(enable_programming));
         nrfx_systick_delay_ms(1);
 
+        uint32_t erase_start = DWT->CYCCNT;
+
         uint8_t erase_device[3] = {0x00, 0x00, 0x00};
         spi_write(FPGA, 0x0E, erase_device, sizeof(erase_device));
         nrfx_systick_delay_ms(200);
 
+        uint32_t bitstream_start = DWT->CYCCNT;
+
         uint8_t initialise_address[3] = {0x00, 0x00, 0x00};
         spi_write(FPGA, 0x46, initialise_address, sizeof(initialise_address));
 
         uint8_t bitstream_burst[4] = {0x7A, 0x00, 0x00, 0x00};
         spi_write_raw(FPGA, bitstream_burst, sizeof(bitstream_burst));
 
+        size_t bitstream_bytes_sent = 0;
+
+        // Recorded as one load, as decoding overlaps the SPI writes
+        io_stats_time_t decompress_start = IO_STATS_NOW();
+
         int status = compression_decompress(4096,
                                             fpga_application,
                                             sizeof(fpga_application),
                                             fpga_send_bitstream_bytes,
-                                            NULL);
+                                            &bitstream_bytes_sent);
+
+        IO_STATS_RECORD(IO_STATS_LZ4_LOAD,
+                        decompress_start,
+                        bitstream_bytes_sent,
+                        status != 0);
 
         if (status)
         {
@@ -331,6 +385,9 @@ static void hardware_setup(bool *factory_reset)
         }
 
         nrf_gpio_pin_set(FPGA_SPI_SELECT_PIN);
+
+        uint32_t startup_start = DWT->CYCCNT;
+
         nrfx_systick_delay_ms(10);
 
         uint8_t exit_programming[3] = {0x00, 0x00, 0x00};
@@ -346,7 +403,21 @@ static void hardware_setup(bool *factory_reset)
             {
                 error_with_message("FPGA not found");
             }
+
+            uint8_t fpga_feature_register[1] = {0x00};
+            spi_read(FPGA, 0xDA, fpga_feature_register, 1);
+            fpga_features = fpga_feature_register[0];
         }
+
+        uint32_t configuration_end = DWT->CYCCNT;
+
+        LOG("FPGA power up: %lu ms, erase: %lu ms, "
+            "bitstream: %lu ms (%u bytes), startup: %lu ms",
+            cycles_to_ms(power_up_start, erase_start),
+            cycles_to_ms(erase_start, bitstream_start),
+            cycles_to_ms(bitstream_start, startup_start),
+            bitstream_bytes_sent,
+            cycles_to_ms(startup_start, configuration_end));
     }
 
     // Initialize the SPI and configure the display
@@ -393,8 +464,13 @@ static void hardware_setup(bool *factory_reset)
 
 int main(void)
 {
+    memory_paint_stack();
+
     LOG("Frame firmware " BUILD_VERSION " (" GIT_COMMIT ")");
 
+    // The pools back the bitstream and display buffers during hardware setup
+    memory_configure();
+
     bool factory_reset = false;
 
     hardware_setup(&factory_reset);
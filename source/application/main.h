@@ -25,8 +25,16 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+// Read from the FPGA at boot. Older bitstreams report none of these
+#define FPGA_FEATURE_FAST_SPI 0x01
+#define FPGA_FEATURE_RLE_SPRITES 0x02
+#define FPGA_FEATURE_SPRITE_STORE 0x04
+#define FPGA_FEATURE_CAPTURE_COMPLETE 0x08
 
 extern bool not_real_hardware;
 extern bool stay_awake;
+extern uint8_t fpga_features;
 
 void shutdown(bool enable_imu_wakeup);
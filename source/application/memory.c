@@ -0,0 +1,623 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error_logging.h"
+#include "memory.h"
+#include "nrf.h"
+
+#define MEMORY_TRANSIENT_POOL_SIZE (16 * 1024)
+#define MEMORY_MALLOC_RESERVE (8 * 1024)
+
+/*
+ * Two level segregated fit. Free blocks are kept in lists indexed by a first
+ * level (power of two) and a second level (16 linear steps within that power
+ * of two). Two bitmaps make finding a large enough list a couple of bit scans.
+ * Blocks below 128 bytes all sit in the first level 0 lists, 8 bytes apart.
+ */
+#define ALIGN_SIZE_LOG2 3
+#define ALIGN_SIZE (1 << ALIGN_SIZE_LOG2)
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_MAX 18
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+/*
+ * Every block starts with a pointer to its physical neighbour below and its
+ * size. The lowest bit of the size marks the block as free. Free blocks also
+ * keep their free list links in what would otherwise be the payload.
+ */
+typedef struct block_t
+{
+    struct block_t *previous_physical;
+    size_t size;
+    struct block_t *next_free;
+    struct block_t *previous_free;
+} block_t;
+
+#define BLOCK_HEADER_SIZE (offsetof(block_t, next_free))
+#define BLOCK_SIZE_MIN (sizeof(block_t) - BLOCK_HEADER_SIZE)
+#define BLOCK_SIZE_MAX (((size_t)1 << FL_INDEX_MAX) - 1)
+#define BLOCK_FREE_BIT 0x01
+
+typedef struct pool_t
+{
+    uint8_t *start;
+    uint8_t *end;
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_INDEX_COUNT];
+    block_t *free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    memory_stats_t stats;
+} pool_t;
+
+static pool_t pools[MEMORY_POOL_COUNT];
+
+static struct
+{
+    bool active;
+    size_t base_used_size;
+    memory_trace_t counters;
+} trace;
+
+#define STACK_PAINT_VALUE 0xA5A5A5A5
+
+static int fls(size_t value)
+{
+    return (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(value);
+}
+
+static size_t block_size(const block_t *block)
+{
+    return block->size & ~(size_t)BLOCK_FREE_BIT;
+}
+
+static bool block_is_free(const block_t *block)
+{
+    return block->size & BLOCK_FREE_BIT;
+}
+
+static void *block_payload(block_t *block)
+{
+    return (uint8_t *)block + BLOCK_HEADER_SIZE;
+}
+
+static block_t *block_from_payload(void *pointer)
+{
+    return (block_t *)((uint8_t *)pointer - BLOCK_HEADER_SIZE);
+}
+
+static block_t *block_next(block_t *block)
+{
+    return (block_t *)((uint8_t *)block_payload(block) + block_size(block));
+}
+
+static size_t adjust_size(size_t size)
+{
+    size_t adjusted = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    return adjusted < BLOCK_SIZE_MIN ? BLOCK_SIZE_MIN : adjusted;
+}
+
+static void mapping_insert(size_t size, int *fl, int *sl)
+{
+    if (size < SMALL_BLOCK_SIZE)
+    {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+        return;
+    }
+
+    int bit = fls(size);
+    *sl = (size >> (bit - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = bit - (FL_INDEX_SHIFT - 1);
+}
+
+// Rounds up to the next list so that any block found there is large enough
+static void mapping_search(size_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE)
+    {
+        size += (1 << (fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+
+    mapping_insert(size, fl, sl);
+}
+
+static void insert_free_block(pool_t *pool, block_t *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    block_t *head = pool->free_lists[fl][sl];
+    block->next_free = head;
+    block->previous_free = NULL;
+
+    if (head)
+    {
+        head->previous_free = block;
+    }
+
+    pool->free_lists[fl][sl] = block;
+    pool->fl_bitmap |= 1U << fl;
+    pool->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void remove_free_block(pool_t *pool, block_t *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    if (block->previous_free)
+    {
+        block->previous_free->next_free = block->next_free;
+    }
+    else
+    {
+        pool->free_lists[fl][sl] = block->next_free;
+    }
+
+    if (block->next_free)
+    {
+        block->next_free->previous_free = block->previous_free;
+    }
+
+    if (pool->free_lists[fl][sl] == NULL)
+    {
+        pool->sl_bitmap[fl] &= ~(1U << sl);
+
+        if (pool->sl_bitmap[fl] == 0)
+        {
+            pool->fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+static block_t *find_free_block(pool_t *pool, size_t size)
+{
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+
+    if (fl >= FL_INDEX_COUNT)
+    {
+        return NULL;
+    }
+
+    uint32_t sl_map = pool->sl_bitmap[fl] & (~0U << sl);
+
+    if (sl_map == 0)
+    {
+        uint32_t fl_map = pool->fl_bitmap & (~0U << (fl + 1));
+
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = pool->sl_bitmap[fl];
+    }
+
+    sl = __builtin_ctz(sl_map);
+    return pool->free_lists[fl][sl];
+}
+
+// Absorbs the following block if it's free. The block must not be in a list
+static void merge_next(pool_t *pool, block_t *block)
+{
+    block_t *next = block_next(block);
+
+    if (!block_is_free(next))
+    {
+        return;
+    }
+
+    remove_free_block(pool, next);
+    block->size += BLOCK_HEADER_SIZE + block_size(next);
+    block_next(block)->previous_physical = block;
+}
+
+// Trims a used block down to size and returns the rest to the free lists
+static void trim_block(pool_t *pool, block_t *block, size_t size)
+{
+    size_t remaining = block_size(block) - size;
+
+    if (remaining < BLOCK_HEADER_SIZE + BLOCK_SIZE_MIN)
+    {
+        return;
+    }
+
+    block_t *rest = (block_t *)((uint8_t *)block_payload(block) + size);
+    rest->previous_physical = block;
+    rest->size = (remaining - BLOCK_HEADER_SIZE) | BLOCK_FREE_BIT;
+    block_next(rest)->previous_physical = rest;
+    block->size = size;
+
+    merge_next(pool, rest);
+    insert_free_block(pool, rest);
+}
+
+static void update_used(pool_t *pool, size_t before, size_t after)
+{
+    pool->stats.used_size += after;
+    pool->stats.used_size -= before;
+
+    if (pool->stats.used_size > pool->stats.high_water_mark)
+    {
+        pool->stats.high_water_mark = pool->stats.used_size;
+    }
+}
+
+static void pool_initialise(pool_t *pool, void *memory, size_t size)
+{
+    memset(pool, 0, sizeof(pool_t));
+
+    uintptr_t start = ((uintptr_t)memory + ALIGN_SIZE - 1) &
+                      ~(uintptr_t)(ALIGN_SIZE - 1);
+    size -= start - (uintptr_t)memory;
+    size &= ~(size_t)(ALIGN_SIZE - 1);
+
+    // One free block covering everything, followed by an empty used block
+    // which stops merging at the top of the pool
+    size_t block_bytes = size - 2 * BLOCK_HEADER_SIZE;
+    if (block_bytes > BLOCK_SIZE_MAX)
+    {
+        block_bytes = BLOCK_SIZE_MAX & ~(size_t)(ALIGN_SIZE - 1);
+    }
+
+    block_t *block = (block_t *)start;
+    block->previous_physical = NULL;
+    block->size = block_bytes | BLOCK_FREE_BIT;
+
+    block_t *sentinel = block_next(block);
+    sentinel->previous_physical = block;
+    sentinel->size = 0;
+
+    insert_free_block(pool, block);
+
+    pool->start = (uint8_t *)start;
+    pool->end = (uint8_t *)sentinel;
+    pool->stats.total_size = block_bytes + BLOCK_HEADER_SIZE;
+}
+
+static void *pool_allocate(pool_t *pool, size_t size)
+{
+    if (size == 0 || size > BLOCK_SIZE_MAX)
+    {
+        return NULL;
+    }
+
+    size_t adjusted = adjust_size(size);
+    block_t *block = find_free_block(pool, adjusted);
+
+    if (block == NULL)
+    {
+        pool->stats.failures++;
+        return NULL;
+    }
+
+    remove_free_block(pool, block);
+    block->size &= ~(size_t)BLOCK_FREE_BIT;
+    trim_block(pool, block, adjusted);
+
+    update_used(pool, 0, block_size(block) + BLOCK_HEADER_SIZE);
+    pool->stats.allocations++;
+
+    return block_payload(block);
+}
+
+static void pool_free(pool_t *pool, void *pointer)
+{
+    block_t *block = block_from_payload(pointer);
+
+    update_used(pool, block_size(block) + BLOCK_HEADER_SIZE, 0);
+    pool->stats.frees++;
+
+    block->size |= BLOCK_FREE_BIT;
+
+    block_t *previous = block->previous_physical;
+
+    if (previous && block_is_free(previous))
+    {
+        remove_free_block(pool, previous);
+        previous->size += BLOCK_HEADER_SIZE + block_size(block);
+        block_next(previous)->previous_physical = previous;
+        block = previous;
+    }
+
+    merge_next(pool, block);
+    insert_free_block(pool, block);
+}
+
+// Resizes in place if possible. Shrinking never fails
+static bool pool_resize(pool_t *pool, void *pointer, size_t size)
+{
+    block_t *block = block_from_payload(pointer);
+    size_t before = block_size(block);
+    size_t adjusted = adjust_size(size);
+
+    if (adjusted > before)
+    {
+        block_t *next = block_next(block);
+
+        if (!block_is_free(next) ||
+            before + BLOCK_HEADER_SIZE + block_size(next) < adjusted)
+        {
+            return false;
+        }
+
+        remove_free_block(pool, next);
+        block->size += BLOCK_HEADER_SIZE + block_size(next);
+        block_next(block)->previous_physical = block;
+    }
+
+    trim_block(pool, block, adjusted);
+    update_used(pool, before, block_size(block));
+
+    return true;
+}
+
+static pool_t *pool_from_pointer(void *pointer)
+{
+    for (size_t i = 0; i < MEMORY_POOL_COUNT; i++)
+    {
+        if ((uint8_t *)pointer >= pools[i].start &&
+            (uint8_t *)pointer < pools[i].end)
+        {
+            return &pools[i];
+        }
+    }
+
+    error_with_message("Pointer isn't from a memory pool");
+    return NULL;
+}
+
+extern uint32_t __heap_start;
+extern uint32_t __heap_end;
+extern uint32_t __stack_bottom;
+extern uint32_t __stack_top;
+
+void memory_paint_stack(void)
+{
+    // Leave some room below the current frame for the loop itself
+    uint32_t *limit = (uint32_t *)(__get_MSP() - 64);
+
+    for (volatile uint32_t *word = &__stack_bottom; word < limit; word++)
+    {
+        *word = STACK_PAINT_VALUE;
+    }
+}
+
+size_t memory_stack_size(void)
+{
+    return (uintptr_t)&__stack_top - (uintptr_t)&__stack_bottom;
+}
+
+size_t memory_stack_high_water_mark(void)
+{
+    uint32_t *word = &__stack_bottom;
+
+    while (word < &__stack_top && *word == STACK_PAINT_VALUE)
+    {
+        word++;
+    }
+
+    return (uintptr_t)&__stack_top - (uintptr_t)word;
+}
+
+void memory_configure(void)
+{
+    size_t heap_size = (uintptr_t)&__heap_end - (uintptr_t)&__heap_start;
+
+    if (heap_size < MEMORY_TRANSIENT_POOL_SIZE + MEMORY_MALLOC_RESERVE)
+    {
+        error_with_message("Heap too small for memory pools");
+    }
+
+    size_t lua_pool_size = heap_size -
+                           MEMORY_TRANSIENT_POOL_SIZE -
+                           MEMORY_MALLOC_RESERVE;
+
+    void *transient_memory = malloc(MEMORY_TRANSIENT_POOL_SIZE);
+    void *lua_memory = malloc(lua_pool_size);
+
+    if (transient_memory == NULL || lua_memory == NULL)
+    {
+        error_with_message("Cannot allocate memory pools");
+    }
+
+    pool_initialise(&pools[MEMORY_POOL_TRANSIENT],
+                    transient_memory,
+                    MEMORY_TRANSIENT_POOL_SIZE);
+
+    pool_initialise(&pools[MEMORY_POOL_LUA], lua_memory, lua_pool_size);
+}
+
+static void trace_update(void)
+{
+    size_t used = pools[MEMORY_POOL_LUA].stats.used_size;
+
+    if (used > trace.base_used_size &&
+        used - trace.base_used_size > trace.counters.peak_used_size)
+    {
+        trace.counters.peak_used_size = used - trace.base_used_size;
+    }
+}
+
+void memory_trace_start(void)
+{
+    memset(&trace.counters, 0, sizeof(trace.counters));
+    trace.base_used_size = pools[MEMORY_POOL_LUA].stats.used_size;
+    trace.active = true;
+}
+
+void memory_trace_stop(memory_trace_t *counters)
+{
+    trace.active = false;
+    *counters = trace.counters;
+}
+
+void *memory_allocate(memory_pool_id_t pool, size_t size)
+{
+    void *pointer = pool_allocate(&pools[pool], size);
+
+    if (pointer == NULL && pool == MEMORY_POOL_TRANSIENT)
+    {
+        pointer = pool_allocate(&pools[MEMORY_POOL_LUA], size);
+    }
+
+    return pointer;
+}
+
+void *memory_reallocate(memory_pool_id_t pool, void *pointer, size_t size)
+{
+    if (pointer == NULL)
+    {
+        return memory_allocate(pool, size);
+    }
+
+    if (size == 0)
+    {
+        memory_free(pointer);
+        return NULL;
+    }
+
+    pool_t *owner = pool_from_pointer(pointer);
+
+    if (pool_resize(owner, pointer, size))
+    {
+        return pointer;
+    }
+
+    void *new_pointer = memory_allocate(pool, size);
+
+    if (new_pointer == NULL)
+    {
+        return NULL;
+    }
+
+    size_t old_size = block_size(block_from_payload(pointer));
+    memcpy(new_pointer, pointer, old_size < size ? old_size : size);
+    pool_free(owner, pointer);
+
+    return new_pointer;
+}
+
+void memory_free(void *pointer)
+{
+    if (pointer == NULL)
+    {
+        return;
+    }
+
+    pool_free(pool_from_pointer(pointer), pointer);
+}
+
+void memory_get_stats(memory_pool_id_t pool, memory_stats_t *stats)
+{
+    pool_t *p = &pools[pool];
+
+    *stats = p->stats;
+    stats->free_size = p->stats.total_size - p->stats.used_size;
+    stats->largest_free_block = 0;
+
+    if (p->fl_bitmap == 0)
+    {
+        return;
+    }
+
+    // The largest block is somewhere in the highest non-empty list
+    int fl = fls(p->fl_bitmap);
+    int sl = fls(p->sl_bitmap[fl]);
+
+    for (block_t *block = p->free_lists[fl][sl];
+         block != NULL;
+         block = block->next_free)
+    {
+        if (block_size(block) > stats->largest_free_block)
+        {
+            stats->largest_free_block = block_size(block);
+        }
+    }
+}
+
+uint32_t memory_fragmentation(const memory_stats_t *stats)
+{
+    if (stats->free_size == 0)
+    {
+        return 0;
+    }
+
+    // Sizes are counted with their headers, so count it here too
+    size_t largest = stats->largest_free_block + BLOCK_HEADER_SIZE;
+
+    return 100 - (uint32_t)((uint64_t)largest * 100 / stats->free_size);
+}
+
+void *memory_lua_allocator(void *user_data,
+                           void *pointer,
+                           size_t old_size,
+                           size_t new_size)
+{
+    (void)user_data;
+
+    if (new_size == 0)
+    {
+        memory_free(pointer);
+
+        if (trace.active && pointer)
+        {
+            trace.counters.frees++;
+        }
+
+        return NULL;
+    }
+
+    void *new_pointer = memory_reallocate(MEMORY_POOL_LUA,
+                                          pointer,
+                                          new_size);
+
+    if (trace.active && new_pointer)
+    {
+        // Lua passes the object type as old_size for new objects
+        size_t previous = pointer ? old_size : 0;
+
+        if (pointer == NULL)
+        {
+            trace.counters.allocations++;
+        }
+
+        if (new_size > previous)
+        {
+            trace.counters.bytes_allocated += new_size - previous;
+        }
+
+        trace_update();
+    }
+
+    return new_pointer;
+}
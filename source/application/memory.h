@@ -0,0 +1,112 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The heap is split into two TLSF pools with constant time allocation
+ *        and immediate coalescing. Lua gets one to itself, while short lived
+ *        firmware buffers (SPI payloads, camera and microphone reads, script
+ *        loading) come from the transient pool so they can't fragment the Lua
+ *        heap. What's left over stays with malloc() for littlefs and libc.
+ */
+typedef enum memory_pool_id_t
+{
+    MEMORY_POOL_LUA,
+    MEMORY_POOL_TRANSIENT,
+    MEMORY_POOL_COUNT,
+} memory_pool_id_t;
+
+typedef struct memory_stats_t
+{
+    size_t total_size;
+    size_t used_size;
+    size_t free_size;
+    size_t largest_free_block;
+    size_t high_water_mark;
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t failures;
+} memory_stats_t;
+
+typedef struct memory_trace_t
+{
+    uint32_t allocations;
+    uint32_t frees;
+    size_t bytes_allocated;
+    size_t peak_used_size;
+} memory_trace_t;
+
+/**
+ * @brief Fills the unused part of the stack with a known pattern so that
+ *        memory_stack_high_water_mark() can later see how deep it went. Must
+ *        be called as early as possible in main().
+ */
+void memory_paint_stack(void);
+
+size_t memory_stack_size(void);
+
+size_t memory_stack_high_water_mark(void);
+
+void memory_configure(void);
+
+/**
+ * @brief Transient allocations fall back to the Lua pool if the transient pool
+ *        can't fit the request. Returns NULL if neither can.
+ */
+void *memory_allocate(memory_pool_id_t pool, size_t size);
+
+void *memory_reallocate(memory_pool_id_t pool, void *pointer, size_t size);
+
+/**
+ * @brief Frees memory from either pool. The pool is found from the address.
+ */
+void memory_free(void *pointer);
+
+void memory_get_stats(memory_pool_id_t pool, memory_stats_t *stats);
+
+/**
+ * @brief Fragmentation as a percentage. 0 means all free memory is one block.
+ */
+uint32_t memory_fragmentation(const memory_stats_t *stats);
+
+/**
+ * @brief Counts Lua pool activity between start and stop. peak_used_size is
+ *        relative to the usage when the trace started. Traces don't nest.
+ */
+void memory_trace_start(void);
+
+void memory_trace_stop(memory_trace_t *trace);
+
+/**
+ * @brief lua_Alloc compatible allocator for lua_newstate(). The user data
+ *        pointer is ignored.
+ */
+void *memory_lua_allocator(void *user_data,
+                           void *pointer,
+                           size_t old_size,
+                           size_t new_size);
@@ -34,12 +34,14 @@
 
 #define NRFX_RTC_ENABLED 1
 #define NRFX_RTC1_ENABLED 1
+#define NRFX_RTC2_ENABLED 1
 
 #define NRFX_SAADC_ENABLED 1
 
 #define NRFX_SPIM_ENABLED 1
 #define NRFX_SPIM1_ENABLED 1
-#define NRFX_SPIM2_ENABLED 1
+#define NRFX_SPIM3_ENABLED 1
+#define NRFX_SPIM3_NRF52840_ANOMALY_198_WORKAROUND_ENABLED 1
 
 #define NRFX_SYSTICK_ENABLED 1
 
@@ -25,13 +25,337 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "error_logging.h"
+#include "io_stats.h"
+#include "main.h"
+#include "memory.h"
 #include "nrfx_spim.h"
 #include "pinout.h"
 #include "spi.h"
 
 static const nrfx_spim_t display_spi = NRFX_SPIM_INSTANCE(1);
-static const nrfx_spim_t fpga_spi = NRFX_SPIM_INSTANCE(2);
+static const nrfx_spim_t fpga_spi = NRFX_SPIM_INSTANCE(3);
+
+// The FPGA receives on the SPI clock itself so writes can run at full speed.
+// Older bitstreams take around 10 FPGA clock cycles to turn each read response
+// around, whereas ones with FPGA_FEATURE_FAST_SPI prefetch the next response.
+// The bitstream goes to the configuration port rather than the application
+#define FPGA_SPI_BITSTREAM_FREQUENCY NRF_SPIM_FREQ_32M
+#define FPGA_SPI_WRITE_FREQUENCY NRF_SPIM_FREQ_8M
+#define FPGA_SPI_READ_FREQUENCY NRF_SPIM_FREQ_4M
+#define FPGA_SPI_FAST_WRITE_FREQUENCY NRF_SPIM_FREQ_32M
+#define FPGA_SPI_FAST_READ_FREQUENCY NRF_SPIM_FREQ_16M
+
+// EasyDMA on the nRF52840 can only move 16 bits worth of bytes at a time
+#define SPI_MAX_DMA_LENGTH 0xFFFF
+
+#define SPI_QUEUE_LENGTH 16
+#define SPI_HEADER_MAX_LENGTH 8
+#define SPI_BOUNCE_BUFFER_SIZE 256
+
+typedef enum spi_transfer_flags_t
+{
+    SPI_TRANSFER_RAW = 0x01,
+    SPI_TRANSFER_READ = 0x02,
+    SPI_TRANSFER_FREE_WHEN_DONE = 0x04,
+} spi_transfer_flags_t;
+
+typedef enum spi_transfer_stage_t
+{
+    SPI_STAGE_ADDRESS,
+    SPI_STAGE_HEADER,
+    SPI_STAGE_DATA,
+    SPI_STAGE_DONE,
+} spi_transfer_stage_t;
+
+typedef struct spi_transfer_t
+{
+    uint8_t address;
+    uint8_t flags;
+    uint8_t header[SPI_HEADER_MAX_LENGTH];
+    uint8_t header_length;
+    spi_transfer_stage_t stage;
+    uint8_t *data;
+    size_t length;
+    size_t offset;
+    io_stats_time_t start_time;
+} spi_transfer_t;
+
+/*
+ * FPGA transfers are queued and then stepped through from the SPIM event
+ * handler. The thread side owns queue_tail and queue_reclaim, the interrupt
+ * owns queue_head. Entries between queue_reclaim and queue_head are finished
+ * but may still own a buffer that has to be freed outside of the interrupt.
+ */
+static spi_transfer_t queue[SPI_QUEUE_LENGTH];
+static volatile size_t queue_head = 0;
+static volatile size_t queue_tail = 0;
+static size_t queue_reclaim = 0;
+static volatile bool fpga_spi_running = false;
+
+// Flash can't be read by EasyDMA, so data from there is copied in chunks. Once
+// a chunk is started, the next one is copied into the other buffer while the
+// first is still being sent
+static uint8_t bounce_buffers[2][SPI_BOUNCE_BUFFER_SIZE];
+static uint8_t bounce_buffer_index = 0;
+static const uint8_t *bounce_prepared_source = NULL;
+
+static size_t queue_next(size_t index)
+{
+    return (index + 1) % SPI_QUEUE_LENGTH;
+}
+
+static void fpga_spi_start(nrfx_spim_xfer_desc_t const *descriptor)
+{
+    check_error(nrfx_spim_xfer(&fpga_spi, descriptor, 0));
+}
+
+static nrf_spim_frequency_t fpga_spi_frequency(spi_transfer_t const *transfer)
+{
+    if (transfer->flags & SPI_TRANSFER_RAW)
+    {
+        return FPGA_SPI_BITSTREAM_FREQUENCY;
+    }
+
+    bool read = transfer->flags & SPI_TRANSFER_READ;
+
+    if ((fpga_features & FPGA_FEATURE_FAST_SPI) == 0)
+    {
+        return read ? FPGA_SPI_READ_FREQUENCY : FPGA_SPI_WRITE_FREQUENCY;
+    }
+
+    if (read)
+    {
+        return FPGA_SPI_FAST_READ_FREQUENCY;
+    }
+
+    // Pixel streams are drawn as they arrive, and the sprite engine needs
+    // longer than a 32MHz byte to draw one
+    if (transfer->address == 0x12 || transfer->address == 0x15)
+    {
+        return FPGA_SPI_WRITE_FREQUENCY;
+    }
+
+    return FPGA_SPI_FAST_WRITE_FREQUENCY;
+}
+
+static bool fpga_spi_step(spi_transfer_t *transfer)
+{
+    switch (transfer->stage)
+    {
+    case SPI_STAGE_ADDRESS:
+    {
+        transfer->stage = SPI_STAGE_HEADER;
+
+        nrf_spim_frequency_set(fpga_spi.p_reg, fpga_spi_frequency(transfer));
+
+        nrf_gpio_pin_clear(FPGA_SPI_SELECT_PIN);
+
+        if (transfer->flags & SPI_TRANSFER_RAW)
+        {
+            return fpga_spi_step(transfer);
+        }
+
+        nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(&transfer->address, 1);
+        fpga_spi_start(&tx);
+        return true;
+    }
+
+    case SPI_STAGE_HEADER:
+    {
+        transfer->stage = SPI_STAGE_DATA;
+
+        if (transfer->header_length == 0)
+        {
+            return fpga_spi_step(transfer);
+        }
+
+        nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(transfer->header,
+                                                     transfer->header_length);
+        fpga_spi_start(&tx);
+        return true;
+    }
+
+    case SPI_STAGE_DATA:
+    {
+        size_t remaining = transfer->length - transfer->offset;
+
+        if (remaining == 0)
+        {
+            transfer->stage = SPI_STAGE_DONE;
+            return fpga_spi_step(transfer);
+        }
+
+        uint8_t *pointer = transfer->data + transfer->offset;
+
+        if (transfer->flags & SPI_TRANSFER_READ)
+        {
+            size_t chunk = remaining < SPI_MAX_DMA_LENGTH
+                               ? remaining
+                               : SPI_MAX_DMA_LENGTH;
+            nrfx_spim_xfer_desc_t rx = NRFX_SPIM_XFER_RX(pointer, chunk);
+            transfer->offset += chunk;
+            fpga_spi_start(&rx);
+            return true;
+        }
+
+        if (nrfx_is_in_ram(pointer))
+        {
+            size_t chunk = remaining < SPI_MAX_DMA_LENGTH
+                               ? remaining
+                               : SPI_MAX_DMA_LENGTH;
+            nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(pointer, chunk);
+            transfer->offset += chunk;
+            fpga_spi_start(&tx);
+            return true;
+        }
+
+        size_t chunk = remaining < SPI_BOUNCE_BUFFER_SIZE
+                           ? remaining
+                           : SPI_BOUNCE_BUFFER_SIZE;
+        uint8_t *bounce = bounce_buffers[bounce_buffer_index];
+
+        if (bounce_prepared_source != pointer)
+        {
+            memcpy(bounce, pointer, chunk);
+        }
+
+        nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(bounce, chunk);
+        transfer->offset += chunk;
+        fpga_spi_start(&tx);
+
+        bounce_buffer_index ^= 1;
+        bounce_prepared_source = NULL;
+
+        // Sent next, as nothing else can start before this transfer finishes
+        size_t next_chunk = remaining - chunk < SPI_BOUNCE_BUFFER_SIZE
+                                ? remaining - chunk
+                                : SPI_BOUNCE_BUFFER_SIZE;
+
+        if (next_chunk > 0)
+        {
+            memcpy(bounce_buffers[bounce_buffer_index],
+                   pointer + chunk,
+                   next_chunk);
+            bounce_prepared_source = pointer + chunk;
+        }
+
+        return true;
+    }
+
+    case SPI_STAGE_DONE:
+        // Includes the time spent waiting behind earlier transfers
+        IO_STATS_RECORD(transfer->flags & SPI_TRANSFER_READ
+                            ? IO_STATS_SPI_READ
+                            : IO_STATS_SPI_WRITE,
+                        transfer->start_time,
+                        transfer->header_length + transfer->length,
+                        false);
+
+        // Raw transfers are continued by the next raw transfer, or by the
+        // caller releasing select once everything is fenced
+        if (!(transfer->flags & SPI_TRANSFER_RAW))
+        {
+            nrf_gpio_pin_set(FPGA_SPI_SELECT_PIN);
+        }
+        return false;
+    }
+
+    return false;
+}
+
+// Starts the next piece of work. Called from the event handler, or from the
+// thread with the SPIM interrupt masked when the queue was idle
+static void fpga_spi_advance(void)
+{
+    while (queue_head != queue_tail)
+    {
+        if (fpga_spi_step(&queue[queue_head]))
+        {
+            fpga_spi_running = true;
+            return;
+        }
+
+        queue_head = queue_next(queue_head);
+    }
+
+    fpga_spi_running = false;
+}
+
+static void fpga_spi_event_handler(nrfx_spim_evt_t const *event, void *context)
+{
+    if (event->type == NRFX_SPIM_EVENT_DONE)
+    {
+        fpga_spi_advance();
+    }
+}
+
+static void fpga_spi_reclaim(void)
+{
+    while (queue_reclaim != queue_head)
+    {
+        spi_transfer_t *transfer = &queue[queue_reclaim];
+
+        if (transfer->flags & SPI_TRANSFER_FREE_WHEN_DONE)
+        {
+            memory_free(transfer->data);
+        }
+
+        queue_reclaim = queue_next(queue_reclaim);
+    }
+}
+
+static void fpga_spi_enqueue(uint8_t address,
+                             uint8_t flags,
+                             const uint8_t *header,
+                             size_t header_length,
+                             uint8_t *data,
+                             size_t length)
+{
+    if (header_length > SPI_HEADER_MAX_LENGTH)
+    {
+        error_with_message("SPI header too long");
+    }
+
+    // Wait for a free slot. One is always kept empty to tell full from empty
+    while (true)
+    {
+        fpga_spi_reclaim();
+
+        if (queue_next(queue_tail) != queue_reclaim)
+        {
+            break;
+        }
+
+        __WFE();
+    }
+
+    spi_transfer_t *transfer = &queue[queue_tail];
+    transfer->address = address;
+    transfer->flags = flags;
+    transfer->header_length = header_length;
+    if (header_length > 0)
+    {
+        memcpy(transfer->header, header, header_length);
+    }
+    transfer->stage = SPI_STAGE_ADDRESS;
+    transfer->data = data;
+    transfer->length = data == NULL ? 0 : length;
+    transfer->offset = 0;
+    transfer->start_time = IO_STATS_NOW();
+
+    NVIC_DisableIRQ(SPIM3_IRQn);
+
+    queue_tail = queue_next(queue_tail);
+
+    if (!fpga_spi_running)
+    {
+        fpga_spi_advance();
+    }
+
+    NVIC_EnableIRQ(SPIM3_IRQn);
+}
 
 void spi_configure(void)
 {
@@ -56,7 +380,7 @@ void spi_configure(void)
         FPGA_SPI_CIPO_PIN,
         NRF_SPIM_PIN_NOT_CONNECTED);
 
-    fpga_spi_config.frequency = NRFX_MHZ_TO_HZ(4);
+    fpga_spi_config.frequency = NRFX_MHZ_TO_HZ(8);
 
     check_error(nrfx_spim_init(&display_spi,
                                &display_spi_config,
@@ -65,8 +389,38 @@ void spi_configure(void)
 
     check_error(nrfx_spim_init(&fpga_spi,
                                &fpga_spi_config,
-                               NULL,
+                               fpga_spi_event_handler,
                                NULL));
+
+    // High drive is needed for clean edges at 32MHz
+    nrf_gpio_cfg(FPGA_SPI_CLOCK_PIN,
+                 NRF_GPIO_PIN_DIR_OUTPUT,
+                 NRF_GPIO_PIN_INPUT_CONNECT,
+                 NRF_GPIO_PIN_NOPULL,
+                 NRF_GPIO_PIN_H0H1,
+                 NRF_GPIO_PIN_NOSENSE);
+
+    nrf_gpio_cfg(FPGA_SPI_COPI_PIN,
+                 NRF_GPIO_PIN_DIR_OUTPUT,
+                 NRF_GPIO_PIN_INPUT_DISCONNECT,
+                 NRF_GPIO_PIN_NOPULL,
+                 NRF_GPIO_PIN_H0H1,
+                 NRF_GPIO_PIN_NOSENSE);
+}
+
+void spi_fence(spi_device_t device)
+{
+    if (device != FPGA)
+    {
+        return;
+    }
+
+    while (fpga_spi_running)
+    {
+        __WFE();
+    }
+
+    fpga_spi_reclaim();
 }
 
 void spi_read(spi_device_t device,
@@ -74,94 +428,68 @@ void spi_read(spi_device_t device,
               uint8_t *data,
               size_t length)
 {
-    nrfx_spim_t instance;
-    uint32_t cs_pin = 0xFF;
-
     switch (device)
     {
     case DISPLAY:
-        instance = display_spi;
-        cs_pin = DISPLAY_SPI_SELECT_PIN;
-        break;
-
-    case FPGA:
-        instance = fpga_spi;
-        cs_pin = FPGA_SPI_SELECT_PIN;
-        break;
-
-    default:
-        error_with_message("Invalid SPI device selected");
-        break;
-    }
-
-    nrf_gpio_pin_clear(cs_pin);
+    {
+        io_stats_time_t start_time = IO_STATS_NOW();
 
-    nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(&address, 1);
-    check_error(nrfx_spim_xfer(&instance, &tx, 0));
+        nrf_gpio_pin_clear(DISPLAY_SPI_SELECT_PIN);
 
-    nrfx_spim_xfer_desc_t rx = NRFX_SPIM_XFER_RX(data, length);
-    check_error(nrfx_spim_xfer(&instance, &rx, 0));
+        nrfx_spim_xfer_desc_t tx = NRFX_SPIM_XFER_TX(&address, 1);
+        check_error(nrfx_spim_xfer(&display_spi, &tx, 0));
 
-    nrf_gpio_pin_set(cs_pin);
-}
+        nrfx_spim_xfer_desc_t rx = NRFX_SPIM_XFER_RX(data, length);
+        check_error(nrfx_spim_xfer(&display_spi, &rx, 0));
 
-static void _spi_write(spi_device_t device,
-                       uint8_t address,
-                       uint8_t *data,
-                       size_t length,
-                       bool raw_mode)
-{
-    nrfx_spim_t instance;
-    uint32_t cs_pin = 0xFF;
+        nrf_gpio_pin_set(DISPLAY_SPI_SELECT_PIN);
 
-    switch (device)
-    {
-    case DISPLAY:
-        instance = display_spi;
-        cs_pin = DISPLAY_SPI_SELECT_PIN;
+        IO_STATS_RECORD(IO_STATS_SPI_READ, start_time, length, false);
         break;
+    }
 
     case FPGA:
-        instance = fpga_spi;
-        cs_pin = FPGA_SPI_SELECT_PIN;
+        fpga_spi_enqueue(address, SPI_TRANSFER_READ, NULL, 0, data, length);
+        spi_fence(FPGA);
         break;
 
     default:
         error_with_message("Invalid SPI device selected");
         break;
     }
+}
 
-    nrf_gpio_pin_clear(cs_pin);
+static void display_spi_write(uint8_t address, uint8_t *data, size_t length)
+{
+    io_stats_time_t start_time = IO_STATS_NOW();
 
-    // If address is 0, don't send an address, and don't clear CS pin
-    if (!raw_mode)
-    {
-        nrfx_spim_xfer_desc_t tx_address = NRFX_SPIM_XFER_TX(&address, 1);
-        check_error(nrfx_spim_xfer(&instance, &tx_address, 0));
-    }
+    nrf_gpio_pin_clear(DISPLAY_SPI_SELECT_PIN);
 
+    nrfx_spim_xfer_desc_t tx_address = NRFX_SPIM_XFER_TX(&address, 1);
+    check_error(nrfx_spim_xfer(&display_spi, &tx_address, 0));
+
+    // The display bus has no bounce buffers, so flash data is copied here
     if (!nrfx_is_in_ram(data))
     {
-        uint8_t *m_data = malloc(length);
+        uint8_t *m_data = memory_allocate(MEMORY_POOL_TRANSIENT, length);
         if (m_data == NULL)
         {
             error();
         }
         memcpy(m_data, data, length);
         nrfx_spim_xfer_desc_t tx_data = NRFX_SPIM_XFER_TX(m_data, length);
-        check_error(nrfx_spim_xfer(&instance, &tx_data, 0));
-        free(m_data);
+        check_error(nrfx_spim_xfer(&display_spi, &tx_data, 0));
+        memory_free(m_data);
     }
     else
     {
         nrfx_spim_xfer_desc_t tx_data = NRFX_SPIM_XFER_TX(data, length);
-        check_error(nrfx_spim_xfer(&instance, &tx_data, 0));
+        check_error(nrfx_spim_xfer(&display_spi, &tx_data, 0));
     }
 
-    if (!raw_mode)
-    {
-        nrf_gpio_pin_set(cs_pin);
-    }
+    nrf_gpio_pin_set(DISPLAY_SPI_SELECT_PIN);
+
+    IO_STATS_RECORD(IO_STATS_SPI_WRITE, start_time, length, false);
 }
 
 void spi_write(spi_device_t device,
@@ -169,12 +497,60 @@ void spi_write(spi_device_t device,
                uint8_t *data,
                size_t length)
 {
-    _spi_write(device, address, data, length, false);
+    switch (device)
+    {
+    case DISPLAY:
+        display_spi_write(address, data, length);
+        break;
+
+    case FPGA:
+        fpga_spi_enqueue(address, 0, NULL, 0, data, length);
+        spi_fence(FPGA);
+        break;
+
+    default:
+        error_with_message("Invalid SPI device selected");
+        break;
+    }
+}
+
+void spi_write_async(spi_device_t device,
+                     uint8_t address,
+                     const uint8_t *header,
+                     size_t header_length,
+                     uint8_t *data,
+                     size_t length,
+                     bool free_when_done)
+{
+    if (device != FPGA)
+    {
+        error_with_message("Only the FPGA supports asynchronous writes");
+    }
+
+    fpga_spi_enqueue(address,
+                     free_when_done ? SPI_TRANSFER_FREE_WHEN_DONE : 0,
+                     header,
+                     header_length,
+                     data,
+                     length);
 }
 
 void spi_write_raw(spi_device_t device,
                    uint8_t *data,
                    size_t length)
 {
-    _spi_write(device, 0x00, data, length, true);
-}
\ No newline at end of file
+    spi_write_raw_nonblocking(device, data, length);
+    spi_fence(device);
+}
+
+void spi_write_raw_nonblocking(spi_device_t device,
+                               uint8_t *data,
+                               size_t length)
+{
+    if (device != FPGA)
+    {
+        error_with_message("Raw writes are only supported on the FPGA");
+    }
+
+    fpga_spi_enqueue(0x00, SPI_TRANSFER_RAW, NULL, 0, data, length);
+}
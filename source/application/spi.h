@@ -45,6 +45,38 @@ void spi_write(spi_device_t device,
                uint8_t *data,
                size_t length);
 
+/**
+ * @brief Queues a write and returns straight away. The optional header of up
+ *        to 8 bytes is copied, and is sent between the address and the data.
+ *        Data in flash is sent through internal bounce buffers. Data in RAM
+ *        must stay untouched until spi_fence() returns, unless
+ *        free_when_done is set, in which case the queue takes ownership of
+ *        a buffer from memory_allocate(). Only supported on the FPGA bus.
+ */
+void spi_write_async(spi_device_t device,
+                     uint8_t address,
+                     const uint8_t *header,
+                     size_t header_length,
+                     uint8_t *data,
+                     size_t length,
+                     bool free_when_done);
+
 void spi_write_raw(spi_device_t device,
                    uint8_t *data,
-                   size_t length);
\ No newline at end of file
+                   size_t length);
+
+/**
+ * @brief Queues a raw write without touching the select line afterwards. The
+ *        data must remain untouched until spi_fence() returns. Only supported
+ *        on the FPGA bus.
+ */
+void spi_write_raw_nonblocking(spi_device_t device,
+                               uint8_t *data,
+                               size_t length);
+
+/**
+ * @brief Waits until every queued transfer on the bus has completed and frees
+ *        any buffers handed over with free_when_done. Reads and blocking
+ *        writes already do this.
+ */
+void spi_fence(spi_device_t device);
\ No newline at end of file
@@ -1,3 +1,5 @@
+#define FPGA_APPLICATION_CODEC_LZ4
+
 const unsigned char fpga_application[] = {
   0x04, 0x22, 0x4d, 0x18, 0x64, 0x40, 0xa7, 0x74, 0x07, 0x00, 0x00, 0xf4,
   0x2c, 0x4c, 0x53, 0x43, 0x43, 0xff, 0x00, 0x4c, 0x61, 0x74, 0x74, 0x69,
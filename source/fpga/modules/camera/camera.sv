@@ -45,6 +45,7 @@ module camera (
     input logic [7:0] operand_in,
     input logic operand_valid_in,
     input integer operand_count_in,
+    input integer response_count_in,
     output logic [7:0] response_out,
     output logic response_valid_out
 );
@@ -52,6 +53,9 @@ module camera (
 logic start_capture_spi_clock_domain;
 logic start_capture_metastable;
 logic start_capture_pixel_clock_domain;
+logic image_valid_pixel_clock_domain;
+logic image_valid_metastable;
+logic image_valid_spi_clock_domain;
 logic [10:0] x_resolution = 512;
 logic [10:0] y_resolution = 512;
 logic [10:0] x_pan = 0;
@@ -77,6 +81,7 @@ spi_registers spi_registers (
     .operand_in(operand_in),
     .operand_valid_in(operand_valid_in),
     .operand_count_in(operand_count_in),
+    .response_count_in(response_count_in),
     .response_out(response_out),
     .response_valid_out(response_valid_out),
 
@@ -86,6 +91,7 @@ spi_registers spi_registers (
     // .x_pan_out(x_pan),
     .compression_factor_out(compression_factor),
 
+    .image_valid_in(image_valid_spi_clock_domain),
     .bytes_available_in(bytes_available),
     .data_in(image_buffer_data),
     .bytes_read_out(image_buffer_address),
@@ -110,6 +116,18 @@ always @(posedge pixel_clock_in) begin
     end
 end
 
+always @(posedge spi_clock_in) begin
+    if (spi_reset_n_in == 0) begin
+        image_valid_metastable <= 0;
+        image_valid_spi_clock_domain <= 0;
+    end
+
+    else begin
+        image_valid_metastable <= image_valid_pixel_clock_domain;
+        image_valid_spi_clock_domain <= image_valid_metastable;
+    end
+end
+
 logic [9:0] byte_to_pixel_data;
 logic byte_to_pixel_line_valid;
 logic byte_to_pixel_frame_valid;
@@ -390,7 +408,7 @@ jpeg_encoder jpeg_encoder (
     .data_out(final_image_data),
     .data_valid_out(final_image_data_valid),
     .address_out(final_image_address),
-    .image_valid_out()
+    .image_valid_out(image_valid_pixel_clock_domain)
 );
 
 always_comb bytes_available = final_image_address + 4;
@@ -19,6 +19,7 @@
     input logic [7:0] operand_in,
     input logic operand_valid_in,
     input integer operand_count_in,
+    input integer response_count_in,
     output logic [7:0] response_out,
     output logic response_valid_out,
 
@@ -26,6 +27,7 @@
     // TODO position signals
     output logic [3:0] compression_factor_out,
 
+    input logic image_valid_in,
     input logic [15:0] bytes_available_in,
     input logic [7:0] data_in,
     output logic [15:0] bytes_read_out,
@@ -41,7 +43,10 @@
 logic [15:0] bytes_remaining;
 assign bytes_remaining = bytes_available_in - bytes_read_out;
 
-logic [1:0] operand_valid_in_edge_monitor;
+integer last_response_count;
+
+logic [1:0] image_valid_in_edge_monitor;
+logic capture_complete;
 
 always_ff @(posedge clock_in) begin
     
@@ -55,12 +60,23 @@ always_ff @(posedge clock_in) begin
 
         bytes_read_out <= 0;
 
-        operand_valid_in_edge_monitor <= 0;
+        last_response_count <= 0;
+
+        image_valid_in_edge_monitor <= 2'b11;
+        capture_complete <= 0;
     end
 
     else begin
-        operand_valid_in_edge_monitor <= {operand_valid_in_edge_monitor[0], 
-                                          operand_valid_in};
+        last_response_count <= response_count_in;
+
+        // The encoder holds image valid until the next capture resets it, so
+        // only a new rising edge counts as that capture being complete
+        image_valid_in_edge_monitor <= {image_valid_in_edge_monitor[0],
+                                        image_valid_in};
+
+        if (image_valid_in_edge_monitor == 2'b01) begin
+            capture_complete <= 1;
+        end
 
         if (op_code_valid_in) begin
 
@@ -70,11 +86,12 @@ always_ff @(posedge clock_in) begin
                 'h20: begin
                     start_capture_out <= 1;
                     bytes_read_out <= 0;
+                    capture_complete <= 0;
                 end
 
                 // Bytes available
                 'h21: begin
-                    case (operand_count_in)
+                    case (response_count_in)
                         0: response_out <= bytes_remaining[15:8];
                         1: response_out <= bytes_remaining[7:0];
                     endcase
@@ -82,11 +99,14 @@ always_ff @(posedge clock_in) begin
                     response_valid_out <= 1;
                 end
 
-                // Read data
+                // Read data. The SPI peripheral fetches each byte before the
+                // previous one has finished, so the address moves on as soon
+                // as a byte starts, leaving the last fetch unread until the
+                // next transaction
                 'h22: begin
                     response_out <= data_in;
 
-                    if (operand_valid_in_edge_monitor == 2'b01) begin
+                    if (response_count_in != last_response_count) begin
                         if (bytes_read_out < bytes_available_in) begin 
                             bytes_read_out <= bytes_read_out + 1;
                         end
@@ -111,7 +131,7 @@ always_ff @(posedge clock_in) begin
 
                 // Metering
                 'h25: begin
-                    case (operand_count_in)
+                    case (response_count_in)
                         0: response_out <= red_center_metering_in;
                         1: response_out <= green_center_metering_in;
                         2: response_out <= blue_center_metering_in;
@@ -130,6 +150,12 @@ always_ff @(posedge clock_in) begin
                     end
                 end
 
+                // Capture complete
+                'h27: begin
+                    response_out <= {7'b0, capture_complete};
+                    response_valid_out <= 1;
+                end
+
             endcase
 
         end
@@ -25,7 +25,9 @@
 
     output logic pixel_write_enable_out,
     output logic [17:0] pixel_write_address_out,
-    output logic [3:0] pixel_write_data_out
+    output logic [3:0] pixel_write_data_out,
+
+    output logic ready_out
  );
 
 enum {IDLE, NEW_PIXELS, DRAW, HOLD_OUTPUT_DATA, WAIT_FOR_NEW_PIXELS} state;
@@ -33,6 +35,9 @@ logic [9:0] current_x_pen_position;
 logic [9:0] current_y_pen_position;
 logic [4:0] pixels_remaining;
 
+// High while waiting for the next byte of pixel data
+assign ready_out = state == NEW_PIXELS;
+
 always_ff @(posedge clock_in) begin
 
     if (reset_n_in == 0 || enable_in == 0) begin
@@ -0,0 +1,157 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Raj Nakarja / Brilliant Labs Limited (raj@brilliant.xyz)
+ *
+ * CERN Open Hardware Licence Version 2 - Permissive
+ *
+ * Copyright © 2023 Brilliant Labs Limited
+ */
+
+ /*
+  * Draws run-length encoded sprites. Each byte is one token:
+  *
+  *   0nnn nnnn = Skip n + 1 pixels (1 - 128), leaving them untouched
+  *   1nnn cccc = Draw n + 1 pixels (1 - 8) of color c + the palette offset
+  *
+  * Runs wrap onto the next row at the sprite width, the same as raw sprites.
+  * Skipped pixels are never written, so transparent areas cost no display
+  * buffer bandwidth. A skip advances the pen by up to one row per clock, and a
+  * draw takes two clocks per pixel, so the worst case token takes well under
+  * the ~36 display clocks between bytes when SPI runs at 8MHz. Encoders limit
+  * skips to 16 rows for very narrow sprites to keep within this.
+  */
+
+ module sprite_rle_decoder (
+    input logic clock_in,
+    input logic reset_n_in,
+    input logic enable_in,
+
+    input logic [9:0] x_position_in,
+    input logic [9:0] y_position_in,
+    input logic [9:0] width_in,
+    input logic [3:0] color_palette_offset_in,
+
+    input logic data_valid_in,
+    input logic [7:0] data_in,
+
+    output logic pixel_write_enable_out,
+    output logic [17:0] pixel_write_address_out,
+    output logic [3:0] pixel_write_data_out
+ );
+
+enum {IDLE, NEW_TOKEN, SKIP, DRAW, HOLD_OUTPUT_DATA, WAIT_FOR_NEW_TOKEN} state;
+logic [17:0] current_row_address;
+logic [9:0] current_x_pen_offset;
+logic [7:0] skip_remaining;
+logic [3:0] pixels_remaining;
+logic [3:0] run_color;
+
+always_ff @(posedge clock_in) begin
+
+    if (reset_n_in == 0 || enable_in == 0) begin
+        pixel_write_enable_out <= 0;
+        state <= IDLE;
+    end
+
+    else begin
+
+        case (state)
+
+            IDLE: begin
+                if (enable_in) begin
+                    current_row_address <= x_position_in + (y_position_in * 640);
+                    current_x_pen_offset <= 0;
+                    state <= NEW_TOKEN;
+                end
+            end
+
+            NEW_TOKEN: begin
+                if (data_valid_in) begin
+                    if (data_in[7] == 0) begin
+                        skip_remaining <= data_in[6:0] + 1;
+                        state <= SKIP;
+                    end
+
+                    else begin
+                        pixels_remaining <= data_in[6:4] + 1;
+                        run_color <= data_in[3:0] + color_palette_offset_in;
+                        state <= DRAW;
+                    end
+                end
+
+                if (enable_in == 0) begin
+                    state <= IDLE;
+                end
+            end
+
+            SKIP: begin
+
+                // Move the pen to the end of the skip, one row at a time
+                if (current_x_pen_offset + skip_remaining < width_in) begin
+                    current_x_pen_offset <= current_x_pen_offset + skip_remaining;
+                    state <= WAIT_FOR_NEW_TOKEN;
+                end
+
+                else begin
+                    skip_remaining <= skip_remaining -
+                                      (width_in - current_x_pen_offset);
+                    current_x_pen_offset <= 0;
+                    current_row_address <= current_row_address + 640;
+                end
+
+            end
+
+            DRAW: begin
+
+                pixels_remaining <= pixels_remaining - 1;
+
+                // Calculate the cursor position and width wrapping
+                if (current_x_pen_offset < width_in - 1) begin
+                    current_x_pen_offset <= current_x_pen_offset + 1;
+                end
+
+                else begin
+                    current_x_pen_offset <= 0;
+                    current_row_address <= current_row_address + 640;
+                end
+
+                pixel_write_address_out <= current_row_address +
+                                           current_x_pen_offset;
+
+                pixel_write_data_out <= run_color;
+
+                pixel_write_enable_out <= 1;
+
+                state <= HOLD_OUTPUT_DATA;
+
+            end
+
+            HOLD_OUTPUT_DATA: begin
+
+                if (pixels_remaining == 0) begin
+                    state <= WAIT_FOR_NEW_TOKEN;
+                end
+
+                else begin
+                    state <= DRAW;
+                end
+
+            end
+
+            WAIT_FOR_NEW_TOKEN: begin
+                pixel_write_enable_out <= 0;
+
+                if (data_valid_in == 0) begin
+                    state <= NEW_TOKEN;
+                end
+            end
+
+        endcase
+
+    end
+
+end
+
+endmodule
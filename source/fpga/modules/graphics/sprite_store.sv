@@ -0,0 +1,343 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Raj Nakarja / Brilliant Labs Limited (raj@brilliant.xyz)
+ *
+ * CERN Open Hardware Licence Version 2 - Permissive
+ *
+ * Copyright © 2023 Brilliant Labs Limited
+ */
+
+ /*
+  * Holds sprites uploaded once over SPI so that they can be drawn again using
+  * only their ID. Sprites use the same pixel format as the draw sprite command,
+  * and up to 256 IDs can point anywhere within the store. Where sprites are
+  * placed in the store is managed by the nRF, which gives the address and
+  * length of each sprite along with its width and color count.
+  *
+  * Draw requests are queued and then drawn one after the other by a dedicated
+  * sprite engine. Drawing takes longer than sending a request, so the nRF must
+  * not send more than QUEUE_DEPTH requests before waiting for the busy flag to
+  * clear. It must also wait before sending any other graphics commands, so that
+  * everything is drawn in order.
+  */
+
+ module sprite_store #(
+    parameter STORE_SIZE = 16384, // Bytes. Must be a power of 2
+    parameter QUEUE_DEPTH = 32    // Must be a power of 2
+ ) (
+    input logic spi_clock_in,
+    input logic spi_reset_n_in,
+
+    input logic display_clock_in,
+    input logic display_reset_n_in,
+
+    input logic [7:0] op_code_in,
+    input logic op_code_valid_in,
+    input logic [7:0] operand_in,
+    input logic operand_valid_in,
+    input integer operand_count_in,
+
+    output logic [7:0] response_out,
+    output logic response_valid_out,
+
+    output logic pixel_write_enable_out,
+    output logic [17:0] pixel_write_address_out,
+    output logic [3:0] pixel_write_data_out
+ );
+
+localparam ADDRESS_BITS = $clog2(STORE_SIZE);
+localparam QUEUE_BITS = $clog2(QUEUE_DEPTH);
+
+// Descriptors are {total_colors, width, length, address}
+localparam DESCRIPTOR_BITS = 5 + 10 + (ADDRESS_BITS + 1) + ADDRESS_BITS;
+
+// Written from the SPI domain, and read from the display domain
+logic [7:0] store [0:STORE_SIZE-1];
+logic [DESCRIPTOR_BITS-1:0] descriptors [0:255];
+
+// Draw requests are {id, palette_offset, y_position, x_position}
+logic [31:0] draw_request_spi_domain;
+logic draw_request_toggle_spi_domain;
+
+logic [1:0] operand_valid_in_edge_monitor;
+logic [7:0] upload_id;
+logic [15:0] upload_address;
+logic [9:0] upload_width;
+logic [4:0] upload_color_count;
+logic [15:0] upload_length;
+
+logic [9:0] draw_x_position_spi_domain;
+logic [9:0] draw_y_position_spi_domain;
+logic [3:0] draw_palette_offset_spi_domain;
+
+logic draw_request_acknowledge;
+logic busy;
+logic [1:0] draw_request_acknowledge_spi_domain_sync;
+logic [1:0] busy_spi_domain_sync;
+
+// SPI registers
+always_ff @(posedge spi_clock_in) begin
+
+    if (spi_reset_n_in == 0) begin
+        response_out <= 0;
+        response_valid_out <= 0;
+
+        draw_request_toggle_spi_domain <= 0;
+        operand_valid_in_edge_monitor <= 0;
+        draw_request_acknowledge_spi_domain_sync <= 0;
+        busy_spi_domain_sync <= 0;
+    end
+
+    else begin
+        operand_valid_in_edge_monitor <= {operand_valid_in_edge_monitor[0],
+                                          operand_valid_in};
+
+        draw_request_acknowledge_spi_domain_sync <= {
+            draw_request_acknowledge_spi_domain_sync[0],
+            draw_request_acknowledge
+        };
+
+        busy_spi_domain_sync <= {busy_spi_domain_sync[0], busy};
+
+        if (op_code_valid_in) begin
+
+            case (op_code_in)
+
+                // Store sprite
+                'h16: begin
+                    if (operand_valid_in_edge_monitor == 2'b01) begin
+                        case (operand_count_in)
+                            1: upload_id <= operand_in;
+                            2: upload_address <= {operand_in, 8'b0};
+                            3: upload_address <= {upload_address[15:8], operand_in};
+                            4: upload_width <= {operand_in[1:0], 8'b0};
+                            5: upload_width <= {upload_width[9:8], operand_in};
+                            6: upload_color_count <= operand_in[4:0];
+                            7: upload_length <= {operand_in, 8'b0};
+                            8: begin
+                                descriptors[upload_id] <= {
+                                    upload_color_count,
+                                    upload_width,
+                                    upload_length[ADDRESS_BITS:8],
+                                    operand_in,
+                                    upload_address[ADDRESS_BITS-1:0]
+                                };
+                            end
+                            default begin
+                                store[upload_address[ADDRESS_BITS-1:0]] <= operand_in;
+                                upload_address <= upload_address + 1;
+                            end
+                        endcase
+                    end
+                end
+
+                // Draw stored sprite
+                'h17: begin
+                    if (operand_valid_in_edge_monitor == 2'b01) begin
+                        case (operand_count_in)
+                            1: draw_x_position_spi_domain <= {operand_in[1:0], 8'b0};
+                            2: draw_x_position_spi_domain <= {draw_x_position_spi_domain[9:8], operand_in};
+                            3: draw_y_position_spi_domain <= {operand_in[1:0], 8'b0};
+                            4: draw_y_position_spi_domain <= {draw_y_position_spi_domain[9:8], operand_in};
+                            5: draw_palette_offset_spi_domain <= operand_in[3:0];
+                            6: begin
+                                draw_request_spi_domain <= {
+                                    operand_in,
+                                    draw_palette_offset_spi_domain,
+                                    draw_y_position_spi_domain,
+                                    draw_x_position_spi_domain
+                                };
+                                draw_request_toggle_spi_domain <= ~draw_request_toggle_spi_domain;
+                            end
+                        endcase
+                    end
+                end
+
+                // Busy
+                'h18: begin
+                    response_out <= {
+                        7'b0,
+                        busy_spi_domain_sync[1] ||
+                        draw_request_acknowledge_spi_domain_sync[1] != draw_request_toggle_spi_domain
+                    };
+
+                    response_valid_out <= 1;
+                end
+
+            endcase
+
+        end
+
+        else begin
+            response_valid_out <= 0;
+        end
+    end
+
+end
+
+// Draw request queue
+logic [2:0] draw_request_toggle_sync;
+logic [31:0] queue [0:QUEUE_DEPTH-1];
+logic [QUEUE_BITS:0] queue_write_pointer;
+logic [QUEUE_BITS:0] queue_read_pointer;
+logic queue_empty;
+logic queue_full;
+
+assign queue_empty = queue_write_pointer == queue_read_pointer;
+assign queue_full = queue_write_pointer == {~queue_read_pointer[QUEUE_BITS],
+                                            queue_read_pointer[QUEUE_BITS-1:0]};
+
+// Sprite playback
+enum {IDLE, READ_DESCRIPTOR, LOAD_DESCRIPTOR, START, FETCH, PRESENT, WAIT_FOR_ACCEPT, FINISH} state;
+logic [31:0] draw_request;
+logic [DESCRIPTOR_BITS-1:0] descriptor;
+logic [ADDRESS_BITS-1:0] read_address;
+logic [7:0] read_data;
+logic [ADDRESS_BITS:0] bytes_remaining;
+
+logic [9:0] sprite_x_position;
+logic [9:0] sprite_y_position;
+logic [9:0] sprite_width;
+logic [4:0] sprite_color_count;
+logic [3:0] sprite_palette_offset;
+logic [7:0] sprite_data;
+logic sprite_data_valid;
+logic sprite_enable;
+logic sprite_ready;
+
+always_ff @(posedge display_clock_in) begin
+    read_data <= store[read_address];
+end
+
+always_ff @(posedge display_clock_in) begin
+
+    if (display_reset_n_in == 0) begin
+        draw_request_toggle_sync <= 0;
+        draw_request_acknowledge <= 0;
+        queue_write_pointer <= 0;
+        queue_read_pointer <= 0;
+
+        sprite_data_valid <= 0;
+        sprite_enable <= 0;
+        busy <= 0;
+        state <= IDLE;
+    end
+
+    else begin
+        draw_request_toggle_sync <= {draw_request_toggle_sync[1:0],
+                                     draw_request_toggle_spi_domain};
+
+        busy <= state != IDLE || queue_empty == 0;
+
+        // The request was set alongside the toggle, so it is stable by now
+        if (draw_request_toggle_sync[2] != draw_request_acknowledge &&
+            queue_full == 0) begin
+            queue[queue_write_pointer[QUEUE_BITS-1:0]] <= draw_request_spi_domain;
+            queue_write_pointer <= queue_write_pointer + 1;
+            draw_request_acknowledge <= draw_request_toggle_sync[2];
+            busy <= 1;
+        end
+
+        case (state)
+
+            IDLE: begin
+                if (queue_empty == 0) begin
+                    draw_request <= queue[queue_read_pointer[QUEUE_BITS-1:0]];
+                    queue_read_pointer <= queue_read_pointer + 1;
+                    state <= READ_DESCRIPTOR;
+                end
+            end
+
+            READ_DESCRIPTOR: begin
+                descriptor <= descriptors[draw_request[31:24]];
+                state <= LOAD_DESCRIPTOR;
+            end
+
+            LOAD_DESCRIPTOR: begin
+                {sprite_color_count,
+                 sprite_width,
+                 bytes_remaining,
+                 read_address} <= descriptor;
+                sprite_palette_offset <= draw_request[23:20];
+                sprite_y_position <= draw_request[19:10];
+                sprite_x_position <= draw_request[9:0];
+                state <= START;
+            end
+
+            START: begin
+                if (bytes_remaining == 0) begin
+                    state <= IDLE;
+                end
+
+                else begin
+                    sprite_enable <= 1;
+                    state <= FETCH;
+                end
+            end
+
+            // Wait for the store to output the byte at read_address
+            FETCH: begin
+                state <= PRESENT;
+            end
+
+            PRESENT: begin
+                if (sprite_ready) begin
+                    sprite_data <= read_data;
+                    sprite_data_valid <= 1;
+                    state <= WAIT_FOR_ACCEPT;
+                end
+            end
+
+            WAIT_FOR_ACCEPT: begin
+                if (sprite_ready == 0) begin
+                    sprite_data_valid <= 0;
+                    read_address <= read_address + 1;
+                    bytes_remaining <= bytes_remaining - 1;
+
+                    if (bytes_remaining == 1) begin
+                        state <= FINISH;
+                    end
+
+                    else begin
+                        state <= FETCH;
+                    end
+                end
+            end
+
+            // Wait for the last byte to be drawn before stopping the engine
+            FINISH: begin
+                if (sprite_ready) begin
+                    sprite_enable <= 0;
+                    state <= IDLE;
+                end
+            end
+
+        endcase
+    end
+
+end
+
+sprite_engine sprite_engine (
+    .clock_in(display_clock_in),
+    .reset_n_in(display_reset_n_in),
+    .enable_in(sprite_enable),
+
+    .x_position_in(sprite_x_position),
+    .y_position_in(sprite_y_position),
+    .width_in(sprite_width),
+    .total_colors_in(sprite_color_count),
+    .color_palette_offset_in(sprite_palette_offset),
+
+    .data_valid_in(sprite_data_valid),
+    .data_in(sprite_data),
+
+    .pixel_write_enable_out(pixel_write_enable_out),
+    .pixel_write_address_out(pixel_write_address_out),
+    .pixel_write_data_out(pixel_write_data_out),
+
+    .ready_out(sprite_ready)
+);
+
+endmodule
@@ -79,6 +79,9 @@ graphics graphics (
     .operand_valid_in(operand_valid),
     .operand_count_in(operand_count),
 
+    .response_out(),
+    .response_valid_out(),
+
     .display_clock_out(),
     .display_hsync_out(),
     .display_vsync_out(),
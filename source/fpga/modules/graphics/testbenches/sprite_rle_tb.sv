@@ -0,0 +1,259 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Raj Nakarja / Brilliant Labs Limited (raj@brilliant.xyz)
+ *
+ * CERN Open Hardware Licence Version 2 - Permissive
+ *
+ * Copyright © 2023 Brilliant Labs Limited
+ */
+
+ /*
+  * Draws each sprite from simulation/sprite_rle_vectors.mem twice. Once using
+  * the raw sprite command on the left, and once using the RLE sprite command on
+  * the right, over a solid background. Every pixel is then compared, where
+  * transparent pixels of the RLE sprite should leave the background untouched.
+  * The vectors are created by tools/sprite-rle/sprite_rle.py
+  */
+
+`timescale 10ns / 10ns
+
+`include "../graphics.sv"
+
+module sprite_rle_tb;
+
+logic spi_clock = 0;
+logic spi_reset_n = 0;
+logic display_clock = 0;
+logic display_reset_n = 0;
+
+logic [7:0] opcode;
+logic opcode_valid = 0;
+logic [7:0] operand;
+logic operand_valid = 0;
+integer operand_count = 0;
+
+logic [7:0] vectors [0:65535];
+
+localparam RAW_X = 8;
+localparam RLE_X = 320;
+localparam [3:0] BACKGROUND = 15;
+
+integer index;
+integer sprite_y;
+integer width;
+integer height;
+integer colors;
+integer raw_length;
+integer rle_length;
+integer errors;
+integer i;
+integer x;
+integer y;
+logic [3:0] expected;
+
+initial begin
+    $readmemh("simulation/sprite_rle_vectors.mem", vectors);
+
+    #20000
+    spi_reset_n <= 1;
+    display_reset_n <= 1;
+    #10000
+
+    // Switch/clear command
+    send_opcode('h14);
+    done();
+    wait (graphics.display_buffers.clear_flag == 1);
+    wait (graphics.display_buffers.clear_flag == 0);
+
+    index = 0;
+    sprite_y = 4;
+    errors = 0;
+
+    while ({vectors[index], vectors[index + 1]} != 0) begin
+        width = {vectors[index], vectors[index + 1]};
+        height = {vectors[index + 2], vectors[index + 3]};
+        colors = {vectors[index + 4], vectors[index + 5]};
+        raw_length = {vectors[index + 6], vectors[index + 7]};
+        rle_length = {vectors[index + 8], vectors[index + 9]};
+        index = index + 10;
+
+        // Raw sprite
+        send_header('h12, RAW_X, sprite_y, width);
+        send_operand(colors);
+        send_operand('h00); // palette offset
+        for (i = 0; i < raw_length; i = i + 1) begin
+            send_operand(vectors[index + i]);
+        end
+        done();
+        index = index + raw_length;
+
+        // Background under the RLE sprite
+        send_header('h12, RLE_X, sprite_y, width);
+        send_operand('h10); // Total colors
+        send_operand('h00); // palette offset
+        for (i = 0; i < width * height / 2; i = i + 1) begin
+            send_operand({BACKGROUND, BACKGROUND});
+        end
+        if (width * height % 2) begin
+            send_operand({BACKGROUND, 4'h0});
+        end
+        done();
+
+        // RLE sprite
+        send_header('h15, RLE_X, sprite_y, width);
+        send_operand('h00); // palette offset
+        for (i = 0; i < rle_length; i = i + 1) begin
+            send_operand(vectors[index + i]);
+        end
+        done();
+        index = index + rle_length;
+
+        #1000
+
+        for (y = sprite_y; y < sprite_y + height; y = y + 1) begin
+            for (x = 0; x < width; x = x + 1) begin
+                expected = pixel(RAW_X + x, y) == 0 ? BACKGROUND : pixel(RAW_X + x, y);
+
+                if (pixel(RLE_X + x, y) != expected) begin
+                    $display("Sprite at y=%0d: pixel %0d,%0d is %0d, expected %0d",
+                             sprite_y, x, y - sprite_y, pixel(RLE_X + x, y), expected);
+                    errors = errors + 1;
+                end
+            end
+
+            // Nothing should be drawn either side of the sprite
+            if (pixel(RLE_X - 1, y) != 0 || pixel(RLE_X + width, y) != 0) begin
+                $display("Sprite at y=%0d: pixels drawn outside row %0d",
+                         sprite_y, y - sprite_y);
+                errors = errors + 1;
+            end
+        end
+
+        for (x = RLE_X - 1; x <= RLE_X + width; x = x + 1) begin
+            if (pixel(x, sprite_y - 1) != 0 || pixel(x, sprite_y + height) != 0) begin
+                $display("Sprite at y=%0d: pixels drawn above or below", sprite_y);
+                errors = errors + 1;
+            end
+        end
+
+        $display("Sprite %0dx%0d, %0d colors: %0d raw bytes, %0d RLE bytes",
+                 width, height, colors, raw_length, rle_length);
+
+        sprite_y = sprite_y + height + 4;
+    end
+
+    if (errors == 0) begin
+        $display("PASS");
+    end
+
+    else begin
+        $display("FAIL: %0d mismatches", errors);
+    end
+
+    $finish;
+end
+
+graphics graphics (
+    .spi_clock_in(spi_clock),
+    .spi_reset_n_in(spi_reset_n),
+
+    .display_clock_in(display_clock),
+    .display_reset_n_in(display_reset_n),
+
+    .op_code_in(opcode),
+    .op_code_valid_in(opcode_valid),
+    .operand_in(operand),
+    .operand_valid_in(operand_valid),
+    .operand_count_in(operand_count),
+
+    .response_out(),
+    .response_valid_out(),
+
+    .display_clock_out(),
+    .display_hsync_out(),
+    .display_vsync_out(),
+    .display_y_out(),
+    .display_cb_out(),
+    .display_cr_out()
+);
+
+initial begin
+    forever #1 spi_clock <= ~spi_clock;
+end
+
+initial begin
+    forever #2 display_clock <= ~display_clock;
+end
+
+// After the first switch, buffer B is displayed and buffer A is drawn into
+function [3:0] pixel(
+    input integer x,
+    input integer y
+);
+    logic [17:0] address;
+    logic [31:0] word;
+    begin
+        address = x + y * 640;
+        word = graphics.display_buffers.buffer_a.mem[address[17:3]];
+        pixel = word[address[2:0] * 4 +: 4];
+    end
+endfunction
+
+task send_header(
+    input logic [7:0] data,
+    input integer x,
+    input integer y,
+    input integer width
+);
+    begin
+        send_opcode(data);
+        send_operand(x[15:8]);
+        send_operand(x[7:0]);
+        send_operand(y[15:8]);
+        send_operand(y[7:0]);
+        send_operand(width[15:8]);
+        send_operand(width[7:0]);
+    end
+endtask
+
+task send_opcode(
+    input logic [7:0] data
+);
+    begin
+        opcode <= data;
+        opcode_valid <= 1;
+        #64;
+    end
+endtask
+
+// Bytes take 36 display clocks, the same as when SPI runs at 8MHz
+task send_operand(
+    input logic [7:0] data
+);
+    begin
+        operand <= data;
+        operand_valid <= 1;
+        operand_count <= operand_count + 1;
+        #128;
+        operand_valid <= 0;
+        #16;
+    end
+endtask
+
+task done;
+    begin
+        opcode_valid <= 0;
+        operand_valid <= 0;
+        operand_count <= 0;
+        #8;
+    end
+endtask
+
+initial begin
+    $dumpfile("simulation/sprite_rle_tb.fst");
+    $dumpvars(0, sprite_rle_tb);
+end
+
+endmodule
@@ -0,0 +1,317 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Raj Nakarja / Brilliant Labs Limited (raj@brilliant.xyz)
+ *
+ * CERN Open Hardware Licence Version 2 - Permissive
+ *
+ * Copyright © 2023 Brilliant Labs Limited
+ */
+
+ /*
+  * Stores a few sprites with each color mode, and then queues draws of them
+  * back to back, including an empty sprite and a repeated one. Every pixel
+  * write is captured into a frame and compared against a model of the sprite
+  * engine, so missing, extra or misplaced pixels are all caught.
+  *
+  * The handshake between the store and the sprite engine is also checked. Each
+  * byte must be presented once and taken once before the next, and the engine
+  * must only be disabled once it's waiting for new pixels, which is what the
+  * WAIT_FOR_ACCEPT and FINISH states are there for.
+  */
+
+`timescale 10ns / 10ns
+
+`include "modules/graphics/sprite_engine.sv"
+`include "modules/graphics/sprite_store.sv"
+
+module sprite_store_tb;
+
+logic spi_clock = 0;
+logic spi_reset_n = 0;
+logic display_clock = 0;
+logic display_reset_n = 0;
+
+logic [7:0] opcode;
+logic opcode_valid = 0;
+logic [7:0] operand;
+logic operand_valid = 0;
+integer operand_count = 0;
+
+logic [7:0] response;
+logic response_valid;
+
+logic pixel_write_enable;
+logic [17:0] pixel_write_address;
+logic [3:0] pixel_write_data;
+
+localparam FRAME_SIZE = 640 * 400;
+
+// Bit 4 marks pixels which were never written
+logic [4:0] frame [0:FRAME_SIZE-1];
+logic [4:0] expected [0:FRAME_SIZE-1];
+
+integer errors = 0;
+integer presented = 0;
+integer taken = 0;
+integer outstanding = 0;
+integer bytes_drawn = 0;
+integer i;
+
+initial begin
+    for (i = 0; i < FRAME_SIZE; i = i + 1) begin
+        frame[i] = 5'h10;
+        expected[i] = 5'h10;
+    end
+
+    #20000
+    spi_reset_n <= 1;
+    display_reset_n <= 1;
+    #10000
+
+    // id, address, width, colors, length
+    store_sprite(0, 'h0000, 6, 16, 12);
+    store_sprite(1, 'h0100, 16, 2, 6);
+    store_sprite(2, 'h3FF0, 3, 4, 3);
+    store_sprite(7, 'h0200, 8, 16, 0);
+
+    // id, x, y, palette offset, then the stored width, colors and length.
+    // Queued back to back without waiting for the busy flag
+    draw_sprite(0, 10, 10, 0, 6, 16, 12);
+    draw_sprite(1, 100, 20, 1, 16, 2, 6);
+    draw_sprite(2, 200, 30, 2, 3, 4, 3);
+    draw_sprite(7, 300, 40, 0, 8, 16, 0);
+    draw_sprite(0, 10, 50, 3, 6, 16, 12);
+
+    wait_until_idle();
+
+    for (i = 0; i < FRAME_SIZE; i = i + 1) begin
+        if (frame[i] != expected[i]) begin
+            $display("Pixel %0d,%0d is %0h, expected %0h",
+                     i % 640, i / 640, frame[i], expected[i]);
+            errors = errors + 1;
+        end
+    end
+
+    if (presented != bytes_drawn || taken != bytes_drawn) begin
+        $display("%0d bytes presented and %0d taken, expected %0d",
+                 presented, taken, bytes_drawn);
+        errors = errors + 1;
+    end
+
+    if (errors == 0) begin
+        $display("PASS");
+    end
+
+    else begin
+        $display("FAIL: %0d errors", errors);
+    end
+
+    $finish;
+end
+
+sprite_store sprite_store (
+    .spi_clock_in(spi_clock),
+    .spi_reset_n_in(spi_reset_n),
+
+    .display_clock_in(display_clock),
+    .display_reset_n_in(display_reset_n),
+
+    .op_code_in(opcode),
+    .op_code_valid_in(opcode_valid),
+    .operand_in(operand),
+    .operand_valid_in(operand_valid),
+    .operand_count_in(operand_count),
+
+    .response_out(response),
+    .response_valid_out(response_valid),
+
+    .pixel_write_enable_out(pixel_write_enable),
+    .pixel_write_address_out(pixel_write_address),
+    .pixel_write_data_out(pixel_write_data)
+);
+
+initial begin
+    forever #1 spi_clock <= ~spi_clock;
+end
+
+initial begin
+    forever #2 display_clock <= ~display_clock;
+end
+
+always @(posedge display_clock) begin
+    if (pixel_write_enable) begin
+        frame[pixel_write_address] <= {1'b0, pixel_write_data};
+    end
+end
+
+// Sampled before each edge so that changes can be checked on the next one
+logic data_valid_q = 0;
+logic ready_q = 0;
+logic enable_q = 0;
+
+always @(posedge display_clock) begin
+    data_valid_q <= sprite_store.sprite_data_valid;
+    ready_q <= sprite_store.sprite_ready;
+    enable_q <= sprite_store.sprite_enable;
+end
+
+always @(negedge display_clock) begin
+
+    // A new byte can only be presented once the previous one was taken
+    if (data_valid_q == 0 && sprite_store.sprite_data_valid == 1) begin
+        if (outstanding != 0) begin
+            $display("Byte presented before the previous one was taken");
+            errors = errors + 1;
+        end
+
+        presented = presented + 1;
+        outstanding = outstanding + 1;
+    end
+
+    // The engine takes a byte by leaving its ready state while it's valid
+    if (ready_q == 1 && sprite_store.sprite_ready == 0 && data_valid_q == 1) begin
+        if (outstanding != 1) begin
+            $display("Byte taken %0d times", 2 - outstanding);
+            errors = errors + 1;
+        end
+
+        taken = taken + 1;
+        outstanding = outstanding - 1;
+    end
+
+    // Disabling the engine mid byte would drop its remaining pixels
+    if (enable_q == 1 && sprite_store.sprite_enable == 0) begin
+        if (ready_q == 0 || outstanding != 0) begin
+            $display("Sprite engine disabled before the last byte was drawn");
+            errors = errors + 1;
+        end
+    end
+end
+
+function [7:0] sprite_byte(
+    input integer id,
+    input integer index
+);
+    begin
+        sprite_byte = index * 37 + id * 11 + 5;
+    end
+endfunction
+
+task store_sprite(
+    input integer id,
+    input integer address,
+    input integer width,
+    input integer colors,
+    input integer length
+);
+    begin
+        send_opcode('h16);
+        send_operand(id[7:0]);
+        send_operand(address[15:8]);
+        send_operand(address[7:0]);
+        send_operand(width[15:8]);
+        send_operand(width[7:0]);
+        send_operand(colors[7:0]);
+        send_operand(length[15:8]);
+        send_operand(length[7:0]);
+        for (i = 0; i < length; i = i + 1) begin
+            send_operand(sprite_byte(id, i));
+        end
+        done();
+    end
+endtask
+
+// Sends the draw request, and fills in what the sprite engine should draw
+task draw_sprite(
+    input integer id,
+    input integer x,
+    input integer y,
+    input integer palette_offset,
+    input integer width,
+    input integer colors,
+    input integer length
+);
+    integer bits;
+    integer pixel;
+    integer shift;
+    logic [7:0] data;
+    logic [3:0] color;
+    begin
+        send_opcode('h17);
+        send_operand(x[15:8]);
+        send_operand(x[7:0]);
+        send_operand(y[15:8]);
+        send_operand(y[7:0]);
+        send_operand(palette_offset[7:0]);
+        send_operand(id[7:0]);
+        done();
+
+        bits = colors == 2 ? 1 : colors == 4 ? 2 : 4;
+
+        // Pixels are drawn from the most significant bits first
+        for (pixel = 0; pixel < length * 8 / bits; pixel = pixel + 1) begin
+            data = sprite_byte(id, pixel * bits / 8);
+            shift = 8 - bits - (pixel * bits % 8);
+            color = ((data >> shift) & ((1 << bits) - 1)) + palette_offset;
+            expected[x + pixel % width + (y + pixel / width) * 640] = {1'b0, color};
+        end
+
+        bytes_drawn = bytes_drawn + length;
+    end
+endtask
+
+task wait_until_idle;
+    logic busy;
+    begin
+        busy = 1;
+
+        while (busy) begin
+            send_opcode('h18);
+            busy = response[0];
+            done();
+            #1000;
+        end
+    end
+endtask
+
+task send_opcode(
+    input logic [7:0] data
+);
+    begin
+        opcode <= data;
+        opcode_valid <= 1;
+        #64;
+    end
+endtask
+
+// Bytes take 36 display clocks, the same as when SPI runs at 8MHz
+task send_operand(
+    input logic [7:0] data
+);
+    begin
+        operand <= data;
+        operand_valid <= 1;
+        operand_count <= operand_count + 1;
+        #128;
+        operand_valid <= 0;
+        #16;
+    end
+endtask
+
+task done;
+    begin
+        opcode_valid <= 0;
+        operand_valid <= 0;
+        operand_count <= 0;
+        #8;
+    end
+endtask
+
+initial begin
+    $dumpfile("simulation/sprite_store_tb.fst");
+    $dumpvars(0, sprite_store_tb);
+end
+
+endmodule
@@ -25,6 +25,7 @@ module spi_peripheral (
     output logic opcode_valid_out,
     output logic operand_valid_out,
     output integer operand_count_out,
+    output integer response_count_out,
 
     input logic [7:0] response_1_in,
     input logic [7:0] response_2_in,
@@ -34,96 +35,180 @@ module spi_peripheral (
     input logic response_3_valid_in
 );
 
+// The receive shift register is clocked directly by the SPI clock so that
+// the bus can run well above what oversampling in the 72MHz domain allows.
+// Each completed byte is handed to the system clock domain with a toggle
+// flag, and the opcode and operand interface below is unchanged.
+//
+// Responses are prefetched. When a byte starts, the system clock domain is
+// told with a second toggle. It then moves response_count_out on to the next
+// byte, gives the sub-peripheral RESPONSE_SETTLE_CYCLES to answer, and
+// captures the answer into tx_next. The SPI clock domain loads tx_next at the
+// start of the following byte, so tx_next is only ever written while it's not
+// being used. Sub-peripherals with more than one response byte must therefore
+// pick them using response_count_out rather than operand_count_out.
+//
+// Writes may run at up to 32MHz. Reads may run at up to 16MHz, where the
+// synchronizer and settle time take under half of the byte period. The first
+// response is captured once the opcode has arrived, so the opcode must be
+// followed by a short pause before the response is clocked out. The nRF sends
+// it as its own transfer, which leaves several microseconds.
+
+parameter OPERAND_VALID_CYCLES = 8;
+parameter RESPONSE_SETTLE_CYCLES = 10;
+
+logic [7:0] tx_next;
+
+// SPI clock domain
+logic [2:0] rx_bit_count = 0;
+logic rx_first_byte = 1;
+logic [6:0] rx_shift;
+logic [7:0] rx_byte;
+logic rx_byte_is_opcode;
+logic rx_toggle = 0;
+logic tx_toggle = 0;
+logic [7:0] tx_shift;
+
+always_ff @(posedge spi_clock_in or posedge spi_select_in) begin
+
+    if (spi_select_in) begin
+        rx_bit_count <= 0;
+        rx_first_byte <= 1;
+    end
+
+    else begin
+        rx_shift <= {rx_shift[5:0], spi_data_in};
+        rx_bit_count <= rx_bit_count + 1;
+
+        if (rx_bit_count == 7) begin
+            rx_first_byte <= 0;
+        end
+    end
+
+end
+
+// Kept outside of the select reset so that a toggle is never lost when the
+// controller raises select immediately after the final clock edge
+always_ff @(posedge spi_clock_in) begin
+
+    if (spi_select_in == 0 & rx_bit_count == 7) begin
+        rx_byte <= {rx_shift, spi_data_in};
+        rx_byte_is_opcode <= rx_first_byte;
+        rx_toggle <= ~rx_toggle;
+    end
+
+end
+
+// The prefetched response is loaded on the first rising edge of each byte,
+// and then shifted out on the falling edges
+always_ff @(posedge spi_clock_in) begin
+
+    if (spi_select_in == 0 & rx_bit_count == 0) begin
+        tx_shift <= tx_next;
+        tx_toggle <= ~tx_toggle;
+    end
+
+end
+
+logic [7:0] tx_shift_out;
+
+always_ff @(negedge spi_clock_in or posedge spi_select_in) begin
+
+    if (spi_select_in) begin
+        tx_shift_out <= 0;
+    end
+
+    else if (rx_bit_count == 1) begin
+        tx_shift_out <= {tx_shift[6:0], 1'b0};
+    end
+
+    else begin
+        tx_shift_out <= {tx_shift_out[6:0], 1'b0};
+    end
+
+end
+
+// Before the first rising edge of a byte, bit 7 comes straight from tx_next,
+// which was captured several SPI clock periods earlier
+assign spi_data_out = rx_bit_count == 0 ? tx_next[7] : tx_shift_out[7];
+
+// System clock domain
 logic metastable_spi_select_in;
-logic metastable_spi_clock_in;
-logic metastable_spi_data_in;
 logic stable_spi_select_in;
-logic stable_spi_clock_in;
-logic stable_spi_data_in;
-logic last_stable_spi_clock_in;
-logic [7:0] response_reg;
-
-integer spi_bit_index;
+logic [2:0] rx_toggle_sync;
+logic [2:0] tx_toggle_sync;
+integer operand_valid_counter;
+integer response_settle_counter;
 
 always_ff @(posedge clock_in) begin
 
-    // Synchronizer
+    // Synchronizers
     metastable_spi_select_in <= spi_select_in;
-    metastable_spi_clock_in <= spi_clock_in;
-    metastable_spi_data_in <= spi_data_in;
     stable_spi_select_in <= metastable_spi_select_in;
-    stable_spi_clock_in <= metastable_spi_clock_in;
-    stable_spi_data_in <= metastable_spi_data_in;
-
-    // Edge detection
-    last_stable_spi_clock_in <= stable_spi_clock_in;
+    rx_toggle_sync <= {rx_toggle_sync[1:0], rx_toggle};
+    tx_toggle_sync <= {tx_toggle_sync[1:0], tx_toggle};
 
     // Reset
     if (stable_spi_select_in == 1 | reset_n_in == 0) begin
-        spi_bit_index <= 15;
         opcode_valid_out <= 0;
         operand_valid_out <= 0;
         operand_count_out <= 0;
-        response_reg <= 0;
+        operand_valid_counter <= 0;
+        response_count_out <= 0;
+        response_settle_counter <= 0;
+        tx_next <= 0;
     end
 
     // Normal operation
     else begin
 
-        // Choose output data based on valid response
-        case ({response_1_valid_in, response_2_valid_in, response_3_valid_in})
-            'b100: response_reg <= response_1_in;
-            'b010: response_reg <= response_2_in;
-            'b001: response_reg <= response_3_in;
-            default: response_reg <= 'h0;
-        endcase
-
-        // Output data
-        if (spi_bit_index < 8) begin
-            spi_data_out <= response_reg[spi_bit_index];
+        // Capture the next response once the sub-peripheral has settled
+        if (response_settle_counter > 0) begin
+            response_settle_counter <= response_settle_counter - 1;
         end
 
-        else begin
-            spi_data_out <= 0;
+        if (response_settle_counter == 1) begin
+            case ({response_1_valid_in, response_2_valid_in, response_3_valid_in})
+                'b100: tx_next <= response_1_in;
+                'b010: tx_next <= response_2_in;
+                'b001: tx_next <= response_3_in;
+                default: tx_next <= 'h0;
+            endcase
         end
 
-        // On rising SPI clock, buffer in data
-        if (last_stable_spi_clock_in == 0 & stable_spi_clock_in == 1) begin
+        // Operand valid is stretched so that slower clock domains can see it
+        if (operand_valid_counter > 0) begin
+            operand_valid_counter <= operand_valid_counter - 1;
+        end
 
-            // If address
-            if (spi_bit_index > 7) begin
-                opcode_out[spi_bit_index - 8] <= stable_spi_data_in;
+        else begin
+            operand_valid_out <= 0;
+        end
 
-                if (spi_bit_index == 8) begin
-                    opcode_valid_out <= 1;
-                end
-            end 
-            
-            // Otherwise data
-            else begin
-                operand_out[spi_bit_index] <= stable_spi_data_in;
-                
-                if (spi_bit_index == 0) begin
-                    operand_valid_out <= 1;
-                end
-
-                else begin
-                    operand_valid_out <= 0;
-                end
-            end
+        // A byte after the opcode has started, so prefetch the one after it
+        if (tx_toggle_sync[2] != tx_toggle_sync[1] & opcode_valid_out) begin
+            response_count_out <= response_count_out + 1;
+            response_settle_counter <= RESPONSE_SETTLE_CYCLES;
+        end
 
-            // Roll underflows back over to read multiple bytes continiously
-            if (spi_bit_index == 0) begin 
-                spi_bit_index <= 7;
-                operand_count_out <= operand_count_out + 1;
+        // A new byte has arrived from the SPI clock domain
+        if (rx_toggle_sync[2] != rx_toggle_sync[1]) begin
+
+            if (rx_byte_is_opcode) begin
+                opcode_out <= rx_byte;
+                opcode_valid_out <= 1;
+                response_settle_counter <= RESPONSE_SETTLE_CYCLES;
             end
 
             else begin
-                spi_bit_index <= spi_bit_index - 1;
+                operand_out <= rx_byte;
+                operand_valid_out <= 1;
+                operand_valid_counter <= OPERAND_VALID_CYCLES - 1;
+                operand_count_out <= operand_count_out + 1;
             end
 
         end
     end
 end
 
-endmodule
\ No newline at end of file
+endmodule
@@ -9,17 +9,18 @@
  * Copyright © 2023 Brilliant Labs Limited
  */
 
-`timescale 10ns / 10ns
+`timescale 1ns / 100ps
 
 `include "../spi_peripheral.sv"
 `include "../spi_register.sv"
 
 module spi_tb ();
 
+// 72MHz system clock, as in top.sv
 logic system_clock = 0;
 
 initial begin
-    forever #1 system_clock <= ~system_clock;
+    forever #6.944 system_clock <= ~system_clock;
 end
 
 logic reset = 0;
@@ -36,6 +37,11 @@ logic [7:0] opcode;
 logic opcode_valid;
 logic [7:0] operand;
 logic operand_valid;
+integer operand_count;
+integer response_count;
+
+logic [7:0] response_1;
+logic response_1_valid;
 
 logic [7:0] response_2;
 logic response_2_valid;
@@ -56,11 +62,13 @@ spi_peripheral spi_peripheral (
     .opcode_valid_out(opcode_valid),
     .operand_out(operand),
     .operand_valid_out(operand_valid),
+    .operand_count_out(operand_count),
+    .response_count_out(response_count),
 
-    .response_1_in(8'b0),
+    .response_1_in(response_1),
     .response_2_in(response_2),
     .response_3_in(response_3),
-    .response_1_valid_in(1'b0),
+    .response_1_valid_in(response_1_valid),
     .response_2_valid_in(response_2_valid),
     .response_3_valid_in(response_3_valid)
 );
@@ -91,19 +99,148 @@ spi_register #(
     .response_valid_out(response_3_valid)
 );
 
-task send_byte(
-    input logic [7:0] data
+// Counter register which behaves like the camera bytes available and
+// metering registers, responding with a different value for each byte
+always_ff @(posedge system_clock) begin
+    if (opcode_valid & opcode == 'h30) begin
+        response_1 <= 'hA0 + response_count;
+        response_1_valid <= 1;
+    end
+
+    else if (opcode_valid & opcode == 'h31) begin
+        response_1 <= stream_data[2];
+        response_1_valid <= 1;
+    end
+
+    else begin
+        response_1_valid <= 0;
+    end
+end
+
+// Streaming register which behaves like the camera image data. The address
+// moves on as each byte starts, and the memory takes a few cycles to answer.
+// It carries on from where the previous transaction finished
+logic [7:0] stream_address = 0;
+logic [7:0] stream_data [0:2];
+integer last_response_count = 0;
+
+always_ff @(posedge system_clock) begin
+    last_response_count <= response_count;
+
+    if (opcode_valid & opcode == 'h31 & response_count != last_response_count) begin
+        stream_address <= stream_address + 1;
+    end
+
+    stream_data[0] <= stream_address * 7 + 3;
+    stream_data[1] <= stream_data[0];
+    stream_data[2] <= stream_data[1];
+end
+
+// Record everything the sub-peripheral interface sees
+logic [7:0] received_opcode;
+logic [7:0] received_operands [0:15];
+integer received_operand_count;
+logic last_operand_valid = 0;
+
+always @(posedge system_clock) begin
+    last_operand_valid <= operand_valid;
+
+    if (opcode_valid) begin
+        received_opcode <= opcode;
+    end
+
+    if (operand_valid & ~last_operand_valid) begin
+        received_operands[operand_count - 1] <= operand;
+        received_operand_count <= operand_count;
+    end
+end
+
+integer errors = 0;
+
+task check(
+    input string name,
+    input integer actual,
+    input integer expected
+);
+    begin
+        if (actual !== expected) begin
+            $display("FAIL: %s = 0x%0h, expected 0x%0h", name, actual, expected);
+            errors++;
+        end
+    end
+endtask
+
+// Mode 0 transfer. Data changes on the falling edge and is sampled on the
+// rising edge, as the nRF52 SPIM does
+task transfer_byte(
+    input real half_period,
+    input logic [7:0] data_out,
+    output logic [7:0] data_in
 );
     begin
         for (integer i = 7; i >= 0; i--) begin
-            spi_data_in <= data[i];
-            #4;
-            spi_clock_in <= ~spi_clock_in;
-            #4;
-            spi_clock_in <= ~spi_clock_in;
+            spi_data_in <= data_out[i];
+            #(half_period);
+            spi_clock_in <= 1;
+            data_in[i] = spi_data_out;
+            #(half_period);
+            spi_clock_in <= 0;
+        end
+    end
+endtask
+
+logic [7:0] data [0:15];
+logic [7:0] dummy;
+logic [7:0] read_data;
+
+task write_transaction(
+    input real half_period,
+    input logic [7:0] write_opcode,
+    input integer length
+);
+    begin
+        received_operand_count = 0;
+        spi_select_in <= 0;
+        #(half_period);
+        transfer_byte(half_period, write_opcode, dummy);
+
+        for (integer i = 0; i < length; i++) begin
+            transfer_byte(half_period, data[i], dummy);
         end
-        
-        #4;
+
+        #100;
+        check("opcode", received_opcode, write_opcode);
+        check("operand count", received_operand_count, length);
+
+        for (integer i = 0; i < length; i++) begin
+            check("operand", received_operands[i], data[i]);
+        end
+
+        spi_select_in <= 1;
+        #200;
+    end
+endtask
+
+task read_transaction(
+    input real half_period,
+    input logic [7:0] read_opcode,
+    input integer length
+);
+    begin
+        spi_select_in <= 0;
+        #(half_period);
+        transfer_byte(half_period, read_opcode, dummy);
+
+        // The nRF sends the opcode as its own transfer
+        #1000;
+
+        for (integer i = 0; i < length; i++) begin
+            transfer_byte(half_period, 'h00, read_data);
+            check("read data", read_data, data[i]);
+        end
+
+        spi_select_in <= 1;
+        #200;
     end
 endtask
 
@@ -112,31 +249,54 @@ initial begin
     $dumpvars(0, spi_tb);
 end
 
+
 initial begin
 
-    #8
+    #100
     reset <= 1;
+    #100
+
+    // Sprite style writes at 32MHz and 8MHz
+    for (integer i = 0; i < 16; i++) data[i] = 'h5A ^ (i * 'h11);
+    write_transaction(15.625, 'h12, 16);
+    write_transaction(62.5, 'h12, 16);
 
-    // Test chip ID 1
-    #8
-    spi_select_in <= 0;    
-    send_byte('hDB);
-    send_byte('hFF);
-    spi_select_in <= 1;    
-    #8
-
-    // Test chip ID 2 with extra operands
-    #8
-    spi_select_in <= 0;    
-    send_byte('hF4);
-    send_byte('h12);
-    send_byte('h43);
-    send_byte('h65);
-    spi_select_in <= 1;    
-    #8
+    // Opcode only
+    write_transaction(15.625, 'h14, 0);
+
+    // Chip ID reads at 16MHz and 4MHz
+    data[0] = 'h81;
+    read_transaction(31.25, 'hDB, 1);
+    read_transaction(125, 'hDB, 1);
+    data[0] = 'h27;
+    data[1] = 'h27;
+    data[2] = 'h27;
+    read_transaction(31.25, 'hF4, 3);
+
+    // Per byte responses at 16MHz and 4MHz
+    for (integer i = 0; i < 6; i++) data[i] = 'hA0 + i;
+    read_transaction(31.25, 'h30, 6);
+    read_transaction(125, 'h30, 6);
+
+    // Streamed reads split over several transactions, where no byte may be
+    // skipped or repeated even though one more is always fetched than is read
+    for (integer i = 0; i < 5; i++) data[i] = i * 7 + 3;
+    read_transaction(31.25, 'h31, 5);
+    for (integer i = 0; i < 11; i++) data[i] = (i + 5) * 7 + 3;
+    read_transaction(31.25, 'h31, 11);
+    for (integer i = 0; i < 4; i++) data[i] = (i + 16) * 7 + 3;
+    read_transaction(125, 'h31, 4);
 
     reset <= 0;
-    #8
+    #100
+
+    if (errors == 0) begin
+        $display("PASS");
+    end
+
+    else begin
+        $display("%0d errors", errors);
+    end
 
     $finish;
 end
@@ -124,7 +124,10 @@ logic opcode_valid;
 logic [7:0] operand;
 logic operand_valid;
 integer operand_count;
+integer response_count;
 
+logic [7:0] response_1;
+logic response_1_valid;
 logic [7:0] response_2;
 logic response_2_valid;
 
@@ -145,11 +148,12 @@ spi_peripheral spi_peripheral (
     .operand_out(operand),
     .operand_valid_out(operand_valid),
     .operand_count_out(operand_count),
+    .response_count_out(response_count),
 
-    .response_1_in(8'b0),
+    .response_1_in(response_1),
     .response_2_in(response_2),
     .response_3_in(response_3),
-    .response_1_valid_in(1'b0),
+    .response_1_valid_in(response_1_valid),
     .response_2_valid_in(response_2_valid),
     .response_3_valid_in(response_3_valid)
 );
@@ -168,6 +172,9 @@ graphics graphics (
     .operand_valid_in(operand_valid),
     .operand_count_in(operand_count),
 
+    .response_out(response_1),
+    .response_valid_out(response_1_valid),
+
     .display_clock_out(display_clock_out),
     .display_hsync_out(display_hsync_out),
     .display_vsync_out(display_vsync_out),
@@ -203,11 +210,15 @@ camera camera (
     .operand_in(operand),
     .operand_valid_in(operand_valid),
     .operand_count_in(operand_count),
+    .response_count_in(response_count),
     .response_out(response_2),
     .response_valid_out(response_2_valid)
 );
 
 // Chip ID register
+logic [7:0] chip_id_response;
+logic chip_id_response_valid;
+
 spi_register #(
     .REGISTER_ADDRESS('hDB),
     .REGISTER_VALUE('h81)
@@ -217,8 +228,40 @@ spi_register #(
 
     .opcode_in(opcode),
     .opcode_valid_in(opcode_valid),
-    .response_out(response_3),
-    .response_valid_out(response_3_valid)
+    .response_out(chip_id_response),
+    .response_valid_out(chip_id_response_valid)
+);
+
+// Feature register. Each bit tells the firmware that this bitstream supports
+// something which older ones don't, as those read back 0 here
+//  bit 0: SPI responses are prefetched, so reads may run at 16MHz
+//  bit 1: Run-length encoded sprites (0x15)
+//  bit 2: Sprite store (0x16 - 0x18), only built with SPRITE_STORE
+//  bit 3: Capture complete flag (0x27)
+`ifdef SPRITE_STORE
+localparam FEATURES = 'h0F;
+`else
+localparam FEATURES = 'h0B;
+`endif
+
+logic [7:0] features_response;
+logic features_response_valid;
+
+spi_register #(
+    .REGISTER_ADDRESS('hDA),
+    .REGISTER_VALUE(FEATURES)
+) features_1 (
+    .clock_in(spi_peripheral_clock),
+    .reset_n_in(spi_peripheral_reset_n),
+
+    .opcode_in(opcode),
+    .opcode_valid_in(opcode_valid),
+    .response_out(features_response),
+    .response_valid_out(features_response_valid)
 );
 
+assign response_3 = chip_id_response_valid ? chip_id_response
+                                           : features_response;
+assign response_3_valid = chip_id_response_valid | features_response_valid;
+
 endmodule
\ No newline at end of file
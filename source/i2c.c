@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include "error_logging.h"
 #include "i2c.h"
+#include "io_stats.h"
 #include "main.h"
 #include "nrfx_twim.h"
 #include "pinout.h"
@@ -110,9 +111,16 @@ i2c_response_t i2c_read(i2c_device_t device,
                                                           &i2c_response.value,
                                                           1);
 
+    io_stats_time_t start_time = IO_STATS_NOW();
+
     // Try several times
     for (uint8_t i = 0; i < 3; i++)
     {
+        if (i > 0)
+        {
+            IO_STATS_RETRY(IO_STATS_I2C_READ);
+        }
+
         nrfx_err_t tx_err = nrfx_twim_xfer(&i2c, &i2c_tx, 0);
 
         if (tx_err == NRFX_ERROR_NOT_SUPPORTED ||
@@ -140,6 +148,11 @@ i2c_response_t i2c_read(i2c_device_t device,
         }
     }
 
+    IO_STATS_RECORD(IO_STATS_I2C_READ,
+                    start_time,
+                    i2c_tx.primary_length + 1,
+                    i2c_response.fail);
+
     i2c_response.value &= register_mask;
 
     return i2c_response;
@@ -212,9 +225,16 @@ i2c_response_t i2c_write(i2c_device_t device,
         i2c_tx.primary_length = 3;
     }
 
+    io_stats_time_t start_time = IO_STATS_NOW();
+
     // Try several times
     for (uint8_t i = 0; i < 3; i++)
     {
+        if (i > 0)
+        {
+            IO_STATS_RETRY(IO_STATS_I2C_WRITE);
+        }
+
         nrfx_err_t err = nrfx_twim_xfer(&i2c, &i2c_tx, 0);
 
         if (err == NRFX_ERROR_BUSY ||
@@ -239,5 +259,10 @@ i2c_response_t i2c_write(i2c_device_t device,
         }
     }
 
+    IO_STATS_RECORD(IO_STATS_I2C_WRITE,
+                    start_time,
+                    i2c_tx.primary_length,
+                    resp.fail);
+
     return resp;
 }
@@ -0,0 +1,123 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include "io_stats.h"
+#include "nrfx.h"
+
+#if IO_STATS
+
+// Operations finish in both thread and interrupt context
+static io_stats_t stats[IO_STATS_OPERATION_COUNT];
+
+static const char *const names[IO_STATS_OPERATION_COUNT] = {
+    [IO_STATS_SPI_READ] = "spi_read",
+    [IO_STATS_SPI_WRITE] = "spi_write",
+    [IO_STATS_I2C_READ] = "i2c_read",
+    [IO_STATS_I2C_WRITE] = "i2c_write",
+    [IO_STATS_FLASH_WRITE] = "flash_write",
+    [IO_STATS_FLASH_ERASE] = "flash_erase",
+    [IO_STATS_BLUETOOTH_SEND] = "bluetooth_send",
+    [IO_STATS_LZ4_LOAD] = "lz4_load",
+};
+
+void io_stats_record(io_stats_operation_t operation,
+                     io_stats_time_t start,
+                     size_t bytes,
+                     bool failed)
+{
+    // Unsigned, so correct across a wrap of the counter
+    uint32_t cycles = DWT->CYCCNT - start.cycles;
+
+    // The first tick may have been about to happen, so only whole ticks after
+    // it are certain. The RTC doesn't move until the time library starts it
+    uint32_t ticks = (NRF_RTC1->COUNTER - start.ticks) &
+                     RTC_COUNTER_COUNTER_Msk;
+
+    if (ticks > 1)
+    {
+        uint64_t slept = (uint64_t)(ticks - 1) *
+                         (NRF_RTC1->PRESCALER + 1) *
+                         SystemCoreClock /
+                         32768;
+
+        if (slept > cycles)
+        {
+            cycles = slept > UINT32_MAX ? UINT32_MAX : slept;
+        }
+    }
+
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    io_stats_t *entry = &stats[operation];
+
+    if (entry->count == 0 || cycles < entry->min_cycles)
+    {
+        entry->min_cycles = cycles;
+    }
+
+    if (cycles > entry->max_cycles)
+    {
+        entry->max_cycles = cycles;
+    }
+
+    entry->count++;
+    entry->bytes += bytes;
+    entry->total_cycles += cycles;
+
+    if (failed)
+    {
+        entry->failures++;
+    }
+
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+void io_stats_retry(io_stats_operation_t operation)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+    stats[operation].retries++;
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+void io_stats_get(io_stats_operation_t operation, io_stats_t *copy)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+    *copy = stats[operation];
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+void io_stats_reset(void)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+    memset(stats, 0, sizeof(stats));
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+const char *io_stats_name(io_stats_operation_t operation)
+{
+    return names[operation];
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counts, bytes and latencies of the slower peripheral operations, timed using
+ * the DWT cycle counter. The counter stops while the CPU sleeps, so the RTC of
+ * the time library is read as well, and catches the time spent waiting in
+ * __WFE to within a tick. Building with IO_STATS=0 removes the instrumentation
+ * entirely, in which case the macros below do nothing.
+ */
+
+typedef enum io_stats_operation_t
+{
+    IO_STATS_SPI_READ,
+    IO_STATS_SPI_WRITE,
+    IO_STATS_I2C_READ,
+    IO_STATS_I2C_WRITE,
+    IO_STATS_FLASH_WRITE,
+    IO_STATS_FLASH_ERASE,
+    IO_STATS_BLUETOOTH_SEND,
+    IO_STATS_LZ4_LOAD,
+    IO_STATS_OPERATION_COUNT,
+} io_stats_operation_t;
+
+typedef struct io_stats_time_t
+{
+    uint32_t cycles;
+    uint32_t ticks;
+} io_stats_time_t;
+
+typedef struct io_stats_t
+{
+    uint32_t count;
+    uint32_t failures;
+    uint32_t retries;
+    uint64_t bytes;
+    uint64_t total_cycles;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+} io_stats_t;
+
+#if IO_STATS
+
+#include "nrf.h"
+
+#define IO_STATS_NOW() \
+    ((io_stats_time_t){.cycles = DWT->CYCCNT, .ticks = NRF_RTC1->COUNTER})
+
+#define IO_STATS_RECORD(operation, start, bytes, failed) \
+    io_stats_record(operation, start, bytes, failed)
+
+#define IO_STATS_RETRY(operation) io_stats_retry(operation)
+
+void io_stats_record(io_stats_operation_t operation,
+                     io_stats_time_t start,
+                     size_t bytes,
+                     bool failed);
+
+void io_stats_retry(io_stats_operation_t operation);
+
+void io_stats_get(io_stats_operation_t operation, io_stats_t *stats);
+
+void io_stats_reset(void);
+
+const char *io_stats_name(io_stats_operation_t operation);
+
+#else
+
+#define IO_STATS_NOW() ((io_stats_time_t){.cycles = 0, .ticks = 0})
+#define IO_STATS_RECORD(operation, start, bytes, failed) ((void)(start))
+#define IO_STATS_RETRY(operation)
+
+#endif
@@ -2,14 +2,22 @@
 Tests the Frame specific Lua libraries over Bluetooth.
 """
 
-import asyncio
+import asyncio, struct, zlib
 from frameutils import Bluetooth
 
 
 class TestBluetooth(Bluetooth):
     def __init__(self):
+        super().__init__()
         self._passed_tests = 0
         self._failed_tests = 0
+        self._upload_replies = []
+
+    def _notification_handler(self, sender, data):
+        if data[0] == 0x02:
+            self._upload_replies.append(data[1])
+        else:
+            super()._notification_handler(sender, data)
 
     def _log_passed(self, sent, responded):
         self._passed_tests += 1
@@ -77,6 +85,24 @@ class TestBluetooth(Bluetooth):
         else:
             self._log_failed(send, response, expect)
 
+    async def upload_equals(self, data: bytes, mode: int, name: str, crc: int, expect):
+        self._upload_replies = []
+        await self._transmit(
+            struct.pack("<BBBII", 0x02, 0x00, mode, len(data), crc) + name.encode()
+        )
+        chunk = self.max_lua_payload() - 4
+        for sequence, offset in enumerate(range(0, len(data), chunk)):
+            await self._transmit(
+                struct.pack("<BBH", 0x02, 0x01, sequence)
+                + data[offset : offset + chunk]
+            )
+        await asyncio.sleep(0.5)
+        response = self._upload_replies[-1] if self._upload_replies else None
+        if response == expect:
+            self._log_passed(f"upload {len(data)} bytes", response)
+        else:
+            self._log_failed(f"upload {len(data)} bytes", response, expect)
+
 
 async def main():
     test = TestBluetooth()
@@ -98,6 +124,14 @@ async def main():
     await test.data_equal(b"test", b"test")
     await test.lua_send("frame.bluetooth.receive_callback(nil)")
 
+    ## Events arriving together are all delivered
+    await test.lua_send("r={} frame.bluetooth.receive_callback(function(d)r[#r+1]=d end)")
+    for i in range(5):
+        await test.send_data(bytes([0x30 + i]))
+    await asyncio.sleep(0.5)
+    await test.lua_equals("table.concat(r)", "01234")
+    await test.lua_send("frame.bluetooth.receive_callback(nil)")
+
     ## MTU size
     max_length = test.max_data_payload()
     await test.lua_equals("frame.bluetooth.max_length()", max_length)
@@ -106,6 +140,21 @@ async def main():
     await test.lua_send(f"frame.bluetooth.send(string.rep('a',{max_length}))")
     await test.lua_error(f"frame.bluetooth.send(string.rep('a',{max_length + 1}))")
 
+    ## Connection parameters
+    await test.lua_is_type("frame.bluetooth.connection()", "table")
+    await test.lua_equals("frame.bluetooth.connection().mtu", max_length + 4)
+    await test.lua_send(
+        "frame.bluetooth.set_connection{interval=15, latency=0, timeout=2000, phy='2m'}"
+    )
+    await test.lua_error("frame.bluetooth.set_connection{interval=5}")
+    await test.lua_error(
+        "frame.bluetooth.set_connection{interval=100, latency=10, timeout=1000}"
+    )
+    await test.lua_error("frame.bluetooth.set_connection{phy='3m'}")
+
+    ## Print arguments are sent together
+    await test.lua_equals("'a', 1, nil", "a\t1\tnil")
+
     # Display
 
     ## Text
@@ -120,7 +169,27 @@ async def main():
     # TODO
 
     ## Sprites
-    # TODO
+    await test.lua_send("frame.display.bitmap(1, 1, 4, 2, 0, '\\xA5')")
+    await test.lua_send("frame.display.bitmap_rle(1, 1, 16, 0, '\\x0F\\xF1\\x0F\\xF2')")
+    await test.lua_send("frame.display.bitmap_rle(1, 1, 16, 0, '')")
+    await test.lua_error("frame.display.bitmap_rle(1, 1, 0, 0, '\\xF1')")
+    await test.lua_error("frame.display.bitmap_rle(1, 1, 16, 16, '\\xF1')")
+    await test.lua_send("frame.display.show()")
+
+    ## Stored sprites
+    await test.lua_send("frame.display.store_sprite(1, 8, 2, string.rep('\\xA5', 8))")
+    await test.lua_send("frame.display.draw_sprite(1, 1, 1)")
+    await test.lua_send("frame.display.draw_sprite(1, 100, 100, 3)")
+    await test.lua_equals("select(2, frame.display.sprite_memory())", "16384")
+    await test.lua_equals("(frame.display.sprite_memory())", "16376")
+    await test.lua_send("frame.display.free_sprite(1)")
+    await test.lua_equals("(frame.display.sprite_memory())", "16384")
+    await test.lua_error("frame.display.draw_sprite(1, 1, 1)")
+    await test.lua_error("frame.display.store_sprite(129, 8, 2, '\\xA5')")
+    await test.lua_error("frame.display.store_sprite(1, 8, 3, '\\xA5')")
+    await test.lua_error("frame.display.store_sprite(1, 8, 2, string.rep('a', 16385))")
+    await test.lua_send("for i=1,40 do frame.display.text('Hello', 1, 1) end")
+    await test.lua_send("frame.display.show()")
 
     # Camera
 
@@ -129,8 +198,29 @@ async def main():
     await test.lua_send("frame.sleep(0.1)")
     await test.lua_send("frame.camera.capture()")
     await test.lua_equals("#frame.camera.read(123)", "123")
+
+    ## Save directly to a file
+    await test.lua_send("frame.camera.capture()")
+    await test.lua_send("frame.sleep(0.1)")
+    await test.lua_send("n,t=frame.camera.save('image.jpg')")
+    await test.lua_equals("n > 625", "true")
+    await test.lua_is_type("t", "number")
+    await test.lua_equals("frame.camera.read(10)", "nil")
+    await test.lua_send("f=frame.file.open('image.jpg')")
+    await test.lua_equals("f:size() == n", "true")
+    await test.lua_equals("f:read(2) == '\\xFF\\xD8'", "true")
+    await test.lua_send("f:close()")
+    await test.lua_send("frame.file.remove('image.jpg')")
+
+    ## Saving a partly read capture is an error
+    await test.lua_send("frame.camera.capture()")
+    await test.lua_send("frame.sleep(0.1)")
+    await test.lua_equals("#frame.camera.read(10)", "10")
+    await test.lua_error("frame.camera.save('image.jpg')")
+
     await test.lua_send("frame.camera.sleep()")
     await test.lua_error("frame.camera.capture()")
+    await test.lua_error("frame.camera.save('image.jpg')")
 
     ## Resolution, scale & color format
     # TODO
@@ -176,6 +266,38 @@ async def main():
     await asyncio.sleep(0.1)
     await test.lua_equals("#frame.microphone.read(512)", "400")
 
+    ## Audio features
+    await test.lua_send("frame.microphone.record{seconds=0.1, sample_rate=16000}")
+    await asyncio.sleep(0.2)
+    await test.lua_send("features = frame.microphone.features()")
+    await test.lua_equals("#features.bands", "5")
+    await test.lua_equals("features.rms >= 0 and features.rms <= 1", "true")
+    await test.lua_equals("features.peak_frequency <= 8000", "true")
+    await test.lua_equals("type(features.voice)", "boolean")
+
+    ## Voice only recording
+    await test.lua_send(
+        "frame.microphone.record{seconds=0.5, sample_rate=8000, voice_only=true}"
+    )
+    await test.lua_error("frame.microphone.record{voice_only=1}")
+
+    ## Encodings
+    await test.lua_send(
+        "frame.microphone.record{seconds=0.05, sample_rate=16000, encoding='adpcm'}"
+    )
+    await asyncio.sleep(0.1)
+    await test.lua_equals("#frame.microphone.read(1024)", "400")
+
+    await test.lua_send(
+        "frame.microphone.record{seconds=0.05, sample_rate=16000, encoding='ulaw'}"
+    )
+    await asyncio.sleep(0.1)
+    await test.lua_equals("#frame.microphone.read(1024)", "800")
+
+    await test.lua_error("frame.microphone.record{encoding='mp3'}")
+    await test.lua_error("frame.microphone.record{encoding='adpcm', bit_depth=8}")
+    await test.lua_error("frame.microphone.read(4100)")
+
     ## Continuous readout
     # TODO
 
@@ -240,6 +362,38 @@ async def main():
     await test.lua_equals("frame.time.date(1698943733)['day of year']", "305")
     await test.lua_equals("frame.time.date(1698943733)['is daylight saving']", "false")
 
+    ## Timers
+    await test.lua_send("t=0 frame.time.set_timeout(function() t=t+1 end, 0.05)")
+    await test.lua_equals("t", "0")
+    await test.lua_send("frame.sleep(0.1)")
+    await test.lua_equals("t", "1")
+    await test.lua_send("i=frame.time.set_interval(function() t=t+1 end, 0.02)")
+    await test.lua_send("frame.sleep(0.11)")
+    await test.lua_equals("t >= 5", "true")
+    await test.lua_send("frame.time.clear_timer(i) t=0 frame.sleep(0.05)")
+    await test.lua_equals("t", "0")
+    await test.lua_error("frame.time.set_interval(function() end, 0)")
+    await test.lua_error("frame.time.set_timeout(1, 1)")
+
+    ## Tasks
+    await test.lua_error("frame.wait(0.1)")
+    await test.lua_send(
+        "s='' frame.spawn(function(a) for i=1,3 do s=s..a frame.wait(0.02) end end, 'a')"
+    )
+    await test.lua_send(
+        "frame.spawn(function() for i=1,3 do frame.wait(0.01) s=s..'b' frame.wait(0.02) end end)"
+    )
+    await test.lua_send("frame.run()")
+    await test.lua_equals("s", "ababab")
+    await test.lua_error("frame.spawn(function() error('x') end) frame.run()")
+    await test.lua_error("frame.spawn(function() frame.wait('keypress') end) frame.run()")
+
+    ## Break from a task that never yields
+    await test.send_lua("frame.spawn(function() while true do end end) frame.run()")
+    await asyncio.sleep(1)
+    await test.send_break_signal()
+    await test.lua_equals("1 + 1", "2")
+
     # System functions
 
     ## Resets
@@ -266,9 +420,71 @@ async def main():
     ## Update function exists
     await test.lua_is_type("frame.update", "function")
 
+    ## Memory introspection
+    await test.lua_is_type("frame.system.memory()", "table")
+    await test.lua_is_type("frame.system.memory().free", "number")
+    await test.lua_is_type("frame.system.memory().largest_free_block", "number")
+    await test.lua_is_type("frame.system.memory().high_water_mark", "number")
+    await test.lua_is_type("frame.system.memory().lua_count", "number")
+    await test.lua_equals("frame.system.memory().stack_size", "8192")
+    await test.lua_is_type("frame.system.memory().stack_high_water_mark", "number")
+    await test.lua_is_type("frame.system.memory().transient.free", "number")
+    await test.lua_send(
+        "frame.system.without_gc(function() local trace=frame.system.memory_trace; "
+        + "base=trace(function() end); "
+        + "used=trace(function() for i=1,10 do local t={} end end) end)"
+    )
+    await test.lua_equals("used.allocations - base.allocations", "10")
+    await test.lua_equals("used.bytes_allocated > base.bytes_allocated", "true")
+    await test.lua_error("frame.system.memory_trace(function() error('x') end)")
+    await test.lua_error("frame.system.memory_trace(1)")
+
+    ## Garbage collector control
+    await test.lua_equals("frame.system.gc()", "incremental")
+    await test.lua_equals("frame.system.gc{mode='generational'}", "incremental")
+    await test.lua_equals("frame.system.gc{mode='incremental', pause=150}", "generational")
+    await test.lua_send("frame.system.gc{stepmul=200, idle=false}")
+    await test.lua_send("frame.system.gc{idle=true}")
+    await test.lua_error("frame.system.gc{mode='manual'}")
+    await test.lua_error("frame.system.gc{pause=-1}")
+
+    ## Idle collection wakes up and sleeps again in both modes
+    await test.lua_send("frame.system.gc{mode='generational'}")
+    await test.lua_error("frame.system.gc{pause=150}")
+    await test.lua_send("t=frame.time.utc(); frame.sleep(0.05); t=frame.time.utc()-t")
+    await test.lua_equals("t >= 0.05 and t < 0.1", "true")
+    await test.lua_send("frame.system.gc{mode='incremental'}")
+    await test.lua_send("t=frame.time.utc(); frame.sleep(0.05); t=frame.time.utc()-t")
+    await test.lua_equals("t >= 0.05 and t < 0.1", "true")
+    await test.lua_equals("frame.system.without_gc(function(a) return a + 1 end, 1)", "2")
+    await test.lua_equals("collectgarbage('isrunning')", "true")
+    await test.lua_error("frame.system.without_gc(function() error('x') end)")
+    await test.lua_equals("collectgarbage('isrunning')", "true")
+
+    # IO stats
+    await test.lua_send("frame.system.reset_stats()")
+    await test.lua_equals("frame.system.stats().spi_read.count", "0")
+    await test.lua_send("frame.fpga.read(0xDB, 1)")
+    await test.lua_equals("frame.system.stats().spi_read.count", "1")
+    await test.lua_equals("frame.system.stats().spi_read.bytes", "1")
+    await test.lua_equals("frame.system.stats().spi_read.max_us > 0", "true")
+    await test.lua_is_type("frame.system.stats().i2c_write.retries", "number")
+    await test.lua_is_type("frame.system.stats().lz4_load.avg_us", "number")
+
+    # Profiler
+    await test.lua_equals("frame.system.profile.is_running()", "false")
+    await test.lua_error("frame.system.profile.start(0)")
+    await test.lua_send("frame.system.profile.start(1)")
+    await test.lua_equals("frame.system.profile.is_running()", "true")
+    await test.lua_error("frame.system.profile.dump()")
+    await test.lua_send("for i=1,20000 do local x=math.sqrt(i) end frame.sleep(0.05)")
+    await test.lua_equals("frame.system.profile.stop() > 0", "true")
+    await test.lua_equals("string.byte(frame.system.profile.dump())", "1")
+
     ## FPGA IO
     await test.lua_equals("string.byte(frame.fpga.read(0xDB, 1))", "129")
     await test.lua_send("frame.fpga.write(0xDC, 'test data')")
+    await test.lua_send("frame.display.text('Hello', 1, 1) frame.fpga.fence()")
 
     # File handling
 
@@ -329,6 +545,111 @@ async def main():
     await test.lua_send("frame.file.remove('/this')")
     await test.lua_equals("#frame.file.listdir('/')", "2")
 
+    ## Multi-packet uploads
+    data = bytes(range(256)) * 4
+    await test.upload_equals(data, 0x01, "upload.bin", zlib.crc32(data), 0x00)
+    await test.lua_send("f=frame.file.open('upload.bin', 'r')")
+    await test.lua_equals("f:size()", "1024")
+    await test.lua_equals("f:read(3) == '\\x00\\x01\\x02'", "true")
+    await test.lua_send("f:close()")
+    await test.upload_equals(data, 0x01, "upload.bin", 0, 0x03)
+    await test.lua_send("frame.file.remove('upload.bin')")
+    await test.lua_equals("#frame.file.listdir('/')", "2")
+
+    script = " ".join(f"u=(u or 0)+{i}" for i in range(100)).encode()
+    await test.upload_equals(script, 0x00, "", zlib.crc32(script), 0x00)
+    await test.lua_equals("u", "4950")
+
+    # Compression
+
+    ## One shot and streamed decompression of an LZ4 frame of 'hello world '
+    await test.lua_send(
+        "c='\\x04\\x22\\x4D\\x18\\x64\\x40\\xA7\\x17\\x00\\x00\\x00\\xCF\\x68\\x65\\x6C\\x6C\\x6F\\x20\\x77\\x6F\\x72\\x6C\\x64\\x20\\x0C\\x00\\xFF\\xBD\\x50\\x6F\\x72\\x6C\\x64\\x20\\x00\\x00\\x00\\x00\\xFE\\x7D\\xCB\\x2C'"
+    )
+    await test.lua_send("t={}")
+    await test.lua_equals(
+        "frame.compression.decompress(c, function(s) t[#t+1]=s end)", "480"
+    )
+    await test.lua_equals("table.concat(t) == string.rep('hello world ', 40)", "true")
+    await test.lua_send("t={}")
+    await test.lua_send("d=frame.compression.decoder(function(s) t[#t+1]=s end)")
+    await test.lua_send("for i=1,#c,5 do d:feed(c:sub(i,i+4)) end")
+    await test.lua_equals("d:finish()", "480")
+    await test.lua_equals("table.concat(t) == string.rep('hello world ', 40)", "true")
+    await test.lua_error("d:feed(c)")
+
+    ## Decompressing into a file
+    await test.lua_send("f=frame.file.open('test.txt', 'w')")
+    await test.lua_send("frame.compression.decompress(c, f)")
+    await test.lua_send("f:close()")
+    await test.lua_send("f=frame.file.open('test.txt', 'r')")
+    await test.lua_equals("f:size()", "480")
+    await test.lua_send("f:close()")
+    await test.lua_send("frame.file.remove('test.txt')")
+
+    ## Decompressing into a buffer
+    await test.lua_send("b=frame.buffer.new(480)")
+    await test.lua_equals("frame.compression.decompress(c, b)", "480")
+    await test.lua_equals("b:tostring() == string.rep('hello world ', 40)", "true")
+    await test.lua_error("frame.compression.decompress(c, frame.buffer.new(479))")
+
+    ## Invalid data
+    await test.lua_error("frame.compression.decompress(c:sub(1, -3), print)")
+    await test.lua_error("frame.compression.decompress('hello', print)")
+    await test.lua_error("frame.compression.decompress(c, 123)")
+    await test.lua_error("frame.compression.decompress(c, print, 8)")
+
+    # Buffers
+
+    ## Creating, writing and reading
+    await test.lua_send("b=frame.buffer.new(16, 'abc')")
+    await test.lua_equals("#b .. ' ' .. b:capacity()", "3 16")
+    await test.lua_equals("b[1]", "97")
+    await test.lua_send("b:append('def')")
+    await test.lua_equals("b:tostring()", "abcdef")
+    await test.lua_send("b:set_u16(7, 0x1234)")
+    await test.lua_equals("b:get_u16(7)", "4660")
+    await test.lua_equals("b:get_u16(7, true)", "13330")
+    await test.lua_send("b:set_i32(9, -2)")
+    await test.lua_equals("b:get_i32(9)", "-2")
+    await test.lua_equals("b:get_u32(9)", "4294967294")
+    await test.lua_send("b:fill(0, 13, 16)")
+    await test.lua_equals("#b", "16")
+    await test.lua_error("b:append('x')")
+    await test.lua_error("frame.buffer.new(0)")
+    await test.lua_error("frame.buffer.new(0xFFFFFFF8)")
+    await test.lua_error("frame.buffer.new(frame.system.memory().total + 1)")
+
+    ## Ranges ending at or past the capacity are clamped
+    await test.lua_send("c=frame.buffer.new(4)")
+    await test.lua_send("c:fill(7, 1, 4)")
+    await test.lua_equals("#c", "4")
+    await test.lua_send("c:fill(1, 1, 5)")
+    await test.lua_equals("#c .. ' ' .. c:capacity()", "4 4")
+    await test.lua_equals("#c:tostring(1, 5)", "4")
+    await test.lua_equals("#c:slice(2, 5)", "3")
+    await test.lua_equals("c:tostring(3, 2)", "")
+    await test.lua_error("c:fill(0, 6)")
+
+    ## Slices share the same memory
+    await test.lua_send("s=b:slice(2, 3)")
+    await test.lua_send("s[1]=120")
+    await test.lua_equals("b:tostring(1, 3)", "axc")
+
+    ## Passing buffers to other libraries
+    await test.lua_send("f=frame.file.open('buffer.bin', 'w')")
+    await test.lua_send("f:write(b:slice(1, 6))")
+    await test.lua_send("f:close()")
+    await test.lua_send("f=frame.file.open('buffer.bin', 'r')")
+    await test.lua_send("b:clear()")
+    await test.lua_equals("f:read(b) == b", "true")
+    await test.lua_equals("b:tostring()", "axcdef")
+    await test.lua_equals("f:read(b)", "nil")
+    await test.lua_send("f:close()")
+    await test.lua_send("frame.file.remove('buffer.bin')")
+    await test.lua_send("frame.bluetooth.send(b:slice(1, 3))")
+    await test.lua_error("frame.microphone.read(512, b)")
+
     # Standard libraries
     await test.lua_equals("math.sqrt(25)", "5.0")
 
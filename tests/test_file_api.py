@@ -107,9 +107,86 @@ async def main():
     await test.lua_equals("f:read()", "test 789")
     await test.lua_send("f:close()")
 
+    ## Binary data, read lengths, seek, tell and size
+    await test.lua_send("f=frame.file.open('test.lua', 'w')")
+    await test.lua_send("f:write('ab\\0cd\\0')")
+    await test.lua_equals("f:append_many({'12', '\\0', '345'})", "6")
+    await test.lua_equals("f:tell()", "12")
+    await test.lua_send("f:flush()")
+    await test.lua_equals("f:size()", "12")
+    await test.lua_equals("f:seek('set', 1)", "1")
+    await test.lua_equals("#f:read(4)", "4")
+    await test.lua_equals("f:seek('end', -3)", "9")
+    await test.lua_equals("f:read(10)", "345")
+    await test.lua_equals("f:read(1)", "nil")
+    await test.lua_equals("f:seek('set')", "0")
+    await test.lua_equals("#f:read('a')", "12")
+    await test.lua_error("f:append_many({'1', 2})")
+    await test.lua_send(
+        "p=setmetatable({}, {__len=function() return 2 end, "
+        + "__index=function() return string.rep('x', 100) end})"
+    )
+    await test.lua_equals("f:append_many(p)", "0")
+    await test.lua_error("f:seek('middle')")
+    await test.lua_send("f:close()")
+
+    await test.lua_send("f=frame.file.open('test.lua', 'r')")
+    await test.lua_equals("f:read(3) == 'ab\\0'", "true")
+    await test.lua_error("f:append_many({'000'})")
+    await test.lua_send("f:close()")
+
+    ## Compressed files
+    await test.lua_send("s=string.rep('frame.display.text(\\'hello\\', 1, 1)\\n', 200)")
+    await test.lua_send("f=frame.file.open('test.lua', 'wz')")
+    await test.lua_send("f:write(s)")
+    await test.lua_equals("f:size() == #s", "true")
+    await test.lua_error("f:read(1)")
+    await test.lua_error("f:seek('set', 0)")
+    await test.lua_send("f:close()")
+    await test.lua_equals("frame.file.listdir('/')[3]['size'] < #s / 2", "true")
+    await test.lua_send("f=frame.file.open('test.lua', 'r')")
+    await test.lua_equals("f:size() == #s", "true")
+    await test.lua_equals("f:read()", "frame.display.text('hello', 1, 1)")
+    await test.lua_equals("f:seek('set', 4000)", "4000")
+    await test.lua_equals("f:read(10) == s:sub(4001, 4010)", "true")
+    await test.lua_send("f:seek('set', 0)")
+    await test.lua_equals("f:read('a') == s", "true")
+    await test.lua_send("f:close()")
+    await test.lua_error("frame.file.open('test.lua', 'az')")
+    await test.lua_error("frame.file.open('test.lua', 'a')")
+    await test.lua_send("frame.file.remove('test.lua')")
+
+    await test.lua_send("f=frame.file.open('compressed.lua', 'wz')")
+    await test.lua_send("f:write('return 40 + 2')")
+    await test.lua_send("f:close()")
+    await test.lua_equals("require('compressed')", "42")
+    await test.lua_send("frame.file.remove('compressed.lua')")
+
+    ## Files left open are closed on reset
+    await test.lua_send("f=frame.file.open('open.txt', 'w');f:write('plain')")
+    await test.lua_send("g=frame.file.open('open.lua', 'wz');g:write('return 7')")
+    await test.send_reset_signal()
+    await asyncio.sleep(1)
+    await test.lua_send("f=frame.file.open('open.txt', 'r')")
+    await test.lua_equals("f:read('a')", "plain")
+    await test.lua_send("f:close()")
+    await test.lua_equals("require('open')", "7")
+    await test.lua_send("frame.file.remove('open.txt')")
+    await test.lua_send("frame.file.remove('open.lua')")
+
+    ## Files are closed when collected or going out of scope
+    await test.lua_send("do local g <close> = frame.file.open('test.lua', 'a') end")
+    await test.lua_send("frame.file.open('test.lua', 'r');collectgarbage()")
+
+    await test.lua_send("f=frame.file.open('test.lua', 'w')")
+    await test.lua_send("f:write('test 789')")
+    await test.lua_send("f:close()")
+
     ## Prevent operations when file is closed
     await test.lua_error("f:read()")
     await test.lua_error("f:write('000')")
+    await test.lua_error("f:seek('set', 0)")
+    await test.lua_error("f:size()")
     await test.lua_error("f:close()")
 
     ## List, rename and delete file
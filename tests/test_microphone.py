@@ -10,6 +10,51 @@ import numpy as np
 audio_buffer = b""
 expected_samples = 0
 
+ADPCM_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8] * 2
+
+ADPCM_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+    45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209,
+    230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876,
+    963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749,
+    3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630,
+    9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+    27086, 29794, 32767,
+]  # fmt: skip
+
+
+def decode_adpcm(data: bytes):
+    predictor = 0
+    index = 0
+    samples = []
+
+    # The first sample of each pair is in the low nibble
+    for byte in data:
+        for code in (byte & 0x0F, byte >> 4):
+            step = ADPCM_STEP_TABLE[index]
+            delta = step >> 3
+            if code & 4:
+                delta += step
+            if code & 2:
+                delta += step >> 1
+            if code & 1:
+                delta += step >> 2
+
+            predictor += -delta if code & 8 else delta
+            predictor = max(-32768, min(32767, predictor))
+            index = max(0, min(88, index + ADPCM_INDEX_TABLE[code]))
+            samples.append(predictor)
+
+    return np.array(samples, dtype=np.int16)
+
+
+def decode_ulaw(data: bytes):
+    codes = ~np.frombuffer(data, dtype=np.uint8)
+    exponent = (codes >> 4) & 0x07
+    mantissa = codes & 0x0F
+    magnitude = ((mantissa.astype(np.int32) << 3) + 0x84 << exponent) - 0x84
+    return np.where(codes & 0x80, -magnitude, magnitude).astype(np.int16)
+
 
 def receive_data(data):
     global audio_buffer
@@ -21,13 +66,17 @@ def receive_data(data):
     )
 
 
-async def record_and_play(b: Bluetooth, seconds, sample_rate, bit_depth):
+async def record_and_play(
+    b: Bluetooth, seconds, sample_rate, bit_depth, encoding="pcm"
+):
     global audio_buffer
     global expected_samples
 
-    print(f"Recording {seconds} seconds at {sample_rate/1000}kHz {bit_depth}bit")
+    print(
+        f"Recording {seconds} seconds at {sample_rate/1000}kHz {bit_depth}bit {encoding}"
+    )
     await b.send_lua(
-        f"frame.microphone.record{{seconds={seconds}, sample_rate={sample_rate}, bit_depth={bit_depth}}}"
+        f"frame.microphone.record{{seconds={seconds}, sample_rate={sample_rate}, bit_depth={bit_depth}, encoding='{encoding}'}}"
     )
     await asyncio.sleep(0.5)
 
@@ -42,19 +91,25 @@ async def record_and_play(b: Bluetooth, seconds, sample_rate, bit_depth):
 
     print("\nConverting to audio")
 
-    # Convert audio bytes to a NumPy array of type int8
-    if bit_depth == 16:
-        audio_data = np.frombuffer(audio_buffer, dtype=np.int16)
-    if bit_depth == 8:
+    # Convert audio bytes to a NumPy array of samples
+    if encoding == "adpcm":
+        audio_data = decode_adpcm(audio_buffer)
+    elif encoding == "ulaw":
+        audio_data = decode_ulaw(audio_buffer)
+    elif bit_depth == 16:
+        audio_data = np.frombuffer(audio_buffer, dtype=">i2")
+    elif bit_depth == 8:
         audio_data = np.frombuffer(audio_buffer, dtype=np.int8)
-    if bit_depth == 4:
+    else:
         raise NotImplementedError("TODO")
 
+    full_scale = np.iinfo(audio_data.dtype).max
+
     # Convert it to float32 which is what sounddevice expects for playback
     audio_data = audio_data.astype(np.float32)
 
-    # Normalize the 8-bit data range (-128 to 127) to (-1, 1) for playback
-    audio_data /= np.iinfo(np.int8).max
+    # Normalize the data range to (-1, 1) for playback
+    audio_data /= full_scale
 
     sd.play(audio_data, sample_rate)
 
@@ -72,6 +127,10 @@ async def main():
 
     await record_and_play(b, 2.5, 16000, 16)
 
+    await record_and_play(b, 2.5, 16000, 8, "ulaw")
+
+    await record_and_play(b, 5, 16000, 4, "adpcm")
+
     await b.disconnect()
 
 
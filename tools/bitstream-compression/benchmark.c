@@ -0,0 +1,135 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Host benchmark for the firmware decompressor. Build once per codec with the
+ * matching COMPRESSION_CODEC define. Cycle counts come from the host's time
+ * stamp counter so only compare them against each other, not against the nRF52
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "compression.h"
+#include "memory.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define read_cycles() __rdtsc()
+#else
+static uint64_t read_cycles(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+// The firmware pools aren't needed on the host
+void *memory_allocate(memory_pool_id_t pool, size_t size)
+{
+    (void)pool;
+    return malloc(size);
+}
+
+void memory_free(void *pointer)
+{
+    free(pointer);
+}
+
+static void count_bytes(void *context, void *data, size_t data_size)
+{
+    (void)data;
+    *(size_t *)context += data_size;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <compressed file> <block size> [runs]\n",
+                argv[0]);
+        return 1;
+    }
+
+    size_t block_size = strtoul(argv[2], NULL, 0);
+    int runs = argc > 3 ? atoi(argv[3]) : 20;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t source_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *source = malloc(source_size);
+    if (source == NULL || fread(source, 1, source_size, file) != source_size)
+    {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(file);
+
+    size_t output_size = 0;
+    uint64_t best_cycles = UINT64_MAX;
+    int status = 0;
+
+    for (int run = 0; run < runs; run++)
+    {
+        output_size = 0;
+
+        uint64_t start = read_cycles();
+        status = compression_decompress(block_size,
+                                        source,
+                                        source_size,
+                                        count_bytes,
+                                        &output_size);
+        uint64_t cycles = read_cycles() - start;
+
+        if (status != COMPRESSION_SUCCESS)
+        {
+            break;
+        }
+
+        if (cycles < best_cycles)
+        {
+            best_cycles = cycles;
+        }
+    }
+
+    printf("status=%d compressed=%zu decompressed=%zu cycles_per_byte=%.3f\n",
+           status,
+           source_size,
+           output_size,
+           output_size ? (double)best_cycles / output_size : 0.0);
+
+    free(source);
+
+    return status == COMPRESSION_SUCCESS ? 0 : 1;
+}
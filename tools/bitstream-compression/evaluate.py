@@ -0,0 +1,108 @@
+"""
+Compares bitstream compression options for fpga_application.h.
+
+Each candidate is compressed, decompressed with the firmware's own decoder (see
+benchmark.c), and reported with its compressed size and host cycles per byte.
+Candidates which the firmware can't decode are still listed for reference.
+"""
+
+import argparse, os, re, subprocess, tempfile
+import lzss
+
+# (name, block size, lz4 arguments, decodable by firmware)
+LZ4_CANDIDATES = [
+    ("lz4 -9 4KB (current)", 4096, ["-9", "-B4096"], True),
+    ("lz4 -12 4KB", 4096, ["-12", "-B4096"], True),
+    ("lz4 -12 4KB no checksum", 4096, ["-12", "-B4096", "--no-frame-crc"], True),
+    ("lz4 -12 16KB", 16384, ["-12", "-B16384"], True),
+    ("lz4 -12 64KB", 65536, ["-12", "-B65536"], True),
+    ("lz4 -12 4KB linked blocks", 4096, ["-12", "-B4096", "-BD"], False),
+]
+
+LZSS_CANDIDATES = [
+    ("lzss 4KB", 4096),
+    ("lzss 2KB", 2048),
+]
+
+
+def bitstream_from_header(path: str, directory: str) -> bytes:
+    with open(path) as file:
+        data = bytes(int(x, 16) for x in re.findall(r"0x([0-9a-fA-F]{2})", file.read()))
+
+    compressed = os.path.join(directory, "fpga_application.lz4")
+    with open(compressed, "wb") as file:
+        file.write(data)
+
+    return subprocess.run(
+        ["lz4", "-d", "-c", compressed], check=True, capture_output=True
+    ).stdout
+
+
+def benchmark(binary: str, path: str, block_size: int) -> dict:
+    result = subprocess.run(
+        [binary, path, str(block_size)], capture_output=True, text=True
+    )
+    return dict(pair.split("=") for pair in result.stdout.split())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("bitstream", nargs="?", help="uncompressed .bit file")
+    parser.add_argument("--from-header", help="recover the bitstream from an fpga_application.h")
+    parser.add_argument("--benchmark-directory", default="../../build/bitstream-compression")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        if args.bitstream:
+            with open(args.bitstream, "rb") as file:
+                bitstream = file.read()
+        elif args.from_header:
+            bitstream = bitstream_from_header(args.from_header, directory)
+        else:
+            parser.error("either a bitstream or --from-header is required")
+
+        results = []
+
+        input = os.path.join(directory, "bitstream.bit")
+        with open(input, "wb") as file:
+            file.write(bitstream)
+
+        for name, block_size, options, supported in LZ4_CANDIDATES:
+            path = os.path.join(directory, "candidate.lz4")
+            subprocess.run(["lz4", "-q", "-f", *options, input, path], check=True)
+            binary = os.path.join(args.benchmark_directory, "benchmark_lz4")
+            stats = benchmark(binary, path, block_size) if supported else {}
+            results.append((name, block_size, supported, os.path.getsize(path), stats))
+
+        for name, block_size in LZSS_CANDIDATES:
+            path = os.path.join(directory, "candidate.lzss")
+            with open(path, "wb") as file:
+                file.write(lzss.compress(bitstream, block_size))
+            binary = os.path.join(args.benchmark_directory, "benchmark_lzss")
+            stats = benchmark(binary, path, block_size)
+            results.append((name, block_size, True, os.path.getsize(path), stats))
+
+    baseline = results[0][3]
+
+    print(f"Bitstream: {len(bitstream)} bytes\n")
+    print(f"{'Candidate':<28}{'Size':>9}{'Ratio':>8}{'vs now':>9}{'RAM':>8}{'Cycles/B':>10}  Decoded")
+
+    for name, block_size, supported, size, stats in results:
+        ratio = len(bitstream) / size
+        change = 100.0 * (size - baseline) / baseline
+
+        if not supported:
+            cycles, decoded = "-", "unsupported"
+        elif stats.get("status") == "0" and int(stats["decompressed"]) == len(bitstream):
+            cycles, decoded = stats["cycles_per_byte"], "ok"
+        else:
+            cycles, decoded = "-", f"FAILED ({stats.get('status')})"
+
+        # Two block buffers are needed for double buffering
+        ram = f"{2 * block_size // 1024}KB"
+
+        print(f"{name:<28}{size:>9}{ratio:>8.2f}{change:>+8.1f}%{ram:>8}{cycles:>10}  {decoded}")
+
+
+if __name__ == "__main__":
+    main()
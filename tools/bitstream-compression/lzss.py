@@ -0,0 +1,160 @@
+"""
+Compresses a file into the LZSS frame format understood by compression.c when
+the firmware is built with COMPRESSION_CODEC=LZSS.
+
+Frame layout (all integers little endian):
+    u32 magic (0x535A4C46)
+    u32 maximum decompressed block size
+    blocks, each as a u32 size followed by the block data. The MSB of the size
+        marks a block that is stored uncompressed. A size of 0 ends the frame
+    u32 XXH32 checksum of the decompressed content
+
+Each compressed block starts with a flag byte describing the next eight tokens,
+LSB first. A set bit is a literal byte. A clear bit is a two byte match made up
+of a 12 bit offset and 4 bit length. A length field of 15 is followed by one
+extra byte which extends the match up to 273 bytes.
+"""
+
+import argparse, struct
+
+MAGIC = 0x535A4C46
+MIN_MATCH = 3
+MAX_MATCH = 18 + 255
+MAX_OFFSET = 4096
+
+
+def xxh32(data: bytes, seed: int = 0) -> int:
+    p1, p2, p3, p4, p5 = 0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F, 0x165667B1
+    mask = 0xFFFFFFFF
+
+    def rotl(x, r):
+        return ((x << r) | (x >> (32 - r))) & mask
+
+    def round(acc, value):
+        return (rotl((acc + value * p2) & mask, 13) * p1) & mask
+
+    length = len(data)
+    index = 0
+
+    if length >= 16:
+        v = [(seed + p1 + p2) & mask, (seed + p2) & mask, seed, (seed - p1) & mask]
+        while index + 16 <= length:
+            for lane in range(4):
+                value = struct.unpack_from("<I", data, index + lane * 4)[0]
+                v[lane] = round(v[lane], value)
+            index += 16
+        hash = (rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18)) & mask
+    else:
+        hash = (seed + p5) & mask
+
+    hash = (hash + length) & mask
+
+    while index + 4 <= length:
+        value = struct.unpack_from("<I", data, index)[0]
+        hash = (rotl((hash + value * p3) & mask, 17) * p4) & mask
+        index += 4
+
+    while index < length:
+        hash = (rotl((hash + data[index] * p5) & mask, 11) * p1) & mask
+        index += 1
+
+    hash ^= hash >> 15
+    hash = (hash * p2) & mask
+    hash ^= hash >> 13
+    hash = (hash * p3) & mask
+    hash ^= hash >> 16
+
+    return hash
+
+
+def compress_block(block: bytes, chain_depth: int) -> bytes:
+    output = bytearray()
+    flag_index = 0
+    token = 8
+    chains = {}
+    position = 0
+
+    def insert(at):
+        if at + MIN_MATCH <= len(block):
+            chains.setdefault(block[at : at + MIN_MATCH], []).append(at)
+
+    while position < len(block):
+        if token == 8:
+            flag_index = len(output)
+            output.append(0)
+            token = 0
+
+        best_length = 0
+        best_offset = 0
+        candidates = chains.get(block[position : position + MIN_MATCH], [])
+
+        for candidate in reversed(candidates[-chain_depth:]):
+            offset = position - candidate
+            if offset > MAX_OFFSET:
+                break
+
+            length = MIN_MATCH
+            limit = min(MAX_MATCH, len(block) - position)
+            while length < limit and block[candidate + length] == block[position + length]:
+                length += 1
+
+            if length > best_length:
+                best_length = length
+                best_offset = offset
+                if length == limit:
+                    break
+
+        if best_length >= MIN_MATCH:
+            field = min(best_length - MIN_MATCH, 15)
+            output.append((best_offset - 1) & 0xFF)
+            output.append((((best_offset - 1) >> 8) << 4) | field)
+            if field == 15:
+                output.append(best_length - 18)
+            for at in range(position, position + best_length):
+                insert(at)
+            position += best_length
+        else:
+            output[flag_index] |= 1 << token
+            output.append(block[position])
+            insert(position)
+            position += 1
+
+        token += 1
+
+    return bytes(output)
+
+
+def compress(data: bytes, block_size: int = 4096, chain_depth: int = 32) -> bytes:
+    if block_size > MAX_OFFSET:
+        raise ValueError("block size cannot be larger than 4096")
+
+    frame = bytearray(struct.pack("<II", MAGIC, block_size))
+
+    for start in range(0, len(data), block_size):
+        block = data[start : start + block_size]
+        compressed = compress_block(block, chain_depth)
+
+        if len(compressed) < len(block):
+            frame += struct.pack("<I", len(compressed)) + compressed
+        else:
+            frame += struct.pack("<I", len(block) | 0x80000000) + block
+
+    frame += struct.pack("<I", 0)
+    frame += struct.pack("<I", xxh32(data))
+
+    return bytes(frame)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("input")
+    parser.add_argument("output")
+    parser.add_argument("-B", "--block-size", type=int, default=4096)
+    parser.add_argument("--chain-depth", type=int, default=32)
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as file:
+        data = file.read()
+
+    with open(args.output, "wb") as file:
+        file.write(compress(data, args.block_size, args.chain_depth))
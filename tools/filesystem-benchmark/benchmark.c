@@ -0,0 +1,397 @@
+/*
+ * This file is a part of: https://github.com/brilliantlabsAR/frame-codebase
+ *
+ * Authored by: Raj Nakarja / Brilliant Labs Ltd. (raj@brilliant.xyz)
+ *              Rohit Rathnam / Silicon Witchery AB (rohit@siliconwitchery.com)
+ *              Uma S. Gupta / Techno Exponent (umasankar@technoexponent.com)
+ *
+ * ISC Licence
+ *
+ * Copyright © 2023 Brilliant Labs Ltd.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Host benchmark for the littlefs configuration used in file.c. The nRF52
+ * flash is emulated in RAM and every softdevice call the block device layer
+ * would make is counted. Each configuration is run twice: once with the old
+ * word at a time programming, and once with a whole run per call.
+ *
+ * Times are estimated from the nRF52840 datasheet maximums (41us per word,
+ * 85ms per page erase) plus an assumed 100us per softdevice flash call for
+ * scheduling and the completion event. Only compare them to each other.
+ *
+ * Afterwards, an image made with the old 8 byte programs is mounted the way
+ * file.c does, appended to, and checked. Words programmed more often than the
+ * nRF52840 allows between erases are counted as failures.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lfs.h"
+
+#define PAGE_SIZE 4096
+#define WORD_TIME_US 41.0
+#define ERASE_TIME_US 85000.0
+#define CALL_OVERHEAD_US 100.0
+#define MAX_WORD_WRITES 2
+
+// Must match file.c
+#define PROG_SIZE 16
+#define LEGACY_PROG_SIZE 8
+#define PROG_SIZE_ATTRIBUTE 0x50
+
+static uint8_t *flash;
+static uint8_t *word_writes;
+
+static struct
+{
+    bool word_at_a_time;
+    unsigned long program_calls;
+    unsigned long words_programmed;
+    unsigned long erases;
+    unsigned long bytes_read;
+    unsigned long word_overwrites;
+} counters;
+
+static int read_block(const struct lfs_config *c,
+                      lfs_block_t block,
+                      lfs_off_t off,
+                      void *buffer,
+                      lfs_size_t size)
+{
+    memcpy(buffer, flash + block * c->block_size + off, size);
+    counters.bytes_read += size;
+    return 0;
+}
+
+static int program_block(const struct lfs_config *c,
+                         lfs_block_t block,
+                         lfs_off_t off,
+                         const void *buffer,
+                         lfs_size_t size)
+{
+    uint8_t *destination = flash + block * c->block_size + off;
+    const uint8_t *source = buffer;
+
+    // Flash can only clear bits
+    for (lfs_size_t i = 0; i < size; i++)
+    {
+        destination[i] &= source[i];
+    }
+
+    size_t word = (block * c->block_size + off) / 4;
+
+    for (lfs_size_t i = 0; i < size / 4; i++)
+    {
+        if (++word_writes[word + i] > MAX_WORD_WRITES)
+        {
+            counters.word_overwrites++;
+        }
+    }
+
+    counters.words_programmed += size / 4;
+    counters.program_calls += counters.word_at_a_time ? size / 4 : 1;
+    return 0;
+}
+
+static int erase_block(const struct lfs_config *c, lfs_block_t block)
+{
+    memset(flash + block * c->block_size, 0xFF, c->block_size);
+    memset(word_writes + block * c->block_size / 4, 0, c->block_size / 4);
+    counters.erases++;
+    return 0;
+}
+
+static int sync_block(const struct lfs_config *c)
+{
+    return 0;
+}
+
+typedef struct configuration_t
+{
+    lfs_size_t read_size;
+    lfs_size_t prog_size;
+    lfs_size_t cache_size;
+    lfs_size_t lookahead_size;
+} configuration_t;
+
+static const configuration_t configurations[] = {
+    {8, 8, 32, 8},
+    {16, 16, 128, 16},
+    {16, 16, 256, 32},
+    {16, 16, 512, 64},
+    {16, 16, 1024, 64},
+    {32, 32, 512, 64},
+};
+
+typedef enum workload_t
+{
+    WRITE_50KB,
+    APPEND_LOG,
+} workload_t;
+
+static void run_workload(lfs_t *lfs, workload_t workload)
+{
+    lfs_file_t file;
+    uint8_t chunk[256];
+
+    for (size_t i = 0; i < sizeof(chunk); i++)
+    {
+        chunk[i] = (uint8_t)(i * 7);
+    }
+
+    switch (workload)
+    {
+    case WRITE_50KB:
+        // Roughly what a file upload over Bluetooth looks like
+        lfs_file_open(lfs, &file, "image.jpg", LFS_O_WRONLY | LFS_O_CREAT);
+        for (size_t written = 0; written < 50 * 1024; written += 200)
+        {
+            lfs_file_write(lfs, &file, chunk, 200);
+        }
+        lfs_file_close(lfs, &file);
+        break;
+
+    case APPEND_LOG:
+        // A logging app appending a line and closing the file every time
+        for (int line = 0; line < 200; line++)
+        {
+            lfs_file_open(lfs,
+                          &file,
+                          "log.txt",
+                          LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+            lfs_file_write(lfs, &file, chunk, 64);
+            lfs_file_close(lfs, &file);
+        }
+        break;
+    }
+}
+
+static void benchmark(const configuration_t *configuration,
+                      lfs_size_t block_count,
+                      workload_t workload,
+                      bool word_at_a_time)
+{
+    struct lfs_config config = {
+        .read = read_block,
+        .prog = program_block,
+        .erase = erase_block,
+        .sync = sync_block,
+        .read_size = configuration->read_size,
+        .prog_size = configuration->prog_size,
+        .block_size = PAGE_SIZE,
+        .block_count = block_count,
+        .cache_size = configuration->cache_size,
+        .lookahead_size = configuration->lookahead_size,
+        .block_cycles = 100,
+        .name_max = 0x100,
+        .file_max = 0x10000,
+    };
+
+    lfs_t lfs;
+    memset(flash, 0xFF, (size_t)PAGE_SIZE * block_count);
+    memset(word_writes, 0, (size_t)PAGE_SIZE / 4 * block_count);
+
+    if (lfs_format(&lfs, &config) || lfs_mount(&lfs, &config))
+    {
+        printf("failed to create filesystem\n");
+        exit(1);
+    }
+
+    memset(&counters, 0, sizeof(counters));
+    counters.word_at_a_time = word_at_a_time;
+
+    run_workload(&lfs, workload);
+
+    lfs_unmount(&lfs);
+
+    double time_ms = (counters.program_calls * CALL_OVERHEAD_US +
+                      counters.words_programmed * WORD_TIME_US +
+                      counters.erases * (ERASE_TIME_US + CALL_OVERHEAD_US)) /
+                     1000.0;
+
+    // Per open file, plus the read and program caches and lookahead buffer
+    size_t ram = 3 * configuration->cache_size + configuration->lookahead_size;
+
+    printf("%-10s %4u %4u %5u %4u  %-5s %8lu %8lu %6lu %9lu %9.0f %6zu\n",
+           workload == WRITE_50KB ? "write-50k" : "append-log",
+           configuration->read_size,
+           configuration->prog_size,
+           configuration->cache_size,
+           configuration->lookahead_size,
+           word_at_a_time ? "word" : "run",
+           counters.program_calls,
+           counters.words_programmed,
+           counters.erases,
+           counters.bytes_read,
+           time_ms,
+           ram);
+}
+
+static struct lfs_config file_c_config(lfs_size_t prog_size,
+                                       lfs_size_t block_count)
+{
+    struct lfs_config config = {
+        .read = read_block,
+        .prog = program_block,
+        .erase = erase_block,
+        .sync = sync_block,
+        .read_size = 16,
+        .prog_size = prog_size,
+        .block_size = PAGE_SIZE,
+        .block_count = block_count,
+        .cache_size = 512,
+        .lookahead_size = 64,
+        .block_cycles = 100,
+        .name_max = 0x100,
+        .file_max = 0x10000,
+    };
+
+    return config;
+}
+
+static bool log_is_intact(lfs_t *lfs, lfs_size_t lines)
+{
+    lfs_file_t file;
+    uint8_t line[64];
+
+    if (lfs_file_open(lfs, &file, "log.txt", LFS_O_RDONLY))
+    {
+        return false;
+    }
+
+    bool intact = lfs_file_size(lfs, &file) == (lfs_soff_t)(lines * 64);
+
+    for (lfs_size_t i = 0; intact && i < lines; i++)
+    {
+        intact = lfs_file_read(lfs, &file, line, sizeof(line)) == sizeof(line);
+
+        for (size_t j = 0; intact && j < sizeof(line); j++)
+        {
+            intact = line[j] == (uint8_t)(j * 7);
+        }
+    }
+
+    lfs_file_close(lfs, &file);
+    return intact;
+}
+
+// Returns false if the image written with 8 byte programs didn't survive
+static bool check_existing_image(lfs_size_t block_count)
+{
+    struct lfs_config legacy = {
+        .read = read_block,
+        .prog = program_block,
+        .erase = erase_block,
+        .sync = sync_block,
+        .read_size = 8,
+        .prog_size = LEGACY_PROG_SIZE,
+        .block_size = PAGE_SIZE,
+        .block_count = block_count,
+        .cache_size = 32,
+        .lookahead_size = 8,
+        .block_cycles = 100,
+        .name_max = 0x100,
+        .file_max = 0x10000,
+    };
+
+    lfs_t lfs;
+    memset(flash, 0xFF, (size_t)PAGE_SIZE * block_count);
+    memset(word_writes, 0, (size_t)PAGE_SIZE / 4 * block_count);
+    memset(&counters, 0, sizeof(counters));
+
+    if (lfs_format(&lfs, &legacy) || lfs_mount(&lfs, &legacy))
+    {
+        printf("failed to create filesystem\n");
+        exit(1);
+    }
+
+    run_workload(&lfs, APPEND_LOG);
+    lfs_unmount(&lfs);
+
+    // The same steps as lua_open_file_library()
+    struct lfs_config config = file_c_config(PROG_SIZE, block_count);
+    uint32_t prog_size = 0;
+    bool mounted = lfs_mount(&lfs, &config) == 0;
+
+    if (mounted &&
+        lfs_getattr(&lfs, "/", PROG_SIZE_ATTRIBUTE, &prog_size,
+                    sizeof(prog_size)) != sizeof(prog_size))
+    {
+        lfs_unmount(&lfs);
+        config = file_c_config(LEGACY_PROG_SIZE, block_count);
+        mounted = lfs_mount(&lfs, &config) == 0;
+    }
+
+    bool intact = mounted && log_is_intact(&lfs, 200);
+
+    if (intact)
+    {
+        run_workload(&lfs, APPEND_LOG);
+        intact = log_is_intact(&lfs, 400);
+        lfs_unmount(&lfs);
+    }
+
+    // And once more from a fresh mount
+    intact = intact &&
+             lfs_mount(&lfs, &config) == 0 &&
+             log_is_intact(&lfs, 400) &&
+             lfs_unmount(&lfs) == 0;
+
+    printf("\nexisting 8 byte image: mounted with %u byte programs, %s, "
+           "%lu words over-programmed\n",
+           config.prog_size,
+           intact ? "log intact" : "log damaged",
+           counters.word_overwrites);
+
+    return intact && counters.word_overwrites == 0;
+}
+
+int main(int argc, char **argv)
+{
+    lfs_size_t block_count = argc > 1 ? (lfs_size_t)atoi(argv[1]) : 64;
+
+    flash = malloc((size_t)PAGE_SIZE * block_count);
+    word_writes = malloc((size_t)PAGE_SIZE / 4 * block_count);
+    if (flash == NULL || word_writes == NULL)
+    {
+        return 1;
+    }
+
+    printf("%-10s %4s %4s %5s %4s  %-5s %8s %8s %6s %9s %9s %6s\n",
+           "workload", "read", "prog", "cache", "look", "mode",
+           "calls", "words", "erases", "read", "est. ms", "ram");
+
+    for (int workload = WRITE_50KB; workload <= APPEND_LOG; workload++)
+    {
+        benchmark(&configurations[0], block_count, workload, true);
+
+        for (size_t i = 0;
+             i < sizeof(configurations) / sizeof(configurations[0]);
+             i++)
+        {
+            benchmark(&configurations[i], block_count, workload, false);
+        }
+    }
+
+    bool compatible = check_existing_image(block_count);
+
+    free(word_writes);
+    free(flash);
+    return compatible ? 0 : 1;
+}
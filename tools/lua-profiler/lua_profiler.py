@@ -0,0 +1,156 @@
+"""
+Converts frame.system.profile.dump() results into folded stacks for flamegraphs.
+
+Each line of the output is a semicolon separated stack, outermost function
+first, followed by its sample count. Lua functions are named by their source
+and the line they're defined on, and the last Lua function is followed by the
+line that was running. Time spent inside native functions such as frame.sleep()
+appears as a final [native] frame. The output can be given to flamegraph.pl or
+loaded directly into https://speedscope.app
+
+    python3 lua_profiler.py convert profile.bin profile.folded
+    python3 lua_profiler.py capture profile.folded --lua "require('app').run()"
+"""
+
+import argparse, asyncio, struct
+
+FORMAT_VERSION = 1
+
+
+def parse(data: bytes) -> dict:
+    version, interval, samples, native, dropped = struct.unpack_from("<BHIII", data)
+    if version != FORMAT_VERSION:
+        raise ValueError(f"unsupported profile version {version}")
+
+    offset = struct.calcsize("<BHIII")
+    strings = []
+
+    count = data[offset]
+    offset += 1
+
+    for _ in range(count):
+        length = data[offset]
+        strings.append(data[offset + 1 : offset + 1 + length].decode(errors="replace"))
+        offset += 1 + length
+
+    stacks = []
+    count = data[offset]
+    offset += 1
+
+    for _ in range(count):
+        samples_in_stack, line, depth = struct.unpack_from("<IHB", data, offset)
+        offset += 7
+
+        frames = []
+        for _ in range(depth & 0x7F):
+            string, line_defined = struct.unpack_from("<BH", data, offset)
+            frames.append((strings[string], line_defined))
+            offset += 3
+
+        stacks.append((samples_in_stack, line, bool(depth & 0x80), frames))
+
+    return {
+        "interval": interval,
+        "samples": samples,
+        "native": native,
+        "dropped": dropped,
+        "stacks": stacks,
+    }
+
+
+def fold(profile: dict) -> list:
+    lines = []
+
+    for samples, line, native, frames in profile["stacks"]:
+        names = []
+        leaf = None
+
+        if native:
+            leaf = f"{frames[0][0]} [native]"
+            frames = frames[1:]
+
+        for source, line_defined in reversed(frames):
+            names.append(f"{source}:{line_defined}")
+
+        if frames:
+            names.append(f"{frames[0][0]} line {line}")
+
+        if leaf:
+            names.append(leaf)
+
+        lines.append(f"{';'.join(names)} {samples}")
+
+    return lines
+
+
+def summary(profile: dict) -> str:
+    samples = max(profile["samples"], 1)
+    return (
+        f"{profile['samples']} samples every {profile['interval']}ms, "
+        f"{100.0 * profile['native'] / samples:.1f}% native, "
+        f"{profile['dropped']} dropped"
+    )
+
+
+def write(profile: dict, output: str):
+    with open(output, "w") as file:
+        file.write("\n".join(fold(profile)) + "\n")
+
+    print(summary(profile))
+
+
+async def capture(output: str, lua: str, interval: int):
+    from frameutils import Bluetooth
+
+    dump = b""
+    done = asyncio.Event()
+
+    def receive_data(data):
+        nonlocal dump
+
+        if data[0] == 0x00:
+            done.set()
+            return
+
+        dump += data[1:]
+
+    b = Bluetooth()
+    await b.connect(data_response_handler=receive_data)
+
+    await b.send_lua(f"frame.system.profile.start({interval});print(nil)", await_print=True)
+    await b.send_lua(f"{lua};print(nil)", await_print=True)
+    await b.send_lua(
+        "frame.system.profile.stop() local d=frame.system.profile.dump() local n=frame.bluetooth.max_length()-1 for i=1,#d,n do while true do if pcall(frame.bluetooth.send,'\\x01'..d:sub(i,i+n-1)) then break end end end frame.sleep(0.1) frame.bluetooth.send('\\x00')"
+    )
+
+    await done.wait()
+    await b.disconnect()
+
+    write(parse(dump), output)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("convert", help="convert a saved dump")
+    command.add_argument("input")
+    command.add_argument("output")
+
+    command = commands.add_parser("capture", help="profile Lua code over Bluetooth")
+    command.add_argument("output")
+    command.add_argument("--lua", required=True, help="Lua code to profile")
+    command.add_argument("--interval", type=int, default=5, help="milliseconds")
+
+    args = parser.parse_args()
+
+    if args.command == "convert":
+        with open(args.input, "rb") as file:
+            write(parse(file.read()), args.output)
+
+    else:
+        asyncio.run(capture(args.output, args.lua, args.interval))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,141 @@
+"""
+Uploads Lua scripts and files to Frame over many Bluetooth packets.
+
+Each transfer is a start packet giving the mode, length and CRC32 of the data,
+followed by numbered data packets. Files are written to a temporary file and
+only replace the original once the CRC matches. Scripts are run by the REPL
+once they've been received, the same as any other Lua string.
+
+    python3 lua_upload.py file main.lua
+    python3 lua_upload.py file images.bin --name assets/images.bin
+    python3 lua_upload.py run benchmark.lua
+"""
+
+import argparse, asyncio, struct, time, zlib
+from frameutils import Bluetooth
+
+PREFIX = 0x02
+START = 0x00
+DATA = 0x01
+
+MODE_EXECUTE = 0x00
+MODE_FILE = 0x01
+
+DONE = 0x00
+ACK = 0x01
+
+STATUS_NAMES = {
+    0x02: "sequence error",
+    0x03: "CRC mismatch",
+    0x04: "out of memory",
+    0x05: "file error",
+    0x06: "previous script still pending",
+    0x07: "bad packet",
+}
+
+# The device queues packets as Lua events, so only a few can be in flight
+WINDOW = 8
+
+
+def start_packet(data: bytes, mode: int, filename: str = "") -> bytes:
+    header = struct.pack("<BBBII", PREFIX, START, mode, len(data), zlib.crc32(data))
+    return header + filename.encode()
+
+
+def data_packets(data: bytes, payload_size: int) -> list:
+    chunk = payload_size - 4
+    return [
+        struct.pack("<BBH", PREFIX, DATA, sequence & 0xFFFF)
+        + data[offset : offset + chunk]
+        for sequence, offset in enumerate(range(0, len(data), chunk))
+    ]
+
+
+def parse_reply(reply: bytes) -> tuple:
+    _, status, sequence = struct.unpack("<BBH", reply[:4])
+    return status, sequence
+
+
+class UploadBluetooth(Bluetooth):
+    """
+    Takes upload replies out of the notifications before they're treated as
+    print responses.
+    """
+
+    def __init__(self):
+        super().__init__()
+        self._replies = asyncio.Queue()
+
+    def _notification_handler(self, sender, data):
+        if data[0] == PREFIX:
+            self._replies.put_nowait(parse_reply(data))
+        else:
+            super()._notification_handler(sender, data)
+
+    async def _reply(self) -> tuple:
+        status, sequence = await asyncio.wait_for(self._replies.get(), timeout=10)
+
+        if status not in (DONE, ACK):
+            raise RuntimeError(
+                f"upload failed at packet {sequence}: {STATUS_NAMES.get(status, status)}"
+            )
+
+        return status, sequence
+
+    async def upload(self, data: bytes, mode: int, filename: str = ""):
+        packets = data_packets(data, self.max_lua_payload())
+
+        await self._transmit(start_packet(data, mode, filename))
+        status, acknowledged = await self._reply()
+
+        sent = 0
+        while status != DONE:
+            while sent < len(packets) and sent - acknowledged < WINDOW:
+                await self._transmit(packets[sent])
+                sent += 1
+
+            status, sequence = await self._reply()
+            acknowledged += (sequence - acknowledged) & 0xFFFF
+
+
+async def run(path: str, mode: int, filename: str):
+    with open(path, "rb") as file:
+        data = file.read()
+
+    b = UploadBluetooth()
+    await b.connect(print_response_handler=print)
+
+    start = time.time()
+    await b.upload(data, mode, filename)
+    elapsed = time.time() - start
+
+    print(f"Sent {len(data)} bytes in {elapsed:.2f}s ({len(data) / elapsed:.0f} B/s)")
+
+    if mode == MODE_EXECUTE:
+        await asyncio.sleep(1)
+
+    await b.disconnect()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("file", help="write a file to the device")
+    command.add_argument("input")
+    command.add_argument("--name", help="name on the device, input by default")
+
+    command = commands.add_parser("run", help="run a script on the device")
+    command.add_argument("input")
+
+    args = parser.parse_args()
+
+    if args.command == "file":
+        asyncio.run(run(args.input, MODE_FILE, args.name or args.input))
+
+    else:
+        asyncio.run(run(args.input, MODE_EXECUTE, ""))
+
+
+if __name__ == "__main__":
+    main()
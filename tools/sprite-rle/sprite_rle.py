@@ -0,0 +1,231 @@
+"""
+Run-length encodes sprites for frame.display.bitmap_rle().
+
+Sprites are encoded from the same packed 2, 4 or 16 color pixel data accepted by
+frame.display.bitmap(), where pixels are packed MSB first. The output is one byte
+per token, as decoded by sprite_rle_decoder.sv:
+
+    0nnnnnnn    skip n + 1 pixels (1 - 128), leaving them untouched
+    1nnncccc    draw n + 1 pixels (1 - 8) of color c
+
+Color 0 is transparent, so it is always skipped rather than drawn. Skips wrap
+across rows like any other pixel, but are limited to 16 rows at a time so that
+narrow sprites still decode within the time taken to send each byte over SPI.
+
+    python3 sprite_rle.py encode sprite.bin sprite.rle --width 64 --colors 4
+    python3 sprite_rle.py report
+    python3 sprite_rle.py testbench vectors.mem
+"""
+
+import argparse, os, re
+
+MAX_SKIP = 128
+MAX_RUN = 8
+MAX_SKIP_ROWS = 16
+
+SYSTEM_FONT = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)),
+    "../../source/application/lua_libraries/graphical_assets/system_font.h",
+)
+
+
+def unpack(data: bytes, colors: int, count: int) -> list:
+    bits = {2: 1, 4: 2, 16: 4}[colors]
+    per_byte = 8 // bits
+    pixels = []
+
+    for index in range(count):
+        shift = 8 - bits * (index % per_byte + 1)
+        pixels.append((data[index // per_byte] >> shift) & (colors - 1))
+
+    return pixels
+
+
+def pack(pixels: list, colors: int) -> bytes:
+    bits = {2: 1, 4: 2, 16: 4}[colors]
+    per_byte = 8 // bits
+    data = bytearray((len(pixels) + per_byte - 1) // per_byte)
+
+    for index, pixel in enumerate(pixels):
+        shift = 8 - bits * (index % per_byte + 1)
+        data[index // per_byte] |= pixel << shift
+
+    return bytes(data)
+
+
+def encode(pixels: list, width: int) -> bytes:
+    max_skip = min(MAX_SKIP, MAX_SKIP_ROWS * width)
+    output = bytearray()
+    index = 0
+
+    while index < len(pixels):
+        color = pixels[index]
+        limit = max_skip if color == 0 else MAX_RUN
+        length = 1
+
+        while (
+            length < limit
+            and index + length < len(pixels)
+            and pixels[index + length] == color
+        ):
+            length += 1
+
+        if color == 0:
+            output.append(length - 1)
+        else:
+            output.append(0x80 | (length - 1) << 4 | color)
+
+        index += length
+
+    # Trailing skips draw nothing
+    while output and output[-1] & 0x80 == 0:
+        output.pop()
+
+    return bytes(output)
+
+
+def decode(data: bytes, count: int) -> list:
+    pixels = []
+
+    for token in data:
+        if token & 0x80:
+            pixels += [token & 0x0F] * (((token >> 4) & 0x07) + 1)
+        else:
+            pixels += [0] * (token + 1)
+
+    return (pixels + [0] * count)[:count]
+
+
+def system_font_sprites(path: str = SYSTEM_FONT) -> list:
+    with open(path) as file:
+        source = file.read()
+
+    metadata = re.findall(
+        r"\{0x([0-9A-Fa-f]+), (\d+), (\d+), SPRITE_(\d+)_COLORS, 0x([0-9A-Fa-f]+)\}",
+        source,
+    )
+    body = source[source.index("sprite_data[]") :]
+    data = bytes(int(x, 16) for x in re.findall(r"0x([0-9A-Fa-f]{2})\b", body))
+
+    sprites = []
+    for codepoint, width, height, colors, offset in metadata:
+        width, height, colors = int(width), int(height), int(colors)
+        pixels = unpack(data[int(offset, 16) :], colors, width * height)
+        sprites.append((int(codepoint, 16), width, height, colors, pixels))
+
+    return sprites
+
+
+def report(path: str):
+    totals = {}
+
+    for codepoint, width, height, colors, pixels in system_font_sprites(path):
+        kind = "icons" if codepoint >= 0xF0000 else "glyphs"
+        raw = len(pack(pixels, colors))
+        rle = len(encode(pixels, width))
+        writes = sum(1 for pixel in pixels if pixel != 0)
+
+        total = totals.setdefault(kind, [0, 0, 0, 0, 0])
+        total[0] += 1
+        total[1] += raw
+        total[2] += rle
+        total[3] += width * height
+        total[4] += writes
+
+    print(f"{'Sprites':<8}{'Count':>7}{'Raw':>9}{'RLE':>9}{'Saved':>8}{'Pixels':>10}{'Drawn':>10}")
+
+    for kind, (count, raw, rle, pixels, writes) in totals.items():
+        saved = 100.0 * (raw - rle) / raw
+        print(f"{kind:<8}{count:>7}{raw:>9}{rle:>9}{saved:>7.1f}%{pixels:>10}{writes:>10}")
+
+
+def testbench(output: str, path: str):
+    """
+    Writes vectors for sprite_rle_tb.sv. Each sprite is a record of width,
+    height, colors, raw length and RLE length as 16 bit big endian values,
+    followed by the raw and RLE data.
+    """
+    sprites = system_font_sprites(path)
+    glyph = next(sprite for sprite in sprites if sprite[0] == 0x41)
+    icon = next(sprite for sprite in sprites if sprite[0] >= 0xF0000)
+
+    # A 16 color sprite with long runs, short runs and every color
+    width, height = 37, 21
+    pattern = []
+    for y in range(height):
+        for x in range(width):
+            if y % 5 == 0:
+                pattern.append(0)
+            elif x < y:
+                pattern.append((x + y) % 16)
+            else:
+                pattern.append(y % 16 if x > 30 else 0)
+
+    # Narrow enough that skips are limited by rows rather than length
+    narrow = [1 if (x + y) % 11 == 0 else 0 for y in range(40) for x in range(3)]
+
+    cases = [
+        glyph[1:],
+        icon[1:],
+        (width, height, 16, pattern),
+        (3, 40, 2, narrow),
+    ]
+
+    with open(output, "w") as file:
+        for width, height, colors, pixels in cases:
+            raw = pack(pixels, colors)
+            rle = encode(pixels, width)
+            assert decode(rle, len(pixels)) == pixels
+
+            record = bytearray()
+            for value in (width, height, colors, len(raw), len(rle)):
+                record += value.to_bytes(2, "big")
+            record += raw + rle
+
+            file.write("\n".join(f"{byte:02X}" for byte in record) + "\n")
+
+        file.write("00\n00\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("encode", help="encode a packed sprite")
+    command.add_argument("input")
+    command.add_argument("output")
+    command.add_argument("--width", type=int, required=True)
+    command.add_argument("--colors", type=int, choices=[2, 4, 16], required=True)
+
+    command = commands.add_parser("report", help="compare sizes for system_font.h")
+    command.add_argument("--font", default=SYSTEM_FONT)
+
+    command = commands.add_parser("testbench", help="write sprite_rle_tb.sv vectors")
+    command.add_argument("output")
+    command.add_argument("--font", default=SYSTEM_FONT)
+
+    args = parser.parse_args()
+
+    if args.command == "encode":
+        with open(args.input, "rb") as file:
+            data = file.read()
+
+        per_byte = {2: 8, 4: 4, 16: 2}[args.colors]
+        count = len(data) * per_byte
+        count -= count % args.width
+        rle = encode(unpack(data, args.colors, count), args.width)
+
+        with open(args.output, "wb") as file:
+            file.write(rle)
+
+        print(f"{len(data)} bytes encoded to {len(rle)} bytes")
+
+    elif args.command == "report":
+        report(args.font)
+
+    else:
+        testbench(args.output, args.font)
+
+
+if __name__ == "__main__":
+    main()